@@ -14,6 +14,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <ifaddrs.h>
+#include <linux/filter.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
 #include <netdb.h>
@@ -26,6 +27,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/signalfd.h>
 #include <sys/timerfd.h>
@@ -118,8 +120,46 @@ struct device {
 #endif
 };
 
+/*
+ * Sweep mode (-S): many targets probed by one process. Probes are paced
+ * by the timerfd, replies come through a PACKET_RX_RING behind a BPF
+ * filter for the target addresses and are matched against a hash.
+ */
+#define SWEEP_MAX		65536
+#define SWEEP_BPF_RUNS		64
+#define SWEEP_FRAME_SIZE	256
+#define SWEEP_BLOCK_SIZE	16384
+#define SWEEP_BLOCKS		16
+
+struct sweep_target {
+	struct in_addr addr;
+	struct timespec last;
+	long rtt;			/* us, to the first reply */
+	int sent;
+	int received;
+	unsigned char lladdr[8];
+	unsigned int dup:1;		/* replies from another lladdr too */
+};
+
+struct sweep {
+	struct sweep_target *t;
+	unsigned int n;
+	unsigned int answered;
+	uint32_t *hash;			/* index + 1, 0 if free */
+	uint32_t mask;
+	unsigned int next;		/* next target in this round */
+	int round;
+	struct timespec start;
+	struct timespec last_send;
+	unsigned char *ring;
+	size_t ring_len;
+	unsigned int frame;
+	unsigned int nframes;
+};
+
 struct run_state {
 	struct device device;
+	struct sweep *sweep;
 	char *source;
 	struct ifaddrs *ifa0;
 	struct in_addr gsrc;
@@ -184,6 +224,7 @@ static void usage(void)
 		"  -D            duplicate address detection mode\n"
 		"  -U            unsolicited ARP mode, update your neighbours\n"
 		"  -A            ARP answer mode, update your neighbours\n"
+		"  -S            sweep mode, probe all the given destinations\n"
 		"  -V            print version and exit\n"
 		"  -c <count>    how many packets to send\n"
 		"  -w <timeout>  how long to wait for a reply\n"
@@ -196,7 +237,8 @@ static void usage(void)
 	fprintf(stderr, _(
 				"\n"
 		"  -s <source>   source ip address\n"
-		"  <destination> dns name or ip address\n"
+		"  <destination> dns name or ip address; with -S also\n"
+		"                <first>-<last> or <address>/<prefixlen>\n"
 		"\nFor more details see arping(8).\n"
 	));
 	exit(2);
@@ -402,16 +444,10 @@ static void print_hex(unsigned char *p, int len)
 	}
 }
 
-static int recv_pack(struct run_state *ctl, unsigned char *buf, ssize_t len,
+/* Checks common to all modes: an IPv4 ARP request or reply for our hardware type. */
+static int arp_valid(struct run_state *ctl, struct arphdr *ah, ssize_t len,
 		     struct sockaddr_ll *FROM)
 {
-	struct timespec ts;
-	struct arphdr *ah = (struct arphdr *)buf;
-	unsigned char *p = (unsigned char *)(ah + 1);
-	struct in_addr src_ip, dst_ip;
-
-	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
-
 	/* Filter out wild packets */
 	if (FROM->sll_pkttype != PACKET_HOST &&
 	    FROM->sll_pkttype != PACKET_BROADCAST &&
@@ -437,6 +473,21 @@ static int recv_pack(struct run_state *ctl, unsigned char *buf, ssize_t len,
 		return 0;
 	if (len < (ssize_t) sizeof(*ah) + 2 * (4 + ah->ar_hln))
 		return 0;
+	return 1;
+}
+
+static int recv_pack(struct run_state *ctl, unsigned char *buf, ssize_t len,
+		     struct sockaddr_ll *FROM)
+{
+	struct timespec ts;
+	struct arphdr *ah = (struct arphdr *)buf;
+	unsigned char *p = (unsigned char *)(ah + 1);
+	struct in_addr src_ip, dst_ip;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+
+	if (!arp_valid(ctl, ah, len, FROM))
+		return 0;
 	memcpy(&src_ip, p + ah->ar_hln, 4);
 	memcpy(&dst_ip, p + ah->ar_hln + 4 + ah->ar_hln, 4);
 	if (!ctl->dad) {
@@ -515,6 +566,421 @@ static int recv_pack(struct run_state *ctl, unsigned char *buf, ssize_t len,
 	return 1;
 }
 
+/* A dns name or ip address; exits if it does not resolve. */
+static void get_target_addr(const char *name, struct in_addr *addr)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_RAW,
+#ifdef USE_IDN
+		.ai_flags = AI_IDN | AI_CANONIDN
+#endif
+	};
+	struct addrinfo *result;
+	int status;
+
+	if (inet_aton(name, addr) == 1)
+		return;
+	status = getaddrinfo(name, NULL, &hints, &result);
+	if (status) {
+		fprintf(stderr, "arping: %s: %s\n", name, gai_strerror(status));
+		exit(2);
+	}
+	memcpy(addr, &((struct sockaddr_in *)result->ai_addr)->sin_addr, sizeof(*addr));
+	freeaddrinfo(result);
+}
+
+static struct sweep_target *sweep_find(struct sweep *sw, struct in_addr addr)
+{
+	uint32_t h = (ntohl(addr.s_addr) * 2654435761U) & sw->mask;
+
+	for (; sw->hash[h]; h = (h + 1) & sw->mask) {
+		struct sweep_target *t = &sw->t[sw->hash[h] - 1];
+
+		if (t->addr.s_addr == addr.s_addr)
+			return t;
+	}
+	return NULL;
+}
+
+static void sweep_add_addr(struct sweep *sw, uint32_t addr)
+{
+	struct sweep_target *t;
+	uint32_t h = (addr * 2654435761U) & sw->mask;
+
+	for (; sw->hash[h]; h = (h + 1) & sw->mask) {
+		if (sw->t[sw->hash[h] - 1].addr.s_addr == htonl(addr))
+			return;
+	}
+	if (sw->n == SWEEP_MAX) {
+		fprintf(stderr, _("arping: more than %d addresses to sweep\n"), SWEEP_MAX);
+		exit(2);
+	}
+	if ((sw->n & (sw->n - 1)) == 0) {
+		sw->t = realloc(sw->t, (sw->n ? 2 * sw->n : 1) * sizeof(*sw->t));
+		if (!sw->t) {
+			perror("arping: realloc");
+			exit(2);
+		}
+	}
+	t = &sw->t[sw->n++];
+	memset(t, 0, sizeof(*t));
+	t->addr.s_addr = htonl(addr);
+	sw->hash[h] = sw->n;
+}
+
+/*
+ * A sweep target: an address, first-last, or address/prefixlen. The
+ * network and broadcast addresses of a prefix shorter than /31 are
+ * left out.
+ */
+static void sweep_add(struct sweep *sw, char *arg)
+{
+	struct in_addr lo, hi;
+	uint64_t a, first, last;
+	char *sep;
+
+	if (!sw->hash) {
+		sw->mask = 2 * SWEEP_MAX - 1;
+		sw->hash = calloc(sw->mask + 1, sizeof(*sw->hash));
+		if (!sw->hash) {
+			perror("arping: calloc");
+			exit(2);
+		}
+	}
+
+	if ((sep = strchr(arg, '/')) != NULL) {
+		char *end;
+		long plen = strtol(sep + 1, &end, 10);
+
+		*sep = '\0';
+		if (inet_aton(arg, &lo) != 1 || *end || sep[1] == '\0' || plen < 0 || plen > 32) {
+			*sep = '/';
+			fprintf(stderr, _("arping: invalid prefix %s\n"), arg);
+			exit(2);
+		}
+		*sep = '/';
+		first = ntohl(lo.s_addr) & ~(0xffffffffULL >> plen);
+		last = first | (0xffffffffULL >> plen);
+		if (plen < 31) {
+			first++;
+			last--;
+		}
+	} else if ((sep = strchr(arg, '-')) != NULL) {
+		int ok;
+
+		*sep = '\0';
+		ok = inet_aton(arg, &lo) == 1 && inet_aton(sep + 1, &hi) == 1;
+		*sep = '-';
+		if (!ok)
+			goto single;
+		first = ntohl(lo.s_addr);
+		last = ntohl(hi.s_addr);
+		if (first > last) {
+			fprintf(stderr, _("arping: invalid range %s\n"), arg);
+			exit(2);
+		}
+	} else {
+single:
+		get_target_addr(arg, &lo);
+		first = last = ntohl(lo.s_addr);
+	}
+
+	if (last - first >= SWEEP_MAX) {
+		fprintf(stderr, _("arping: more than %d addresses to sweep\n"), SWEEP_MAX);
+		exit(2);
+	}
+	for (a = first; a <= last; a++)
+		sweep_add_addr(sw, a);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Pass only IPv4 ARP with our hardware address length whose sender is
+ * one of the targets. Addresses are matched as runs of consecutive ones;
+ * with too many runs only their span is checked, the hash does the rest.
+ */
+static void sweep_filter(struct run_state *ctl)
+{
+	struct sweep *sw = ctl->sweep;
+	struct sock_filter code[8 + 2 * SWEEP_BPF_RUNS + 2];
+	struct sock_fprog prog = { .filter = code };
+	uint32_t *addrs, runs[SWEEP_BPF_RUNS][2];
+	unsigned int i, nruns = 0, pc, drop, accept;
+	int hln = ((struct sockaddr_ll *)&ctl->me)->sll_halen;
+
+	addrs = malloc(sw->n * sizeof(*addrs));
+	if (!addrs) {
+		perror("arping: malloc");
+		exit(2);
+	}
+	for (i = 0; i < sw->n; i++)
+		addrs[i] = ntohl(sw->t[i].addr.s_addr);
+	qsort(addrs, sw->n, sizeof(*addrs), cmp_u32);
+	for (i = 0; i < sw->n; i++) {
+		if (nruns && addrs[i] == runs[nruns - 1][1] + 1) {
+			runs[nruns - 1][1] = addrs[i];
+			continue;
+		}
+		if (nruns == SWEEP_BPF_RUNS) {
+			runs[0][1] = addrs[sw->n - 1];
+			nruns = 1;
+			break;
+		}
+		runs[nruns][0] = runs[nruns][1] = addrs[i];
+		nruns++;
+	}
+	free(addrs);
+
+	drop = 8;
+	for (i = 0; i < nruns; i++)
+		drop += runs[i][0] == runs[i][1] ? 1 : 2;
+	accept = drop + 1;
+
+	code[0] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 2);
+	code[1] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, drop - 2);
+	code[2] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4);
+	code[3] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (hln << 8) | 4, 0, drop - 4);
+	code[4] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6);
+	code[5] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ARPOP_REQUEST, 1, 0);
+	code[6] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ARPOP_REPLY, 0, drop - 7);
+	code[7] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 8 + hln);
+	for (pc = 8, i = 0; i < nruns; i++) {
+		if (runs[i][0] == runs[i][1]) {
+			code[pc] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, runs[i][0],
+								accept - pc - 1, 0);
+			pc++;
+			continue;
+		}
+		code[pc] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, runs[i][0], 0, 1);
+		pc++;
+		code[pc] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, runs[i][1],
+							0, accept - pc - 1);
+		pc++;
+	}
+	code[drop] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	code[accept] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffff);
+	prog.len = accept + 1;
+
+	if (setsockopt(ctl->socketfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1)
+		perror(_("WARNING: setsockopt(SO_ATTACH_FILTER)"));
+}
+
+/* Without a ring sweep_read() falls back to recvfrom(). */
+static void sweep_ring(struct run_state *ctl)
+{
+	struct sweep *sw = ctl->sweep;
+	int version = TPACKET_V2;
+	struct tpacket_req req = {
+		.tp_block_size = SWEEP_BLOCK_SIZE,
+		.tp_block_nr = SWEEP_BLOCKS,
+		.tp_frame_size = SWEEP_FRAME_SIZE,
+		.tp_frame_nr = SWEEP_BLOCK_SIZE / SWEEP_FRAME_SIZE * SWEEP_BLOCKS
+	};
+	void *ring;
+
+	if (setsockopt(ctl->socketfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1 ||
+	    setsockopt(ctl->socketfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1)
+		return;
+	ring = mmap(NULL, (size_t)SWEEP_BLOCK_SIZE * SWEEP_BLOCKS, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, ctl->socketfd, 0);
+	if (ring == MAP_FAILED) {
+		memset(&req, 0, sizeof(req));
+		setsockopt(ctl->socketfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+		return;
+	}
+	sw->ring = ring;
+	sw->ring_len = (size_t)SWEEP_BLOCK_SIZE * SWEEP_BLOCKS;
+	sw->nframes = req.tp_frame_nr;
+}
+
+static void sweep_init(struct run_state *ctl)
+{
+	unsigned char packet[4096];
+
+	if (ctl->count <= 0)
+		ctl->count = 3;
+	sweep_filter(ctl);
+	sweep_ring(ctl);
+	/* what was queued before the filter and the ring */
+	while (recv(ctl->socketfd, packet, sizeof(packet), MSG_DONTWAIT) >= 0)
+		;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ctl->sweep->start);
+}
+
+/* The next target still to be answered; NULL after the last round. */
+static struct sweep_target *sweep_next(struct run_state *ctl)
+{
+	struct sweep *sw = ctl->sweep;
+	struct sweep_target *t;
+
+	while (sw->round < ctl->count && sw->answered < sw->n) {
+		if (sw->next == sw->n) {
+			sw->next = 0;
+			sw->round++;
+			continue;
+		}
+		t = &sw->t[sw->next++];
+		if (!t->received)
+			return t;
+	}
+	return NULL;
+}
+
+static inline int64_t timespec_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (int64_t)(a->tv_sec - b->tv_sec) * 1000000000 + a->tv_nsec - b->tv_nsec;
+}
+
+/* One probe per timer expiry; returns 1 when the sweep is over. */
+static int sweep_tick(struct run_state *ctl, uint64_t exp)
+{
+	struct sweep *sw = ctl->sweep;
+	struct sweep_target *t = NULL;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+	if (ctl->timeout && now.tv_sec - sw->start.tv_sec >= ctl->timeout)
+		return 1;
+	if (sw->answered == sw->n)
+		return 1;
+	while (exp-- && (t = sweep_next(ctl)) != NULL) {
+		ctl->gdst = t->addr;
+		if (send_pack(ctl) > 0) {
+			t->sent++;
+			t->last = ctl->last;
+		}
+		sw->last_send = now;
+	}
+	if (t)
+		return 0;
+	/* All sent, one more interval for late replies */
+	return timespec_diff_ns(&now, &sw->last_send) >=
+		(int64_t)(ctl->interval ? ctl->interval : 1) * 1000000000;
+}
+
+static int sweep_recv(struct run_state *ctl, unsigned char *buf, ssize_t len,
+		      struct sockaddr_ll *FROM)
+{
+	struct sweep *sw = ctl->sweep;
+	struct sockaddr_ll *ME = (struct sockaddr_ll *)&ctl->me;
+	struct arphdr *ah = (struct arphdr *)buf;
+	unsigned char *p = (unsigned char *)(ah + 1);
+	struct in_addr src_ip, dst_ip;
+	struct sweep_target *t;
+	struct timespec ts;
+
+	if (!arp_valid(ctl, ah, len, FROM))
+		return 0;
+	memcpy(&src_ip, p + ah->ar_hln, 4);
+	memcpy(&dst_ip, p + ah->ar_hln + 4 + ah->ar_hln, 4);
+	t = sweep_find(sw, src_ip);
+	if (!t)
+		return 0;
+	/* The same rules as recv_pack(), see there */
+	if (!ctl->dad) {
+		if (ctl->gsrc.s_addr != dst_ip.s_addr)
+			return 0;
+		if (memcmp(p + ah->ar_hln + 4, ME->sll_addr, ah->ar_hln))
+			return 0;
+	} else {
+		if (memcmp(p, ME->sll_addr, ME->sll_halen) == 0)
+			return 0;
+		if (ctl->gsrc.s_addr && ctl->gsrc.s_addr != dst_ip.s_addr)
+			return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	if (!t->received) {
+		t->rtt = t->last.tv_sec ? timespec_diff_ns(&ts, &t->last) / 1000 : -1;
+		memcpy(t->lladdr, p, ah->ar_hln);
+		sw->answered++;
+	} else if (memcmp(t->lladdr, p, ah->ar_hln))
+		t->dup = 1;
+	t->received++;
+	ctl->received++;
+	if (FROM->sll_pkttype != PACKET_HOST)
+		ctl->brd_recv++;
+	if (ah->ar_op == htons(ARPOP_REQUEST))
+		ctl->req_recv++;
+	return sw->answered == sw->n ? FINAL_PACKS : 1;
+}
+
+/* Everything waiting in the ring; FINAL_PACKS once all targets answered. */
+static int sweep_read(struct run_state *ctl)
+{
+	struct sweep *sw = ctl->sweep;
+	int rc = 0;
+
+	if (!sw->ring) {
+		unsigned char packet[4096];
+		struct sockaddr_storage from;
+		socklen_t addr_len = sizeof(from);
+		ssize_t s;
+
+		s = recvfrom(ctl->socketfd, packet, sizeof(packet), 0,
+			     (struct sockaddr *)&from, &addr_len);
+		if (s < 0)
+			return -1;
+		return sweep_recv(ctl, packet, s, (struct sockaddr_ll *)&from);
+	}
+
+	while (rc != FINAL_PACKS) {
+		struct tpacket2_hdr *h = (struct tpacket2_hdr *)(sw->ring + sw->frame * SWEEP_FRAME_SIZE);
+		struct sockaddr_ll *from;
+
+		if (!(__atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+			break;
+		from = (struct sockaddr_ll *)((unsigned char *)h + TPACKET_ALIGN(sizeof(*h)));
+		rc = sweep_recv(ctl, (unsigned char *)h + h->tp_net, h->tp_snaplen, from);
+		__atomic_store_n(&h->tp_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		if (++sw->frame == sw->nframes)
+			sw->frame = 0;
+	}
+	return rc;
+}
+
+/* The result table; the exit code as finish() would return it. */
+static int sweep_finish(struct run_state *ctl)
+{
+	struct sweep *sw = ctl->sweep;
+	int hln = ((struct sockaddr_ll *)&ctl->me)->sll_halen;
+	unsigned int i;
+	int j;
+
+	for (i = 0; !ctl->quiet && i < sw->n; i++) {
+		struct sweep_target *t = &sw->t[i];
+		char hw[3 * sizeof(t->lladdr)] = "-";
+		char rtt[24] = "";
+
+		for (j = 0; t->received && j < hln; j++)
+			sprintf(hw + (j ? 3 * j - 1 : 0), j ? ":%02X" : "%02X", t->lladdr[j]);
+		if (t->received && t->rtt >= 0)
+			snprintf(rtt, sizeof(rtt), "%ld.%03ldms", t->rtt / 1000, t->rtt % 1000);
+		printf("%-15s %-*s %10s %d/%d%s\n", inet_ntoa(t->addr), 3 * hln - 1, hw, rtt,
+		       t->received, t->sent, t->dup ? _(" DUP!") : "");
+	}
+	if (!ctl->quiet) {
+		printf(_("Sent %d probes to %u address(es), %u answered\n"),
+		       ctl->sent, sw->n, sw->answered);
+		fflush(stdout);
+	}
+
+	if (sw->ring)
+		munmap(sw->ring, sw->ring_len);
+	free(sw->hash);
+	free(sw->t);
+	if (ctl->dad)
+		return !!sw->answered;
+	return sw->answered != sw->n;
+}
+
 /*
  * find_device()
  *
@@ -962,8 +1428,25 @@ static int event_loop(struct run_state *ctl)
 		perror("arping: clock_gettime failed");
 		return 1;
 	}
-	timerfd_vals.it_value.tv_sec = now.tv_sec + ctl->interval;
-	timerfd_vals.it_value.tv_nsec = now.tv_nsec;
+	if (ctl->sweep) {
+		/* every target once per interval */
+		uint64_t period = (uint64_t)ctl->interval * 1000000000 / ctl->sweep->n;
+
+		if (period < 1000)
+			period = 1000;
+		timerfd_vals.it_interval.tv_sec = period / 1000000000;
+		timerfd_vals.it_interval.tv_nsec = period % 1000000000;
+		now.tv_sec += timerfd_vals.it_interval.tv_sec;
+		now.tv_nsec += timerfd_vals.it_interval.tv_nsec;
+		if (now.tv_nsec >= 1000000000) {
+			now.tv_sec++;
+			now.tv_nsec -= 1000000000;
+		}
+		timerfd_vals.it_value = now;
+	} else {
+		timerfd_vals.it_value.tv_sec = now.tv_sec + ctl->interval;
+		timerfd_vals.it_value.tv_nsec = now.tv_nsec;
+	}
 	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &timerfd_vals, NULL)) {
 		perror("arping: timerfd_settime failed");
 		return 1;
@@ -974,7 +1457,10 @@ static int event_loop(struct run_state *ctl)
 	/* socket */
 	pfds[POLLFD_SOCKET].fd = ctl->socketfd;
 	pfds[POLLFD_SOCKET].events = POLLIN | POLLERR | POLLHUP;
-	send_pack(ctl);
+	if (ctl->sweep)
+		sweep_tick(ctl, 1);
+	else
+		send_pack(ctl);
 
 	while (!exit_loop) {
 		int ret;
@@ -1012,6 +1498,11 @@ static int event_loop(struct run_state *ctl)
 					perror("arping: could not read timerfd");
 					continue;
 				}
+				if (ctl->sweep) {
+					if (sweep_tick(ctl, exp))
+						exit_loop = 1;
+					break;
+				}
 				total_expires += exp;
 				if (0 < ctl->count && (uint64_t)ctl->count < total_expires) {
 					exit_loop = 1;
@@ -1020,6 +1511,16 @@ static int event_loop(struct run_state *ctl)
 				send_pack(ctl);
 				break;
 			case POLLFD_SOCKET:
+				if (ctl->sweep) {
+					ret = sweep_read(ctl);
+					if (ret < 0) {
+						perror("arping: recvfrom");
+						if (errno == ENETDOWN)
+							rc = 2;
+					} else if (ret == FINAL_PACKS)
+						exit_loop = 1;
+					break;
+				}
 				if ((s =
 				     recvfrom(ctl->socketfd, packet, sizeof(packet), 0,
 					      (struct sockaddr *)&from, &addr_len)) < 0) {
@@ -1046,6 +1547,11 @@ static int event_loop(struct run_state *ctl)
 		free(ctl->device.name);
 	}
 #endif
+	if (ctl->sweep) {
+		rc |= sweep_finish(ctl);
+		free(ctl->sweep);
+		return rc;
+	}
 	rc |= finish(ctl);
 	rc |= !(ctl->brd_sent != ctl->received);
 	return rc;
@@ -1080,7 +1586,7 @@ int main(int argc, char **argv)
 
 	disable_capability_raw(&ctl);
 
-	while ((ch = getopt(argc, argv, "h?bfDUAqc:w:i:s:I:V")) != EOF) {
+	while ((ch = getopt(argc, argv, "h?bfDUAqSc:w:i:s:I:V")) != EOF) {
 		switch (ch) {
 		case 'b':
 			ctl.broadcast_only = 1;
@@ -1099,6 +1605,14 @@ int main(int argc, char **argv)
 		case 'q':
 			ctl.quiet = 1;
 			break;
+		case 'S':
+			if (!ctl.sweep)
+				ctl.sweep = calloc(1, sizeof(*ctl.sweep));
+			if (!ctl.sweep) {
+				perror("arping: calloc");
+				exit(2);
+			}
+			break;
 		case 'c':
 			ctl.count = atoi(optarg);
 			break;
@@ -1129,8 +1643,12 @@ int main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 1)
+	if (argc < 1 || (argc != 1 && !ctl.sweep))
 		usage();
+	if (ctl.sweep && ctl.unsolicited) {
+		fprintf(stderr, _("arping: -S cannot be used with -U or -A\n"));
+		exit(2);
+	}
 
 	ctl.target = *argv;
 
@@ -1155,26 +1673,18 @@ int main(int argc, char **argv)
 		usage();
 	}
 
-	if (inet_aton(ctl.target, &ctl.gdst) != 1) {
-		struct addrinfo hints = {
-			.ai_family = AF_INET,
-			.ai_socktype = SOCK_RAW,
-#ifdef USE_IDN
-			.ai_flags = AI_IDN | AI_CANONIDN
-#endif
-		};
-		struct addrinfo *result;
-		int status;
+	if (ctl.sweep) {
+		int i;
 
-		status = getaddrinfo(ctl.target, NULL, &hints, &result);
-		if (status) {
-			fprintf(stderr, "arping: %s: %s\n", ctl.target, gai_strerror(status));
+		for (i = 0; i < argc; i++)
+			sweep_add(ctl.sweep, argv[i]);
+		if (!ctl.sweep->n) {
+			fprintf(stderr, _("arping: no addresses to sweep\n"));
 			exit(2);
 		}
-
-		memcpy(&ctl.gdst, &((struct sockaddr_in *)result->ai_addr)->sin_addr, sizeof ctl.gdst);
-		freeaddrinfo(result);
-	}
+		ctl.gdst = ctl.sweep->t[0].addr;
+	} else
+		get_target_addr(ctl.target, &ctl.gdst);
 
 	if (ctl.source && inet_aton(ctl.source, &ctl.gsrc) != 1) {
 		fprintf(stderr, _("arping: invalid source %s\n"), ctl.source);
@@ -1257,7 +1767,10 @@ int main(int argc, char **argv)
 
 	set_device_broadcast(&ctl);
 
-	if (!ctl.quiet) {
+	if (!ctl.quiet && ctl.sweep) {
+		printf(_("ARPING %u addresses "), ctl.sweep->n);
+		printf(_("from %s %s\n"), inet_ntoa(ctl.gsrc), ctl.device.name ? ctl.device.name : "");
+	} else if (!ctl.quiet) {
 		printf(_("ARPING %s "), inet_ntoa(ctl.gdst));
 		printf(_("from %s %s\n"), inet_ntoa(ctl.gsrc), ctl.device.name ? ctl.device.name : "");
 	}
@@ -1269,5 +1782,8 @@ int main(int argc, char **argv)
 
 	drop_capabilities();
 
+	if (ctl.sweep)
+		sweep_init(&ctl);
+
 	return event_loop(&ctl);
 }
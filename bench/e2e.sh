@@ -0,0 +1,213 @@
+#!/bin/sh
+#
+# End-to-end benchmarks between network namespaces joined by veth pairs.
+#
+# usage: e2e.sh <scenario> <program>...
+#
+#   ping_flood <ping>            ping -f packets per second, CPU per packet
+#   ninfod_storm <ping> <ninfod> node information replies per second
+#   tftpd <tftpd>                MB/s per client, several clients at once
+#   tracepath <tracepath>        wall time over a chain of routers
+#
+# Prints one JSON record of type "bench" like bench-micro does. Needs root,
+# ip(8) with netns support and GNU date; tftpd also wants curl with TFTP.
+# Without them the scenario is skipped (exit status 77). BENCH_COUNT,
+# BENCH_CLIENTS and BENCH_HOPS override the defaults below.
+
+set -eu
+
+COUNT=${BENCH_COUNT:-100000}
+CLIENTS=${BENCH_CLIENTS:-4}
+HOPS=${BENCH_HOPS:-4}
+NS=ipbench$$
+NNS=0
+PIDS=
+
+skip()
+{
+	echo "$*, skipping" >&2
+	exit 77
+}
+
+cleanup()
+{
+	[ -z "${DIR:-}" ] || [ ! -f "$DIR/ninfod.pid" ] || PIDS="$PIDS $(cat "$DIR/ninfod.pid")"
+	for p in $PIDS; do
+		kill "$p" 2>/dev/null || :
+	done
+	i=0
+	while [ $i -lt $NNS ]; do
+		ip netns del $NS$i 2>/dev/null || :
+		i=$((i + 1))
+	done
+	[ -z "${DIR:-}" ] || rm -rf "$DIR"
+}
+
+# $NS0 ... $NS<n> in a line; link i joins 10.231.i.1 (left) to 10.231.i.2.
+# The first link also has fec0:231::1 and fec0:231::2, site-local for
+# the default policy of ninfod.
+chain()
+{
+	n=$1
+	i=0
+	while [ $i -le $n ]; do
+		ip netns add $NS$i
+		NNS=$((i + 1))
+		ip -n $NS$i link set lo up
+		ip netns exec $NS$i sh -c 'echo 1 > /proc/sys/net/ipv4/ip_forward'
+		i=$((i + 1))
+	done
+	i=0
+	while [ $i -lt $n ]; do
+		ip link add bench$$l type veth peer name bench$$r
+		ip link set bench$$l netns $NS$i name v$i
+		ip link set bench$$r netns $NS$((i + 1)) name v$i
+		ip -n $NS$i addr add 10.231.$i.1/24 dev v$i
+		ip -n $NS$((i + 1)) addr add 10.231.$i.2/24 dev v$i
+		ip -n $NS$i link set v$i up
+		ip -n $NS$((i + 1)) link set v$i up
+		i=$((i + 1))
+	done
+	ip -n ${NS}0 -6 addr add fec0:231::1/64 dev v0 nodad
+	ip -n ${NS}1 -6 addr add fec0:231::2/64 dev v0 nodad
+	# Every namespace reaches every link through its neighbours.
+	i=0
+	while [ $i -le $n ]; do
+		j=0
+		while [ $j -lt $n ]; do
+			if [ $j -gt $i ]; then
+				ip -n $NS$i route add 10.231.$j.0/24 via 10.231.$i.2
+			elif [ $j -lt $((i - 1)) ]; then
+				ip -n $NS$i route add 10.231.$j.0/24 via 10.231.$((i - 1)).1
+			fi
+			j=$((j + 1))
+		done
+		i=$((i + 1))
+	done
+}
+
+now_ns()
+{
+	date +%s%N
+}
+
+# Run a command in namespace $1 and print the CPU seconds it used last.
+run_cpu()
+{
+	ns=$1
+	shift
+	ip netns exec $ns sh -c '"$@"; times' sh "$@" | awk '
+		{ line[NR] = $0 }
+		END {
+			for (i = 1; i < NR - 1; i++)
+				print line[i]
+			split(line[NR], f, /[ ms]+/)
+			print f[1] * 60 + f[2] + f[3] * 60 + f[4]
+		}'
+}
+
+# Value of numeric "key" in the JSON record on stdin.
+json_get()
+{
+	sed -n "s/.*\"$1\":\\([0-9-]*\\).*/\\1/p" | tail -n 1
+}
+
+record()
+{
+	printf '{"type":"bench","time_ns":%s,"name":"%s","version":"%s"%s}\n' \
+		"$(now_ns)" "$1" "$VERSION" "$2"
+}
+
+wait_port()
+{
+	i=0
+	while [ $i -lt 50 ]; do
+		ip netns exec $1 sh -c "cat /proc/net/udp /proc/net/udp6" |
+			awk -v p="$(printf ':%04X' $2)" '$2 ~ p"$" { f = 1 } END { exit !f }' &&
+			return 0
+		sleep 0.1
+		i=$((i + 1))
+	done
+	return 1
+}
+
+[ $# -ge 2 ] || { echo "usage: $0 <scenario> <program>..." >&2; exit 1; }
+scenario=$1
+shift
+[ "$(id -u)" -eq 0 ] || skip "not root"
+command -v ip >/dev/null || skip "no ip(8)"
+case "$(date +%N)" in
+*N*) skip "no nanoseconds from date(1)" ;;
+esac
+ip netns add ${NS}probe 2>/dev/null || skip "no network namespaces"
+ip netns del ${NS}probe
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+VERSION=$("$1" -V 2>&1 | awk '{ print $NF; exit }')
+
+case $scenario in
+ping_flood)
+	chain 1
+	out=$(run_cpu ${NS}0 "$1" -q -j -f -c $COUNT 10.231.0.2)
+	cpu=$(echo "$out" | tail -n 1)
+	sent=$(echo "$out" | json_get transmitted)
+	rcvd=$(echo "$out" | json_get received)
+	ms=$(echo "$out" | json_get time_ms)
+	record ping_flood "$(awk -v s=$sent -v r=$rcvd -v ms=$ms -v cpu=$cpu 'BEGIN {
+		printf ",\"transmitted\":%d,\"received\":%d,\"time_ms\":%d", s, r, ms
+		printf ",\"pps\":%d,\"cpu_ns_per_packet\":%d", ms ? r * 1000 / ms : 0, s ? cpu * 1e9 / s : 0
+	}')"
+	;;
+ninfod_storm)
+	[ $# -ge 2 ] || { echo "usage: $0 ninfod_storm <ping> <ninfod>" >&2; exit 1; }
+	chain 1
+	DIR=$(mktemp -d)
+	# No rate limits, the storm is what is measured.
+	ip netns exec ${NS}1 "$2" -r 0 -R 0 -p "$DIR/ninfod.pid"
+	sleep 0.5
+	out=$(ip netns exec ${NS}0 "$1" -6 -N name -q -j -f -c $COUNT fec0:231::2)
+	rcvd=$(echo "$out" | json_get received)
+	ms=$(echo "$out" | json_get time_ms)
+	record ninfod_storm "$(awk -v q=$COUNT -v r=$rcvd -v ms=$ms 'BEGIN {
+		printf ",\"queries\":%d,\"replies\":%d,\"time_ms\":%d", q, r, ms
+		printf ",\"replies_per_s\":%d", ms ? r * 1000 / ms : 0
+	}')"
+	;;
+tftpd)
+	command -v curl >/dev/null && curl -V | grep -qw tftp || skip "no curl with TFTP"
+	chain 1
+	DIR=$(mktemp -d)
+	dd if=/dev/urandom of="$DIR/img" bs=1M count=32 2>/dev/null
+	chmod -R a+rX "$DIR"
+	ip netns exec ${NS}1 "$1" -l -p 69 "$DIR" &
+	PIDS="$PIDS $!"
+	wait_port ${NS}1 69 || { echo "tftpd did not start" >&2; exit 1; }
+	clients=
+	i=0
+	while [ $i -lt $CLIENTS ]; do
+		ip netns exec ${NS}0 curl -s --tftp-blksize 1428 -o /dev/null \
+			-w '%{speed_download} %{size_download}\n' tftp://10.231.0.2/img > "$DIR/c$i" &
+		clients="$clients $!"
+		i=$((i + 1))
+	done
+	wait $clients || :
+	record tftpd "$(cat "$DIR"/c* | awk -v n=$CLIENTS '{ s += $1; b += $2; if ($2 < 33554432) bad++ }
+		END {
+			printf ",\"clients\":%d,\"bytes\":%d,\"failed\":%d", n, b, bad
+			printf ",\"mb_per_s_per_client\":%.1f", s / n / 1e6
+		}')"
+	;;
+tracepath)
+	chain $HOPS
+	dst=10.231.$((HOPS - 1)).2
+	t0=$(now_ns)
+	out=$(ip netns exec ${NS}0 "$1" -n $dst)
+	t1=$(now_ns)
+	hops=$(echo "$out" | sed -n 's/.*hops \([0-9]*\).*/\1/p')
+	record tracepath ",\"hops\":${hops:-0},\"wall_ns\":$((t1 - t0))"
+	;;
+*)
+	echo "$0: unknown scenario $scenario" >&2
+	exit 1
+	;;
+esac
@@ -0,0 +1,180 @@
+/*
+ * Microbenchmarks of the per-packet hot paths of ping.
+ *
+ * Every case runs a fixed number of iterations BENCH_RUNS times, after
+ * one warm-up run, and reports the best and the median time per operation
+ * as a JSON record of type "bench" on a line of its own, written by the
+ * same code as ping -j. The iteration count is picked once so that a run
+ * takes about BENCH_RUN_NS, and is reported with the results.
+ *
+ * The code under test is linked in from ping_common.c and ping6_common.c;
+ * the few symbols they need from ping.c are stubbed below.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "iputils_cksum.h"
+#include "ping.h"
+
+#define BENCH_RUNS	7
+#define BENCH_RUN_NS	50000000LL
+
+char *device;
+int pmtudisc = -1;
+
+char *pr_addr(void *sa __attribute__((__unused__)),
+	      socklen_t salen __attribute__((__unused__)))
+{
+	return "bench";
+}
+
+static volatile unsigned long sink;
+static unsigned char buf[65536 + 8];
+
+static void run_cksum(long iters, size_t size)
+{
+	unsigned long acc = 0;
+	long i;
+
+	for (i = 0; i < iters; i++) {
+		buf[i & 7] = i;
+		acc += in_cksum(buf, size, 0);
+	}
+	sink = acc;
+}
+
+/* A reply arriving 100us after it was sent, through the -q flood path. */
+static void run_stats(long iters, size_t size)
+{
+	struct timespec sent = { 1, 0 }, rx;
+	long i;
+
+	memcpy(buf + 8, &sent, sizeof(sent));
+	for (i = 0; i < iters; i++) {
+		rx.tv_sec = 1;
+		rx.tv_nsec = 100000 + (i & 1023);
+		gather_statistics(NULL, buf, 8, size, i, 64, 0, &rx, "bench", NULL);
+	}
+}
+
+/* fill() a probe, then check a reply against it as ping does. */
+static void run_fill_verify(long iters, size_t size)
+{
+	static unsigned char reply[MAXPACKET];
+	unsigned long acc = 0;
+	long i;
+
+	datalen = size;
+	for (i = 0; i < iters; i++) {
+		fill("0123456789abcdefdeadbeefcafef00d", outpack, size + 8);
+		memcpy(reply, outpack + 8, size);
+		acc += contains_pattern_in_payload(reply);
+	}
+	sink = acc;
+}
+
+/* A window of "size" sequence numbers in flight, as a flood keeps them. */
+static void run_rcvd(long iters, size_t size)
+{
+	static long seq;
+	unsigned long acc = 0;
+	long i;
+
+	for (i = 0; i < iters; i++) {
+		seq++;
+		rcvd_sent(&rcvd_tbl, seq + size);
+		acc += rcvd_reply(&rcvd_tbl, seq) == RCVD_NEW;
+	}
+	sink = acc;
+}
+
+struct bench {
+	const char *name;
+	void (*run)(long iters, size_t size);
+	size_t sizes[5];	/* 0 terminated */
+};
+
+static const struct bench benches[] = {
+	{ "in_cksum", run_cksum, { 20, 64, 1500, 9000, 65536 } },
+	{ "gather_statistics", run_stats, { 64, 1472 } },
+	{ "fill_verify", run_fill_verify, { 56, 1472 } },
+	{ "rcvd", run_rcvd, { 64, 1024 } },
+};
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void bench_one(const struct bench *b, size_t size)
+{
+	long long t[BENCH_RUNS];
+	long iters = 1;
+	int i;
+
+	/* Warm up, and find the iteration count while at it. */
+	for (;;) {
+		long long start = now_ns();
+
+		b->run(iters, size);
+		if (now_ns() - start >= BENCH_RUN_NS / 4 || iters >= 1L << 30)
+			break;
+		iters *= 2;
+	}
+	iters *= 4;
+
+	for (i = 0; i < BENCH_RUNS; i++) {
+		long long start = now_ns();
+
+		b->run(iters, size);
+		t[i] = now_ns() - start;
+	}
+	qsort(t, BENCH_RUNS, sizeof(t[0]), cmp_ll);
+
+	json_begin("bench", NULL);
+	json_str("name", b->name);
+	json_str("version", PACKAGE_VERSION);
+	json_int("size", size);
+	json_int("iterations", iters);
+	json_int("runs", BENCH_RUNS);
+	json_int("ps_per_op", t[0] * 1000 / iters);
+	json_int("ps_per_op_median", t[BENCH_RUNS / 2] * 1000 / iters);
+	json_end();
+	json_flush();
+}
+
+int main(int argc, char **argv)
+{
+	size_t i, j;
+	int found = 0;
+
+	options |= F_QUIET;
+	timing = 1;
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 7;
+
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		if (argc > 1 && strcmp(argv[1], benches[i].name))
+			continue;
+		found = 1;
+		for (j = 0; j < 5 && benches[i].sizes[j]; j++)
+			bench_one(&benches[i], benches[i].sizes[j]);
+	}
+	if (!found) {
+		fprintf(stderr, "usage: %s [in_cksum|gather_statistics|fill_verify|rcvd]\n", argv[0]);
+		return 1;
+	}
+	return 0;
+}
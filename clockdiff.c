@@ -61,6 +61,7 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -76,10 +77,18 @@
 # include <sys/capability.h>
 #endif
 
+#include "iputils_cksum.h"
 #include "iputils_common.h"
 
 #define MAX_HOSTNAMELEN	NI_MAXHOST
 
+#ifndef ICMP_FILTER
+#define ICMP_FILTER	1
+struct icmp_filter {
+	uint32_t	data;
+};
+#endif
+
 enum {
 	RANGE = 1,		/* best expected round-trip time, ms */
 	MSGS = 50,
@@ -138,60 +147,6 @@ struct measure_vars {
  * this comment all you can find is functions.
  */
 
-/*
- * addcarry() - checksum routine for Internet Protocol family headers.
- *
- * This routine is very heavily used in the network code and should be modified for each
- * CPU to be as fast as possible.
- *
- * This implementation is TAHOE version.
- */
-static inline int addcarry(int sum)
-{
-	if (sum & 0xffff0000) {
-		sum &= 0xffff;
-		sum++;
-	}
-	return sum;
-}
-
-static int in_cksum(unsigned short *addr, int len)
-{
-	union word {
-		char c[2];
-		unsigned short s;
-	} u;
-	int sum = 0;
-
-	while (len > 0) {
-		/* add by words */
-		while ((len -= 2) >= 0) {
-			if ((unsigned long)addr & 0x1) {
-				/* word is not aligned */
-				u.c[0] = *(char *)addr;
-				u.c[1] = *((char *)addr + 1);
-				sum += u.s;
-				addr++;
-			} else
-				sum += *addr++;
-			sum = addcarry(sum);
-		}
-		if (len == -1)
-			/* odd number of bytes */
-			u.c[0] = *(unsigned char *)addr;
-	}
-	if (len == -1) {
-		/*
-		 * The last mbuf has odd # of bytes.  Follow the standard (the odd byte
-		 * is shifted left by 8 bits)
-		 */
-		u.c[1] = 0;
-		sum += u.s;
-		sum = addcarry(sum);
-	}
-	return (~sum & 0xffff);
-}
-
 static int measure_inner_loop(struct run_state *ctl, struct measure_vars *mv)
 {
 	long delta1;
@@ -349,17 +304,8 @@ static int measure(struct run_state *ctl)
 	ctl->measure_delta1 = HOSTDOWN;
 
 	/* empties the icmp input queue */
-	FD_ZERO(&mv.ready);
- empty:
-	FD_SET(ctl->sock_raw, &mv.ready);
-	if (select(FD_SETSIZE, &mv.ready, NULL, NULL, &mv.tout)) {
-		mv.length = sizeof(struct sockaddr_in);
-		mv.cc = recvfrom(ctl->sock_raw, (char *)mv.packet, PACKET_IN, 0,
-			      NULL, &mv.length);
-		if (mv.cc < 0)
-			return -1;
-		goto empty;
-	}
+	while (recv(ctl->sock_raw, mv.packet, PACKET_IN, MSG_DONTWAIT) >= 0)
+		;
 
 	/*
 	 * To measure the difference, select MSGS messages whose round-trip time is
@@ -402,7 +348,7 @@ static int measure(struct run_state *ctl)
 		gettimeofday(&mv.tv1, NULL);
 		*(uint32_t *) (oicp + 1) =
 		    htonl((mv.tv1.tv_sec % (24 * 60 * 60)) * 1000 + mv.tv1.tv_usec / 1000);
-		oicp->checksum = in_cksum((unsigned short *)oicp, sizeof(*oicp) + 12);
+		oicp->checksum = in_cksum((unsigned short *)oicp, sizeof(*oicp) + 12, 0);
 
 		mv.count = sendto(ctl->sock_raw, (char *)opacket, sizeof(*oicp) + 12, 0,
 			       (struct sockaddr *)&ctl->server, sizeof(struct sockaddr_in));
@@ -430,15 +376,498 @@ static int measure(struct run_state *ctl)
 	return GOOD;
 }
 
+/*
+ * Survey mode: many destinations measured at once over the one raw socket.
+ *
+ * Every host keeps its own measurement state and has at most one probe
+ * outstanding, so its round-trip times are not skewed by our own queueing;
+ * the number of probes in flight over all hosts is bounded by the window.
+ * Probes share ctl->id and are told apart by sequence number, which indexes
+ * the table of outstanding probes. Local times are taken in nanoseconds,
+ * replies are stamped by the kernel on arrival (SO_TIMESTAMPNS), and the
+ * millisecond timestamps of the remote side are read as the middle of the
+ * millisecond they name.
+ */
+enum {
+	SURVEY_WINDOW = 64,
+	SURVEY_MAXWINDOW = 1024,
+	SURVEY_SLOTS = 2048,	/* power of two, above SURVEY_MAXWINDOW */
+	SURVEY_BATCH = 32,
+	SURVEY_MINTMO = 10,	/* ms */
+};
+
+#define NSEC_PER_MSEC	1000000LL
+#define NSEC_PER_DAY	(86400LL * 1000 * NSEC_PER_MSEC)
+
+struct survey_host {
+	char *name;
+	struct sockaddr_in addr;
+	int status;		/* CONTINUE while being measured */
+	int msgcount;
+	int lost;		/* probes unanswered in a row */
+	int64_t rtt;		/* smoothed round-trip time, ns */
+	int64_t rtt_sigma;
+	int64_t min_rtt;
+	int64_t min1;
+	int64_t min2;
+	int64_t delta1;		/* delta of the min_rtt sample */
+};
+
+struct survey_probe {
+	struct survey_host *host;	/* NULL when the slot is free */
+	int64_t sent;		/* CLOCK_REALTIME */
+	int64_t deadline;	/* CLOCK_MONOTONIC */
+	uint16_t seq;
+	int pos;		/* index in inflight[] */
+};
+
+struct survey {
+	struct survey_host *hosts;
+	size_t nhosts;
+	size_t done;
+	size_t *ready;		/* ring of hosts waiting for their next probe */
+	size_t ready_head;
+	size_t ready_len;
+	int window;
+	int ninflight;
+	int inflight[SURVEY_MAXWINDOW];
+	uint16_t seq;
+	struct survey_probe probes[SURVEY_SLOTS];
+};
+
+static int64_t survey_now(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return ts.tv_sec * 1000 * NSEC_PER_MSEC + ts.tv_nsec;
+}
+
+/* Bring a difference of two times of day within +-12 hours. */
+static int64_t survey_wrap(int64_t d)
+{
+	if (d < -NSEC_PER_DAY / 2)
+		d += NSEC_PER_DAY;
+	else if (d >= NSEC_PER_DAY / 2)
+		d -= NSEC_PER_DAY;
+	return d;
+}
+
+static int survey_add(struct survey *sv, const char *name)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_RAW
+	};
+	struct addrinfo *result;
+	struct survey_host *h;
+	int status;
+
+	status = getaddrinfo(name, NULL, &hints, &result);
+	if (status) {
+		fprintf(stderr, "clockdiff: %s: %s\n", name, gai_strerror(status));
+		return -1;
+	}
+	if (!(sv->nhosts & (sv->nhosts + 1))) {
+		h = realloc(sv->hosts, (sv->nhosts + 1) * 2 * sizeof(*h));
+		if (!h) {
+			perror("clockdiff: realloc");
+			exit(1);
+		}
+		sv->hosts = h;
+	}
+	h = &sv->hosts[sv->nhosts++];
+	memset(h, 0, sizeof(*h));
+	h->name = strdup(name);
+	memcpy(&h->addr, result->ai_addr, sizeof(h->addr));
+	freeaddrinfo(result);
+	h->status = CONTINUE;
+	h->rtt = 1000 * NSEC_PER_MSEC;
+	h->min_rtt = h->min1 = h->min2 = INT64_MAX;
+	return 0;
+}
+
+/* Destinations from "path", "-" for stdin: whitespace separated, # comments. */
+static int survey_read(struct survey *sv, const char *path)
+{
+	char line[1024];
+	FILE *fp = stdin;
+	int failed = 0;
+
+	if (strcmp(path, "-") && !(fp = fopen(path, "r"))) {
+		fprintf(stderr, "clockdiff: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		char *p = strchr(line, '#');
+
+		if (p)
+			*p = '\0';
+		for (p = strtok(line, " \t\r\n"); p; p = strtok(NULL, " \t\r\n"))
+			if (survey_add(sv, p))
+				failed = 1;
+	}
+	if (fp != stdin)
+		fclose(fp);
+	return failed;
+}
+
+static void survey_queue(struct survey *sv, struct survey_host *h)
+{
+	sv->ready[(sv->ready_head + sv->ready_len++) % sv->nhosts] = h - sv->hosts;
+}
+
+/* The host of probe "p" is finished with "status", or waits for another probe. */
+static void survey_release(struct survey *sv, struct survey_probe *p, int status)
+{
+	struct survey_host *h = p->host;
+	int last = sv->inflight[--sv->ninflight];
+
+	sv->inflight[p->pos] = last;
+	sv->probes[last].pos = p->pos;
+	p->host = NULL;
+
+	if (status == CONTINUE && h->msgcount >= MSGS)
+		status = GOOD;
+	if (status == CONTINUE && h->lost > TRIALS)
+		status = HOSTDOWN;
+	if (status == CONTINUE) {
+		survey_queue(sv, h);
+		return;
+	}
+	h->status = status;
+	sv->done++;
+}
+
+/* Probe waiting hosts until the window is full; 1 if sending has to back off. */
+static int survey_send(struct run_state *ctl, struct survey *sv)
+{
+	unsigned char opacket[sizeof(struct icmphdr) + 12];
+	struct icmphdr *oicp = (struct icmphdr *)opacket;
+	uint32_t *ts = (uint32_t *)(oicp + 1);
+
+	memset(opacket, 0, sizeof(opacket));
+	oicp->type = ICMP_TIMESTAMP;
+	oicp->un.echo.id = ctl->id;
+
+	while (sv->ready_len && sv->ninflight < sv->window) {
+		struct survey_host *h = &sv->hosts[sv->ready[sv->ready_head]];
+		struct survey_probe *p;
+		int64_t tmo;
+
+		do
+			p = &sv->probes[++sv->seq & (SURVEY_SLOTS - 1)];
+		while (p->host);
+
+		oicp->un.echo.sequence = sv->seq;
+		oicp->checksum = 0;
+		p->sent = survey_now(CLOCK_REALTIME);
+		ts[0] = htonl(p->sent % NSEC_PER_DAY / NSEC_PER_MSEC);
+		oicp->checksum = in_cksum(opacket, sizeof(opacket), 0);
+
+		if (sendto(ctl->sock_raw, opacket, sizeof(opacket), 0,
+			   (struct sockaddr *)&h->addr, sizeof(h->addr)) < 0) {
+			if (errno == ENOBUFS || errno == EAGAIN || errno == EINTR)
+				return 1;
+			h->status = UNREACHABLE;
+			sv->done++;
+		} else {
+			tmo = h->rtt + 4 * h->rtt_sigma;
+			if (tmo < SURVEY_MINTMO * NSEC_PER_MSEC)
+				tmo = SURVEY_MINTMO * NSEC_PER_MSEC;
+			p->host = h;
+			p->seq = sv->seq;
+			p->deadline = survey_now(CLOCK_MONOTONIC) + tmo;
+			p->pos = sv->ninflight;
+			sv->inflight[sv->ninflight++] = p - sv->probes;
+		}
+		sv->ready_head = (sv->ready_head + 1) % sv->nhosts;
+		sv->ready_len--;
+	}
+	return 0;
+}
+
+/* The outstanding probe "seq" to "to", or NULL. */
+static struct survey_probe *survey_match(struct survey *sv, uint16_t seq, uint32_t to)
+{
+	struct survey_probe *p = &sv->probes[seq & (SURVEY_SLOTS - 1)];
+
+	if (!p->host || p->seq != seq || p->host->addr.sin_addr.s_addr != to)
+		return NULL;
+	return p;
+}
+
+static void survey_reply(struct run_state *ctl, struct survey *sv, unsigned char *buf,
+			 int cc, uint32_t from, int64_t recvtime)
+{
+	struct iphdr *ip = (struct iphdr *)buf;
+	struct icmphdr *icp;
+	struct survey_probe *p;
+	struct survey_host *h;
+	uint32_t *ts;
+	uint32_t histime, histime1;
+	int64_t delta1, delta2, diff;
+	int hlen;
+
+	hlen = ip->ihl << 2;
+	if (cc < hlen + (int)sizeof(*icp) + 12)
+		return;
+	icp = (struct icmphdr *)(buf + hlen);
+
+	if (icp->type == ICMP_DEST_UNREACH) {
+		/* The quoted probe, if it is one of ours. */
+		ip = (struct iphdr *)(icp + 1);
+		cc -= hlen + sizeof(*icp);
+		hlen = ip->ihl << 2;
+		if (cc < hlen + (int)sizeof(*icp))
+			return;
+		icp = (struct icmphdr *)((unsigned char *)ip + hlen);
+		if (icp->type != ICMP_TIMESTAMP || icp->un.echo.id != ctl->id)
+			return;
+		p = survey_match(sv, icp->un.echo.sequence, ip->daddr);
+		if (p)
+			survey_release(sv, p, UNREACHABLE);
+		return;
+	}
+	if (icp->type != ICMP_TIMESTAMPREPLY || icp->un.echo.id != ctl->id)
+		return;
+	p = survey_match(sv, icp->un.echo.sequence, from);
+	if (!p)
+		return;
+	h = p->host;
+
+	/* Receive and transmit timestamps of the remote side. */
+	ts = (uint32_t *)(icp + 1);
+	histime = ntohl(ts[1]);
+	histime1 = ntohl(ts[2]);
+	if ((histime | histime1) & 0x80000000) {
+		survey_release(sv, p, NONSTDTIME);
+		return;
+	}
+	diff = recvtime - p->sent;
+	delta1 = survey_wrap(histime * NSEC_PER_MSEC + NSEC_PER_MSEC / 2 -
+			     p->sent % NSEC_PER_DAY);
+	delta2 = survey_wrap(recvtime % NSEC_PER_DAY -
+			     (histime1 * NSEC_PER_MSEC + NSEC_PER_MSEC / 2));
+
+	h->rtt = (h->rtt * 3 + diff) / 4;
+	h->rtt_sigma = (h->rtt_sigma * 3 + llabs(diff - h->rtt)) / 4;
+	h->msgcount++;
+	h->lost = 0;
+	if (delta1 < h->min1)
+		h->min1 = delta1;
+	if (delta2 < h->min2)
+		h->min2 = delta2;
+	/* The shortest exchange bounds the error of its delta best. */
+	if (diff < h->min_rtt) {
+		h->min_rtt = diff;
+		h->delta1 = (delta1 - delta2) / 2;
+	}
+	survey_release(sv, p, CONTINUE);
+}
+
+/* Read whatever is queued, in batches. */
+static int survey_recv(struct run_state *ctl, struct survey *sv)
+{
+	static unsigned char bufs[SURVEY_BATCH][PACKET_IN];
+	static union {
+		char buf[CMSG_SPACE(sizeof(struct timespec))];
+		size_t align;	/* as struct cmsghdr */
+	} ctrl[SURVEY_BATCH];
+#ifdef HAVE_RECVMMSG
+	static int no_mmsg;
+	struct mmsghdr msgs[SURVEY_BATCH];
+#else
+	struct {
+		struct msghdr msg_hdr;
+		unsigned int msg_len;
+	} msgs[SURVEY_BATCH];
+#endif
+	struct sockaddr_in from[SURVEY_BATCH];
+	struct iovec iov[SURVEY_BATCH];
+	int i, n = -1;
+
+	do {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < SURVEY_BATCH; i++) {
+			iov[i].iov_base = bufs[i];
+			iov[i].iov_len = sizeof(bufs[i]);
+			msgs[i].msg_hdr.msg_name = &from[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = ctrl[i].buf;
+			msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i].buf);
+		}
+#ifdef HAVE_RECVMMSG
+		if (!no_mmsg) {
+			n = recvmmsg(ctl->sock_raw, msgs, SURVEY_BATCH, MSG_DONTWAIT, NULL);
+			/* Kernel is older than its headers, go one by one. */
+			if (n < 0 && errno == ENOSYS)
+				no_mmsg = 1;
+		}
+		if (no_mmsg)
+#endif
+		{
+			n = recvmsg(ctl->sock_raw, &msgs[0].msg_hdr, MSG_DONTWAIT);
+			if (n >= 0) {
+				msgs[0].msg_len = n;
+				n = 1;
+			}
+		}
+		if (n < 0)
+			return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+		for (i = 0; i < n; i++) {
+			struct cmsghdr *c;
+			struct timespec rts;
+			int64_t recvtime = 0;
+
+			for (c = CMSG_FIRSTHDR(&msgs[i].msg_hdr); c;
+			     c = CMSG_NXTHDR(&msgs[i].msg_hdr, c)) {
+				if (c->cmsg_level == SOL_SOCKET &&
+				    c->cmsg_type == SCM_TIMESTAMPNS &&
+				    c->cmsg_len >= CMSG_LEN(sizeof(rts))) {
+					memcpy(&rts, CMSG_DATA(c), sizeof(rts));
+					recvtime = rts.tv_sec * 1000 * NSEC_PER_MSEC + rts.tv_nsec;
+				}
+			}
+			if (!recvtime)
+				recvtime = survey_now(CLOCK_REALTIME);
+			survey_reply(ctl, sv, bufs[i], msgs[i].msg_len,
+				     from[i].sin_addr.s_addr, recvtime);
+		}
+	} while (n == SURVEY_BATCH);
+	return 0;
+}
+
+/* Give up on probes past their deadline; ms until the next one, -1 if none. */
+static int survey_expire(struct survey *sv)
+{
+	int64_t now = survey_now(CLOCK_MONOTONIC);
+	int64_t next = INT64_MAX;
+	int i = 0;
+
+	while (i < sv->ninflight) {
+		struct survey_probe *p = &sv->probes[sv->inflight[i]];
+
+		if (p->deadline <= now) {
+			p->host->lost++;
+			survey_release(sv, p, CONTINUE);
+			continue;
+		}
+		if (p->deadline < next)
+			next = p->deadline;
+		i++;
+	}
+	if (next == INT64_MAX)
+		return -1;
+	return (next - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+}
+
+static void survey_print(struct survey *sv)
+{
+	size_t i;
+	int width = 4;
+
+	for (i = 0; i < sv->nhosts; i++)
+		if ((int)strlen(sv->hosts[i].name) > width)
+			width = strlen(sv->hosts[i].name);
+
+	printf("%-*s %10s %10s %10s %10s\n", width, _("host"),
+	       _("rtt"), _("delta"), _("delta1"), _("error"));
+	for (i = 0; i < sv->nhosts; i++) {
+		struct survey_host *h = &sv->hosts[i];
+
+		printf("%-*s ", width, h->name);
+		switch (h->status) {
+		case GOOD:
+			printf("%10.3f %10.3f %10.3f %10.3f\n",
+			       (double)h->min_rtt / NSEC_PER_MSEC,
+			       (double)(h->min1 - h->min2) / 2 / NSEC_PER_MSEC,
+			       (double)h->delta1 / NSEC_PER_MSEC,
+			       (double)(h->min_rtt / 2 + NSEC_PER_MSEC / 2) / NSEC_PER_MSEC);
+			break;
+		case HOSTDOWN:
+			printf(_("down\n"));
+			break;
+		case NONSTDTIME:
+			printf(_("non-standard time format\n"));
+			break;
+		default:
+			printf(_("unreachable\n"));
+			break;
+		}
+	}
+}
+
+/*
+ * Measures all hosts of "sv"; the table goes to stdout. Returns 0 when every
+ * host was measured, 1 if some were not, -1 on failure.
+ */
+static int survey(struct run_state *ctl, struct survey *sv)
+{
+	struct pollfd pfd = { .fd = ctl->sock_raw, .events = POLLIN };
+	struct icmp_filter filt;
+	unsigned char junk[PACKET_IN];
+	int on = 1;
+	int rcvbuf = sv->window * 2048;
+	size_t i;
+
+	filt.data = ~((1 << ICMP_TIMESTAMPREPLY) | (1 << ICMP_DEST_UNREACH));
+	if (setsockopt(ctl->sock_raw, SOL_RAW, ICMP_FILTER, &filt, sizeof(filt)) == -1)
+		perror("clockdiff: WARNING: setsockopt(ICMP_FILTER)");
+	if (setsockopt(ctl->sock_raw, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1)
+		perror("clockdiff: WARNING: setsockopt(SO_TIMESTAMPNS)");
+	setsockopt(ctl->sock_raw, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	sv->ready = malloc(sv->nhosts * sizeof(*sv->ready));
+	if (!sv->ready)
+		return -1;
+	for (i = 0; i < sv->nhosts; i++)
+		survey_queue(sv, &sv->hosts[i]);
+
+	while (recv(ctl->sock_raw, junk, sizeof(junk), MSG_DONTWAIT) >= 0)
+		;
+
+	for (;;) {
+		int tmo = survey_expire(sv);
+		int backoff = survey_send(ctl, sv);
+
+		if (sv->done == sv->nhosts)
+			break;
+		/* New probes expire SURVEY_MINTMO from now at the earliest. */
+		if (backoff && (tmo < 0 || tmo > 1))
+			tmo = 1;
+		else if (tmo < 0)
+			tmo = SURVEY_MINTMO;
+		if (poll(&pfd, 1, tmo) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (pfd.revents && survey_recv(ctl, sv) < 0)
+			return -1;
+	}
+
+	survey_print(sv);
+	for (i = 0; i < sv->nhosts; i++)
+		if (sv->hosts[i].status != GOOD)
+			return 1;
+	return 0;
+}
+
 static void usage(void)
 {
 	fprintf(stderr, _(
 		"\nUsage:\n"
-		"  clockdiff [options] <destination>\n"
+		"  clockdiff [options] <destination>...\n"
 		"\nOptions:\n"
 		"                without -o, use ip timestamp only\n"
 		"  -o            use ip timestamp and icmp echo\n"
 		"  -o1           use three-term ip timestamp and icmp echo\n"
+		"  -f <file>     read destinations from file, - for stdin\n"
+		"  -w <count>    probes in flight with several destinations\n"
 		"  -V            print version and exit\n"
 		"  <destination> dns name or ip address\n"
 		"\nFor more details see clockdiff(8).\n"));
@@ -480,11 +909,12 @@ int main(int argc, char **argv)
 	char hostname[MAX_HOSTNAMELEN];
 	int s_errno = 0;
 	int n_errno = 0;
+	struct survey sv = {
+		.window = SURVEY_WINDOW
+	};
+	char *hostfile = NULL;
+	int ch;
 
-	if (argc == 2 && !strcmp(argv[1], "-V")) {
-		printf(IPUTILS_VERSION("clockdiff"));
-		return 0;
-	}
 	if (argc < 2) {
 		drop_rights();
 		usage();
@@ -498,16 +928,37 @@ int main(int argc, char **argv)
 		n_errno = errno;
 	drop_rights();
 
-	if (argc == 3) {
-		if (strcmp(argv[1], "-o") == 0) {
-			ctl.ip_opt_len = 4 + 4 * 8;
-			argv++;
-		} else if (strcmp(argv[1], "-o1") == 0) {
-			ctl.ip_opt_len = 4 + 3 * 8;
-			argv++;
-		} else
+	while ((ch = getopt(argc, argv, "f:o::w:V")) != EOF) {
+		switch (ch) {
+		case 'f':
+			hostfile = optarg;
+			break;
+		case 'o':
+			if (!optarg)
+				ctl.ip_opt_len = 4 + 4 * 8;
+			else if (!strcmp(optarg, "1"))
+				ctl.ip_opt_len = 4 + 3 * 8;
+			else
+				usage();
+			break;
+		case 'w':
+			sv.window = atoi(optarg);
+			if (sv.window < 1 || sv.window > SURVEY_MAXWINDOW) {
+				fprintf(stderr, _("clockdiff: window must be between 1 and %d\n"),
+					SURVEY_MAXWINDOW);
+				exit(1);
+			}
+			break;
+		case 'V':
+			printf(IPUTILS_VERSION("clockdiff"));
+			return 0;
+		default:
 			usage();
-	} else if (argc != 2)
+		}
+	}
+	argc -= optind;
+	argv += optind - 1;
+	if (argc < 1 && !hostfile)
 		usage();
 
 	if (ctl.sock_raw < 0) {
@@ -527,6 +978,29 @@ int main(int argc, char **argv)
 
 	ctl.id = getpid();
 
+	if (hostfile || argc > 1) {
+		int failed = 0;
+		int i;
+
+		if (ctl.ip_opt_len) {
+			fprintf(stderr, _("clockdiff: -o is not supported with several destinations\n"));
+			exit(1);
+		}
+		if (hostfile)
+			failed = survey_read(&sv, hostfile);
+		for (i = 1; i <= argc; i++)
+			if (survey_add(&sv, argv[i]))
+				failed = 1;
+		if (!sv.nhosts)
+			exit(1);
+		status = survey(&ctl, &sv);
+		if (status < 0) {
+			perror("clockdiff: survey");
+			exit(1);
+		}
+		exit(status || failed);
+	}
+
 	gethostname(hostname, sizeof(hostname));
 	status = getaddrinfo(hostname, NULL, &hints, &result);
 	if (status) {
@@ -0,0 +1,212 @@
+#ifndef IPUTILS_CKSUM_H
+#define IPUTILS_CKSUM_H
+
+/*
+ * Internet checksum (RFC 1071) shared by ping, rdisc and clockdiff.
+ *
+ * The sum is accumulated 32 bits at a time in a 64 bit register and only
+ * folded at the end. On x86 the bulk of a large packet goes through SSE2
+ * or AVX2, picked at runtime; aarch64 always has NEON. in_cksum_update()
+ * adjusts an existing checksum for changed words without touching the
+ * rest of the packet (RFC 1624).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define IPUTILS_CKSUM_X86
+# include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+# define IPUTILS_CKSUM_NEON
+# include <arm_neon.h>
+#endif
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+# define IPUTILS_ODDBYTE(v)	(v)
+#else
+# define IPUTILS_ODDBYTE(v)	((uint16_t)(v) << 8)
+#endif
+
+/* Fold a 64 bit one's complement sum down to 16 bits. */
+static inline uint16_t in_cksum_fold(uint64_t sum)
+{
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	return sum;
+}
+
+/* Plain C: 32 bit words into a 64 bit accumulator, two at a time. */
+static inline uint64_t in_cksum_partial64(const unsigned char *p, size_t len, uint64_t sum)
+{
+	uint32_t w[2];
+
+	while (len >= 8) {
+		memcpy(w, p, 8);
+		sum += w[0];
+		sum += w[1];
+		p += 8;
+		len -= 8;
+	}
+	if (len >= 4) {
+		memcpy(w, p, 4);
+		sum += w[0];
+		p += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		uint16_t h;
+
+		memcpy(&h, p, 2);
+		sum += h;
+		p += 2;
+		len -= 2;
+	}
+	if (len)
+		sum += IPUTILS_ODDBYTE(*p);
+	return sum;
+}
+
+#ifdef IPUTILS_CKSUM_X86
+/*
+ * 16 bit words are widened to 32 bit lanes, which could overflow after
+ * 32768 rounds; the lanes are spilled into the 64 bit sum well before.
+ */
+# define IPUTILS_CKSUM_SPILL	16384
+
+__attribute__((target("sse2")))
+static uint64_t in_cksum_partial_sse2(const unsigned char *p, size_t len, uint64_t sum)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	while (len >= 16) {
+		__m128i acc = zero;
+		uint32_t lanes[4];
+		size_t n = 0;
+
+		for (; len >= 16 && n < IPUTILS_CKSUM_SPILL; n++) {
+			__m128i v = _mm_loadu_si128((const __m128i *)p);
+
+			acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+			acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+			p += 16;
+			len -= 16;
+		}
+		_mm_storeu_si128((__m128i *)lanes, acc);
+		sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+	return in_cksum_partial64(p, len, sum);
+}
+
+__attribute__((target("avx2")))
+static uint64_t in_cksum_partial_avx2(const unsigned char *p, size_t len, uint64_t sum)
+{
+	const __m256i zero = _mm256_setzero_si256();
+
+	while (len >= 32) {
+		__m256i acc = zero;
+		uint32_t lanes[8];
+		size_t n = 0;
+		int i;
+
+		for (; len >= 32 && n < IPUTILS_CKSUM_SPILL; n++) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)p);
+
+			acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+			acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+			p += 32;
+			len -= 32;
+		}
+		_mm256_storeu_si256((__m256i *)lanes, acc);
+		for (i = 0; i < 8; i++)
+			sum += lanes[i];
+	}
+	return in_cksum_partial64(p, len, sum);
+}
+#endif
+
+#ifdef IPUTILS_CKSUM_NEON
+static uint64_t in_cksum_partial_neon(const unsigned char *p, size_t len, uint64_t sum)
+{
+	while (len >= 16) {
+		uint32x4_t acc = vdupq_n_u32(0);
+		size_t n = 0;
+
+		/* Each pairwise add puts at most 2 * 0xffff into a lane. */
+		for (; len >= 16 && n < 16384; n++) {
+			acc = vpadalq_u16(acc, vreinterpretq_u16_u8(vld1q_u8(p)));
+			p += 16;
+			len -= 16;
+		}
+		sum += vaddlvq_u32(acc);
+	}
+	return in_cksum_partial64(p, len, sum);
+}
+#endif
+
+/* Vector paths only pay off once the setup is amortised. */
+#define IPUTILS_CKSUM_VECMIN	64
+
+/*
+ * One's complement sum of "len" bytes at "addr" added to the 16 bit
+ * partial sum "csum", returned folded but not complemented.
+ */
+static inline uint16_t in_cksum_partial(const void *addr, size_t len, uint16_t csum)
+{
+	const unsigned char *p = addr;
+	uint64_t sum = csum;
+
+	if (len < IPUTILS_CKSUM_VECMIN)
+		return in_cksum_fold(in_cksum_partial64(p, len, sum));
+#if defined(IPUTILS_CKSUM_X86)
+	{
+		static uint64_t (*partial)(const unsigned char *, size_t, uint64_t);
+
+		if (!partial) {
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("avx2"))
+				partial = in_cksum_partial_avx2;
+			else if (__builtin_cpu_supports("sse2"))
+				partial = in_cksum_partial_sse2;
+			else
+				partial = in_cksum_partial64;
+		}
+		sum = partial(p, len, sum);
+	}
+#elif defined(IPUTILS_CKSUM_NEON)
+	sum = in_cksum_partial_neon(p, len, sum);
+#else
+	sum = in_cksum_partial64(p, len, sum);
+#endif
+	return in_cksum_fold(sum);
+}
+
+/*
+ * Checksum of "len" bytes at "addr", ready to be stored in a header.
+ * "csum" is a partial sum of data checksummed before, usually 0.
+ */
+static inline uint16_t in_cksum(const void *addr, size_t len, uint16_t csum)
+{
+	return ~in_cksum_partial(addr, len, csum);
+}
+
+/*
+ * RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m'). Returns checksum "csum" with
+ * the "len" bytes "old" replaced by "new". The changed bytes must start
+ * at an even offset from the start of the checksummed data.
+ */
+static inline uint16_t in_cksum_update(uint16_t csum, const void *old,
+				       const void *new, size_t len)
+{
+	uint64_t sum = (uint16_t)~csum;
+
+	sum += (uint16_t)~in_cksum_partial(old, len, 0);
+	sum += in_cksum_partial(new, len, 0);
+	return ~in_cksum_fold(sum);
+}
+
+#endif /* IPUTILS_CKSUM_H */
@@ -0,0 +1,130 @@
+#ifndef IPUTILS_INSTR_H
+#define IPUTILS_INSTR_H
+
+/*
+ * Hot path instrumentation shared by ping, ninfod and tftpd, built in
+ * with -DINSTRUMENT=true (ENABLE_INSTRUMENT). Timed events count calls
+ * and the CLOCK_MONOTONIC ns spent in them, the others are plain
+ * tallies. One translation unit of a program says INSTR_DEFINE; the
+ * counters are bumped with relaxed atomics, so ninfod's workers may
+ * share them. Compiled out, every macro below is empty and the timing
+ * variables are never read, so the compiler drops them.
+ */
+
+#define INSTR_EVENTS(X)					\
+	X(SEND,		"send",		1)		\
+	X(RECV,		"recv",		1)		\
+	X(POLL,		"poll",		1)		\
+	X(FILE,		"file",		1)		\
+	X(PARSE,	"parse",	0)		\
+	X(FORMAT,	"format",	0)		\
+	X(RESOLVE,	"resolve",	0)		\
+	X(WAKEUP,	"wakeups",	0)		\
+	X(EAGAIN,	"eagain",	0)		\
+	X(ENOBUFS,	"enobufs",	0)
+
+#ifdef ENABLE_INSTRUMENT
+
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+#define INSTR_ENUM(id, name, syscall)	INSTR_##id,
+enum { INSTR_EVENTS(INSTR_ENUM) INSTR_NEVENTS };
+#undef INSTR_ENUM
+
+struct instr_event {
+	unsigned long long count;
+	unsigned long long ns;
+};
+
+extern struct instr_event instr_tab[INSTR_NEVENTS];
+#define INSTR_DEFINE	struct instr_event instr_tab[INSTR_NEVENTS]
+
+static inline long long instr_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void instr_add(int ev, long long ns)
+{
+	__atomic_fetch_add(&instr_tab[ev].count, 1, __ATOMIC_RELAXED);
+	if (ns > 0)
+		__atomic_fetch_add(&instr_tab[ev].ns, ns, __ATOMIC_RELAXED);
+}
+
+/* Tally the errors a busy socket gives back. */
+static inline void instr_errno(int err)
+{
+	if (err == EAGAIN || err == EWOULDBLOCK)
+		instr_add(INSTR_EAGAIN, 0);
+	else if (err == ENOBUFS)
+		instr_add(INSTR_ENOBUFS, 0);
+}
+
+static inline const char *instr_name(int ev)
+{
+#define INSTR_NAME(id, name, syscall)	name,
+	static const char *const names[] = { INSTR_EVENTS(INSTR_NAME) };
+#undef INSTR_NAME
+
+	return names[ev];
+}
+
+/* Whether calls of a timed event are system calls. */
+static inline int instr_syscall(int ev)
+{
+#define INSTR_SYSCALL(id, name, syscall)	syscall,
+	static const char flags[] = { INSTR_EVENTS(INSTR_SYSCALL) };
+#undef INSTR_SYSCALL
+
+	return flags[ev];
+}
+
+/*
+ * All counters as one line into "buf", e.g. "syscalls 12, send 4 in
+ * 0.025ms, ..., eagain 3"; events that never happened are left out.
+ */
+static inline void instr_format(char *buf, size_t len)
+{
+	unsigned long long syscalls = 0;
+	size_t n;
+	int i;
+
+	for (i = 0; i < INSTR_NEVENTS; i++)
+		if (instr_syscall(i))
+			syscalls += __atomic_load_n(&instr_tab[i].count, __ATOMIC_RELAXED);
+	n = snprintf(buf, len, "syscalls %llu", syscalls);
+	for (i = 0; i < INSTR_NEVENTS && n < len; i++) {
+		unsigned long long count = __atomic_load_n(&instr_tab[i].count, __ATOMIC_RELAXED);
+		unsigned long long ns = __atomic_load_n(&instr_tab[i].ns, __ATOMIC_RELAXED);
+
+		if (!count)
+			continue;
+		if (i < INSTR_WAKEUP)
+			n += snprintf(buf + n, len - n, ", %s %llu in %llu.%03llums",
+				      instr_name(i), count, ns / 1000000, ns / 1000 % 1000);
+		else
+			n += snprintf(buf + n, len - n, ", %s %llu", instr_name(i), count);
+	}
+}
+
+# define INSTR_START()		instr_now()
+# define INSTR_STOP(ev, t)	instr_add(INSTR_##ev, instr_now() - (t))
+# define INSTR_COUNT(ev)	instr_add(INSTR_##ev, 0)
+# define INSTR_ERRNO(err)	instr_errno(err)
+
+#else
+
+# define INSTR_DEFINE		extern int instr_unused
+# define INSTR_START()		0LL
+# define INSTR_STOP(ev, t)	((void)(t))
+# define INSTR_COUNT(ev)	((void)0)
+# define INSTR_ERRNO(err)	((void)0)
+
+#endif /* ENABLE_INSTRUMENT */
+
+#endif /* IPUTILS_INSTR_H */
@@ -0,0 +1,252 @@
+#ifndef IPUTILS_RDNS_H
+#define IPUTILS_RDNS_H
+
+/*
+ * Reverse DNS shared by ping, tracepath and traceroute6. Names are kept
+ * in a bounded LRU cache and looked up by a few resolver threads, so a
+ * slow or dead name server never holds up a receive loop: rdns_lookup()
+ * answers from the cache, or queues the address and has the caller show
+ * it numerically until the name is in. Include it in one translation
+ * unit of a program, which is then linked with the threads library.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define RDNS_SIZE	256		/* names cached */
+#define RDNS_HASH	512		/* hash buckets, a power of two */
+#define RDNS_THREADS	4		/* lookups running at once */
+#define RDNS_WAIT	1000		/* ms a one-line-per-hop tool waits */
+
+enum { RDNS_FREE, RDNS_QUEUED, RDNS_DONE };
+
+struct rdns_entry {
+	struct rdns_entry *hnext;	/* hash chain */
+	struct rdns_entry *prev;	/* LRU list, most recent first */
+	struct rdns_entry *next;
+	struct rdns_entry *qnext;	/* resolver queue */
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int flags;			/* for getnameinfo() */
+	int state;
+	char name[NI_MAXHOST];		/* "" if there is none */
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t queued;		/* for the resolvers */
+	pthread_cond_t done;		/* for rdns_lookup() waiting */
+	int running;
+	struct rdns_entry ent[RDNS_SIZE];
+	struct rdns_entry *hash[RDNS_HASH];
+	struct rdns_entry lru;
+	struct rdns_entry *queue, **queue_tail;
+} rdns;
+static pthread_once_t rdns_once = PTHREAD_ONCE_INIT;
+
+static int rdns_same(const struct sockaddr *a, const struct sockaddr *b)
+{
+	if (a->sa_family != b->sa_family)
+		return 0;
+	if (a->sa_family == AF_INET)
+		return ((const struct sockaddr_in *)a)->sin_addr.s_addr ==
+		       ((const struct sockaddr_in *)b)->sin_addr.s_addr;
+	return !memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr,
+		       &((const struct sockaddr_in6 *)b)->sin6_addr, sizeof(struct in6_addr)) &&
+	       ((const struct sockaddr_in6 *)a)->sin6_scope_id ==
+	       ((const struct sockaddr_in6 *)b)->sin6_scope_id;
+}
+
+/* FNV-1a of the address, the rest of the sockaddr may vary. */
+static unsigned rdns_hash(const struct sockaddr *sa)
+{
+	const uint8_t *p;
+	uint32_t h = 2166136261u;
+	size_t i, n;
+
+	if (sa->sa_family == AF_INET) {
+		p = (const uint8_t *)&((const struct sockaddr_in *)sa)->sin_addr;
+		n = sizeof(struct in_addr);
+	} else {
+		p = (const uint8_t *)&((const struct sockaddr_in6 *)sa)->sin6_addr;
+		n = sizeof(struct in6_addr);
+	}
+	for (i = 0; i < n; i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h & (RDNS_HASH - 1);
+}
+
+static void rdns_unlink(struct rdns_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void rdns_push(struct rdns_entry *e)
+{
+	e->next = rdns.lru.next;
+	e->prev = &rdns.lru;
+	rdns.lru.next->prev = e;
+	rdns.lru.next = e;
+}
+
+/* The least recently used entry not waiting for a resolver, unhashed. */
+static struct rdns_entry *rdns_evict(void)
+{
+	struct rdns_entry *e, **pp;
+
+	for (e = rdns.lru.prev; e != &rdns.lru && e->state == RDNS_QUEUED; e = e->prev)
+		;
+	if (e == &rdns.lru)
+		return NULL;
+	if (e->state == RDNS_DONE) {
+		pp = &rdns.hash[rdns_hash((struct sockaddr *)&e->addr)];
+		while (*pp != e)
+			pp = &(*pp)->hnext;
+		*pp = e->hnext;
+	}
+	e->state = RDNS_FREE;
+	return e;
+}
+
+static void *rdns_resolver(void *arg __attribute__((__unused__)))
+{
+	pthread_mutex_lock(&rdns.lock);
+	for (;;) {
+		struct sockaddr_storage addr;
+		char name[NI_MAXHOST];
+		struct rdns_entry *e;
+		socklen_t addrlen;
+		int flags;
+
+		while (!rdns.queue)
+			pthread_cond_wait(&rdns.queued, &rdns.lock);
+		e = rdns.queue;
+		rdns.queue = e->qnext;
+		if (!rdns.queue)
+			rdns.queue_tail = &rdns.queue;
+		addr = e->addr;
+		addrlen = e->addrlen;
+		flags = e->flags;
+		pthread_mutex_unlock(&rdns.lock);
+
+		if (getnameinfo((struct sockaddr *)&addr, addrlen, name, sizeof(name), NULL, 0, flags))
+			name[0] = '\0';
+
+		/* Queued entries are never evicted, "e" is still ours. */
+		pthread_mutex_lock(&rdns.lock);
+		memcpy(e->name, name, sizeof(name));
+		e->state = RDNS_DONE;
+		pthread_cond_broadcast(&rdns.done);
+	}
+	return NULL;
+}
+
+static void rdns_setup(void)
+{
+	pthread_condattr_t ca;
+	pthread_t tid;
+	sigset_t all, old;
+	int i;
+
+	pthread_mutex_init(&rdns.lock, NULL);
+	pthread_cond_init(&rdns.queued, NULL);
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&rdns.done, &ca);
+	pthread_condattr_destroy(&ca);
+	rdns.lru.next = rdns.lru.prev = &rdns.lru;
+	for (i = 0; i < RDNS_SIZE; i++)
+		rdns_push(&rdns.ent[i]);
+	rdns.queue_tail = &rdns.queue;
+
+	/* Signals are for the main thread, which may longjmp or exit. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = 0; i < RDNS_THREADS; i++) {
+		if (pthread_create(&tid, NULL, rdns_resolver, NULL))
+			break;
+		pthread_detach(tid);
+		rdns.running++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * The name of "sa" into "buf", 1 if there is one yet. An address not
+ * seen before is queued for the resolvers, and up to "wait" ms spent
+ * waiting for its name. With "buf" NULL the address is only queued, so
+ * that the name may be in by the time it is printed.
+ */
+static int rdns_lookup(const void *sa, socklen_t salen, int flags,
+		       char *buf, size_t size, int wait)
+{
+	const struct sockaddr *s = sa;
+	struct rdns_entry *e;
+	unsigned h;
+	int found = 0;
+
+	if ((s->sa_family != AF_INET && s->sa_family != AF_INET6) ||
+	    salen > sizeof(struct sockaddr_storage))
+		return 0;
+	pthread_once(&rdns_once, rdns_setup);
+	if (!rdns.running)
+		/* No threads to be had, look it up the old way. */
+		return buf && !getnameinfo(sa, salen, buf, size, NULL, 0, flags) && *buf;
+
+	h = rdns_hash(s);
+	pthread_mutex_lock(&rdns.lock);
+	for (e = rdns.hash[h]; e; e = e->hnext)
+		if (rdns_same(s, (struct sockaddr *)&e->addr))
+			break;
+	if (!e) {
+		e = rdns_evict();
+		if (!e) {
+			pthread_mutex_unlock(&rdns.lock);
+			return 0;
+		}
+		memcpy(&e->addr, sa, salen);
+		e->addrlen = salen;
+		e->flags = flags;
+		e->state = RDNS_QUEUED;
+		e->hnext = rdns.hash[h];
+		rdns.hash[h] = e;
+		e->qnext = NULL;
+		*rdns.queue_tail = e;
+		rdns.queue_tail = &e->qnext;
+		pthread_cond_signal(&rdns.queued);
+	}
+	rdns_unlink(e);
+	rdns_push(e);
+
+	if (buf && wait > 0 && e->state == RDNS_QUEUED) {
+		struct timespec deadline;
+
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += wait / 1000;
+		deadline.tv_nsec += wait % 1000 * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (e->state == RDNS_QUEUED &&
+		       pthread_cond_timedwait(&rdns.done, &rdns.lock, &deadline) != ETIMEDOUT)
+			;
+	}
+	if (buf && e->state == RDNS_DONE && e->name[0]) {
+		snprintf(buf, size, "%s", e->name);
+		found = 1;
+	}
+	pthread_mutex_unlock(&rdns.lock);
+	return found;
+}
+
+#endif /* IPUTILS_RDNS_H */
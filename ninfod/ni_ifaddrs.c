@@ -103,6 +103,20 @@ struct rtmaddr_ifamap {
 #endif
 
 /* ====================================================================== */
+/*
+ * Replies are addressed to the port id the kernel gave the socket; that
+ * is only the pid for the first netlink socket of a process.
+ */
+static pid_t nl_portid(int sd)
+{
+	struct sockaddr_nl nladdr;
+	socklen_t len = sizeof(nladdr);
+
+	if (getsockname(sd, (struct sockaddr *) &nladdr, &len) < 0)
+		return getpid();
+	return nladdr.nl_pid;
+}
+
 static int nl_sendreq(int sd, int request, int flags, uint32_t *seq)
 {
 	char reqbuf[NLMSG_ALIGN(sizeof(struct nlmsghdr)) + NLMSG_ALIGN(sizeof(struct rtgenmsg))];
@@ -161,7 +175,7 @@ static int nl_getmsg(int sd, uint32_t seq, struct nlmsghdr **nlhp, int *done)
 	int result = 0;
 	size_t read_size;
 	int msg_flags;
-	pid_t pid = getpid();
+	pid_t pid = nl_portid(sd);
 	for (;;) {
 		void *newbuff = realloc(buff, bufsize);
 		if (newbuff == NULL || bufsize < lastbufsize) {
@@ -314,7 +328,7 @@ int ni_ifaddrs(struct ni_ifaddrs **ifap, sa_family_t family)
 	size_t dlen, xlen;
 	uint32_t max_ifindex = 0;
 
-	pid_t pid = getpid();
+	pid_t pid;
 	int seq = 0;
 	int build;		/* 0 or 1 */
 
@@ -331,6 +345,7 @@ int ni_ifaddrs(struct ni_ifaddrs **ifap, sa_family_t family)
 	sd = nl_open();
 	if (sd < 0)
 		return -1;
+	pid = nl_portid(sd);
 
 /* ---------------------------------- */
 	/* gather info */
@@ -532,3 +547,115 @@ void ni_freeifaddrs(struct ni_ifaddrs *ifa)
 	free(ifa);
 }
 
+/* ====================================================================== */
+/*
+ * Address change notifications. ni_ifaddrs_monitor_open() subscribes to
+ * RTNLGRP_IPV4_IFADDR and RTNLGRP_IPV6_IFADDR on a non-blocking socket;
+ * ni_ifaddrs_monitor() then hands every queued RTM_NEWADDR / RTM_DELADDR
+ * to "event" and returns the number of messages seen, or -1 with ENOBUFS
+ * if the kernel had to drop some, in which case the caller has to dump
+ * the addresses again.
+ */
+int ni_ifaddrs_monitor_open(void)
+{
+	struct sockaddr_nl nladdr;
+	int sd;
+
+	sd = socket(PF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (sd < 0)
+		return -1;
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	nladdr.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if (bind(sd, (struct sockaddr *) &nladdr, sizeof(nladdr)) < 0) {
+		nl_close(sd);
+		return -1;
+	}
+	return sd;
+}
+
+static int nl_parse_ifaddr(struct nlmsghdr *nlh, sa_family_t *family, struct ni_ifaddrs *ifa)
+{
+	struct ifaddrmsg *ifam = (struct ifaddrmsg *) NLMSG_DATA(nlh);
+	struct rtattr *rta;
+	void *address = NULL, *local = NULL;
+	size_t address_len = 0, local_len = 0;
+	int rtasize;
+
+	if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifam)))
+		return -1;
+	*family = ifam->ifa_family;
+	memset(ifa, 0, sizeof(*ifa));
+	ifa->ifa_ifindex = ifam->ifa_index;
+	ifa->ifa_flags = ifam->ifa_flags;
+
+	rtasize = NLMSG_PAYLOAD(nlh, sizeof(*ifam));
+	for (rta = IFA_RTA(ifam); RTA_OK(rta, rtasize); rta = RTA_NEXT(rta, rtasize)) {
+		switch (rta->rta_type) {
+		case IFA_ADDRESS:
+			address = RTA_DATA(rta);
+			address_len = RTA_PAYLOAD(rta);
+			break;
+		case IFA_LOCAL:
+			local = RTA_DATA(rta);
+			local_len = RTA_PAYLOAD(rta);
+			break;
+		case IFA_CACHEINFO:
+			if (RTA_PAYLOAD(rta) >= sizeof(struct ifa_cacheinfo))
+				ifa->ifa_cacheinfo = RTA_DATA(rta);
+			break;
+		}
+	}
+	/* as in ni_ifaddrs(): on p2p links IFA_ADDRESS is the peer */
+	if (local) {
+		address = local;
+		address_len = local_len;
+	}
+	if (!address || (*family == AF_INET6 && address_len != sizeof(struct in6_addr)) ||
+	    (*family == AF_INET && address_len != sizeof(struct in_addr)))
+		return -1;
+	ifa->ifa_addr = address;
+	return 0;
+}
+
+int ni_ifaddrs_monitor(int sd, void (*event)(int type, sa_family_t family, const struct ni_ifaddrs *ifa))
+{
+	char buf[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct sockaddr_nl nladdr;
+	struct iovec iov = { buf, sizeof(buf) };
+	struct msghdr msg = {
+		.msg_name = &nladdr,
+		.msg_namelen = sizeof(nladdr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	int count = 0;
+
+	for (;;) {
+		struct nlmsghdr *nlh;
+		ssize_t len;
+
+		len = recvmsg(sd, &msg, 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return count;
+			return -1;
+		}
+		if (nladdr.nl_pid != 0)
+			continue;	/* not from the kernel */
+		for (nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, (size_t) len); nlh = NLMSG_NEXT(nlh, len)) {
+			struct ni_ifaddrs ifa;
+			sa_family_t family;
+
+			count++;
+			if (nlh->nlmsg_type != RTM_NEWADDR && nlh->nlmsg_type != RTM_DELADDR)
+				continue;
+			if (nl_parse_ifaddr(nlh, &family, &ifa) < 0)
+				continue;
+			event(nlh->nlmsg_type, family, &ifa);
+		}
+	}
+}
+
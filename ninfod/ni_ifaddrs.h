@@ -40,6 +40,8 @@ struct ni_ifaddrs {
 
 int ni_ifaddrs(struct ni_ifaddrs **ifap, sa_family_t family);
 void ni_freeifaddrs(struct ni_ifaddrs *ifa);
+int ni_ifaddrs_monitor_open(void);
+int ni_ifaddrs_monitor(int sd, void (*event)(int type, sa_family_t family, const struct ni_ifaddrs *ifa));
 
 #endif
 
@@ -90,6 +90,10 @@
 # include <netinet/in.h>
 #endif
 
+#if HAVE_NETINET_IP6_H
+# include <netinet/ip6.h>
+#endif
+
 #if HAVE_NETINET_ICMP6_H
 # include <netinet/icmp6.h>
 #endif
@@ -118,6 +122,7 @@
 #endif
 
 #include "ninfod.h"
+#include "iputils_instr.h"
 
 /* Variables */
 int sock;
@@ -128,6 +133,9 @@ static int opt_d = 0;	/* debug */
 static int opt_h = 0;	/* help */
 static char *opt_p = NINFOD_PIDFILE;	/* pidfile */
 static int got_signal = 0;	/* loop unless true */
+#ifdef ENABLE_INSTRUMENT
+static volatile sig_atomic_t got_sigquit;	/* dump the counters */
+#endif
 int opt_v = 0;		/* verbose */
 static uid_t opt_u;
 
@@ -236,37 +244,35 @@ __inline__ static int init_sock(int socket)
 }
 
 /* --------- */
-int ni_recv(struct packetcontext *p)
-{
-	int socket = p->sock;
-	struct iovec iov[1];
-	struct msghdr msgh;
-	char recvcbuf[CMSG_SPACE(sizeof(p->pktinfo))];
-	struct cmsghdr *cmsg;
-	int cc;
-
-	DEBUG(LOG_DEBUG, "%s()\n", __func__);
+#define NI_CMSG_SPACE	CMSG_SPACE(sizeof(struct in6_pktinfo))
 
-	memset(&iov, 0, sizeof(iov));
-	iov[0].iov_base = p->query;
-	iov[0].iov_len = sizeof(p->query);
-
-	memset(&msgh, 0, sizeof(msgh));
-	msgh.msg_name = (struct sockaddr *)&p->addr;
-	msgh.msg_namelen = sizeof(p->addr);
-	msgh.msg_iov = iov;
-	msgh.msg_iovlen = 1;
-	msgh.msg_control = recvcbuf;
-	msgh.msg_controllen = sizeof(recvcbuf);
+static void ni_recv_prep(struct packetcontext *p, struct msghdr *msgh,
+			 struct iovec *iov, char *cbuf)
+{
+	memset(p, 0, offsetof(struct packetcontext, replybuf));
+	p->sock = sock;
+
+	iov->iov_base = p->query;
+	iov->iov_len = sizeof(p->query);
+
+	memset(msgh, 0, sizeof(*msgh));
+	msgh->msg_name = (struct sockaddr *)&p->addr;
+	msgh->msg_namelen = sizeof(p->addr);
+	msgh->msg_iov = iov;
+	msgh->msg_iovlen = 1;
+	msgh->msg_control = cbuf;
+	msgh->msg_controllen = NI_CMSG_SPACE;
+}
 
-	if ((cc = recvmsg(socket, &msgh, 0)) < 0)
-		return -1;
+static void ni_recv_done(struct packetcontext *p, struct msghdr *msgh, int cc)
+{
+	struct cmsghdr *cmsg;
 
 	p->querylen = cc;
-	p->addrlen = msgh.msg_namelen;
+	p->addrlen = msgh->msg_namelen;
 
-	for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg;
-	     cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+	for (cmsg = CMSG_FIRSTHDR(msgh); cmsg;
+	     cmsg = CMSG_NXTHDR(msgh, cmsg)) {
 		if (cmsg->cmsg_level == IPPROTO_IPV6 &&
 		    (cmsg->cmsg_type == IPV6_PKTINFO
 #if defined(IPV6_2292PKTINFO)
@@ -277,43 +283,115 @@ int ni_recv(struct packetcontext *p)
 			break;
 		}
 	}
-
-	return 0;
 }
 
-int ni_send(struct packetcontext *p)
+int ni_recv(struct packetcontext *p)
 {
-	int socket = p->sock;
-	struct iovec iov[2];
-	char cbuf[CMSG_SPACE(sizeof(p->pktinfo))];
+	struct iovec iov[1];
 	struct msghdr msgh;
-	struct cmsghdr *cmsg;
+	char recvcbuf[NI_CMSG_SPACE];
+	long long t;
 	int cc;
 
 	DEBUG(LOG_DEBUG, "%s()\n", __func__);
 
-	memset(&iov, 0, sizeof(iov));
+	ni_recv_prep(p, &msgh, iov, recvcbuf);
+
+	t = INSTR_START();
+	cc = recvmsg(sock, &msgh, 0);
+	INSTR_STOP(RECV, t);
+	if (cc < 0) {
+		INSTR_ERRNO(errno);
+		return -1;
+	}
+
+	ni_recv_done(p, &msgh, cc);
+
+	return 0;
+}
+
+/*
+ * Receive into up to "n" contexts: waits for the first query, takes the
+ * rest only if already queued. Returns how many were filled.
+ */
+int ni_recv_batch(struct packetcontext **p, int n)
+{
+#if HAVE_RECVMMSG
+	static int nommsg;
+	struct mmsghdr msgs[NI_BATCH];
+	struct iovec iov[NI_BATCH];
+	char cbuf[NI_BATCH][NI_CMSG_SPACE];
+	long long t;
+	int cc, i;
+
+	if (n > NI_BATCH)
+		n = NI_BATCH;
+	if (n > 1 && !nommsg) {
+		for (i = 0; i < n; i++)
+			ni_recv_prep(p[i], &msgs[i].msg_hdr, &iov[i], cbuf[i]);
+		t = INSTR_START();
+		cc = recvmmsg(sock, msgs, n, MSG_WAITFORONE, NULL);
+		INSTR_STOP(RECV, t);
+		if (cc < 0)
+			INSTR_ERRNO(errno);
+		if (cc > 0) {
+			for (i = 0; i < cc; i++)
+				ni_recv_done(p[i], &msgs[i].msg_hdr, msgs[i].msg_len);
+			return cc;
+		}
+		if (cc == 0 || errno != ENOSYS)
+			return -1;
+		/* kernel is older than its headers */
+		nommsg = 1;
+	}
+#else
+	(void)n;
+#endif
+	return ni_recv(p[0]) < 0 ? -1 : 1;
+}
+
+static void ni_send_prep(struct packetcontext *p, struct msghdr *msgh,
+			 struct iovec *iov, char *cbuf)
+{
+	struct cmsghdr *cmsg;
+
 	iov[0].iov_base = &p->reply;
 	iov[0].iov_len = sizeof(p->reply);
 	iov[1].iov_base = p->replydata;
 	iov[1].iov_len = p->replydatalen;
 
-	memset(&msgh, 0, sizeof(msgh));
-	msgh.msg_name = (struct sockaddr *)&p->addr;
-	msgh.msg_namelen = p->addrlen;
-	msgh.msg_iov = iov;
-	msgh.msg_iovlen = p->replydata ? 2 : 1;
+	memset(msgh, 0, sizeof(*msgh));
+	msgh->msg_name = (struct sockaddr *)&p->addr;
+	msgh->msg_namelen = p->addrlen;
+	msgh->msg_iov = iov;
+	msgh->msg_iovlen = p->replydata ? 2 : 1;
 
-	msgh.msg_control = cbuf;
-	msgh.msg_controllen = sizeof(cbuf);
+	/* the query's destination is the reply's source */
+	memset(cbuf, 0, NI_CMSG_SPACE);
+	msgh->msg_control = cbuf;
+	msgh->msg_controllen = NI_CMSG_SPACE;
 
-	cmsg = CMSG_FIRSTHDR(&msgh);
+	cmsg = CMSG_FIRSTHDR(msgh);
 	cmsg->cmsg_level = IPPROTO_IPV6;
 	cmsg->cmsg_type = ipv6_pktinfo;
 	cmsg->cmsg_len = CMSG_LEN(sizeof(p->pktinfo));
 	memcpy(CMSG_DATA(cmsg), &p->pktinfo, sizeof(p->pktinfo));
 
-	msgh.msg_controllen = cmsg->cmsg_len;
+	msgh->msg_controllen = cmsg->cmsg_len;
+}
+
+int ni_send(struct packetcontext *p)
+{
+	int socket = p->sock;
+	struct iovec iov[2];
+	char cbuf[NI_CMSG_SPACE];
+	struct msghdr msgh;
+	long long t;
+	int cc;
+
+	DEBUG(LOG_DEBUG, "%s()\n", __func__);
+
+	ni_send_prep(p, &msgh, iov, cbuf);
 
 	if (p->delay) {
 #if HAVE_NANOSLEEP
@@ -332,19 +410,75 @@ int ni_send(struct packetcontext *p)
 #endif
 	}
 
+	t = INSTR_START();
 	cc = sendmsg(socket, &msgh, 0);
-	if (cc < 0)
+	INSTR_STOP(SEND, t);
+	if (cc < 0) {
+		INSTR_ERRNO(errno);
 		DEBUG(LOG_DEBUG, "sendmsg(): %s\n", strerror(errno));
+	}
 
-	free(p->replydata);
-	free(p);
+	ni_ctx_put(p);
 
 	return cc;
 }
 
-/* --------- */
+/*
+ * Send the undelayed replies of one batch and put the contexts back.
+ * Returns the number of replies sent.
+ */
+int ni_send_batch(struct packetcontext **p, int n)
+{
+	int sent = 0;
+	int i = 0;
+#if HAVE_SENDMMSG
+	static int nommsg;
+	struct mmsghdr msgs[NI_BATCH];
+	struct iovec iov[NI_BATCH][2];
+	char cbuf[NI_BATCH][NI_CMSG_SPACE];
+	long long t;
+	int k, cc;
+
+	if (n > NI_BATCH)
+		n = NI_BATCH;
+	for (k = 0; k < n && !nommsg; k++)
+		ni_send_prep(p[k], &msgs[k].msg_hdr, iov[k], cbuf[k]);
+	while (i < n && !nommsg) {
+		t = INSTR_START();
+		cc = sendmmsg(sock, msgs + i, n - i, 0);
+		INSTR_STOP(SEND, t);
+		if (cc < 0)
+			INSTR_ERRNO(errno);
+		if (cc < 0 && errno == ENOSYS) {
+			nommsg = 1;
+			break;
+		}
+		if (cc > 0) {
+			sent += cc;
+			while (cc--)
+				ni_ctx_put(p[i++]);
+			continue;
+		}
+		/* the error is about msgs[i]; drop it and go on */
+		DEBUG(LOG_DEBUG, "sendmmsg(): %s\n", strerror(errno));
+		ni_ctx_put(p[i++]);
+	}
+#endif
+	for (; i < n; i++) {
+		if (ni_send(p[i]) >= 0)	/* this puts p back */
+			sent++;
+	}
+	return sent;
+}
+
 static void sig_handler(int sig)
 {
+#ifdef ENABLE_INSTRUMENT
+	if (sig == SIGQUIT) {
+		got_sigquit = 1;
+		return;
+	}
+#endif
 	if (!got_signal && sig)
 		DEBUG(LOG_INFO, "singnal(%d) received, quitting.\n", sig);
 	got_signal = 1;
@@ -548,6 +682,34 @@ static void drop_capabilities(void)
 }
 
 /* --------- */
+/*
+ * <rate>[/<burst>] replies per second, 0 for no limit; both at most
+ * NSEC_PER_SEC, so that the burst tolerance fits in a long long.
+ */
+static void parse_rate(struct ni_rate *r, const char *arg)
+{
+	unsigned long rate, burst;
+	char *ep;
+
+	/* strtoul() would take "-1" for ULONG_MAX */
+	if (*arg < '0' || *arg > '9')
+		goto invalid;
+	rate = strtoul(arg, &ep, 10);
+	burst = rate;
+	if (*ep == '/') {
+		if (ep[1] < '0' || ep[1] > '9')
+			goto invalid;
+		burst = strtoul(ep + 1, &ep, 10);
+	}
+	if (*ep || rate > NSEC_PER_SEC || burst > NSEC_PER_SEC || (rate && !burst))
+		goto invalid;
+	ni_rate_set(r, rate, burst);
+	return;
+ invalid:
+	DEBUG(LOG_ERR, "Invalid rate: %s\n", arg);
+	exit(1);
+}
+
 static void parse_args(int argc, char **argv)
 {
 	int c;
@@ -555,7 +717,7 @@ static void parse_args(int argc, char **argv)
 	char *ep;
 
 	/* parse options */
-	while ((c = getopt(argc, argv, "dhvp:u:V")) != -1) {
+	while ((c = getopt(argc, argv, "dhvp:P:r:R:t:u:V")) != -1) {
 		switch(c) {
 		case 'd':	/* debug */
 			opt_d = 1;
@@ -566,6 +728,29 @@ static void parse_args(int argc, char **argv)
 		case 'p':
 			opt_p = optarg;
 			break;
+		case 'P':
+			val = strtoul(optarg, &ep, 10);
+			if (*ep || val > 128) {
+				DEBUG(LOG_ERR, "Prefix length must be 0 .. 128\n");
+				exit(1);
+			}
+			rate_prefixlen = val;
+			break;
+		case 'r':
+			parse_rate(&rate_global, optarg);
+			break;
+		case 'R':
+			parse_rate(&rate_source, optarg);
+			break;
+		case 't':
+			val = strtoul(optarg, &ep, 10);
+			if (*ep || val < 1 || val > NI_WORKERS_MAX) {
+				DEBUG(LOG_ERR, "Number of threads must be 1 .. %d\n",
+				      NI_WORKERS_MAX);
+				exit(1);
+			}
+			nworkers = val;
+			break;
 		case 'u':
 			val = strtoul(optarg, &ep, 10);
 			if (!optarg || *ep) {
@@ -613,6 +798,12 @@ static void print_usage(void) {
 		"  -d            debug mode\n"
 		"  -h            show help\n"
 		"  -p <pidfile>  file to store process-id\n"
+		"  -P <len>      prefix length sources are limited by\n"
+		"  -r <rate>[/<burst>]\n"
+		"                replies per second in total\n"
+		"  -R <rate>[/<burst>]\n"
+		"                replies per second per source prefix\n"
+		"  -t <threads>  number of threads sending replies\n"
 		"  -u <user>     run <user>\n"
 		"  -v            verbose mode\n"
 		"  -V            print version and exit\n"
@@ -659,80 +850,98 @@ int main (int argc, char **argv)
 		do_daemonize();
 
 	init_core(1);
+	init_workers();
 
 	/* main loop */
 	while (!got_signal) {
-		struct packetcontext *p;
-		struct icmp6_hdr *icmph;
-#if ENABLE_DEBUG
-		char saddrbuf[NI_MAXHOST];
-		int status;
-#endif 
-
-		init_core(0);
-
-		p = malloc(sizeof(*p));
-		if (!p) {
-			DEBUG(LOG_WARNING, "%s(): failed to allocate packet context; sleep 1 sec.\n",
-			      __func__);
-			sleep(1);
+		struct packetcontext *in[NI_BATCH], *out[NI_BATCH];
+		int n, nin, nout = 0, i, rc;
+		long long t;
+
+#ifdef ENABLE_INSTRUMENT
+		if (got_sigquit) {
+			got_sigquit = 0;
+			ni_instr_dump();
+		}
+#endif
+		/* Waits for a worker to give one back if all are busy. */
+		in[0] = ni_ctx_get();
+		if (!in[0])
 			continue;
+		for (n = 1; n < NI_BATCH; n++) {
+			in[n] = ni_ctx_tryget();
+			if (!in[n])
+				break;
 		}
 
-		while (!got_signal) {
-			memset(p, 0, sizeof(*p));
-			p->sock = sock;
-
-			if (ni_recv(p) < 0) {
-				if (got_signal)
-					break;
-				if (errno == EAGAIN || errno == EINTR)
-					continue;
-				/* XXX: syslog */
-				continue;
-			}
-			break;
+		nin = ni_recv_batch(in, n);
+		INSTR_COUNT(WAKEUP);
+		if (nin < 0) {
+			/* XXX: syslog */
+			nin = 0;
 		}
+		for (i = nin; i < n; i++)
+			ni_ctx_put(in[i]);
+
+		init_core(0);
 
+		for (i = 0; i < nin; i++) {
+			struct packetcontext *p = in[i];
+			struct icmp6_hdr *icmph;
 #if ENABLE_DEBUG
-		status = getnameinfo((struct sockaddr *)&p->addr,
-				  p->addrlen,
-				  saddrbuf, sizeof(saddrbuf),
-				  NULL, 0,
-				  NI_NUMERICHOST);
-		if (status)
-			sprintf(saddrbuf, "???");
+			char saddrbuf[NI_MAXHOST];
+			int status;
+
+			t = INSTR_START();
+			status = getnameinfo((struct sockaddr *)&p->addr,
+					  p->addrlen,
+					  saddrbuf, sizeof(saddrbuf),
+					  NULL, 0,
+					  NI_NUMERICHOST);
+			INSTR_STOP(RESOLVE, t);
+			if (status)
+				sprintf(saddrbuf, "???");
 #endif
-		init_core(0);
 
-		if (p->querylen < sizeof(struct icmp6_hdr)) {
-			free(p);
+			if (p->querylen < sizeof(struct icmp6_hdr)) {
+				ni_ctx_put(p);
 #if ENABLE_DEBUG
-			DEBUG(LOG_WARNING, "Too short icmp message from %s\n", saddrbuf);
+				DEBUG(LOG_WARNING, "Too short icmp message from %s\n", saddrbuf);
 #endif
-			continue;
-		}
+				continue;
+			}
 
-		icmph = (struct icmp6_hdr *)p->query;
+			icmph = (struct icmp6_hdr *)p->query;
 
-		DEBUG(LOG_DEBUG,
-		      "type=%d, code=%d, cksum=0x%04x\n",
-		      icmph->icmp6_type, icmph->icmp6_code,
-		      ntohs(icmph->icmp6_cksum));
+			DEBUG(LOG_DEBUG,
+			      "type=%d, code=%d, cksum=0x%04x\n",
+			      icmph->icmp6_type, icmph->icmp6_code,
+			      ntohs(icmph->icmp6_cksum));
 
-		if (icmph->icmp6_type != ICMP6_NI_QUERY) {
+			if (icmph->icmp6_type != ICMP6_NI_QUERY) {
 #if ENABLE_DEBUG
-			DEBUG(LOG_WARNING,
-			      "Strange icmp type %d from %s\n", 
-			      icmph->icmp6_type, saddrbuf);
+				DEBUG(LOG_WARNING,
+				      "Strange icmp type %d from %s\n", 
+				      icmph->icmp6_type, saddrbuf);
 #endif
-			free(p);
-			continue;
+				ni_ctx_put(p);
+				continue;
+			}
+
+			t = INSTR_START();
+			rc = pr_nodeinfo(p);
+			INSTR_STOP(PARSE, t);
+			if (rc > 0)
+				out[nout++] = p;
 		}
 
-		pr_nodeinfo(p);	/* this frees p */
+		if (nout)
+			ni_send_batch(out, nout);	/* this puts them back */
 	}
 
+#ifdef ENABLE_INSTRUMENT
+	ni_instr_dump();
+#endif
 	cleanup_pidfile();
 
 	exit(0);
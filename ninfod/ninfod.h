@@ -45,6 +45,12 @@
 
 #define MAX_SUPTYPES		32
 
+#define NI_POOL_SIZE		256	/* packet contexts, power of 2 */
+#define NI_WORKERS_MAX		64
+#define NI_BATCH		32	/* queries per recvmmsg() */
+
+#define NSEC_PER_SEC		1000000000LL
+
 #define CHECKANDFILL_ARGS	struct packetcontext *p,\
 				char *subject, size_t subjlen,	\
 				unsigned int flags,		\
@@ -85,10 +91,19 @@ struct packetcontext {
 
 	/* reply info */
 	struct icmp6_nodeinfo reply;	/* common */
-	char *replydata;		/* data */
+	char *replydata;		/* data, NULL or replybuf */
 	int replydatalen;
 
 	unsigned int delay;		/* (random) delay */
+
+	char replybuf[MAX_REPLY_SIZE];	/* last, not cleared per query */
+};
+
+/* reply rate limit, see ni_ratelimit() */
+struct ni_rate {
+	long long interval_ns;		/* one reply per; 0: unlimited */
+	long long tau_ns;		/* burst tolerance */
+	long long tat;			/* theoretical arrival time */
 };
 
 /* variables */
@@ -96,16 +111,30 @@ extern int opt_v;		/* ninfod.c */
 extern int daemonized;		/* ninfod.c */
 extern int sock;		/* ninfod.c */
 extern int initialized;		/* ninfod_core.c */
+extern int nworkers;		/* ninfod_core.c */
+extern struct ni_rate rate_global;	/* ninfod_core.c */
+extern struct ni_rate rate_source;	/* ninfod_core.c */
+extern int rate_prefixlen;	/* ninfod_core.c */
 
 /* ninfod.c* */
 int ni_recv(struct packetcontext *p);
 int ni_send(struct packetcontext *p);
+int ni_recv_batch(struct packetcontext **p, int n);
+int ni_send_batch(struct packetcontext **p, int n);
 
 /* ninfod_core.c */
 extern void DEBUG(int pri, char *fmt, ...);
 
 void init_core(int forced);
+void init_workers(void);
+struct packetcontext *ni_ctx_get(void);
+struct packetcontext *ni_ctx_tryget(void);
+void ni_ctx_put(struct packetcontext *p);
+void ni_rate_set(struct ni_rate *r, unsigned long rate, unsigned long burst);
 int pr_nodeinfo(struct packetcontext *p);
+#ifdef ENABLE_INSTRUMENT
+void ni_instr_dump(void);
+#endif
 
 int pr_nodeinfo_unknown(CHECKANDFILL_ARGS);
 int pr_nodeinfo_refused(CHECKANDFILL_ARGS);
@@ -114,7 +143,7 @@ void init_nodeinfo_suptypes(INIT_ARGS);
 int pr_nodeinfo_suptypes(CHECKANDFILL_ARGS);
 
 /* ninfod_addrs.c */
-void init_nodeinfo_ipv6addr(INIT_ARGS __attribute__((__unused__)));
+void init_nodeinfo_ipv6addr(INIT_ARGS);
 int pr_nodeinfo_ipv6addr(CHECKANDFILL_ARGS);
 void init_nodeinfo_ipv4addr(INIT_ARGS __attribute__((__unused__)));
 int pr_nodeinfo_ipv4addr(CHECKANDFILL_ARGS);
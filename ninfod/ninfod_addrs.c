@@ -105,6 +105,7 @@
 # include <netdb.h>
 #endif
 #include <errno.h>
+#include <limits.h>
 
 #if HAVE_SYSLOG_H
 # include <syslog.h>
@@ -114,11 +115,255 @@
 #include "ni_ifaddrs.h"
 
 /* ---------- */
-/* ipv6 address */
-void init_nodeinfo_ipv6addr(INIT_ARGS __attribute__((__unused__)))
+/*
+ * Local addresses are dumped once and then kept current from the
+ * RTNLGRP_IPV*_IFADDR notifications, so a query costs a hash lookup for
+ * the subject and, usually, a copy of a cached reply. The tables are only
+ * touched from the main thread (pr_nodeinfo() and init_core()).
+ */
+struct addrent {
+	unsigned char addr[sizeof(struct in6_addr)];
+	unsigned int ifindex;
+	unsigned short flags;
+	int next;			/* hash chain, -1 terminates */
+#if ENABLE_TTL
+	int has_cacheinfo;
+	uint32_t valid;
+	time_t stamp;			/* when "valid" was current */
+#endif
+};
+
+struct addrtab {
+	sa_family_t family;
+	size_t addrlen;
+	struct addrent *ent;
+	size_t nent;
+	size_t maxent;
+	int *hash;
+	size_t hashsize;		/* power of 2 */
+	unsigned int gen;		/* bumped on every change */
+};
+
+/* Replies by table, flags and (without NI_NODEADDR_FLAG_ALL) interface. */
+#define NI_REPLY_CACHE_SIZE	16	/* power of 2 */
+
+struct replycache {
+	const struct addrtab *tab;
+	unsigned int gen;
+	unsigned int flags;
+	unsigned int ifindex;
+	int truncated;
+	int len;
+	char data[MAX_REPLY_SIZE];
+};
+
+static struct addrtab addrs6 = { .family = AF_INET6, .addrlen = sizeof(struct in6_addr) };
+static struct addrtab addrs4 = { .family = AF_INET, .addrlen = sizeof(struct in_addr) };
+static struct replycache replycache[NI_REPLY_CACHE_SIZE];
+static int addrmon = -1;	/* netlink notifications */
+static int addrs_valid;		/* tables match the kernel */
+
+static size_t addr_hash(const struct addrtab *t, const void *addr)
 {
-	DEBUG(LOG_DEBUG, "%s()\n", __func__);
-	return;
+	const unsigned char *cp = addr;
+	uint32_t h = 0, w;
+	size_t i;
+
+	for (i = 0; i < t->addrlen; i += sizeof(w)) {
+		memcpy(&w, cp + i, sizeof(w));
+		h = (h ^ w) * 0x9e3779b1;
+	}
+	return (h ^ (h >> 16)) & (t->hashsize - 1);
+}
+
+static void addrtab_link(struct addrtab *t, int i)
+{
+	size_t h = addr_hash(t, t->ent[i].addr);
+
+	t->ent[i].next = t->hash[h];
+	t->hash[h] = i;
+}
+
+static void addrtab_unlink(struct addrtab *t, int i)
+{
+	int *pp = &t->hash[addr_hash(t, t->ent[i].addr)];
+
+	while (*pp != i)
+		pp = &t->ent[*pp].next;
+	*pp = t->ent[i].next;
+}
+
+static int addrtab_find(const struct addrtab *t, const void *addr, unsigned int ifindex)
+{
+	int i;
+
+	if (!t->hashsize)
+		return -1;
+	for (i = t->hash[addr_hash(t, addr)]; i >= 0; i = t->ent[i].next) {
+		if (t->ent[i].ifindex == ifindex &&
+		    !memcmp(t->ent[i].addr, addr, t->addrlen))
+			return i;
+	}
+	return -1;
+}
+
+static void addrtab_clear(struct addrtab *t)
+{
+	size_t i;
+
+	t->nent = 0;
+	for (i = 0; i < t->hashsize; i++)
+		t->hash[i] = -1;
+	t->gen++;
+}
+
+static int addrtab_grow(struct addrtab *t)
+{
+	size_t maxent = t->maxent ? t->maxent * 2 : 64;
+	struct addrent *ent;
+	int *hash;
+	size_t i;
+
+	if (maxent > INT_MAX)
+		return -1;
+	ent = realloc(t->ent, maxent * sizeof(*ent));
+	if (!ent)
+		return -1;
+	t->ent = ent;
+	hash = realloc(t->hash, maxent * sizeof(*hash));
+	if (!hash)
+		return -1;
+	t->hash = hash;
+	t->maxent = t->hashsize = maxent;
+	for (i = 0; i < t->hashsize; i++)
+		t->hash[i] = -1;
+	for (i = 0; i < t->nent; i++)
+		addrtab_link(t, i);
+	return 0;
+}
+
+static int addrtab_add(struct addrtab *t, const struct ni_ifaddrs *ifa)
+{
+	struct addrent *e;
+	int i;
+
+	i = addrtab_find(t, ifa->ifa_addr, ifa->ifa_ifindex);
+	if (i < 0) {
+		if (t->nent == t->maxent && addrtab_grow(t) < 0)
+			return -1;
+		i = t->nent++;
+		e = &t->ent[i];
+		memcpy(e->addr, ifa->ifa_addr, t->addrlen);
+		e->ifindex = ifa->ifa_ifindex;
+		addrtab_link(t, i);
+	}
+	e = &t->ent[i];
+	e->flags = ifa->ifa_flags;
+#if ENABLE_TTL
+	e->has_cacheinfo = ifa->ifa_cacheinfo != NULL;
+	e->valid = ifa->ifa_cacheinfo ? ifa->ifa_cacheinfo->ifa_valid : 0;
+	e->stamp = time(NULL);
+#endif
+	t->gen++;
+	return 0;
+}
+
+static void addrtab_del(struct addrtab *t, const struct ni_ifaddrs *ifa)
+{
+	int i, last;
+
+	i = addrtab_find(t, ifa->ifa_addr, ifa->ifa_ifindex);
+	if (i < 0)
+		return;
+	addrtab_unlink(t, i);
+	last = --t->nent;
+	if (i != last) {
+		addrtab_unlink(t, last);
+		t->ent[i] = t->ent[last];
+		addrtab_link(t, i);
+	}
+	t->gen++;
+}
+
+static void addrs_event(int type, sa_family_t family, const struct ni_ifaddrs *ifa)
+{
+	struct addrtab *t;
+
+	if (family == AF_INET6)
+		t = &addrs6;
+	else if (family == AF_INET)
+		t = &addrs4;
+	else
+		return;
+
+	if (type == RTM_DELADDR)
+		addrtab_del(t, ifa);
+	else if (addrtab_add(t, ifa) < 0)
+		addrs_valid = 0;
+}
+
+static int addrs_load(struct addrtab *t)
+{
+	struct ni_ifaddrs *ifa0, *ifa;
+	int rc = 0;
+
+	addrtab_clear(t);
+	if (ni_ifaddrs(&ifa0, t->family))
+		return -1;
+	for (ifa = ifa0; ifa; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr && addrtab_add(t, ifa) < 0) {
+			rc = -1;
+			break;
+		}
+	}
+	ni_freeifaddrs(ifa0);
+	return rc;
+}
+
+/*
+ * Bring the tables up to date: apply pending notifications, or dump the
+ * addresses again if there is no trustworthy state. The notification
+ * socket is opened before the first dump so that no change can fall
+ * between. Without it the tables are dumped again for every query.
+ */
+static int addrs_sync(int forced)
+{
+	static int monitor_tried;
+
+	if (!monitor_tried) {
+		monitor_tried = 1;
+		addrmon = ni_ifaddrs_monitor_open();
+		if (addrmon < 0)
+			DEBUG(LOG_WARNING,
+			      "%s(): cannot watch addresses: %s\n",
+			      __func__, strerror(errno));
+		forced = 1;
+	}
+	if (addrmon < 0) {
+		if (!forced)
+			return 0;	/* addrs_ready() dumps on demand */
+	} else if (addrs_valid && !forced) {
+		if (ni_ifaddrs_monitor(addrmon, addrs_event) >= 0)
+			return 0;
+		DEBUG(LOG_INFO, "%s(): lost address notifications: %s\n",
+		      __func__, strerror(errno));
+	} else {
+		/* whatever is queued predates the dump */
+		ni_ifaddrs_monitor(addrmon, addrs_event);
+	}
+
+	addrs_valid = 0;
+	if (addrs_load(&addrs6) < 0 || addrs_load(&addrs4) < 0)
+		return -1;
+	addrs_valid = addrmon >= 0;
+	return 0;
+}
+
+static int addrs_ready(void)
+{
+	if (addrs_valid)
+		return 0;
+	return addrs_sync(1);
 }
 
 int filter_ipv6addr(const struct in6_addr *ifaddr, unsigned int flags)
@@ -137,9 +382,155 @@ int filter_ipv6addr(const struct in6_addr *ifaddr, unsigned int flags)
 	return !(flags & NI_NODEADDR_FLAG_GLOBAL);
 }
 
+/*
+ * The interface holding "subject": the receiving interface if it is one
+ * of them, otherwise the first one it was seen on. 0 if not ours.
+ */
+static unsigned int addrs_subject_if(const struct addrtab *t, const void *subject,
+				     unsigned int rcvif)
+{
+	unsigned int ifindex = 0;
+	int i, first = INT_MAX;
+
+	if (!t->hashsize)
+		return 0;
+	for (i = t->hash[addr_hash(t, subject)]; i >= 0; i = t->ent[i].next) {
+		const struct addrent *e = &t->ent[i];
+
+		if (e->flags & (IFA_F_TENTATIVE|IFA_F_SECONDARY))
+			continue;
+		if (memcmp(e->addr, subject, t->addrlen))
+			continue;
+		if (e->ifindex == rcvif)
+			return rcvif;
+		if (i < first) {
+			first = i;
+			ifindex = e->ifindex;
+		}
+	}
+	return ifindex;
+}
+
+static int addrs_skip(const struct addrtab *t, const struct addrent *e,
+		      unsigned int flags, unsigned int ifindex)
+{
+	if (t->family == AF_INET6) {
+		if (e->flags & (IFA_F_TENTATIVE|IFA_F_SECONDARY))
+			return 1;
+	} else {
+#if 1	/* not used in kernel */
+		if (e->flags & (IFA_F_TENTATIVE))
+			return 1;
+#endif
+	}
+	if (!(flags & NI_NODEADDR_FLAG_ALL) && e->ifindex != ifindex)
+		return 1;
+	if (t->family == AF_INET6 &&
+	    filter_ipv6addr((const struct in6_addr *)e->addr, flags))
+		return 1;
+	return 0;
+}
+
+static uint32_t addrs_ttl(const struct addrtab *t __attribute__((__unused__)),
+			  const struct addrent *e __attribute__((__unused__)))
+{
+#if ENABLE_TTL
+	if (e->has_cacheinfo) {
+		time_t age = time(NULL) - e->stamp;
+		uint32_t valid = e->valid;
+
+		if (valid != 0xffffffff)
+			valid = (time_t)valid > age ? valid - age : 0;
+		return valid > 0x7fffffff ? htonl(0x7fffffff) : htonl(valid);
+	}
+	if (t->family == AF_INET6 && (e->flags & IFA_F_PERMANENT))
+		return htonl(0x7fffffff);
+#endif
+	return 0;
+}
+
+/* Build the address list of a reply: preferred addresses first. */
+static void addrs_build(const struct addrtab *t, unsigned int flags,
+			unsigned int ifindex, struct replycache *r)
+{
+	size_t elen = sizeof(uint32_t) + t->addrlen;
+	size_t max = (MAX_REPLY_SIZE - sizeof(struct icmp6_nodeinfo)) / elen;
+	unsigned int addrs0 = 0, paddrs0 = 0;
+	unsigned int addrs, paddrs = 0, daddrs = 0;
+	size_t i;
+
+	r->truncated = 0;
+
+	/* pass 1: count addresses and preferred addresses to be returned */
+	for (i = 0; i < t->nent; i++) {
+		if (addrs_skip(t, &t->ent[i], flags, ifindex))
+			continue;
+		if (addrs0 + 1 >= max) {
+			r->truncated = 1;
+			break;
+		}
+		addrs0++;
+		if (!(t->ent[i].flags & IFA_F_DEPRECATED))
+			paddrs0++;
+	}
+
+	/* pass 2: store addresses */
+	r->len = elen * addrs0;
+	for (i = 0, addrs = 0; i < t->nent && addrs < addrs0; i++) {
+		const struct addrent *e = &t->ent[i];
+		uint32_t ttl;
+		char *cp;
+
+		if (addrs_skip(t, e, flags, ifindex))
+			continue;
+
+		ttl = addrs_ttl(t, e);
+		cp = r->data + elen * (e->flags & IFA_F_DEPRECATED ? paddrs0+daddrs : paddrs);
+		memcpy(cp, &ttl, sizeof(ttl));
+		memcpy(cp + sizeof(ttl), e->addr, t->addrlen);
+
+		addrs++;
+		if (e->flags & IFA_F_DEPRECATED)
+			daddrs++;
+		else
+			paddrs++;
+	}
+}
+
+static const struct replycache *addrs_reply(const struct addrtab *t, unsigned int flags,
+					    unsigned int ifindex)
+{
+	struct replycache *r;
+	size_t h;
+
+	if (flags & NI_NODEADDR_FLAG_ALL)
+		ifindex = 0;
+	h = (ifindex * 0x9e3779b1 + flags + t->family) & (NI_REPLY_CACHE_SIZE - 1);
+	r = &replycache[h];
+#if !ENABLE_TTL	/* lifetimes count down */
+	if (r->tab == t && r->gen == t->gen &&
+	    r->flags == flags && r->ifindex == ifindex)
+		return r;
+#endif
+	addrs_build(t, flags, ifindex, r);
+	r->tab = t;
+	r->gen = t->gen;
+	r->flags = flags;
+	r->ifindex = ifindex;
+	return r;
+}
+
+/* ---------- */
+/* ipv6 address */
+void init_nodeinfo_ipv6addr(INIT_ARGS)
+{
+	DEBUG(LOG_DEBUG, "%s()\n", __func__);
+	addrs_sync(forced);
+	return;
+}
+
 int pr_nodeinfo_ipv6addr(CHECKANDFILL_ARGS)
 {
-	struct ni_ifaddrs *ifa0;
 	unsigned int ifindex = 0;
 
 	DEBUG(LOG_DEBUG, "%s()\n", __func__);
@@ -150,87 +541,47 @@ int pr_nodeinfo_ipv6addr(CHECKANDFILL_ARGS)
 		      __func__, subjlen);
 		return 1;
 	}
-	if (ni_ifaddrs(&ifa0, AF_INET6))
+	if (addrs_ready())
 		return -1;	/* failed to get addresses */
 
-	/* pass 0: consider subject and determine subjected interface */
+	/* consider subject and determine subjected interface */
 	if (subject) {
-		struct ni_ifaddrs *ifa;
-
-		for (ifa = ifa0; ifa; ifa = ifa->ifa_next) {
-			if (!ifa->ifa_addr)
-				continue;
-			if (ifa->ifa_flags & (IFA_F_TENTATIVE|IFA_F_SECONDARY))
-				continue;
-			if (!ifindex && 
-			    IN6_ARE_ADDR_EQUAL(&p->pktinfo.ipi6_addr,
-					       (struct in6_addr *)subject)) {
-				/*
-				 * if subject is equal to destination
-				 * address, receiving interface is
-				 * the candidate subject interface.
-				 */
-				ifindex = p->pktinfo.ipi6_ifindex;
-			}
-			if (!IN6_IS_ADDR_LOOPBACK((struct in6_addr *)subject) &&
-			    IN6_ARE_ADDR_EQUAL((struct in6_addr *)ifa->ifa_addr,
-					       (struct in6_addr *)subject)) {
-				/*
-				 * address is assigned on some interface.
-				 * if multiple interfaces have the same interface,
-				 *  1) prefer receiving interface
-				 *  2) use first found one
-				 */
-				if (!ifindex ||
-				    (p->pktinfo.ipi6_ifindex == ifindex))
-					ifindex = ifa->ifa_ifindex;
-			}
+		if (IN6_ARE_ADDR_EQUAL(&p->pktinfo.ipi6_addr,
+				       (struct in6_addr *)subject)) {
+			/*
+			 * if subject is equal to destination
+			 * address, receiving interface is
+			 * the candidate subject interface.
+			 */
+			ifindex = p->pktinfo.ipi6_ifindex;
+		} else if (!IN6_IS_ADDR_LOOPBACK((struct in6_addr *)subject)) {
+			/*
+			 * address is assigned on some interface.
+			 * if multiple interfaces have the same interface,
+			 *  1) prefer receiving interface
+			 *  2) use first found one
+			 */
+			ifindex = addrs_subject_if(&addrs6, subject,
+						   p->pktinfo.ipi6_ifindex);
 		}
-		if (!ifindex) {
-			ni_freeifaddrs(ifa0);
+		if (!ifindex)
 			return 1;	/* subject not found */
-		}
 		if (subj_if)
 			*subj_if = ifindex;
 	} else {
 		ifindex = subj_if ? *subj_if : 0;
 		if (ifindex == 0)
 			ifindex = p->pktinfo.ipi6_ifindex;
-		if (ifindex == 0) {
-			ni_freeifaddrs(ifa0);
+		if (ifindex == 0)
 			return 1;	/* XXX */
-		}
 	}
 
 	if (reply) {
-		struct ni_ifaddrs *ifa;
-		unsigned int addrs0 = 0, paddrs0 = 0;
-		unsigned int addrs, paddrs = 0, daddrs = 0;
-
-		flags &= ~NI_NODEADDR_FLAG_TRUNCATE;	
-	
-		/* pass 1: count addresses and preferred addresses to be returned */
-		for (ifa = ifa0; ifa; ifa = ifa->ifa_next) {
-			if (!ifa->ifa_addr)
-				continue;
-			if (ifa->ifa_flags & (IFA_F_TENTATIVE|IFA_F_SECONDARY))
-				continue;
-			if (!(flags & NI_NODEADDR_FLAG_ALL) &&
-			    ifa->ifa_ifindex != ifindex)
-				continue;
-			if (filter_ipv6addr((struct in6_addr *)ifa->ifa_addr, flags))
-				continue;
-
-			if (addrs0 + 1 >= ((MAX_REPLY_SIZE - sizeof(struct icmp6_nodeinfo)) / (sizeof(uint32_t) + sizeof(struct in6_addr)))) {
-				flags |= ~NI_NODEADDR_FLAG_TRUNCATE;
-				break;
-			}
-
-			addrs0++;
-			if (!(ifa->ifa_flags & IFA_F_DEPRECATED))
-				paddrs0++;
-		}
-		
+		const struct replycache *r;
+
+		flags &= ~NI_NODEADDR_FLAG_TRUNCATE;
+		r = addrs_reply(&addrs6, flags, ifindex);
+
 		p->reply.ni_type = ICMP6_NI_REPLY;
 		p->reply.ni_code = ICMP6_NI_SUCCESS;
 		p->reply.ni_cksum = 0;
@@ -239,71 +590,27 @@ int pr_nodeinfo_ipv6addr(CHECKANDFILL_ARGS)
 					   NI_NODEADDR_FLAG_LINKLOCAL|
 					   NI_NODEADDR_FLAG_SITELOCAL|
 					   NI_NODEADDR_FLAG_GLOBAL);
-
-		/* pass 2: store addresses */
-		p->replydatalen = (sizeof(uint32_t)+sizeof(struct in6_addr)) * addrs0;
-		p->replydata = p->replydatalen ? malloc(p->replydatalen) : NULL;
-
-		if (p->replydatalen && !p->replydata) {
+		if (r->truncated)
 			p->reply.ni_flags |= NI_NODEADDR_FLAG_TRUNCATE;
-			addrs0 = paddrs0 = 0;
-		}
-
-		for (ifa = ifa0, addrs = 0; 
-		     ifa && addrs < addrs0; 
-		     ifa = ifa->ifa_next) {
-			char *cp;
-			uint32_t ttl;
-
-			if (!ifa->ifa_addr)
-				continue;
-			if (ifa->ifa_flags & (IFA_F_TENTATIVE|IFA_F_SECONDARY))
-				continue;
-			if (!(flags & NI_NODEADDR_FLAG_ALL) &&
-			    ((subj_if && *subj_if) ? (ifa->ifa_ifindex != *subj_if) :
-						     (ifa->ifa_ifindex != p->pktinfo.ipi6_ifindex)))
-				continue;
-			if (filter_ipv6addr((struct in6_addr *)ifa->ifa_addr, flags))
-				continue;
-
-#if ENABLE_TTL
-			if (ifa->ifa_cacheinfo) {
-				ttl = ifa->ifa_cacheinfo->ifa_valid > 0x7fffffff ? 
-				      htonl(0x7fffffff) : htonl(ifa->ifa_cacheinfo->ifa_valid);
-			} else {
-				ttl = (ifa->ifa_flags & IFA_F_PERMANENT) ? htonl(0x7fffffff) : 0;
-			}
-#else
-			ttl = 0;
-#endif
 
-			cp = p->replydata +
-			     (sizeof(uint32_t)+sizeof(struct in6_addr)) * (ifa->ifa_flags & IFA_F_DEPRECATED ? paddrs0+daddrs : paddrs);
-			memcpy(cp, &ttl, sizeof(ttl));
-			memcpy(cp + sizeof(ttl), ifa->ifa_addr, sizeof(struct in6_addr));
-
-			addrs++;
-			if (ifa->ifa_flags & IFA_F_DEPRECATED)
-				daddrs++;
-			else
-				paddrs++;
-		}
+		p->replydatalen = r->len;
+		p->replydata = r->len ? p->replybuf : NULL;
+		memcpy(p->replybuf, r->data, r->len);
 	}
 
-	ni_freeifaddrs(ifa0);
 	return 0;
 }
 
 /* ipv4 address */
 void init_nodeinfo_ipv4addr(INIT_ARGS __attribute__((__unused__)))
 {
+	/* addrs_sync() from init_nodeinfo_ipv6addr() covers both families */
 	DEBUG(LOG_DEBUG, "%s()\n", __func__);
 	return;
 }
 
 int pr_nodeinfo_ipv4addr(CHECKANDFILL_ARGS)
 {
-	struct ni_ifaddrs *ifa0;
 	unsigned int ifindex = 0;
 
 	DEBUG(LOG_DEBUG, "%s()\n", __func__);
@@ -314,135 +621,44 @@ int pr_nodeinfo_ipv4addr(CHECKANDFILL_ARGS)
 		      __func__, subjlen);
 		return 1;
 	}
-	if (ni_ifaddrs(&ifa0, AF_INET))
+	if (addrs_ready())
 		return -1;	/* failed to get addresses */
 
-	/* pass 0: consider subject and determine subjected interface */
+	/* consider subject and determine subjected interface */
 	if (subject) {
-		struct ni_ifaddrs *ifa;
-
-		for (ifa = ifa0; ifa; ifa = ifa->ifa_next) {
-			if (!ifa->ifa_addr)
-				continue;
-			if (ifa->ifa_flags & (IFA_F_TENTATIVE|IFA_F_SECONDARY))
-				continue;
-			if ((((struct in_addr *)subject)->s_addr != htonl(INADDR_LOOPBACK)) &&
-			    memcmp((struct in_addr *)ifa->ifa_addr,
-				   (struct in_addr *)subject,
-				   sizeof(struct in_addr)) == 0) {
-				/*
-				 * address is assigned on some interface.
-				 * if multiple interfaces have the same interface,
-				 *  1) prefer receiving interface
-				 *  2) use first found one
-				 */
-				if (!ifindex ||
-				    (p->pktinfo.ipi6_ifindex == ifindex))
-					ifindex = ifa->ifa_ifindex;
-			}
-		}
-		if (!ifindex) {
-			ni_freeifaddrs(ifa0);
+		if (((struct in_addr *)subject)->s_addr != htonl(INADDR_LOOPBACK))
+			ifindex = addrs_subject_if(&addrs4, subject,
+						   p->pktinfo.ipi6_ifindex);
+		if (!ifindex)
 			return 1;	/* subject not found */
-		}
 		if (subj_if)
 			*subj_if = ifindex;
 	} else {
 		ifindex = subj_if ? *subj_if : 0;
 		if (ifindex == 0)
 			ifindex = p->pktinfo.ipi6_ifindex;
-		if (ifindex == 0) {
-			ni_freeifaddrs(ifa0);
+		if (ifindex == 0)
 			return 1;	/* XXX */
-		}
 	}
 
 	if (reply) {
-		struct ni_ifaddrs *ifa;
-		unsigned int addrs0 = 0, paddrs0 = 0;
-		unsigned int addrs, paddrs = 0, daddrs = 0;
+		const struct replycache *r;
 
 		flags &= ~NI_IPV4ADDR_FLAG_TRUNCATE;
-
-		/* pass 1: count addresses and preferred addresses to be returned */
-		for (ifa = ifa0; ifa; ifa = ifa->ifa_next) {
-			if (!ifa->ifa_addr)
-				continue;
-#if 1	/* not used in kernel */
-			if (ifa->ifa_flags & (IFA_F_TENTATIVE))
-				continue;
-#endif
-			if (!(flags & NI_NODEADDR_FLAG_ALL) &&
-			    ((subj_if && *subj_if) ? (ifa->ifa_ifindex != *subj_if) :
-						     (ifa->ifa_ifindex != p->pktinfo.ipi6_ifindex)))
-				continue;
-
-			if (addrs0 + 1 >= ((MAX_REPLY_SIZE - sizeof(struct icmp6_nodeinfo)) / (sizeof(uint32_t) + sizeof(struct in_addr)))) {
-				flags |= NI_IPV4ADDR_FLAG_TRUNCATE;
-				break;
-			}
-
-			addrs0++;
-			if (!(ifa->ifa_flags & IFA_F_DEPRECATED))
-				paddrs0++;
-		}
+		r = addrs_reply(&addrs4, flags, ifindex);
 
 		p->reply.ni_type = ICMP6_NI_REPLY;
 		p->reply.ni_code = ICMP6_NI_SUCCESS;
 		p->reply.ni_cksum = 0;
 		p->reply.ni_qtype = htons(NI_QTYPE_IPV4ADDR);
 		p->reply.ni_flags = flags & NI_IPV4ADDR_FLAG_ALL;
+		if (r->truncated)
+			p->reply.ni_flags |= NI_IPV4ADDR_FLAG_TRUNCATE;
 
-		/* pass 2: store addresses */
-		p->replydatalen = (sizeof(uint32_t)+sizeof(struct in_addr)) * addrs0;
-		p->replydata = addrs0 ? malloc(p->replydatalen) : NULL;
-
-		if (p->replydatalen && !p->replydata) {
-			p->reply.ni_flags |= NI_NODEADDR_FLAG_TRUNCATE;
-			addrs0 = paddrs0 = 0;
-		}
-
-		for (ifa = ifa0, addrs = 0; 
-		     ifa && addrs < addrs0; 
-		     ifa = ifa->ifa_next) {
-			char *cp;
-			uint32_t ttl;
-
-			if (!ifa->ifa_addr)
-				continue;
-#if 1	/* not used in kernel */
-			if (ifa->ifa_flags & (IFA_F_TENTATIVE))
-				continue;
-#endif
-			if (!(flags & NI_NODEADDR_FLAG_ALL) &&
-			    (ifa->ifa_ifindex != ifindex))
-				continue;
-
-#if ENABLE_TTL
-			if (ifa->ifa_cacheinfo) {
-				ttl = ifa->ifa_cacheinfo->ifa_valid > 0x7fffffff ? 
-				      htonl(0x7fffffff) : htonl(ifa->ifa_cacheinfo->ifa_valid);
-			} else {
-				ttl = 0;	/*XXX*/
-			}
-#else
-			ttl = 0;
-#endif
-
-			cp = (p->replydata +
-			      (sizeof(uint32_t)+sizeof(struct in_addr)) * (ifa->ifa_flags & IFA_F_DEPRECATED ? paddrs0+daddrs : paddrs));
-			memcpy(cp, &ttl, sizeof(ttl));
-			memcpy(cp + sizeof(ttl), ifa->ifa_addr, sizeof(struct in_addr));
-
-			addrs++;
-			if (ifa->ifa_flags & IFA_F_DEPRECATED)
-				daddrs++;
-			else
-				paddrs++;
-		}
+		p->replydatalen = r->len;
+		p->replydata = r->len ? p->replybuf : NULL;
+		memcpy(p->replybuf, r->data, r->len);
 	}
 
-	ni_freeifaddrs(ifa0);
 	return 0;
 }
-
@@ -46,6 +46,7 @@
 #endif
 #if ENABLE_THREADS
 # include <pthread.h>
+# include <semaphore.h>
 #endif
 #if HAVE_STRING_H
 # if !STDC_HEADERS && HAVE_MEMORY_H
@@ -86,6 +87,10 @@
 # include <netinet/in.h>
 #endif
 
+#if HAVE_NETINET_IP6_H
+# include <netinet/ip6.h>
+#endif
+
 #if HAVE_NETINET_ICMP6_H
 # include <netinet/icmp6.h>
 #endif
@@ -102,13 +107,16 @@
 # include <syslog.h>
 #endif
 #include <sys/wait.h>
+#include <signal.h>
 
 #include "ninfod.h"
+#include "iputils_instr.h"
 
 #define ARRAY_SIZE(a)		(sizeof(a) / sizeof(a[0]))
 
 /* Variables */
 int initialized = 0;
+INSTR_DEFINE;
 
 #if ENABLE_THREADS
 pthread_attr_t pattr;
@@ -270,12 +278,7 @@ int pr_nodeinfo_suptypes(CHECKANDFILL_ARGS)
 		p->reply.ni_flags = flags&~NI_SUPTYPE_FLAG_COMPRESS;
 		
 		p->replydatalen = suptypes_len<<2;
-		p->replydata = malloc(p->replydatalen);
-		if (p->replydata == NULL) {
-			p->replydatalen = -1;
-			return -1;	/*XXX*/
-		}
-
+		p->replydata = p->replybuf;
 		memcpy(p->replydata, suptypes, p->replydatalen);
 	}
 	return 0;
@@ -374,6 +377,146 @@ static int ni_policy(struct packetcontext *p)
 	return 1;
 }
 
+/* ---------- */
+/*
+ * Packet contexts come from a fixed pool and replies are handed to a
+ * fixed set of worker threads, so a flood of queries costs neither a
+ * thread nor an allocation per packet and memory stays bounded. Both
+ * the free list and the work queue are bounded lock-free rings of
+ * NI_POOL_SIZE slots (D. Vyukov's MPMC queue), with a semaphore each
+ * counting what is in them for threads to sleep on. As there are only
+ * NI_POOL_SIZE contexts, neither ring can overflow.
+ */
+struct ni_ring {
+	struct {
+		unsigned long seq;
+		struct packetcontext *p;
+	} cell[NI_POOL_SIZE];
+	unsigned long head;
+	unsigned long tail;
+};
+
+static struct packetcontext ctx_pool[NI_POOL_SIZE];
+static struct ni_ring free_ring;
+#if ENABLE_THREADS
+static struct ni_ring work_ring;
+static sem_t free_sem;
+static sem_t work_sem;
+#endif
+int nworkers;
+
+static void ring_init(struct ni_ring *r)
+{
+	unsigned long i;
+
+	for (i = 0; i < NI_POOL_SIZE; i++)
+		r->cell[i].seq = i;
+	r->head = r->tail = 0;
+}
+
+static int ring_put(struct ni_ring *r, struct packetcontext *p)
+{
+	unsigned long pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	unsigned long seq;
+	long dif;
+
+	for (;;) {
+		seq = __atomic_load_n(&r->cell[pos % NI_POOL_SIZE].seq, __ATOMIC_ACQUIRE);
+		dif = (long)(seq - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return -1;	/* full */
+		else
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	}
+	r->cell[pos % NI_POOL_SIZE].p = p;
+	__atomic_store_n(&r->cell[pos % NI_POOL_SIZE].seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static struct packetcontext *ring_get(struct ni_ring *r)
+{
+	unsigned long pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	struct packetcontext *p;
+	unsigned long seq;
+	long dif;
+
+	for (;;) {
+		seq = __atomic_load_n(&r->cell[pos % NI_POOL_SIZE].seq, __ATOMIC_ACQUIRE);
+		dif = (long)(seq - (pos + 1));
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return NULL;	/* empty */
+		else
+			pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	}
+	p = r->cell[pos % NI_POOL_SIZE].p;
+	__atomic_store_n(&r->cell[pos % NI_POOL_SIZE].seq, pos + NI_POOL_SIZE,
+			 __ATOMIC_RELEASE);
+	return p;
+}
+
+static void init_pool(void)
+{
+	size_t i;
+
+	ring_init(&free_ring);
+	for (i = 0; i < ARRAY_SIZE(ctx_pool); i++)
+		ring_put(&free_ring, &ctx_pool[i]);
+#if ENABLE_THREADS
+	ring_init(&work_ring);
+	sem_init(&free_sem, 0, NI_POOL_SIZE);
+	sem_init(&work_sem, 0, 0);
+#endif
+}
+
+/* A free packet context, NULL if interrupted by a signal. */
+struct packetcontext *ni_ctx_get(void)
+{
+#if ENABLE_THREADS
+	if (sem_wait(&free_sem) < 0)
+		return NULL;
+#endif
+	return ring_get(&free_ring);
+}
+
+/* A free packet context if there is one right now. */
+struct packetcontext *ni_ctx_tryget(void)
+{
+#if ENABLE_THREADS
+	if (sem_trywait(&free_sem) < 0)
+		return NULL;
+#endif
+	return ring_get(&free_ring);
+}
+
+void ni_ctx_put(struct packetcontext *p)
+{
+	p->replydata = NULL;
+	p->replydatalen = 0;
+	ring_put(&free_ring, p);
+#if ENABLE_THREADS
+	sem_post(&free_sem);
+#endif
+}
+
+#ifdef ENABLE_INSTRUMENT
+/* Log the hot path counters, on SIGQUIT and on the way out. */
+void ni_instr_dump(void)
+{
+	char line[512];
+
+	instr_format(line, sizeof(line));
+	DEBUG(LOG_INFO, "instr %s\n", line);
+}
+#endif
+
 /* ---------- */
 void init_core(int forced)
 {
@@ -404,6 +547,8 @@ void init_core(int forced)
 		pthread_attr_init(&pattr);
 		pthread_attr_setdetachstate(&pattr, PTHREAD_CREATE_DETACHED);
 #endif
+		if (!initialized)
+			init_pool();
 	}
 
 	for (i=0; i < ARRAY_SIZE(subjinfo_table); i++) {
@@ -426,21 +571,73 @@ void init_core(int forced)
 }
 
 #if ENABLE_THREADS
-static void *ni_send_thread(void *data)
+static void *ni_send_thread(void *data __attribute__((__unused__)))
 {
+	for (;;) {
+		struct packetcontext *p;
 #if ENABLE_DEBUG
-	int ret;
+		int ret;
+#endif
 
-	DEBUG(LOG_DEBUG, "%s(): thread=%ld\n", __func__, pthread_self());
-	ret =
+		while (sem_wait(&work_sem) < 0)
+			;
+		p = ring_get(&work_ring);
+		if (!p)
+			continue;
+#if ENABLE_DEBUG
+		DEBUG(LOG_DEBUG, "%s(): thread=%ld\n", __func__, pthread_self());
+		ret =
 #endif
-	  ni_send(data);
+		  ni_send(p);	/* this puts p back */
 #if ENABLE_DEBUG
-	DEBUG(LOG_DEBUG, "%s(): thread=%ld => %d\n", __func__, pthread_self(), ret);
+		DEBUG(LOG_DEBUG, "%s(): thread=%ld => %d\n", __func__, pthread_self(), ret);
 #endif
+	}
 	return NULL;
 }
+
+/* Start the workers; must run after daemon(), which keeps no threads. */
+void init_workers(void)
+{
+	sigset_t all, old;
+	pthread_t thread;
+	int i;
+
+	if (!nworkers) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		nworkers = n < 1 ? 1 : n > NI_WORKERS_MAX ? NI_WORKERS_MAX : n;
+	}
+
+	/* Signals are for the main loop. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&thread, &pattr, ni_send_thread, NULL)) {
+			DEBUG(LOG_ERR, "%s(): pthread_create: %s\n",
+			      __func__, strerror(errno));
+			if (!i)
+				exit(1);
+			nworkers = i;
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	DEBUG(LOG_DEBUG, "%s(): %d workers\n", __func__, nworkers);
+}
+
+static int ni_send_queue(struct packetcontext *p)
+{
+	if (ring_put(&work_ring, p))
+		return -1;
+	sem_post(&work_sem);
+	return 0;
+}
 #else
+void init_workers(void)
+{
+}
+
 static int ni_send_fork(struct packetcontext *p)
 {
 	pid_t child = fork();
@@ -459,43 +656,160 @@ static int ni_send_fork(struct packetcontext *p)
 			      __func__, getpid(), ret);
 			exit(ret > 0 ? 1 : 0);
 		}
-		free(p->replydata);
-		free(p);
 		exit(0);
 	} else {
 		waitpid(child, NULL, 0);
-		free(p->replydata);
-		free(p);
+		ni_ctx_put(p);
 	}
 	return 0;
 }
 #endif
 
-static int ni_ratelimit(void)
+/*
+ * Rate limits are token buckets kept as GCRA: instead of a token count
+ * each bucket remembers the theoretical arrival time "tat" of the next
+ * reply, which needs no refill arithmetic. A reply conforms if it is at
+ * most "tau" (the burst) early. Every reply is charged to the bucket of
+ * its source prefix and to the global one; refusals and unknown qtypes
+ * keep their own bucket of one per second for the whole daemon.
+ */
+struct ni_rate rate_global;
+/* 100 per second in bursts of up to 200 */
+struct ni_rate rate_source = {
+	.interval_ns = NSEC_PER_SEC / 100,
+	.tau_ns = 199 * (NSEC_PER_SEC / 100),
+};
+int rate_prefixlen = 64;
+
+static struct ni_rate rate_refused = { .interval_ns = NSEC_PER_SEC };
+
+/*
+ * Per-source state lives in a fixed 4-way set-associative table of
+ * NI_RATE_SETS sets, one set per two cache lines; when a set is full the
+ * least recently charged entry is replaced.
+ */
+#define NI_RATE_SETS	1024	/* power of 2 */
+#define NI_RATE_WAYS	4
+
+struct ni_rate_entry {
+	struct in6_addr prefix;	/* masked source, scope id if link-local */
+	long long tat;
+	long long last;		/* last charge, 0 if unused */
+};
+
+static struct ni_rate_entry rate_table[NI_RATE_SETS][NI_RATE_WAYS]
+	__attribute__((aligned(64)));
+
+void ni_rate_set(struct ni_rate *r, unsigned long rate, unsigned long burst)
 {
-	static struct timeval last;
-	struct timeval tv, sub;
+	if (!rate) {
+		r->interval_ns = r->tau_ns = 0;
+		return;
+	}
+	if (!burst)
+		burst = 1;
+	if (burst > NSEC_PER_SEC)
+		burst = NSEC_PER_SEC;
+	r->interval_ns = NSEC_PER_SEC / rate;
+	r->tau_ns = (long long)(burst - 1) * r->interval_ns;
+}
 
-	if (gettimeofday(&tv, NULL) < 0) {
-		DEBUG(LOG_WARNING, "%s(): gettimeofday(): %s\n",
-		      __func__, strerror(errno));
-		return -1;
+static __inline__ int rate_conforms(const struct ni_rate *conf, long long tat, long long now)
+{
+	return !conf->interval_ns || tat - now <= conf->tau_ns;
+}
+
+static __inline__ long long rate_charge(const struct ni_rate *conf, long long tat, long long now)
+{
+	return (tat > now ? tat : now) + conf->interval_ns;
+}
+
+static void rate_key(const struct packetcontext *p, struct in6_addr *key)
+{
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)&p->addr;
+	int bits = rate_prefixlen;
+	int i;
+
+	*key = sin6->sin6_addr;
+	for (i = 0; i < 16; i++, bits -= 8) {
+		if (bits <= 0)
+			key->s6_addr[i] = 0;
+		else if (bits < 8)
+			key->s6_addr[i] &= 0xff << (8 - bits);
 	}
+	/* fe80::/64 is on every link; tell the links apart */
+	if (IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr)) {
+		uint32_t scope = sin6->sin6_scope_id;
 
-	if (!timerisset(&last)) {
-		last = tv;
-		return 0;
+		memcpy(&key->s6_addr[4], &scope, sizeof(scope));
+	}
+}
+
+static struct ni_rate_entry *rate_lookup(const struct in6_addr *key)
+{
+	struct ni_rate_entry *set, *victim;
+	uint32_t h = 0, w;
+	int i;
+
+	for (i = 0; i < 16; i += 4) {
+		memcpy(&w, &key->s6_addr[i], sizeof(w));
+		h = (h ^ w) * 0x9e3779b1;
 	}
+	set = rate_table[(h ^ (h >> 16)) & (NI_RATE_SETS - 1)];
+
+	victim = &set[0];
+	for (i = 0; i < NI_RATE_WAYS; i++) {
+		if (set[i].last && IN6_ARE_ADDR_EQUAL(&set[i].prefix, key))
+			return &set[i];
+		if (set[i].last < victim->last)
+			victim = &set[i];
+	}
+	victim->prefix = *key;
+	victim->tat = 0;
+	victim->last = 0;
+	return victim;
+}
 
-	timersub(&tv, &last, &sub);
+/* 1 if the reply in "p" is over a limit and must be dropped. */
+static int ni_ratelimit(struct packetcontext *p, int refusal)
+{
+	struct ni_rate_entry *e = NULL;
+	struct in6_addr key;
+	struct timespec ts;
+	long long now;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
 
-	if (sub.tv_sec < 1)
+	if (refusal && !rate_conforms(&rate_refused, rate_refused.tat, now))
 		return 1;
+	if (!rate_conforms(&rate_global, rate_global.tat, now))
+		return 1;
+	if (rate_source.interval_ns) {
+		rate_key(p, &key);
+		e = rate_lookup(&key);
+		if (!rate_conforms(&rate_source, e->tat, now)) {
+			e->last = now;
+			return 1;
+		}
+	}
 
-	last = tv;
+	if (refusal)
+		rate_refused.tat = rate_charge(&rate_refused, rate_refused.tat, now);
+	if (rate_global.interval_ns)
+		rate_global.tat = rate_charge(&rate_global, rate_global.tat, now);
+	if (e) {
+		e->tat = rate_charge(&rate_source, e->tat, now);
+		e->last = now;
+	}
 	return 0;
 }
 
+/*
+ * Answer the query in "p". Returns 1 if "p" now holds a reply for the
+ * caller to send; otherwise (0: handed over for a delayed reply, -1:
+ * dropped) "p" is no longer the caller's.
+ */
 int pr_nodeinfo(struct packetcontext *p)
 {
 	struct icmp6_nodeinfo *query = (struct icmp6_nodeinfo *)p->query;
@@ -510,9 +824,6 @@ int pr_nodeinfo(struct packetcontext *p)
 	char printbuf[128];
 	int i;
 	char *cp;
-#endif
-#if ENABLE_THREADS
-	pthread_t thread;
 #endif
 	int rc;
 
@@ -524,7 +835,7 @@ int pr_nodeinfo(struct packetcontext *p)
 		if (!IN6_IS_ADDR_MC_LINKLOCAL(&p->pktinfo.ipi6_addr)) {
 			DEBUG(LOG_WARNING,
 			      "Destination is non-link-local multicast address.\n");
-			free(p);
+			ni_ctx_put(p);
 			return -1;
 		}
 	}
@@ -532,7 +843,7 @@ int pr_nodeinfo(struct packetcontext *p)
 	/* Step 1: Check length */
 	if (p->querylen < sizeof(struct icmp6_nodeinfo)) {
 		DEBUG(LOG_WARNING, "Query too short\n");
-		free(p);
+		ni_ctx_put(p);
 		return -1;
 	}
 
@@ -566,7 +877,7 @@ int pr_nodeinfo(struct packetcontext *p)
 			DEBUG(LOG_WARNING,
 			      "%s(): unknown code %u\n",
 			      __func__, query->ni_code);
-			free(p);
+			ni_ctx_put(p);
 			return -1;
 		}
 	}
@@ -590,19 +901,18 @@ int pr_nodeinfo(struct packetcontext *p)
 			      "failed to make reply: %s\n",
 			      strerror(errno));
 		}
-		free(p);
+		ni_ctx_put(p);
 		return -1;
 	}
 
 	/* XXX: Step 5: Check the policy */
 	rc = ni_policy(p);
 	if (rc <= 0) {
-		free(p->replydata);
 		p->replydata = NULL;
 		p->replydatalen = 0;
 		if (rc < 0) {
 			DEBUG(LOG_WARNING, "Ignored by policy.\n");
-			free(p);
+			ni_ctx_put(p);
 			return -1;
 		}
 		DEBUG(LOG_WARNING, "Refused by policy.\n");
@@ -622,16 +932,15 @@ int pr_nodeinfo(struct packetcontext *p)
 				      "failed to make reply: %s\n",
 				      strerror(errno));
 			}
-			free(p);
+			ni_ctx_put(p);
 			return -1;
 		}
 	}
 
 	/* Step 7: Rate Limit */
-	if (qtypeinfo->flags&QTYPEINFO_F_RATELIMIT &&
-	    ni_ratelimit()) {
-		free(p->replydata);
-		free(p);
+	if (ni_ratelimit(p, qtypeinfo->flags&QTYPEINFO_F_RATELIMIT)) {
+		DEBUG(LOG_DEBUG, "Rate limited.\n");
+		ni_ctx_put(p);
 		return -1;
 	}
 
@@ -657,18 +966,18 @@ int pr_nodeinfo(struct packetcontext *p)
 
 	/* Step 10: Send the reply
 	 * XXX: with possible random delay */
+	if (!p->delay)
+		return 1;	/* the caller sends it with its batch */
 #if ENABLE_THREADS
-	/* ni_send_thread() frees p */
-	if (pthread_create(&thread, &pattr, ni_send_thread, p)) {
-		free(p->replydata);
-		free(p);
+	/* a worker puts p back */
+	if (ni_send_queue(p)) {
+		ni_ctx_put(p);
 		return -1;
 	}
 #else
-	/* ni_send_fork() frees p */
+	/* ni_send_fork() puts p back */
 	if (ni_send_fork(p)) {
-		free(p->replydata);
-		free(p);
+		ni_ctx_put(p);
 		return -1;
 	}
 #endif
@@ -86,6 +86,10 @@
 # include <netinet/in.h>
 #endif
 
+#if HAVE_NETINET_IP6_H
+# include <netinet/ip6.h>
+#endif
+
 #if HAVE_NETINET_ICMP6_H
 # include <netinet/icmp6.h>
 #endif
@@ -129,6 +133,7 @@ static char *uts_nodename = utsname.nodename;
 
 char nodename[MAX_DNSNAME_SIZE];
 static size_t nodenamelen;
+static char namereply[sizeof(uint32_t)+MAX_DNSNAME_SIZE];
 
 static struct ipv6_mreq nigroup;
 
@@ -275,6 +280,20 @@ void init_nodeinfo_nodename(int forced)
 
 	DEBUG(LOG_DEBUG, "%s()\n", __func__);
 
+	/*
+	 * This runs for every query; the kernel does not tell about a new
+	 * hostname, so look at most once a second.
+	 */
+	if (!forced) {
+		static time_t last;
+		struct timespec now;
+
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+		if (now.tv_sec == last)
+			return;
+		last = now.tv_sec;
+	}
+
 	uname(&newname);
 	changed = strcmp(newname.nodename, utsname.nodename);
 
@@ -303,8 +322,10 @@ void init_nodeinfo_nodename(int forced)
 			     sizeof(nodename),
 			     0);
 
-	/* setup ni reply */
+	/* setup ni reply: a zero TTL and the name */
 	nodenamelen = len > 0 ? len : 0;
+	memset(namereply, 0, sizeof(uint32_t));
+	memcpy(namereply + sizeof(uint32_t), nodename, nodenamelen);
 
 	/* setup ni group */
 	if (changed || forced) {
@@ -348,20 +369,16 @@ int pr_nodeinfo_nodename(CHECKANDFILL_ARGS_2)
 	}
 
 	if (reply) {
-		uint32_t ttl = 0;
-
 		p->reply.ni_type = ICMP6_NI_REPLY;
 		p->reply.ni_code = ICMP6_NI_SUCCESS;
 		p->reply.ni_cksum = 0;
 		p->reply.ni_qtype = htons(NI_QTYPE_DNSNAME);
 		p->reply.ni_flags = 0;
 
-		p->replydatalen = nodenamelen ? sizeof(ttl)+nodenamelen : 0;
-		p->replydata = nodenamelen ? malloc(p->replydatalen) : NULL;
-		if (p->replydata) {
-			memcpy(p->replydata, &ttl, sizeof(ttl));
-			memcpy(p->replydata + sizeof(ttl), &nodename, nodenamelen);
-		}
+		p->replydatalen = nodenamelen ? sizeof(uint32_t)+nodenamelen : 0;
+		p->replydata = nodenamelen ? p->replybuf : NULL;
+		if (p->replydata)
+			memcpy(p->replydata, namereply, p->replydatalen);
 	}
 
 	return 0;
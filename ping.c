@@ -50,6 +50,8 @@
  */
 
 #include "ping.h"
+#include "iputils_cksum.h"
+#include "iputils_rdns.h"
 
 #include <assert.h>
 #include <netinet/ip.h>
@@ -68,7 +70,8 @@ ping_func_set_st ping4_func_set = {
 	.send_probe = ping4_send_probe,
 	.receive_error_msg = ping4_receive_error_msg,
 	.parse_reply = ping4_parse_reply,
-	.install_filter = ping4_install_filter
+	.install_filter = ping4_install_filter,
+	.build_probe = ping4_build_probe
 };
 
 #define	MAXIPLEN	60
@@ -88,12 +91,24 @@ static int broadcast_pings = 0;
 
 static void pr_options(unsigned char * cp, int hlen);
 static void pr_iph(struct iphdr *ip);
-static unsigned short in_cksum(const unsigned short *addr, int len, unsigned short salt);
 static void pr_icmph(uint8_t type, uint8_t code, uint32_t info, struct icmphdr *icp);
 static int parsetos(char *str);
 static int parseflow(char *str);
 
 static struct sockaddr_in source = { .sin_family = AF_INET };
+
+/* Is daddr a destination of ours? In multi-target mode also say which. */
+static int ping4_is_dest(uint32_t daddr, struct ping_target **target)
+{
+	struct in_addr in = { daddr };
+
+	if (!ntargets) {
+		*target = NULL;
+		return daddr == whereto.sin_addr.s_addr;
+	}
+	*target = find_target(AF_INET, &in);
+	return *target != NULL;
+}
 char *device;
 int pmtudisc = -1;
 
@@ -222,10 +237,13 @@ main(int argc, char **argv)
 	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_protocol = IPPROTO_UDP, .ai_socktype = SOCK_DGRAM, .ai_flags = getaddrinfo_flags };
 	struct addrinfo *result, *ai;
 	int status;
-	int ch;
+	int ch, i;
 	socket_st sock4 = { .fd = -1 };
 	socket_st sock6 = { .fd = -1 };
+	socket_st shard4[MAX_SHARDS], shard6[MAX_SHARDS];
 	char *target;
+	char *target_list = NULL;
+	struct addrinfo target_ai;
 
 	limit_capabilities();
 
@@ -248,7 +266,7 @@ main(int argc, char **argv)
 		hints.ai_family = AF_INET6;
 
 	/* Parse command line options */
-	while ((ch = getopt(argc, argv, "h?" "4bRT:" "6F:N:" "aABc:dDfi:I:l:Lm:M:nOp:qQ:rs:S:t:UvVw:W:")) != EOF) {
+	while ((ch = getopt(argc, argv, "h?" "4bRT:" "6F:N:" "aABc:dDfG:H:i:I:jk:l:Lm:M:nOp:P:qQ:rs:S:t:UvVw:W:")) != EOF) {
 		switch(ch) {
 		/* IPv4 specific options */
 		case '4':
@@ -313,6 +331,12 @@ main(int argc, char **argv)
 		case 'D':
 			options |= F_PTIMEOFDAY;
 			break;
+		case 'G':
+			target_list = optarg;
+			break;
+		case 'H':
+			hist_path = optarg;
+			break;
 		case 'i':
 		{
 			double optval;
@@ -320,7 +344,7 @@ main(int argc, char **argv)
 			optval = ping_strtod(optarg, _("bad timing interval"));
 			if (isgreater(optval, (double)(INT_MAX / 1000)))
 				error(2, 0, _("bad timing interval: %s"), optarg);
-			interval = (int)(optval * 1000);
+			set_interval(llround(optval * 1000000000));
 			options |= F_INTERVAL;
 		}
 			break;
@@ -350,6 +374,17 @@ main(int argc, char **argv)
 				device = optarg;
 			}
 			break;
+		case 'j':
+			options |= F_JSON;
+			break;
+		case 'k':
+			if (strcmp(optarg, "sw") == 0)
+				tstamping = TSTAMP_SW;
+			else if (strcmp(optarg, "hw") == 0)
+				tstamping = TSTAMP_HW;
+			else
+				error(2, 0, _("invalid -k argument: %s"), optarg);
+			break;
 		case 'l':
 			preload = atoi(optarg);
 			if (preload <= 0)
@@ -396,6 +431,11 @@ main(int argc, char **argv)
 			options |= F_PINGFILLED;
 			fill(optarg, outpack, sizeof(outpack));
 			break;
+		case 'P':
+			nshards = atoi(optarg);
+			if (nshards < 1 || nshards > MAX_SHARDS)
+				error(2, 0, _("bad number of shards: %s, should be 1..%d"), optarg, MAX_SHARDS);
+			break;
 		case 'q':
 			options |= F_QUIET;
 			break;
@@ -458,10 +498,21 @@ main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (!argc)
+	if (target_list) {
+		if (argc)
+			usage();
+		if (hints.ai_socktype == SOCK_RAW)
+			error(2, 0, _("-N cannot be used with -G"));
+		if (nshards > 1)
+			error(2, 0, _("-P cannot be used with -G"));
+		read_targets(target_list, hints.ai_family);
+		hints.ai_family = targets[0].addr.ss_family;
+	} else if (!argc)
 		error(1, EDESTADDRREQ, "usage error");
+	if (npackets && npackets < nshards)
+		error(2, 0, _("bad number of packets to transmit: %ld, -P needs at least one for each shard"), npackets);
 
-	target = argv[argc-1];
+	target = target_list ? targets[0].name : argv[argc-1];
 
 	/* Create sockets */
 	enable_capability_raw();
@@ -475,6 +526,16 @@ main(int argc, char **argv)
 			   pmtudisc == IP_PMTUDISC_DONT ? IPV6_PMTUDISC_DONT :
 			   pmtudisc == IP_PMTUDISC_WANT ? IPV6_PMTUDISC_WANT : pmtudisc;
 	}
+	/* -P: the sockets of the other shards, while they can be opened. */
+	shard4[0] = sock4;
+	shard6[0] = sock6;
+	for (i = 1; i < nshards; i++) {
+		shard4[i].fd = shard6[i].fd = -1;
+		if (sock4.fd != -1)
+			create_socket(&shard4[i], AF_INET, hints.ai_socktype, IPPROTO_ICMP, 1);
+		if (sock6.fd != -1)
+			create_socket(&shard6[i], AF_INET6, hints.ai_socktype, IPPROTO_ICMPV6, 1);
+	}
 	disable_capability_raw();
 
 	/* Limit address family on single-protocol systems */
@@ -485,16 +546,35 @@ main(int argc, char **argv)
 			hints.ai_family = AF_INET;
 	}
 
+	if (target_list) {
+		/* Targets are resolved already, the first one stands for all. */
+		memset(&target_ai, 0, sizeof(target_ai));
+		target_ai.ai_family = targets[0].addr.ss_family;
+		target_ai.ai_addr = (struct sockaddr *)&targets[0].addr;
+		target_ai.ai_addrlen = targets[0].addrlen;
+		target_ai.ai_canonname = targets[0].name;
+		argc = 1;
+		argv = &target;
+		result = &target_ai;
+	} else {
+		status = getaddrinfo(target, NULL, &hints, &result);
+		if (status)
+			error(2, 0, "%s: %s", target, gai_strerror(status));
+	}
+
+	/* From here on each shard goes its own way, with its own sockets. */
+	if (nshards > 1) {
+		shard_start(shard4, shard6);
+		sock4 = shard4[0];
+		sock6 = shard6[0];
+	}
+
 	/* Set socket options */
 	if (settos)
 		set_socket_option(&sock4, IPPROTO_IP, IP_TOS, &settos, sizeof settos);
 	if (tclass)
 		set_socket_option(&sock6, IPPROTO_IPV6, IPV6_TCLASS, &tclass, sizeof tclass);
 
-	status = getaddrinfo(target, NULL, &hints, &result);
-	if (status)
-		error(2, 0, "%s: %s", target, gai_strerror(status));
-
 	for (ai = result; ai; ai = ai->ai_next) {
 		switch (ai->ai_family) {
 		case AF_INET:
@@ -511,7 +591,8 @@ main(int argc, char **argv)
 			break;
 	}
 
-	freeaddrinfo(result);
+	if (!target_list)
+		freeaddrinfo(result);
 
 	return status;
 }
@@ -547,7 +628,7 @@ int ping4_run(int argc, char **argv, struct addrinfo *ai, socket_st *sock)
 		whereto.sin_family = AF_INET;
 		if (inet_aton(target, &whereto.sin_addr) == 1) {
 			hostname = target;
-			if (argc == 1)
+			if (argc == 1 && !ntargets)
 				options |= F_NUMERIC;
 		} else {
 			struct addrinfo *result = NULL;
@@ -803,16 +884,22 @@ int ping4_run(int argc, char **argv, struct addrinfo *ai, socket_st *sock)
 		error(2, 0, _("packet size %d is too large. Maximum is %d"),
 		      datalen, 0xFFFF - 8 - 20 - optlen);
 
-	if (datalen >= (int) sizeof(struct timeval))	/* can we time transfer */
+	if (datalen >= (int) sizeof(struct timespec))	/* can we time transfer */
 		timing = 1;
 	packlen = datalen + MAXIPLEN + MAXICMPLEN;
 	if (!(packet = (unsigned char *)malloc((unsigned int)packlen)))
 		error(2, errno, _("memory allocation failed"));
 
-	printf(_("PING %s (%s) "), hostname, inet_ntoa(whereto.sin_addr));
-	if (device || (options&F_STRICTSOURCE))
-		printf(_("from %s %s: "), inet_ntoa(source.sin_addr), device ? device : "");
-	printf(_("%d(%d) bytes of data.\n"), datalen, datalen+8+optlen+20);
+	/* With -P only the parent, which reports for all, says hello. */
+	if (!(options & F_JSON) && !shard) {
+		if (ntargets)
+			printf(_("PING %d targets "), ntargets);
+		else
+			printf(_("PING %s (%s) "), hostname, inet_ntoa(whereto.sin_addr));
+		if (device || (options&F_STRICTSOURCE))
+			printf(_("from %s %s: "), inet_ntoa(source.sin_addr), device ? device : "");
+		printf(_("%d(%d) bytes of data.\n"), datalen, datalen+8+optlen+20);
+	}
 
 	setup(sock);
 
@@ -829,12 +916,19 @@ int ping4_receive_error_msg(socket_st *sock)
 	struct sock_extended_err *e;
 	struct icmphdr icmph;
 	struct sockaddr_in target;
+	struct ping_target *t = NULL;
 	int net_errors = 0;
 	int local_errors = 0;
 	int saved_errno = errno;
 
-	iov.iov_base = &icmph;
-	iov.iov_len = sizeof(icmph);
+again:
+	/* With -k the probes come back looped, headers and all. */
+	if (tstamping) {
+		iov = tstamp_iov;
+	} else {
+		iov.iov_base = &icmph;
+		iov.iov_len = sizeof(icmph);
+	}
 	msg.msg_name = (void*)&target;
 	msg.msg_namelen = sizeof(target);
 	msg.msg_iov = &iov;
@@ -846,6 +940,8 @@ int ping4_receive_error_msg(socket_st *sock)
 	res = recvmsg(sock->fd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT);
 	if (res < 0)
 		goto out;
+	if (tstamping)
+		memcpy(&icmph, iov.iov_base, sizeof(icmph));
 
 	e = NULL;
 	for (cmsgh = CMSG_FIRSTHDR(&msg); cmsgh; cmsgh = CMSG_NXTHDR(&msg, cmsgh)) {
@@ -857,22 +953,33 @@ int ping4_receive_error_msg(socket_st *sock)
 	if (e == NULL)
 		abort();
 
+	if (e->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+		/* Not an error: a TX stamp (-k). */
+		tstamp_tx(&msg, e, res);
+		goto again;
+	}
+
 	if (e->ee_origin == SO_EE_ORIGIN_LOCAL) {
 		local_errors++;
 		if (options & F_QUIET)
 			goto out;
-		if (options & F_FLOOD)
+		ping4_is_dest(target.sin_addr.s_addr, &t);
+		if (options & F_JSON)
+			json_local_error(t ? t->name : NULL, e->ee_errno, e->ee_info);
+		else if (options & F_FLOOD)
 			write_stdout("E", 1);
 		else if (e->ee_errno != EMSGSIZE)
 			error(0, 0, _("local error: %s"), strerror(e->ee_errno));
 		else
 			error(0, 0, _("local error: message too long, mtu=%u"), e->ee_info);
 		nerrors++;
+		if (t)
+			t->nerrors++;
 	} else if (e->ee_origin == SO_EE_ORIGIN_ICMP) {
 		struct sockaddr_in *sin = (struct sockaddr_in*)(e+1);
 
 		if (res < (ssize_t) sizeof(icmph) ||
-		    target.sin_addr.s_addr != whereto.sin_addr.s_addr ||
+		    !ping4_is_dest(target.sin_addr.s_addr, &t) ||
 		    icmph.type != ICMP_ECHO ||
 		    !is_ours(sock, icmph.un.echo.id)) {
 			/* Not our error, not an error at all. Clear. */
@@ -884,9 +991,14 @@ int ping4_receive_error_msg(socket_st *sock)
 
 		net_errors++;
 		nerrors++;
+		if (t)
+			t->nerrors++;
 		if (options & F_QUIET)
 			goto out;
-		if (options & F_FLOOD) {
+		if (options & F_JSON) {
+			json_icmp_error(pr_addr(sin, sizeof *sin), ntohs(icmph.un.echo.sequence),
+					e->ee_type, e->ee_code, e->ee_info);
+		} else if (options & F_FLOOD) {
 			write_stdout("\bE", 2);
 		} else {
 			print_timestamp();
@@ -901,56 +1013,136 @@ out:
 	return net_errors ? net_errors : -local_errors;
 }
 
+/* Write the current time into a probe and fix up its checksum. */
+static void ping4_timestamp(struct icmphdr *icp)
+{
+	struct timespec old;
+
+	memcpy(&old, icp+1, sizeof(old));
+	stamp_payload(icp+1);
+	icp->checksum = in_cksum_update(icp->checksum, &old, icp+1, sizeof(old));
+}
+
 /*
- * pinger --
- * 	Compose and transmit an ICMP ECHO REQUEST packet.  The IP packet
- * will be added on by the kernel.  The ID field is our UNIX process ID,
- * and the sequence number is an ascending integer.  The first several bytes
- * of the data portion are used to hold a UNIX "timeval" struct in VAX
- * byte-order, to compute the round-trip time.
+ * Compose an echo request with sequence number "seq". The timestamp,
+ * if any, is left zeroed unless -U is given; ping4_stamp() fills it in
+ * just before the packet leaves.
+ *
+ * Probes differ only in sequence number and timestamp, so the payload
+ * is summed once, for a probe with both zeroed, and every probe's
+ * checksum is derived from that (RFC 1624).
  */
-int ping4_send_probe(socket_st *sock, void *packet, unsigned packet_size __attribute__((__unused__)))
+static int ping4_prepare(struct icmphdr *icp, uint16_t seq)
 {
-	struct icmphdr *icp;
+	static uint16_t template_csum;
+	static int have_template;
+	uint16_t seq0 = 0;
 	int cc;
-	int i;
 
-	icp = (struct icmphdr *)packet;
 	icp->type = ICMP_ECHO;
 	icp->code = 0;
 	icp->checksum = 0;
-	icp->un.echo.sequence = htons(ntransmitted+1);
+	icp->un.echo.sequence = 0;
 	icp->un.echo.id = ident;			/* ID */
 
-	rcvd_clear(ntransmitted+1);
+	if (timing)
+		memset(icp+1, 0, sizeof(struct timespec));
 
-	if (timing) {
-		if (options&F_LATENCY) {
-			struct timeval tmp_tv;
-			gettimeofday(&tmp_tv, NULL);
-			memcpy(icp+1, &tmp_tv, sizeof(tmp_tv));
-		} else {
-			memset(icp+1, 0, sizeof(struct timeval));
-		}
+	cc = datalen + 8;			/* skips ICMP portion */
+
+	if (!have_template) {
+		template_csum = in_cksum(icp, cc, 0);
+		have_template = 1;
 	}
+	icp->un.echo.sequence = htons(seq);
+	icp->checksum = in_cksum_update(template_csum, &seq0,
+					&icp->un.echo.sequence, sizeof(seq0));
 
-	cc = datalen + 8;			/* skips ICMP portion */
+	if (timing && (options&F_LATENCY))
+		ping4_timestamp(icp);
+
+	return cc;
+}
 
-	/* compute ICMP checksum here */
-	icp->checksum = in_cksum((unsigned short *)icp, cc, 0);
+/* Put the send time into a prepared probe. */
+static void ping4_stamp(struct icmphdr *icp)
+{
+	if (timing && !(options&F_LATENCY))
+		ping4_timestamp(icp);
+}
 
-	if (timing && !(options&F_LATENCY)) {
-		struct timeval tmp_tv;
-		gettimeofday(&tmp_tv, NULL);
-		memcpy(icp+1, &tmp_tv, sizeof(tmp_tv));
-		icp->checksum = in_cksum((unsigned short *)&tmp_tv, sizeof(tmp_tv), ~icp->checksum);
+/*
+ * Send the probe prepared by ping4_send_probe() once to every target.
+ * Failures only cost the target concerned its probe, the round goes on.
+ */
+static int ping4_send_targets(socket_st *sock, struct icmphdr *icp, int cc)
+{
+	int i;
+
+	for (i = 0; i < ntargets; i++) {
+		struct ping_target *t = &targets[i];
+
+		rcvd_sent(&t->rcvd, ntransmitted+1);
+		ping4_stamp(icp);
+
+		if (sendto(sock->fd, icp, cc, 0, (struct sockaddr *)&t->addr, t->addrlen) == cc) {
+			tstamp_sent(t, ntransmitted+1);
+			continue;
+		}
+
+		t->nerrors++;
+		nerrors++;
+		if (options & F_QUIET)
+			continue;
+		if (options & F_JSON)
+			json_local_error(t->name, errno, 0);
+		else if (options & F_FLOOD)
+			write_stdout("E", 1);
+		else
+			error(0, errno, "sendmsg: %s", t->name);
 	}
+	return 0;
+}
+
+/*
+ * pinger --
+ * 	Compose and transmit an ICMP ECHO REQUEST packet.  The IP packet
+ * will be added on by the kernel.  The ID field is our UNIX process ID,
+ * and the sequence number is an ascending integer.  The first several bytes
+ * of the data portion are used to hold a UNIX "timespec" struct in VAX
+ * byte-order, to compute the round-trip time.
+ */
+int ping4_send_probe(socket_st *sock, void *packet, unsigned packet_size __attribute__((__unused__)))
+{
+	struct icmphdr *icp = packet;
+	int cc;
+	int i;
+
+	cc = ping4_prepare(icp, ntransmitted+1);
+
+	if (ntargets)
+		return ping4_send_targets(sock, icp, cc);
+
+	ping4_stamp(icp);
 
 	i = sendto(sock->fd, icp, cc, 0, (struct sockaddr*)&whereto, sizeof(whereto));
 
 	return (cc == i ? 0 : i);
 }
 
+int ping4_build_probe(socket_st *sock __attribute__((__unused__)), uint8_t *packet, uint16_t seq, struct msghdr *msg)
+{
+	struct icmphdr *icp = (struct icmphdr *)packet;
+	int cc;
+
+	cc = ping4_prepare(icp, seq);
+	ping4_stamp(icp);
+
+	msg->msg_name = &whereto;
+	msg->msg_namelen = sizeof(whereto);
+	return cc;
+}
+
 /*
  * parse_reply --
  *	Print out the packet, if it came from us.  This logic is necessary
@@ -966,9 +1158,10 @@ void pr_echo_reply(uint8_t *_icp, int len __attribute__((__unused__)))
 }
 
 int
-ping4_parse_reply(struct socket_st *sock, struct msghdr *msg, int cc, void *addr, struct timeval *tv)
+ping4_parse_reply(struct socket_st *sock, struct msghdr *msg, int cc, void *addr, struct timespec *ts)
 {
 	struct sockaddr_in *from = addr;
+	struct ping_target *t = NULL;
 	uint8_t *buf = msg->msg_iov->iov_base;
 	struct icmphdr *icp;
 	struct iphdr *ip;
@@ -1015,16 +1208,18 @@ ping4_parse_reply(struct socket_st *sock, struct msghdr *msg, int cc, void *addr
 	/* Now the ICMP part */
 	cc -= hlen;
 	icp = (struct icmphdr *)(buf + hlen);
-	csfailed = in_cksum((unsigned short *)icp, cc, 0);
+	csfailed = in_cksum(icp, cc, 0);
 
 	if (icp->type == ICMP_ECHOREPLY) {
 		if (!is_ours(sock, icp->un.echo.id))
 			return 1;			/* 'Twas not our ECHO */
 		if (!contains_pattern_in_payload((uint8_t*)(icp+1)))
 			return 1;			/* 'Twas really not our ECHO */
-		if (gather_statistics((uint8_t*)icp, sizeof(*icp), cc,
+		if (ntargets && !ping4_is_dest(from->sin_addr.s_addr, &t))
+			return 1;			/* Not from any of our targets */
+		if (gather_statistics(t, (uint8_t*)icp, sizeof(*icp), cc,
 				      ntohs(icp->un.echo.sequence),
-				      reply_ttl, 0, tv, pr_addr(from, sizeof *from),
+				      reply_ttl, 0, ts, t ? t->name : pr_addr(from, sizeof *from),
 				      pr_echo_reply)) {
 			fflush(stdout);
 			return 0;
@@ -1049,7 +1244,7 @@ ping4_parse_reply(struct socket_st *sock, struct msghdr *msg, int cc, void *addr
 				    cc < 8+iph->ihl*4+8)
 					return 1;
 				if (icp1->type != ICMP_ECHO ||
-				    iph->daddr != whereto.sin_addr.s_addr ||
+				    !ping4_is_dest(iph->daddr, &t) ||
 				    !is_ours(sock, icp1->un.echo.id))
 					return 1;
 				error_pkt = (icp->type != ICMP_REDIRECT &&
@@ -1058,6 +1253,12 @@ ping4_parse_reply(struct socket_st *sock, struct msghdr *msg, int cc, void *addr
 					acknowledge(ntohs(icp1->un.echo.sequence));
 					return 0;
 				}
+				if ((options & F_JSON) && !(options & F_QUIET)) {
+					json_icmp_error(pr_addr(from, sizeof *from),
+							ntohs(icp1->un.echo.sequence),
+							icp->type, icp->code, ntohl(icp->un.gateway));
+					return 1;
+				}
 				if (options & (F_QUIET | F_FLOOD))
 					return 1;
 				print_timestamp();
@@ -1073,14 +1274,14 @@ ping4_parse_reply(struct socket_st *sock, struct msghdr *msg, int cc, void *addr
 			/* MUST NOT */
 			break;
 		}
-		if ((options & F_FLOOD) && !(options & (F_VERBOSE|F_QUIET))) {
+		if ((options & F_FLOOD) && !(options & (F_VERBOSE|F_QUIET|F_JSON))) {
 			if (!csfailed)
 				write_stdout("!E", 2);
 			else
 				write_stdout("!EC", 3);
 			return 0;
 		}
-		if (!(options & F_VERBOSE) || uid)
+		if (!(options & F_VERBOSE) || uid || (options & F_JSON))
 			return 0;
 		if (options & F_PTIMEOFDAY) {
 			struct timeval recv_time;
@@ -1111,46 +1312,6 @@ ping4_parse_reply(struct socket_st *sock, struct msghdr *msg, int cc, void *addr
 }
 
 
-#if BYTE_ORDER == LITTLE_ENDIAN
-# define ODDBYTE(v)	(v)
-#elif BYTE_ORDER == BIG_ENDIAN
-# define ODDBYTE(v)	((unsigned short)(v) << 8)
-#else
-# define ODDBYTE(v)	htons((unsigned short)(v) << 8)
-#endif
-
-unsigned short
-in_cksum(const unsigned short *addr, int len, unsigned short csum)
-{
-	int nleft = len;
-	const unsigned short *w = addr;
-	unsigned short answer;
-	int sum = csum;
-
-	/*
-	 *  Our algorithm is simple, using a 32 bit accumulator (sum),
-	 *  we add sequential 16 bit words to it, and at the end, fold
-	 *  back all the carry bits from the top 16 bits into the lower
-	 *  16 bits.
-	 */
-	while (nleft > 1)  {
-		sum += *w++;
-		nleft -= 2;
-	}
-
-	/* mop up an odd byte, if necessary */
-	if (nleft == 1)
-		sum += ODDBYTE(*(unsigned char *)w); /* le16toh() may be unavailable on old systems */
-
-	/*
-	 * add back carry outs from top 16 bits to low 16 bits
-	 */
-	sum = (sum >> 16) + (sum & 0xffff);	/* add hi 16 to low 16 */
-	sum += (sum >> 16);			/* add carry */
-	answer = ~sum;				/* truncate to 16 bits */
-	return (answer);
-}
-
 /*
  * pr_icmph --
  *	Print a descriptive string about an ICMP header.
@@ -1492,28 +1653,23 @@ char *
 pr_addr(void *sa, socklen_t salen)
 {
 	static char buffer[4096] = "";
-	static struct sockaddr_storage last_sa = { 0, {0}, 0 };
-	static socklen_t last_salen = 0;
 	char name[NI_MAXHOST] = "";
 	char address[NI_MAXHOST] = "";
+	long long t;
 
-	if (salen == last_salen && !memcmp(sa, &last_sa, salen))
-		return buffer;
-
-	memcpy(&last_sa, sa, (last_salen = salen));
-
-	in_pr_addr = !setjmp(pr_addr_jmp);
+	t = INSTR_START();
 
 	getnameinfo(sa, salen, address, sizeof address, NULL, 0, getnameinfo_flags | NI_NUMERICHOST);
+	/* Never waits: until the name is in, the address does. */
 	if (!exiting && !(options & F_NUMERIC))
-		getnameinfo(sa, salen, name, sizeof name, NULL, 0, getnameinfo_flags);
+		rdns_lookup(sa, salen, getnameinfo_flags, name, sizeof name, 0);
 
 	if (*name)
 		snprintf(buffer, sizeof buffer, "%s (%s)", name, address);
 	else
 		snprintf(buffer, sizeof buffer, "%s", address);
 
-	in_pr_addr = 0;
+	INSTR_STOP(RESOLVE, t);
 
 	return(buffer);
 }
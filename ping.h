@@ -10,6 +10,15 @@
 #include <linux/sockios.h>
 #include <sys/file.h>
 #include <sys/time.h>
+#ifdef HAVE_TIMERFD
+#include <sys/timerfd.h>
+#endif
+#include <sys/mman.h>
+#include <sys/wait.h>
+#ifdef HAVE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <sys/uio.h>
@@ -17,7 +26,6 @@
 #include <errno.h>
 #include <string.h>
 #include <netdb.h>
-#include <setjmp.h>
 #include <netinet/icmp6.h>
 #include <asm/byteorder.h>
 #include <sched.h>
@@ -41,6 +49,7 @@
 #endif
 
 #include "iputils_common.h"
+#include "iputils_instr.h"
 
 #ifdef USE_IDN
 #include <idn2.h>
@@ -67,6 +76,7 @@
 #include <arpa/inet.h>
 #include <linux/types.h>
 #include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 #include <linux/in6.h>
 
 #ifndef SCOPE_DELIMITER
@@ -80,6 +90,7 @@
 #define MINUSERINTERVAL	200		/* Minimal allowed interval for non-root */
 
 #define SCHINT(a)	(((a) <= MININTERVAL) ? MININTERVAL : (a))
+#define NSEC_PER_MSEC	1000000LL
 
 /* various options */
 extern int options;
@@ -94,7 +105,6 @@ extern int options;
 #define	F_VERBOSE	0x100
 #define	F_TIMESTAMP	0x200
 #define	F_SOURCEROUTE	0x400
-#define	F_FLOOD_POLL	0x800
 #define	F_LATENCY	0x1000
 #define	F_AUDIBLE	0x2000
 #define	F_ADAPTIVE	0x4000
@@ -106,56 +116,101 @@ extern int options;
 #define F_OUTSTANDING	0x100000
 #define F_FLOWINFO	0x200000
 #define F_TCLASS	0x400000
+#define F_JSON		0x800000
 
 /*
- * MAX_DUP_CHK is the number of bits in received table, i.e. the maximum
- * number of received sequence numbers we can keep track of.
+ * MAX_DUP_CHK is the size of the 16 bit sequence space on the wire, which
+ * bounds the preload and the -N nonce memory.
  */
 #define	MAX_DUP_CHK	0x10000
 
-#if defined(__WORDSIZE) && __WORDSIZE == 64
-# define USE_BITMAP64
-#endif
-
-#ifdef USE_BITMAP64
-typedef uint64_t	bitmap_t;
-# define BITMAP_SHIFT	6
-#else
-typedef uint32_t	bitmap_t;
-# define BITMAP_SHIFT	5
-#endif
-
-#if ((MAX_DUP_CHK >> (BITMAP_SHIFT + 3)) << (BITMAP_SHIFT + 3)) != MAX_DUP_CHK
-# error Please MAX_DUP_CHK and/or BITMAP_SHIFT
-#endif
+/*
+ * Received table: one bit for each of the last "size" probes sent, kept
+ * by extended (64 bit) sequence number, so it never aliases however long
+ * ping runs. The 16 bit sequence number of a reply is extended against
+ * the newest probe sent. The window starts small and doubles, up to
+ * RCVD_MAX, while probes newer than every reply are about to fall out
+ * of it; it covers what is really in flight without one fixed 8 KB
+ * table per target. A probe leaves the window received or lost, and
+ * runs of lost ones are the loss bursts. A reply that comes after a
+ * newer one was reordered, one for a probe that already left is late.
+ */
+#define RCVD_MIN	256
+#define RCVD_MAX	0x8000	/* half the 16 bit space, for extension */
 
 struct rcvd_table {
-	bitmap_t bitmap[MAX_DUP_CHK / (sizeof(bitmap_t) * 8)];
+	uint64_t *bits;		/* bit (seq & (size - 1)) for probe seq */
+	unsigned size;		/* power of two */
+	long top;		/* newest probe sent */
+	long tail;		/* oldest probe in the window */
+	long high;		/* newest probe answered */
+	long burst;		/* lost probes since the last answered one */
+	long reordered;
+	long reorder_max;	/* newer probes answered before it */
+	long late;
+	long bursts;
+	long burst_max;
 };
 
 extern struct rcvd_table rcvd_tbl;
 
-#define	A(bit)	(rcvd_tbl.bitmap[(bit) >> BITMAP_SHIFT])	/* identify word in array */
-#define	B(bit)	(((bitmap_t)1) << ((bit) & ((1 << BITMAP_SHIFT) - 1)))	/* identify bit in word */
+enum { RCVD_NEW, RCVD_DUP, RCVD_LATE };
 
-static inline void rcvd_set(uint16_t seq)
-{
-	unsigned bit = seq % MAX_DUP_CHK;
-	A(bit) |= B(bit);
-}
+extern void rcvd_sent(struct rcvd_table *tbl, long seq);
+extern int rcvd_reply(struct rcvd_table *tbl, uint16_t seq);
+extern void rcvd_flush(struct rcvd_table *tbl);
 
-static inline void rcvd_clear(uint16_t seq)
+/* Whether probe "seq" is in the window and was answered. */
+static inline int rcvd_test(struct rcvd_table *tbl, long seq)
 {
-	unsigned bit = seq % MAX_DUP_CHK;
-	A(bit) &= ~B(bit);
-}
+	unsigned bit = seq & (tbl->size - 1);
 
-static inline bitmap_t rcvd_test(uint16_t seq)
-{
-	unsigned bit = seq % MAX_DUP_CHK;
-	return A(bit) & B(bit);
+	if (seq < tbl->tail || seq > tbl->top || !tbl->bits)
+		return 0;
+	return (tbl->bits[bit >> 6] >> (bit & 63)) & 1;
 }
 
+/*
+ * Multi-target mode (-G). All targets share one socket, one sequence
+ * number space and one schedule: every "transmission" is a round sending
+ * one probe to each target with the same sequence number. Replies are
+ * matched back to their target by address, so the global counters below
+ * hold totals and each target keeps its own breakdown and dup table.
+ */
+struct ping_target {
+	struct ping_target *hnext;	/* address hash chain */
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	char *name;			/* "name (address)" as printed */
+	long nreceived;
+	long nrepeats;
+	long nchecksum;
+	long nerrors;
+	long long tmin;			/* round trip times in ns */
+	long long tmax;
+	double tsum;
+	double tsum2;
+	struct rcvd_table rcvd;
+};
+
+extern struct ping_target *targets;
+extern int ntargets;
+
+extern void read_targets(const char *path, int family);
+extern struct ping_target *find_target(int family, const void *addr);
+
+/*
+ * Sharded flood (-P). The parent forks nshards - 1 children, each with
+ * its own socket, ICMP id, CPU and token bucket, and reports for all of
+ * them; the children publish their counters to shared memory as they go.
+ */
+#define MAX_SHARDS	64
+
+extern int nshards;
+extern int shard;			/* 0 in the parent */
+extern void shard_publish(void);
+extern void shard_go(void);
+
 #ifndef HAVE_ERROR_H
 static void error(int status, int errnum, const char *format, ...)
 {
@@ -189,6 +244,7 @@ extern long ntransmitted;		/* sequence # for outbound packets = #sent */
 extern long nchecksum;			/* replies with bad checksum */
 extern long nerrors;			/* icmp errors */
 extern int interval;			/* interval between packets (msec) */
+extern long long interval_ns;		/* the same, exactly (nsec) */
 extern int preload;
 extern int deadline;			/* time to die */
 extern int lingertime;
@@ -200,9 +256,6 @@ extern int confirm_flag;
 extern char *device;
 extern int pmtudisc;
 
-extern volatile int in_pr_addr;		/* pr_addr() is executing */
-extern jmp_buf pr_addr_jmp;
-
 #ifndef MSG_CONFIRM
 #define MSG_CONFIRM 0
 #endif
@@ -210,12 +263,22 @@ extern jmp_buf pr_addr_jmp;
 
 /* timing */
 extern int timing;			/* flag to do timing */
-extern long tmin;			/* minimum round trip time */
-extern long tmax;			/* maximum round trip time */
+extern long long tmin;			/* minimum round trip time (ns) */
+extern long long tmax;			/* maximum round trip time (ns) */
 extern double tsum;			/* sum of all times, for doing average */
 extern double tsum2;
 extern int rtt;
-extern uint16_t acked;
+extern char *hist_path;
+
+/* -k: RTT from kernel or NIC timestamps (SO_TIMESTAMPING) */
+#define TSTAMP_SW	1
+#define TSTAMP_HW	2
+extern int tstamping;
+
+extern void tstamp_sent(struct ping_target *target, uint16_t seq);
+extern struct iovec tstamp_iov;
+extern void tstamp_tx(struct msghdr *msg, struct sock_extended_err *e, size_t len);
+extern long acked;
 extern int pipesize;
 
 /*
@@ -245,6 +308,26 @@ static inline void tvsub(struct timeval *out, struct timeval *in)
 	out->tv_sec -= in->tv_sec;
 }
 
+/* a - b in nanoseconds */
+static inline long long tsdiff(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec);
+}
+
+static inline int ts_isset(const struct timespec *ts)
+{
+	return ts->tv_sec || ts->tv_nsec;
+}
+
+/* Put the send time into the first bytes of a probe's payload. */
+static inline void stamp_payload(void *p)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memcpy(p, &ts, sizeof(ts));
+}
+
 static inline void set_signal(int signo, void (*handler)(int))
 {
 	struct sigaction sa;
@@ -255,39 +338,50 @@ static inline void set_signal(int signo, void (*handler)(int))
 	sigaction(signo, &sa, NULL);
 }
 
-extern int __schedule_exit(int next);
+extern long long __schedule_exit(long long next);
 
-static inline int schedule_exit(int next)
+static inline long long schedule_exit(long long next)
 {
 	if (npackets && ntransmitted >= npackets && !deadline)
 		next = __schedule_exit(next);
 	return next;
 }
 
+/* Number of probes sent so far, counting each target of a round. */
+static inline long nprobes(void)
+{
+	return ntargets ? ntransmitted * ntargets : ntransmitted;
+}
+
+/* Probes sent after the newest one answered. */
 static inline int in_flight(void)
 {
-	uint16_t diff = (uint16_t)ntransmitted - acked;
-	return (diff<=0x7FFF) ? diff : ntransmitted-nreceived-nerrors;
+	return ntransmitted - acked;
 }
 
-static inline void acknowledge(uint16_t seq)
+/* Extend 16 bit "seq" against the newest probe sent, negative if ahead. */
+static inline long seq_extend(uint16_t seq)
 {
 	uint16_t diff = (uint16_t)ntransmitted - seq;
-	if (diff <= 0x7FFF) {
-		if ((int)diff+1 > pipesize)
-			pipesize = (int)diff+1;
-		if ((int16_t)(seq - acked) > 0 ||
-		    (uint16_t)ntransmitted - acked > 0x7FFF)
-			acked = seq;
-	}
+
+	return diff <= 0x7FFF ? ntransmitted - diff : -1;
+}
+
+static inline void acknowledge(uint16_t seq)
+{
+	long s = seq_extend(seq);
+
+	if (s < 0)
+		return;
+	if (ntransmitted - s + 1 > pipesize)
+		pipesize = ntransmitted - s + 1;
+	if (s > acked)
+		acked = s;
 }
 
 static inline void advance_ntransmitted(void)
 {
 	ntransmitted++;
-	/* Invalidate acked, if 16 bit seq overflows. */
-	if ((uint16_t)ntransmitted - acked > 0x7FFF)
-		acked = (uint16_t)ntransmitted + 1;
 }
 
 extern void usage(void) __attribute__((noreturn));
@@ -323,32 +417,47 @@ int is_ours(socket_st *sock, uint16_t id);
 int ping4_run(int argc, char **argv, struct addrinfo *ai, socket_st *sock);
 int ping4_send_probe(socket_st *, void *packet, unsigned packet_size);
 int ping4_receive_error_msg(socket_st *);
-int ping4_parse_reply(socket_st *, struct msghdr *msg, int len, void *addr, struct timeval *);
+int ping4_parse_reply(socket_st *, struct msghdr *msg, int len, void *addr, struct timespec *);
 void ping4_install_filter(socket_st *);
+int ping4_build_probe(socket_st *, uint8_t *packet, uint16_t seq, struct msghdr *msg);
 
 typedef struct ping_func_set_st {
 	int (*send_probe)(socket_st *, void *packet, unsigned packet_size);
 	int (*receive_error_msg)(socket_st *sock);
-	int (*parse_reply)(socket_st *, struct msghdr *msg, int len, void *addr, struct timeval *);
+	int (*parse_reply)(socket_st *, struct msghdr *msg, int len, void *addr, struct timespec *);
 	void (*install_filter)(socket_st *);
+	/* Compose probe "seq" in "packet" ready to go, point msg at its
+	 * destination and return its length; used for sendmmsg() bursts.
+	 * May be NULL when the current mode cannot be batched. */
+	int (*build_probe)(socket_st *, uint8_t *packet, uint16_t seq, struct msghdr *msg);
 } ping_func_set_st;
 
 #define	MAXPACKET	128000		/* max packet size */
 extern ping_func_set_st ping4_func_set;
 
-extern int pinger(ping_func_set_st *fset, socket_st *sock);
+extern long long pinger(ping_func_set_st *fset, socket_st *sock);
+extern void set_interval(long long ns);
 extern void sock_setbufs(socket_st*, int alloc);
 extern void setup(socket_st *);
 extern int contains_pattern_in_payload(uint8_t *ptr);
 extern void main_loop(ping_func_set_st *fset, socket_st*, uint8_t *buf, int buflen) __attribute__((noreturn));
+extern void shard_start(socket_st *socks4, socket_st *socks6);
 extern void finish(void) __attribute__((noreturn));
 extern void status(void);
 extern void common_options(int ch);
-extern int gather_statistics(uint8_t *ptr, int icmplen,
+extern int gather_statistics(struct ping_target *target, uint8_t *ptr, int icmplen,
 			     int cc, uint16_t seq, int hops,
-			     int csfailed, struct timeval *tv, char *from,
+			     int csfailed, struct timespec *ts, char *from,
 			     void (*pr_reply)(uint8_t *ptr, int cc));
 extern void print_timestamp(void);
+extern void json_begin(const char *type, const struct timespec *ts);
+extern void json_int(const char *key, long long v);
+extern void json_str(const char *key, const char *s);
+extern void json_bool(const char *key, int v);
+extern void json_end(void);
+extern void json_flush(void);
+extern void json_icmp_error(const char *from, int seq, int type, int code, uint32_t info);
+extern void json_local_error(const char *to, int err, uint32_t mtu);
 void fill(char *patp, unsigned char *packet, unsigned packet_size);
 
 extern int mark;
@@ -361,8 +470,9 @@ void ping6_usage(unsigned from_ping);
 
 int ping6_send_probe(socket_st *sockets, void *packet, unsigned packet_size);
 int ping6_receive_error_msg(socket_st *sockets);
-int ping6_parse_reply(socket_st *, struct msghdr *msg, int len, void *addr, struct timeval *);
+int ping6_parse_reply(socket_st *, struct msghdr *msg, int len, void *addr, struct timespec *);
 void ping6_install_filter(socket_st *sockets);
+int ping6_build_probe(socket_st *, uint8_t *packet, uint16_t seq, struct msghdr *msg);
 
 extern ping_func_set_st ping6_func_set;
 
@@ -63,7 +63,8 @@ ping_func_set_st ping6_func_set = {
 	.send_probe = ping6_send_probe,
 	.receive_error_msg = ping6_receive_error_msg,
 	.parse_reply = ping6_parse_reply,
-	.install_filter = ping6_install_filter
+	.install_filter = ping6_install_filter,
+	.build_probe = ping6_build_probe
 };
 
 #ifndef SCOPE_DELIMITER
@@ -81,6 +82,17 @@ static size_t cmsglen = 0;
 
 static int pr_icmph(uint8_t type, uint8_t code, uint32_t info);
 
+/* Is daddr a destination of ours? In multi-target mode also say which. */
+static int ping6_is_dest(const struct in6_addr *daddr, struct ping_target **target)
+{
+	if (!ntargets) {
+		*target = NULL;
+		return !memcmp(daddr, &whereto.sin6_addr, 16);
+	}
+	*target = find_target(AF_INET6, daddr);
+	return *target != NULL;
+}
+
 struct sockaddr_in6 source6 = { .sin6_family = AF_INET6 };
 extern char *device;
 
@@ -560,6 +572,7 @@ int ping6_run(int argc, char **argv, struct addrinfo *ai, struct socket_st *sock
 
 	if (niquery_is_enabled()) {
 		niquery_init_nonce();
+		ping6_func_set.build_probe = NULL;
 
 		if (!niquery_is_subject_valid()) {
 			ni_subject = &whereto.sin6_addr;
@@ -591,7 +604,7 @@ int ping6_run(int argc, char **argv, struct addrinfo *ai, struct socket_st *sock
 	if (result)
 		freeaddrinfo(result);
 
-	if (memchr(target, ':', strlen(target)))
+	if (memchr(target, ':', strlen(target)) && !ntargets)
 		options |= F_NUMERIC;
 
 	if (IN6_IS_ADDR_UNSPECIFIED(&firsthop.sin6_addr)) {
@@ -714,7 +727,7 @@ int ping6_run(int argc, char **argv, struct addrinfo *ai, struct socket_st *sock
 	    bind(sock->fd, (struct sockaddr *) &source6, sizeof source6) == -1)
 		error(2, errno, "bind icmp socket");
 
-	if ((ssize_t) datalen >= (ssize_t) sizeof(struct timeval) && (ni_query < 0)) {
+	if ((ssize_t) datalen >= (ssize_t) sizeof(struct timespec) && (ni_query < 0)) {
 		/* can we time transfer */
 		timing = 1;
 	}
@@ -827,17 +840,23 @@ int ping6_run(int argc, char **argv, struct addrinfo *ai, struct socket_st *sock
 #endif
 	}
 
-	printf(_("PING %s(%s) "), hostname, pr_addr(&whereto, sizeof whereto));
-	if (flowlabel)
-		printf(_(", flow 0x%05x, "), (unsigned)ntohl(flowlabel));
-	if (device || (options&F_STRICTSOURCE)) {
-		int saved_options = options;
-
-		options |= F_NUMERIC;
-		printf(_("from %s %s: "), pr_addr(&source6, sizeof source6), device ? device : "");
-		options = saved_options;
+	/* With -P only the parent, which reports for all, says hello. */
+	if (!(options & F_JSON) && !shard) {
+		if (ntargets)
+			printf(_("PING %d targets "), ntargets);
+		else
+			printf(_("PING %s(%s) "), hostname, pr_addr(&whereto, sizeof whereto));
+		if (flowlabel)
+			printf(_(", flow 0x%05x, "), (unsigned)ntohl(flowlabel));
+		if (device || (options&F_STRICTSOURCE)) {
+			int saved_options = options;
+
+			options |= F_NUMERIC;
+			printf(_("from %s %s: "), pr_addr(&source6, sizeof source6), device ? device : "");
+			options = saved_options;
+		}
+		printf(_("%d data bytes\n"), datalen);
 	}
-	printf(_("%d data bytes\n"), datalen);
 
 	setup(sock);
 
@@ -856,12 +875,19 @@ int ping6_receive_error_msg(socket_st *sock)
 	struct sock_extended_err *e;
 	struct icmp6_hdr icmph;
 	struct sockaddr_in6 target;
+	struct ping_target *t = NULL;
 	int net_errors = 0;
 	int local_errors = 0;
 	int saved_errno = errno;
 
-	iov.iov_base = &icmph;
-	iov.iov_len = sizeof(icmph);
+again:
+	/* With -k the probes come back looped, headers and all. */
+	if (tstamping) {
+		iov = tstamp_iov;
+	} else {
+		iov.iov_base = &icmph;
+		iov.iov_len = sizeof(icmph);
+	}
 	msg.msg_name = (void*)&target;
 	msg.msg_namelen = sizeof(target);
 	msg.msg_iov = &iov;
@@ -873,6 +899,8 @@ int ping6_receive_error_msg(socket_st *sock)
 	res = recvmsg(sock->fd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT);
 	if (res < 0)
 		goto out;
+	if (tstamping)
+		memcpy(&icmph, iov.iov_base, sizeof(icmph));
 
 	e = NULL;
 	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
@@ -884,22 +912,33 @@ int ping6_receive_error_msg(socket_st *sock)
 	if (e == NULL)
 		abort();
 
+	if (e->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+		/* Not an error: a TX stamp (-k). */
+		tstamp_tx(&msg, e, res);
+		goto again;
+	}
+
 	if (e->ee_origin == SO_EE_ORIGIN_LOCAL) {
 		local_errors++;
 		if (options & F_QUIET)
 			goto out;
-		if (options & F_FLOOD)
+		ping6_is_dest(&target.sin6_addr, &t);
+		if (options & F_JSON)
+			json_local_error(t ? t->name : NULL, e->ee_errno, e->ee_info);
+		else if (options & F_FLOOD)
 			write_stdout("E", 1);
 		else if (e->ee_errno != EMSGSIZE)
 			error(0, e->ee_errno, _("local error"));
 		else
 			error(0, 0, _("local error: message too long, mtu: %u"), e->ee_info);
 		nerrors++;
+		if (t)
+			t->nerrors++;
 	} else if (e->ee_origin == SO_EE_ORIGIN_ICMP6) {
 		struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)(e+1);
 
 		if ((size_t) res < sizeof(icmph) ||
-		    memcmp(&target.sin6_addr, &whereto.sin6_addr, 16) ||
+		    !ping6_is_dest(&target.sin6_addr, &t) ||
 		    icmph.icmp6_type != ICMP6_ECHO_REQUEST ||
 		    !is_ours(sock, icmph.icmp6_id)) {
 			/* Not our error, not an error at all. Clear. */
@@ -909,9 +948,14 @@ int ping6_receive_error_msg(socket_st *sock)
 
 		net_errors++;
 		nerrors++;
+		if (t)
+			t->nerrors++;
 		if (options & F_QUIET)
 			goto out;
-		if (options & F_FLOOD) {
+		if (options & F_JSON) {
+			json_icmp_error(pr_addr(sin6, sizeof *sin6), ntohs(icmph.icmp6_seq),
+					e->ee_type, e->ee_code, e->ee_info);
+		} else if (options & F_FLOOD) {
 			write_stdout("\bE", 2);
 		} else {
 			print_timestamp();
@@ -932,10 +976,10 @@ out:
  * 	Compose and transmit an ICMP ECHO REQUEST packet.  The IP packet
  * will be added on by the kernel.  The ID field is our UNIX process ID,
  * and the sequence number is an ascending integer.  The first several bytes
- * of the data portion are used to hold a UNIX "timeval" struct in VAX
+ * of the data portion are used to hold a UNIX "timespec" struct in VAX
  * byte-order, to compute the round-trip time.
  */
-int build_echo(uint8_t *_icmph, unsigned packet_size __attribute__((__unused__)))
+int build_echo(uint8_t *_icmph, unsigned packet_size __attribute__((__unused__)), uint16_t seq)
 {
 	struct icmp6_hdr *icmph;
 	int cc;
@@ -944,12 +988,11 @@ int build_echo(uint8_t *_icmph, unsigned packet_size __attribute__((__unused__))
 	icmph->icmp6_type = ICMP6_ECHO_REQUEST;
 	icmph->icmp6_code = 0;
 	icmph->icmp6_cksum = 0;
-	icmph->icmp6_seq = htons(ntransmitted+1);
+	icmph->icmp6_seq = htons(seq);
 	icmph->icmp6_id = ident;
 
 	if (timing)
-		gettimeofday((struct timeval *)&_icmph[8],
-		    (struct timezone *)NULL);
+		stamp_payload(&_icmph[8]);
 
 	cc = datalen + 8;			/* skips ICMP portion */
 
@@ -979,21 +1022,12 @@ int build_niquery(uint8_t *_nih, unsigned packet_size __attribute__((__unused__)
 	return cc;
 }
 
-int ping6_send_probe(socket_st *sock, void *packet, unsigned packet_size)
+static int ping6_sendto(socket_st *sock, void *packet, int len, struct sockaddr_in6 *dst)
 {
-	int len, cc;
-
-	rcvd_clear(ntransmitted + 1);
-
-	if (niquery_is_enabled())
-		len = build_niquery(packet, packet_size);
-	else
-		len = build_echo(packet, packet_size);
-
 	if (cmsglen == 0) {
-		cc = sendto(sock->fd, (char *)packet, len, confirm,
-			    (struct sockaddr *) &whereto,
-			    sizeof(struct sockaddr_in6));
+		return sendto(sock->fd, (char *)packet, len, confirm,
+			      (struct sockaddr *) dst,
+			      sizeof(struct sockaddr_in6));
 	} else {
 		struct msghdr mhdr;
 		struct iovec iov;
@@ -1002,20 +1036,84 @@ int ping6_send_probe(socket_st *sock, void *packet, unsigned packet_size)
 		iov.iov_base = packet;
 
 		memset(&mhdr, 0, sizeof(mhdr));
-		mhdr.msg_name = &whereto;
+		mhdr.msg_name = dst;
 		mhdr.msg_namelen = sizeof(struct sockaddr_in6);
 		mhdr.msg_iov = &iov;
 		mhdr.msg_iovlen = 1;
 		mhdr.msg_control = cmsgbuf;
 		mhdr.msg_controllen = cmsglen;
 
-		cc = sendmsg(sock->fd, &mhdr, confirm);
+		return sendmsg(sock->fd, &mhdr, confirm);
+	}
+}
+
+/*
+ * Send the probe built by ping6_send_probe() once to every target.
+ * Failures only cost the target concerned its probe, the round goes on.
+ */
+static int ping6_send_targets(socket_st *sock, void *packet, int len)
+{
+	int i;
+
+	for (i = 0; i < ntargets; i++) {
+		struct ping_target *t = &targets[i];
+
+		rcvd_sent(&t->rcvd, ntransmitted + 1);
+
+		if (timing)
+			stamp_payload((uint8_t *)packet + 8);
+
+		if (ping6_sendto(sock, packet, len, (struct sockaddr_in6 *)&t->addr) == len) {
+			tstamp_sent(t, ntransmitted + 1);
+			continue;
+		}
+
+		t->nerrors++;
+		nerrors++;
+		if (options & F_QUIET)
+			continue;
+		if (options & F_JSON)
+			json_local_error(t->name, errno, 0);
+		else if (options & F_FLOOD)
+			write_stdout("E", 1);
+		else
+			error(0, errno, "sendmsg: %s", t->name);
 	}
 	confirm = 0;
+	return 0;
+}
+
+int ping6_send_probe(socket_st *sock, void *packet, unsigned packet_size)
+{
+	int len, cc;
+
+	if (niquery_is_enabled())
+		len = build_niquery(packet, packet_size);
+	else
+		len = build_echo(packet, packet_size, ntransmitted + 1);
+
+	if (ntargets)
+		return ping6_send_targets(sock, packet, len);
+
+	cc = ping6_sendto(sock, packet, len, &whereto);
+	confirm = 0;
 
 	return (cc == len ? 0 : cc);
 }
 
+/* Echo requests only: node information queries are not batched, and the
+ * kernel computes the checksum, so there is nothing else to prepare. */
+int ping6_build_probe(socket_st *sock __attribute__((__unused__)), uint8_t *packet, uint16_t seq, struct msghdr *msg)
+{
+	msg->msg_name = &whereto;
+	msg->msg_namelen = sizeof(struct sockaddr_in6);
+	if (cmsglen) {
+		msg->msg_control = cmsgbuf;
+		msg->msg_controllen = cmsglen;
+	}
+	return build_echo(packet, 0, seq);
+}
+
 void pr_echo_reply(uint8_t *_icmph, int cc __attribute__((__unused__)))
 {
 	struct icmp6_hdr *icmph = (struct icmp6_hdr *) _icmph;
@@ -1168,9 +1266,10 @@ void pr_niquery_reply(uint8_t *_nih, int len)
  * program to be run without having intermingled output (or statistics!).
  */
 int
-ping6_parse_reply(socket_st *sock, struct msghdr *msg, int cc, void *addr, struct timeval *tv)
+ping6_parse_reply(socket_st *sock, struct msghdr *msg, int cc, void *addr, struct timespec *ts)
 {
 	struct sockaddr_in6 *from = addr;
+	struct ping_target *t = NULL;
 	uint8_t *buf = msg->msg_iov->iov_base;
 	struct cmsghdr *c;
 	struct icmp6_hdr *icmph;
@@ -1205,9 +1304,11 @@ ping6_parse_reply(socket_st *sock, struct msghdr *msg, int cc, void *addr, struc
 			return 1;
                if (!contains_pattern_in_payload((uint8_t*)(icmph+1)))
                		return 1;            /* 'Twas really not our ECHO */
-		if (gather_statistics((uint8_t*)icmph, sizeof(*icmph), cc,
+		if (ntargets && !ping6_is_dest(&from->sin6_addr, &t))
+			return 1;		/* Not from any of our targets */
+		if (gather_statistics(t, (uint8_t*)icmph, sizeof(*icmph), cc,
 				      ntohs(icmph->icmp6_seq),
-				      hops, 0, tv, pr_addr(from, sizeof *from),
+				      hops, 0, ts, t ? t->name : pr_addr(from, sizeof *from),
 				      pr_echo_reply)) {
 			fflush(stdout);
 			return 0;
@@ -1217,9 +1318,9 @@ ping6_parse_reply(socket_st *sock, struct msghdr *msg, int cc, void *addr, struc
 		int seq = niquery_check_nonce(nih->ni_nonce);
 		if (seq < 0)
 			return 1;
-		if (gather_statistics((uint8_t*)icmph, sizeof(*icmph), cc,
+		if (gather_statistics(NULL, (uint8_t*)icmph, sizeof(*icmph), cc,
 				      seq,
-				      hops, 0, tv, pr_addr(from, sizeof *from),
+				      hops, 0, ts, pr_addr(from, sizeof *from),
 				      pr_niquery_reply))
 			return 0;
 	} else {
@@ -1237,7 +1338,7 @@ ping6_parse_reply(socket_st *sock, struct msghdr *msg, int cc, void *addr, struc
 		if (cc < (int) (8 + sizeof(struct ip6_hdr) + 8))
 			return 1;
 
-		if (memcmp(&iph1->ip6_dst, &whereto.sin6_addr, 16))
+		if (!ping6_is_dest(&iph1->ip6_dst, &t))
 			return 1;
 
 		nexthdr = iph1->ip6_nxt;
@@ -1252,6 +1353,15 @@ ping6_parse_reply(socket_st *sock, struct msghdr *msg, int cc, void *addr, struc
 				return 1;
 			acknowledge(ntohs(icmph1->icmp6_seq));
 			nerrors++;
+			if (t)
+				t->nerrors++;
+			if (options & F_JSON) {
+				if (!(options & F_QUIET))
+					json_icmp_error(pr_addr(from, sizeof *from), ntohs(icmph1->icmp6_seq),
+							icmph->icmp6_type, icmph->icmp6_code,
+							ntohl(icmph->icmp6_mtu));
+				return 0;
+			}
 			if (options & F_FLOOD) {
 				write_stdout("\bE", 2);
 				return 0;
@@ -1260,7 +1370,7 @@ ping6_parse_reply(socket_st *sock, struct msghdr *msg, int cc, void *addr, struc
 			printf(_("From %s: icmp_seq=%u "), pr_addr(from, sizeof *from), ntohs(icmph1->icmp6_seq));
 		} else {
 			/* We've got something other than an ECHOREPLY */
-			if (!(options & F_VERBOSE) || uid)
+			if (!(options & F_VERBOSE) || uid || (options & F_JSON))
 				return 1;
 			print_timestamp();
 			printf(_("From %s: "), pr_addr(from, sizeof *from));
@@ -32,10 +32,6 @@
 
 #include "ping.h"
 
-#ifndef HZ
-#define HZ sysconf(_SC_CLK_TCK)
-#endif
-
 int options;
 
 int mark;
@@ -43,11 +39,18 @@ int sndbuf;
 int ttl;
 int rtt;
 int rtt_addend;
-uint16_t acked;
+long acked;
 
 unsigned char outpack[MAXPACKET];
 struct rcvd_table rcvd_tbl;
 
+/* multi-target mode */
+struct ping_target *targets;
+int ntargets;
+static const char *targets_path;
+static struct ping_target **target_hash;
+static unsigned target_hash_mask;
+
 /* counters */
 long npackets;			/* max packets to transmit */
 long nreceived;			/* # of packets we got back */
@@ -55,16 +58,17 @@ long nrepeats;			/* number of duplicates */
 long ntransmitted;		/* sequence # for outbound packets = #sent */
 long nchecksum;			/* replies with bad checksum */
 long nerrors;			/* icmp errors */
+INSTR_DEFINE;			/* hot path counters, see iputils_instr.h */
 int interval = 1000;		/* interval between packets (msec) */
+long long interval_ns = 1000 * NSEC_PER_MSEC;
 int preload = 1;
 int deadline = 0;		/* time to die */
 int lingertime = MAXWAIT*1000;
 struct timeval start_time, cur_time;
 volatile int exiting;
+static volatile int interrupted;	/* exiting on SIGINT, not the timer */
 volatile int status_snapshot;
 int confirm = 0;
-volatile int in_pr_addr = 0;	/* pr_addr() is executing */
-jmp_buf pr_addr_jmp;
 
 /* Stupid workarounds for bugs/missing functionality in older linuces.
  * confirm_flag fixes refusing service of kernels without MSG_CONFIRM.
@@ -73,8 +77,8 @@ int confirm_flag = MSG_CONFIRM;
 
 /* timing */
 int timing;			/* flag to do timing */
-long tmin = LONG_MAX;		/* minimum round trip time */
-long tmax;			/* maximum round trip time */
+long long tmin = LLONG_MAX;	/* minimum round trip time (ns) */
+long long tmax;			/* maximum round trip time (ns) */
 /* Message for rpm maintainers: have _shame_. If you want
  * to fix something send the patch to me for sanity checking.
  * "sparcfix" patch is a complete non-sense, apparenly the person
@@ -114,9 +118,13 @@ void usage(void)
 		"  -D                 print timestamps\n"
 		"  -d                 use SO_DEBUG socket option\n"
 		"  -f                 flood ping\n"
+		"  -G <file>          ping every target listed in <file> ('-' for stdin)\n"
 		"  -h                 print help and exit\n"
+		"  -H <file>          write RTT histogram to <file> at exit and on SIGQUIT\n"
 		"  -I <interface>     either interface name or address\n"
+		"  -k <sw|hw>         take RTT from kernel (sw) or NIC (hw) timestamps\n"
 		"  -i <interval>      seconds between sending each packet\n"
+		"  -j                 print one JSON record per event\n"
 		"  -L                 suppress loopback of multicast packets\n"
 		"  -l <preload>       send <preload> number of packages while waiting replies\n"
 		"  -m <mark>          tag the packets going out\n"
@@ -124,6 +132,7 @@ void usage(void)
 		"  -n                 no dns name resolution\n"
 		"  -O                 report outstanding replies\n"
 		"  -p <pattern>       contents of padding byte\n"
+		"  -P <shards>        flood from <shards> processes, each with its own socket\n"
 		"  -q                 quiet output\n"
 		"  -Q <tclass>        use quality of service <tclass> bits\n"
 		"  -s <size>          use <size> as number of data bytes to be sent\n"
@@ -248,6 +257,253 @@ void drop_capabilities(void)
 #endif
 }
 
+static unsigned target_hash_fn(int family, const void *addr)
+{
+	const uint32_t *w = addr;
+	uint32_t h = 0x9e3779b9;
+	int i, n = family == AF_INET6 ? 4 : 1;
+
+	for (i = 0; i < n; i++) {
+		h ^= w[i];
+		h *= 0x01000193;
+	}
+	return (h ^ (h >> 16)) & target_hash_mask;
+}
+
+static const void *target_addr(struct ping_target *t)
+{
+	if (t->addr.ss_family == AF_INET6)
+		return &((struct sockaddr_in6 *)&t->addr)->sin6_addr;
+	return &((struct sockaddr_in *)&t->addr)->sin_addr;
+}
+
+/*
+ * find_target --
+ *	Map a destination (in_addr or in6_addr) back to its target in
+ * multi-target mode. NULL means the address is not one of ours.
+ */
+struct ping_target *find_target(int family, const void *addr)
+{
+	struct ping_target *t;
+	size_t alen = family == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+
+	if (!target_hash)
+		return NULL;
+	for (t = target_hash[target_hash_fn(family, addr)]; t; t = t->hnext) {
+		if (t->addr.ss_family == family && !memcmp(target_addr(t), addr, alen))
+			return t;
+	}
+	return NULL;
+}
+
+/*
+ * read_targets --
+ *	Load the target list for multi-target mode: one host per line,
+ * blank lines and '#' comments are ignored. Every host is resolved once,
+ * here, so that the reply path never has to call the resolver. Only
+ * targets of a single address family can share a run; the family is
+ * either the one requested with -4/-6 or that of the first target.
+ */
+void read_targets(const char *path, int family)
+{
+	struct addrinfo hints = { .ai_family = family, .ai_socktype = SOCK_DGRAM, .ai_flags = getaddrinfo_flags };
+	FILE *fp;
+	char line[NI_MAXHOST + 64];
+	int nalloc = 0;
+	int i, j;
+
+	targets_path = path;
+	if (strcmp(path, "-") == 0)
+		fp = stdin;
+	else if (!(fp = fopen(path, "r")))
+		error(2, errno, _("cannot open target list %s"), path);
+
+	while (fgets(line, sizeof(line), fp)) {
+		struct addrinfo *result;
+		struct ping_target *t;
+		char address[NI_MAXHOST];
+		char *p, *name = line;
+		int status;
+
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		while (isspace((unsigned char)*name))
+			name++;
+		for (p = name + strlen(name); p > name && isspace((unsigned char)p[-1]); p--)
+			;
+		*p = '\0';
+		if (*name == '\0')
+			continue;
+
+		status = getaddrinfo(name, NULL, &hints, &result);
+		if (status) {
+			error(0, 0, "%s: %s", name, gai_strerror(status));
+			continue;
+		}
+		if (hints.ai_family == AF_UNSPEC)
+			hints.ai_family = result->ai_family;
+		if (result->ai_family != hints.ai_family) {
+			error(0, 0, _("%s: skipped, address family differs from the first target"), name);
+			freeaddrinfo(result);
+			continue;
+		}
+
+		if (ntargets == nalloc) {
+			nalloc = nalloc ? 2 * nalloc : 64;
+			targets = realloc(targets, nalloc * sizeof(*targets));
+			if (!targets)
+				error(2, errno, _("memory allocation failed"));
+		}
+		t = &targets[ntargets];
+		memset(t, 0, sizeof(*t));
+		memcpy(&t->addr, result->ai_addr, result->ai_addrlen);
+		t->addrlen = result->ai_addrlen;
+		t->tmin = LLONG_MAX;
+		freeaddrinfo(result);
+
+		getnameinfo((struct sockaddr *)&t->addr, t->addrlen, address, sizeof(address),
+			    NULL, 0, NI_NUMERICHOST);
+		if (strcmp(name, address) == 0)
+			t->name = strdup(address);
+		else if (asprintf(&t->name, "%s (%s)", name, address) < 0)
+			t->name = NULL;
+		if (!t->name)
+			error(2, errno, _("memory allocation failed"));
+		ntargets++;
+	}
+	if (fp != stdin)
+		fclose(fp);
+
+	if (!ntargets)
+		error(2, 0, _("no usable targets in %s"), path);
+	if (ntargets > 1 && (options & F_RROUTE || options & F_TIMESTAMP))
+		error(2, 0, _("-R and -T cannot be used with multiple targets"));
+
+	for (target_hash_mask = 1; target_hash_mask < 2U * ntargets; target_hash_mask <<= 1)
+		;
+	target_hash = calloc(target_hash_mask, sizeof(*target_hash));
+	if (!target_hash)
+		error(2, errno, _("memory allocation failed"));
+	target_hash_mask--;
+
+	/* Drop duplicates while hashing; entries are only ever moved down
+	 * into slots that nothing in the hash points to yet. */
+	for (i = 0, j = 0; i < ntargets; i++) {
+		struct ping_target *t = &targets[i];
+		unsigned h;
+
+		if (find_target(t->addr.ss_family, target_addr(t))) {
+			error(0, 0, _("%s: duplicate target, skipped"), t->name);
+			free(t->name);
+			continue;
+		}
+		if (j != i)
+			targets[j] = *t;
+		t = &targets[j++];
+		h = target_hash_fn(t->addr.ss_family, target_addr(t));
+		t->hnext = target_hash[h];
+		target_hash[h] = t;
+	}
+	ntargets = j;
+}
+
+static void rcvd_burst_end(struct rcvd_table *tbl)
+{
+	if (!tbl->burst)
+		return;
+	tbl->bursts++;
+	if (tbl->burst > tbl->burst_max)
+		tbl->burst_max = tbl->burst;
+	tbl->burst = 0;
+}
+
+/* A probe leaves the window: a lost one extends the loss burst. */
+static void rcvd_retire(struct rcvd_table *tbl)
+{
+	if (rcvd_test(tbl, tbl->tail))
+		rcvd_burst_end(tbl);
+	else
+		tbl->burst++;
+	tbl->tail++;
+}
+
+/* Double the window, 0 unless there is room for it. */
+static int rcvd_grow(struct rcvd_table *tbl)
+{
+	unsigned size = tbl->size ? 2 * tbl->size : RCVD_MIN;
+	uint64_t *bits;
+	long seq;
+
+	if (size > RCVD_MAX)
+		return 0;
+	bits = calloc(size / 64, sizeof(*bits));
+	if (!bits)
+		return 0;
+	for (seq = tbl->tail; tbl->bits && seq <= tbl->top; seq++) {
+		unsigned bit = seq & (size - 1);
+
+		if (rcvd_test(tbl, seq))
+			bits[bit >> 6] |= (uint64_t)1 << (bit & 63);
+	}
+	free(tbl->bits);
+	tbl->bits = bits;
+	tbl->size = size;
+	return 1;
+}
+
+/* Probe "seq" is about to go out; it may be a retry of one prepared before. */
+void rcvd_sent(struct rcvd_table *tbl, long seq)
+{
+	unsigned bit;
+
+	if (!tbl->bits) {
+		if (!rcvd_grow(tbl))
+			error(2, errno, _("memory allocation failed"));
+		tbl->tail = seq;
+	}
+	if (seq < tbl->tail)
+		return;
+	if (seq > tbl->top)
+		tbl->top = seq;
+	/* Keep what is newer than every reply, evict what is overtaken. */
+	while (tbl->top - tbl->tail >= (long)tbl->size)
+		if (tbl->tail <= tbl->high || !rcvd_grow(tbl))
+			rcvd_retire(tbl);
+	bit = seq & (tbl->size - 1);
+	tbl->bits[bit >> 6] &= ~((uint64_t)1 << (bit & 63));
+}
+
+/* Account for a reply to 16 bit "seq". */
+int rcvd_reply(struct rcvd_table *tbl, uint16_t seq)
+{
+	long s = tbl->top - (uint16_t)((uint16_t)tbl->top - seq);
+	unsigned bit;
+
+	if (!tbl->bits || s < tbl->tail) {
+		tbl->late++;
+		return RCVD_LATE;
+	}
+	if (rcvd_test(tbl, s))
+		return RCVD_DUP;
+	bit = s & (tbl->size - 1);
+	tbl->bits[bit >> 6] |= (uint64_t)1 << (bit & 63);
+	if (s < tbl->high) {
+		tbl->reordered++;
+		if (tbl->high - s > tbl->reorder_max)
+			tbl->reorder_max = tbl->high - s;
+	} else
+		tbl->high = s;
+	return RCVD_NEW;
+}
+
+/* The run is over: what is still in flight is lost. */
+void rcvd_flush(struct rcvd_table *tbl)
+{
+	while (tbl->bits && tbl->tail <= tbl->top)
+		rcvd_retire(tbl);
+	rcvd_burst_end(tbl);
+}
+
 /* Fills all the outpack, excluding ICMP header, but _including_
  * timestamp area with supplied pattern.
  */
@@ -290,11 +546,11 @@ void fill(char *patp, unsigned char *packet, unsigned packet_size)
 #endif
 }
 
-static void sigexit(int signo __attribute__((__unused__)))
+static void sigexit(int signo)
 {
+	if (signo == SIGINT)
+		interrupted = 1;
 	exiting = 1;
-	if (in_pr_addr)
-		longjmp(pr_addr_jmp, 0);
 }
 
 static void sigstatus(int signo __attribute__((__unused__)))
@@ -303,7 +559,7 @@ static void sigstatus(int signo __attribute__((__unused__)))
 }
 
 
-int __schedule_exit(int next)
+long long __schedule_exit(long long next)
 {
 	static unsigned long waittime;
 	struct itimerval it;
@@ -312,14 +568,14 @@ int __schedule_exit(int next)
 		return next;
 
 	if (nreceived) {
-		waittime = 2 * tmax;
-		if (waittime < (unsigned long) (1000*interval))
-			waittime = 1000*interval;
+		waittime = 2 * tmax / 1000;
+		if (waittime < (unsigned long)(interval_ns / 1000))
+			waittime = interval_ns / 1000;
 	} else
 		waittime = lingertime*1000;
 
-	if (next < 0 || (unsigned long)next < waittime/1000)
-		next = waittime/1000;
+	if (next < 0 || next < (long long)waittime * 1000)
+		next = (long long)waittime * 1000;
 
 	it.it_interval.tv_sec = 0;
 	it.it_interval.tv_usec = 0;
@@ -329,13 +585,21 @@ int __schedule_exit(int next)
 	return next;
 }
 
+/* Interval in ns; "interval" keeps the value in ms for messages and checks. */
+void set_interval(long long ns)
+{
+	interval_ns = ns;
+	interval = ns / NSEC_PER_MSEC;
+}
+
 static inline void update_interval(void)
 {
-	int est = rtt ? rtt/8 : interval*1000;
+	long long est = rtt ? rtt/8 : interval_ns/1000;
 
-	interval = (est+rtt_addend+500)/1000;
-	if (uid && interval < MINUSERINTERVAL)
-		interval = MINUSERINTERVAL;
+	est += rtt_addend;
+	if (uid && est < MINUSERINTERVAL*1000)
+		est = MINUSERINTERVAL*1000;
+	set_interval(est * 1000);
 }
 
 /*
@@ -351,73 +615,488 @@ void print_timestamp(void)
 	}
 }
 
+/*
+ * JSON lines output (-j). Every event is one object on a line of its own.
+ * Records are assembled in jbuf without stdio or gettext and go out with
+ * write_stdout() in batches: main_loop() flushes before it may block, and
+ * a full buffer flushes itself.
+ */
+#define JSON_BUFSZ	16384
+
+static char jbuf[JSON_BUFSZ];
+static size_t jlen;
+
+void json_flush(void)
+{
+	if (jlen)
+		write_stdout(jbuf, jlen);
+	jlen = 0;
+}
+
+static void json_put(const char *s, size_t len)
+{
+	if (jlen + len > sizeof(jbuf)) {
+		json_flush();
+		if (len > sizeof(jbuf)) {
+			write_stdout(s, len);
+			return;
+		}
+	}
+	memcpy(jbuf + jlen, s, len);
+	jlen += len;
+}
+
+static void json_key(const char *key)
+{
+	json_put(",\"", 2);
+	json_put(key, strlen(key));
+	json_put("\":", 2);
+}
+
+void json_int(const char *key, long long v)
+{
+	char tmp[24];
+	char *p = tmp + sizeof(tmp);
+	unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (v < 0)
+		*--p = '-';
+	json_key(key);
+	json_put(p, tmp + sizeof(tmp) - p);
+}
+
+void json_str(const char *key, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *run = s;
+
+	json_key(key);
+	json_put("\"", 1);
+	for (; *s; s++) {
+		unsigned char c = *s;
+		char esc[6] = { '\\', 'u', '0', '0' };
+
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+		json_put(run, s - run);
+		if (c == '"' || c == '\\') {
+			esc[1] = c;
+			json_put(esc, 2);
+		} else {
+			esc[4] = hex[c >> 4];
+			esc[5] = hex[c & 15];
+			json_put(esc, 6);
+		}
+		run = s + 1;
+	}
+	json_put(run, s - run);
+	json_put("\"", 1);
+}
+
+void json_bool(const char *key, int v)
+{
+	json_key(key);
+	if (v)
+		json_put("true", 4);
+	else
+		json_put("false", 5);
+}
+
+/* Open a record of "type"; "ts" is when it happened, NULL for now. */
+void json_begin(const char *type, const struct timespec *ts)
+{
+	struct timespec now;
+
+	if (!ts) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		ts = &now;
+	}
+	json_put("{\"type\":\"", 9);
+	json_put(type, strlen(type));
+	json_put("\"", 1);
+	json_int("time_ns", ts->tv_sec * 1000000000LL + ts->tv_nsec);
+}
+
+void json_end(void)
+{
+	json_put("}\n", 2);
+}
+
+/* An ICMP error about probe "seq" reported by "from". */
+void json_icmp_error(const char *from, int seq, int type, int code, uint32_t info)
+{
+	json_begin("error", NULL);
+	json_str("from", from);
+	json_int("seq", seq);
+	json_int("icmp_type", type);
+	json_int("icmp_code", code);
+	if (info)
+		json_int("info", info);
+	json_end();
+}
+
+/* A local error sending towards "to" ("mtu" for EMSGSIZE). */
+void json_local_error(const char *to, int err, uint32_t mtu)
+{
+	json_begin("local_error", NULL);
+	if (to)
+		json_str("to", to);
+	json_int("errno", err);
+	json_str("message", strerror(err));
+	if (err == EMSGSIZE)
+		json_int("mtu", mtu);
+	json_end();
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uring engine. On kernels with multishot recvmsg and provided buffer
+ * rings (6.0) main_loop() hands over to uring_loop(): a single recvmsg
+ * request keeps filling buffers the kernel takes from a ring of our own,
+ * probes are queued as sendmsg requests, the error queue is watched by a
+ * multishot poll, and one io_uring_enter() per round submits the probes
+ * and waits for the replies or the next probe, whichever comes first.
+ * Where any of it is missing, the poll() loop below carries on.
+ */
+#define UR_ENTRIES	256		/* SQ entries, the CQ gets 16 times more */
+#define UR_TX		128		/* probes in flight in the ring */
+#define UR_BGID		0		/* our provided buffer group */
+#define UR_BUFMEM	(1 << 20)	/* bytes of receive buffers */
+
+enum { UR_RECV = 1, UR_ERRQ, UR_SEND };	/* low byte of user_data */
+
+struct ur_tx {
+	struct msghdr msg;
+	struct iovec iov;
+	uint8_t *buf;
+};
+
+static struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	unsigned sq_entries;
+	unsigned sq_local;		/* our tail, published by ur_enter() */
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *ring;
+	size_t ring_len;
+
+	struct io_uring_buf_ring *br;
+	unsigned nbufs;
+	uint16_t br_tail;
+	uint8_t *bufs;
+	size_t bufsize;
+	struct msghdr rx_tmpl;
+	int rx_armed, errq_armed;
+
+	struct ur_tx tx[UR_TX];
+	int tx_free[UR_TX];
+	int ntx_free;
+} *ur;
+
+/* Submit what is queued; with "arg" also wait for one completion or
+ * until arg->ts expires. */
+static int ur_enter(struct io_uring_getevents_arg *arg)
+{
+	unsigned n = ur->sq_local - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+
+	__atomic_store_n(ur->sq_tail, ur->sq_local, __ATOMIC_RELEASE);
+	if (!arg)
+		return syscall(__NR_io_uring_enter, ur->fd, n, 0, 0, NULL, 0);
+	return syscall(__NR_io_uring_enter, ur->fd, n, 1,
+		       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, arg, sizeof(*arg));
+}
+
+static struct io_uring_sqe *ur_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (ur->sq_local - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >= ur->sq_entries)
+		ur_enter(NULL);
+	idx = ur->sq_local++ & *ur->sq_mask;
+	ur->sq_array[idx] = idx;
+	sqe = &ur->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/*
+ * The tx_burst() of the ring: queue n probes, to go out with the next
+ * io_uring_enter(). Their results come back as completions, so only a
+ * lack of free buffers is reported here, as EAGAIN.
+ */
+static int ur_send(ping_func_set_st *fset, socket_st *sock, int n, int *nsent)
+{
+	int i;
+
+	if (n > ur->ntx_free)
+		n = ur->ntx_free;
+	if (!n) {
+		errno = EAGAIN;
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		int slot = ur->tx_free[--ur->ntx_free];
+		struct ur_tx *tx = &ur->tx[slot];
+		struct io_uring_sqe *sqe;
+
+		memset(&tx->msg, 0, sizeof(tx->msg));
+		tx->iov.iov_base = tx->buf;
+		tx->iov.iov_len = fset->build_probe(sock, tx->buf, ntransmitted + 1 + i, &tx->msg);
+		tx->msg.msg_iov = &tx->iov;
+		tx->msg.msg_iovlen = 1;
+
+		sqe = ur_sqe();
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = sock->fd;
+		sqe->addr = (unsigned long)&tx->msg;
+		sqe->len = 1;
+		sqe->user_data = UR_SEND | (uint64_t)slot << 8;
+	}
+	/* Into the window once queued, as tx_burst() does once sent. */
+	for (i = 0; i < n; i++)
+		rcvd_sent(&rcvd_tbl, ntransmitted + 1 + i);
+	*nsent = n;
+	return 0;
+}
+#endif /* HAVE_IO_URING */
+
+/*
+ * Transmit ring for bursts. When the token bucket (or preload) allows
+ * several probes at once, pinger() has fset->build_probe() compose them
+ * in separate buffers and pushes them out with a single sendmmsg().
+ */
+#define TX_BATCH	64
+
+#ifdef HAVE_SENDMMSG
+static struct mmsghdr *tx_msgs;
+static struct iovec *tx_iov;
+static uint8_t **tx_bufs;
+#endif
+static int tx_batch = -1;		/* -1: not set up yet */
+
+static void tx_init(ping_func_set_st *fset)
+{
+	tx_batch = 1;
+#ifdef HAVE_IO_URING
+	if (ur && fset->build_probe && !ntargets && preload > 1) {
+		/* The ring has buffers of its own. */
+		tx_batch = preload < TX_BATCH ? preload : TX_BATCH;
+		return;
+	}
+#endif
+#ifdef HAVE_SENDMMSG
+	int i;
+
+	if (!fset->build_probe || ntargets || preload < 2)
+		return;
+
+	tx_batch = preload < TX_BATCH ? preload : TX_BATCH;
+	tx_msgs = calloc(tx_batch, sizeof(*tx_msgs));
+	tx_iov = calloc(tx_batch, sizeof(*tx_iov));
+	tx_bufs = calloc(tx_batch, sizeof(*tx_bufs));
+	if (!tx_msgs || !tx_iov || !tx_bufs)
+		error(2, errno, _("memory allocation failed"));
+	for (i = 0; i < tx_batch; i++) {
+		/* Each buffer carries its own copy of the payload pattern. */
+		tx_bufs[i] = malloc(8 + datalen);
+		if (!tx_bufs[i])
+			error(2, errno, _("memory allocation failed"));
+		memcpy(tx_bufs[i], outpack, 8 + datalen);
+	}
+#else
+	(void)fset;
+#endif
+}
+
+/*
+ * Send n consecutive probes in one go. Returns 0 and the number actually
+ * sent in *nsent (which may fall short of n when the queue fills up), or
+ * -1 with errno set if not even the first one went out.
+ */
+static int tx_burst(ping_func_set_st *fset, socket_st *sock, int n, int *nsent)
+{
+#ifdef HAVE_SENDMMSG
+	int i;
+
+	for (i = 0; i < n; i++) {
+		struct msghdr *msg = &tx_msgs[i].msg_hdr;
+
+		memset(msg, 0, sizeof(*msg));
+		tx_iov[i].iov_base = tx_bufs[i];
+		tx_iov[i].iov_len = fset->build_probe(sock, tx_bufs[i], ntransmitted + 1 + i, msg);
+		msg->msg_iov = &tx_iov[i];
+		msg->msg_iovlen = 1;
+	}
+
+	i = sendmmsg(sock->fd, tx_msgs, n, 0);
+	if (i < 0) {
+		if (errno == ENOSYS)
+			tx_batch = 1;
+		return -1;
+	}
+	/* Probes a short send left out are not in the window yet. */
+	*nsent = i;
+	for (i = 0; i < *nsent; i++)
+		rcvd_sent(&rcvd_tbl, ntransmitted + 1 + i);
+	return 0;
+#else
+	(void)fset; (void)sock; (void)n; (void)nsent;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* Whether probe "seq" got a reply, from any target with -G. */
+static int answered(long seq)
+{
+	int i;
+
+	if (!ntargets)
+		return rcvd_test(&rcvd_tbl, seq);
+	for (i = 0; i < ntargets; i++)
+		if (rcvd_test(&targets[i].rcvd, seq))
+			return 1;
+	return 0;
+}
+
 /*
  * pinger --
  * 	Compose and transmit an ICMP ECHO REQUEST packet.  The IP packet
  * will be added on by the kernel.  The ID field is our UNIX process ID,
  * and the sequence number is an ascending integer.  The first several bytes
- * of the data portion are used to hold a UNIX "timeval" struct in VAX
+ * of the data portion are used to hold a UNIX "timespec" struct in VAX
  * byte-order, to compute the round-trip time.
+ *
+ * Returns the time in ns until the next probe is due. Tokens are counted
+ * in ns against CLOCK_MONOTONIC, so intervals well below a millisecond
+ * keep their rate and a step of the wall clock leaves the bucket alone.
  */
-int pinger(ping_func_set_st *fset, socket_st *sock)
+long long pinger(ping_func_set_st *fset, socket_st *sock)
 {
 	static int oom_count;
-	static int tokens;
+	static long long tokens;
+	static struct timespec last;
+	int burst = 1;
+	int nsent = 1;
+	long long t;
 	int i;
 
 	/* Have we already sent enough? If we have, return an arbitrary positive value. */
 	if (exiting || (npackets && ntransmitted >= npackets && !deadline))
-		return 1000;
+		return 1000 * NSEC_PER_MSEC;
 
 	/* Check that packets < rate*time + preload */
-	if (cur_time.tv_sec == 0) {
+	if (!ts_isset(&last)) {
+		clock_gettime(CLOCK_MONOTONIC, &last);
 		gettimeofday(&cur_time, NULL);
-		tokens = interval*(preload-1);
+		tokens = interval_ns*(preload-1);
 	} else {
-		long ntokens;
-		struct timeval tv;
+		long long ntokens;
+		struct timespec now;
 
-		gettimeofday(&tv, NULL);
-		ntokens = (tv.tv_sec - cur_time.tv_sec)*1000 +
-			(tv.tv_usec-cur_time.tv_usec)/1000;
-		if (!interval) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ntokens = tsdiff(&now, &last);
+		if (!interval_ns) {
 			/* Case of unlimited flood is special;
 			 * if we see no reply, they are limited to 100pps */
-			if (ntokens < MININTERVAL && in_flight() >= preload)
-				return MININTERVAL-ntokens;
+			if (ntokens < MININTERVAL*NSEC_PER_MSEC && in_flight() >= preload)
+				return MININTERVAL*NSEC_PER_MSEC - ntokens;
 		}
 		ntokens += tokens;
-		if (ntokens > interval*preload)
-			ntokens = interval*preload;
-		if (ntokens < interval)
-			return interval - ntokens;
+		if (ntokens > interval_ns*preload)
+			ntokens = interval_ns*preload;
+		if (ntokens < interval_ns)
+			return interval_ns - ntokens;
 
-		cur_time = tv;
-		tokens = ntokens - interval;
+		last = now;
+		gettimeofday(&cur_time, NULL);
+		tokens = ntokens - interval_ns;
 	}
 
 	if (options & F_OUTSTANDING) {
-		if (ntransmitted > 0 && !rcvd_test(ntransmitted)) {
-			print_timestamp();
-			printf(_("no answer yet for icmp_seq=%lu\n"), (ntransmitted % MAX_DUP_CHK));
-			fflush(stdout);
+		if (ntransmitted > 0 && !answered(ntransmitted)) {
+			if (options & F_JSON) {
+				json_begin("timeout", NULL);
+				json_int("seq", ntransmitted % MAX_DUP_CHK);
+				json_end();
+			} else {
+				print_timestamp();
+				printf(_("no answer yet for icmp_seq=%lu\n"), (ntransmitted % MAX_DUP_CHK));
+				fflush(stdout);
+			}
 		}
 	}
 
+	/* How many more probes would the bucket let through right now? */
+	if (tx_batch < 0)
+		tx_init(fset);
+	if (tx_batch > 1) {
+		if (interval_ns)
+			burst += tokens / interval_ns;
+		else
+			burst += preload - 1 - in_flight();
+		if (burst > tx_batch)
+			burst = tx_batch;
+		if (npackets && !deadline && burst > npackets - ntransmitted)
+			burst = npackets - ntransmitted;
+	}
+
 resend:
-	i = fset->send_probe(sock, outpack, sizeof(outpack));
+#ifdef HAVE_IO_URING
+	if (ur && fset->build_probe && !ntargets) {
+		/* No system call: they go out with uring_loop()'s wait. */
+		i = ur_send(fset, sock, burst, &nsent);
+		goto sent;
+	}
+#endif
+	t = INSTR_START();
+	if (burst > 1 && tx_batch > 1)
+		i = tx_burst(fset, sock, burst, &nsent);
+	else {
+		/* Multi-target rounds keep a window for each target. */
+		if (!ntargets)
+			rcvd_sent(&rcvd_tbl, ntransmitted + 1);
+		i = fset->send_probe(sock, outpack, sizeof(outpack));
+	}
+	INSTR_STOP(SEND, t);
+	if (i < 0)
+		INSTR_ERRNO(errno);
+#ifdef HAVE_IO_URING
+sent:
+#endif
 
 	if (i == 0) {
 		oom_count = 0;
-		advance_ntransmitted();
-		if (!(options & F_QUIET) && (options & F_FLOOD)) {
-			/* Very silly, but without this output with
-			 * high preload or pipe size is very confusing. */
-			if ((preload < screen_width && pipesize < screen_width) ||
-			    in_flight() < screen_width)
-				write_stdout(".", 1);
+		/* A short burst leaves its tokens in the bucket, the next
+		 * call then retries and gets to see the error. */
+		tokens -= (nsent - 1) * interval_ns;
+		while (nsent--) {
+			/* Multi-target rounds are accounted by send_probe. */
+			if (!ntargets)
+				tstamp_sent(NULL, ntransmitted + 1);
+			advance_ntransmitted();
+			if (!(options & (F_QUIET|F_JSON)) && (options & F_FLOOD)) {
+				/* Very silly, but without this output with
+				 * high preload or pipe size is very confusing. */
+				if ((preload < screen_width && pipesize < screen_width) ||
+				    in_flight() < screen_width)
+					write_stdout(".", 1);
+			}
 		}
-		return interval - tokens;
+		return interval_ns - tokens;
+	}
+
+	if (burst > 1 && tx_batch == 1) {
+		/* sendmmsg() is not there after all. */
+		burst = 1;
+		goto resend;
 	}
 
 	/* And handle various errors... */
@@ -438,7 +1117,7 @@ resend:
 			nores_interval = 500;
 		oom_count++;
 		if (oom_count*nores_interval < lingertime)
-			return nores_interval;
+			return nores_interval * NSEC_PER_MSEC;
 		i = 0;
 		/* Fall to hard error. It is to avoid complete deadlock
 		 * on stuck output device even when dealine was not requested.
@@ -446,8 +1125,8 @@ resend:
 		 * exit some day. :-) */
 	} else if (errno == EAGAIN) {
 		/* Socket buffer is full. */
-		tokens += interval;
-		return MININTERVAL;
+		tokens += interval_ns;
+		return MININTERVAL * NSEC_PER_MSEC;
 	} else {
 		if ((i=fset->receive_error_msg(sock)) > 0) {
 			/* An ICMP error arrived. In this case, we've received
@@ -479,7 +1158,7 @@ hard_local_error:
 			perror("ping: sendmsg");
 	}
 	tokens = 0;
-	return SCHINT(interval);
+	return SCHINT(interval) * NSEC_PER_MSEC;
 }
 
 /* Set socket buffers, "alloc" is an estimate of memory taken by single packet. */
@@ -489,6 +1168,10 @@ void sock_setbufs(socket_st *sock, int alloc)
 	int rcvbuf, hold;
 	socklen_t tmplen = sizeof(hold);
 
+	/* A round sends one packet to each target at once. */
+	if (ntargets)
+		alloc *= ntargets;
+
 	if (!sndbuf)
 		sndbuf = alloc;
 	setsockopt(sock->fd, SOL_SOCKET, SO_SNDBUF, (char *)&sndbuf, sizeof(sndbuf));
@@ -503,6 +1186,215 @@ void sock_setbufs(socket_st *sock, int alloc)
 	}
 }
 
+/*
+ * Kernel timestamps (-k). The TX stamps come back on the error queue with
+ * the probe looped back, link and IP headers included, and are matched to
+ * it by target and sequence number. tx_stamps[] holds the probes in the
+ * order they went out, tx_first[] the first of each sequence number, so
+ * that tstamp_tx() and gather_statistics() find a probe straight away.
+ * A count kept by the kernel (SOF_TIMESTAMPING_OPT_ID) is no use here,
+ * it also goes up for datagrams dropped with ENOBUFS.
+ */
+#define TX_STAMPS	1024
+
+struct tx_stamp {
+	struct ping_target *target;
+	uint16_t seq;
+	int pending;			/* counted in tx_unstamped */
+	struct timespec sw;
+	struct timespec hw;
+};
+
+int tstamping;
+static struct tx_stamp tx_stamps[TX_STAMPS];
+static uint32_t tx_first[TX_STAMPS];	/* by seq: key of its first probe */
+static uint32_t tx_key;		/* key of the next probe, its place in tx_stamps[] */
+struct iovec tstamp_iov;	/* where the probes looped back are read */
+static long tx_unstamped;	/* sent, but no software TX stamp yet */
+static struct timespec rx_hw;	/* hardware stamp of the reply at hand */
+
+static void tstamp_setup(socket_st *sock)
+{
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE |
+		    SOF_TIMESTAMPING_SOFTWARE;
+
+	/* Room for the probe behind link and IP headers with options. */
+	tstamp_iov.iov_len = 8 + datalen + 128;
+	tstamp_iov.iov_base = malloc(tstamp_iov.iov_len);
+	if (!tstamp_iov.iov_base)
+		error(2, errno, _("memory allocation failed"));
+
+	if (tstamping == TSTAMP_HW) {
+		flags |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_TX_HARDWARE |
+			 SOF_TIMESTAMPING_RAW_HARDWARE;
+		if (device) {
+			struct hwtstamp_config cfg;
+			struct ifreq ifr;
+			int ret;
+
+			memset(&cfg, 0, sizeof(cfg));
+			cfg.tx_type = HWTSTAMP_TX_ON;
+			cfg.rx_filter = HWTSTAMP_FILTER_ALL;
+			memset(&ifr, 0, sizeof(ifr));
+			strncpy(ifr.ifr_name, device, IFNAMSIZ-1);
+			ifr.ifr_data = (void *)&cfg;
+
+			enable_capability_admin();
+			ret = ioctl(sock->fd, SIOCSHWTSTAMP, &ifr);
+			disable_capability_admin();
+			if (ret < 0)
+				error(0, errno, _("Warning: cannot enable hardware timestamps on %s"), device);
+		} else {
+			error(0, 0, _("Warning: no interface given, hardware timestamps must be enabled already"));
+		}
+	}
+
+	if (setsockopt(sock->fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)))
+		error(2, errno, "SO_TIMESTAMPING");
+}
+
+/* Remember the probe the kernel is about to stamp under the next key. */
+void tstamp_sent(struct ping_target *target, uint16_t seq)
+{
+	struct tx_stamp *s;
+	uint32_t key;
+
+	if (!tstamping)
+		return;
+	key = tx_key++;
+	/* The targets of a round go out one after the other. */
+	if (!key || tx_stamps[(key - 1) % TX_STAMPS].seq != seq)
+		tx_first[seq % TX_STAMPS] = key;
+	s = &tx_stamps[key % TX_STAMPS];
+	/* A stamp that never came is no longer waited for. */
+	if (s->pending)
+		tx_unstamped--;
+	memset(s, 0, sizeof(*s));
+	s->target = target;
+	s->seq = seq;
+	s->pending = 1;
+	tx_unstamped++;
+}
+
+/* The probe "seq" sent to "target", if it is still in tx_stamps[]. */
+static struct tx_stamp *tstamp_find(struct ping_target *target, uint16_t seq)
+{
+	uint32_t key = tx_first[seq % TX_STAMPS];
+
+	for (; tx_key - key - 1 < TX_STAMPS; key++) {
+		struct tx_stamp *s = &tx_stamps[key % TX_STAMPS];
+
+		if (s->seq != seq)
+			return NULL;
+		if (s->target == target)
+			return s;
+	}
+	return NULL;
+}
+
+/*
+ * Find our echo request in a looped back packet of len bytes; the link
+ * header in front of it is of any length. 1 with its sequence number and
+ * destination, 0 if it is not there.
+ */
+static int tstamp_probe(const uint8_t *p, size_t len, int *family,
+			const uint8_t **daddr, uint16_t *seq)
+{
+	size_t off, hl;
+
+	for (off = 0; off < 64 && off + 28 <= len; off++) {
+		const uint8_t *ip = p + off;
+
+		if (ip[0] >> 4 == 4 && ip[9] == IPPROTO_ICMP) {
+			hl = (ip[0] & 15) * 4;
+			if (hl < 20 || (size_t)((ip[2] << 8) | ip[3]) != hl + 8 + datalen ||
+			    off + hl + 8 > len || ip[hl] != ICMP_ECHO)
+				continue;
+			*family = AF_INET;
+			*daddr = ip + 16;
+		} else if (ip[0] >> 4 == 6 && ip[6] == IPPROTO_ICMPV6) {
+			hl = 40;
+			if ((size_t)((ip[4] << 8) | ip[5]) != 8 + (size_t)datalen ||
+			    off + hl + 8 > len || ip[hl] != ICMP6_ECHO_REQUEST)
+				continue;
+			*family = AF_INET6;
+			*daddr = ip + 24;
+		} else {
+			continue;
+		}
+		*seq = (ip[hl + 6] << 8) | ip[hl + 7];
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * A TX stamp read from the error queue by fset->receive_error_msg(),
+ * with the len bytes of its packet in tstamp_iov.
+ */
+void tstamp_tx(struct msghdr *msg, struct sock_extended_err *e, size_t len)
+{
+	struct scm_timestamping tss;
+	struct ping_target *target = NULL;
+	const uint8_t *daddr;
+	struct cmsghdr *c;
+	struct tx_stamp *s;
+	int found = 0, family;
+	uint16_t seq;
+
+	for (c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+		if (c->cmsg_level == SOL_SOCKET &&
+		    c->cmsg_type == SCM_TIMESTAMPING &&
+		    c->cmsg_len >= CMSG_LEN(sizeof(tss))) {
+			memcpy(&tss, CMSG_DATA(c), sizeof(tss));
+			found = 1;
+		}
+	}
+	if (!found || e->ee_info != SCM_TSTAMP_SND || (msg->msg_flags & MSG_TRUNC) ||
+	    !tstamp_probe(tstamp_iov.iov_base, len, &family, &daddr, &seq))
+		return;
+	if (ntargets && !(target = find_target(family, daddr)))
+		return;
+	/* Probes already overwritten, or not ours, are of no use. */
+	s = tstamp_find(target, seq);
+	if (!s)
+		return;
+	if (ts_isset(&tss.ts[0]) && !ts_isset(&s->sw)) {
+		s->sw = tss.ts[0];
+		if (s->pending) {
+			s->pending = 0;
+			tx_unstamped--;
+		}
+	}
+	if (ts_isset(&tss.ts[2]))
+		s->hw = tss.ts[2];
+}
+
+/*
+ * Swap the user space send time of probe "seq" for the kernel's, and both
+ * ends for the NIC's if it stamped both. Software and hardware stamps are
+ * never mixed, they are taken from different clocks.
+ */
+static void tstamp_rtt(struct ping_target *target, uint16_t seq,
+		       struct timespec *sent, struct timespec *recv)
+{
+	struct tx_stamp *s = tstamp_find(target, seq);
+
+	if (!s)
+		return;
+	/* The error queue was drained before the reply was read. */
+	if (s->pending) {
+		s->pending = 0;
+		tx_unstamped--;
+	}
+	if (tstamping == TSTAMP_HW && ts_isset(&s->hw) && ts_isset(&rx_hw)) {
+		*sent = s->hw;
+		*recv = rx_hw;
+	} else if (ts_isset(&s->sw)) {
+		*sent = s->sw;
+	}
+}
+
 /* Protocol independent setup and parameter checks. */
 
 void setup(socket_st *sock)
@@ -512,9 +1404,9 @@ void setup(socket_st *sock)
 	sigset_t sset;
 
 	if ((options & F_FLOOD) && !(options & F_INTERVAL))
-		interval = 0;
+		set_interval(0);
 
-	if (uid && interval < MINUSERINTERVAL)
+	if (uid && interval_ns < MINUSERINTERVAL * NSEC_PER_MSEC)
 		error(2, 0, _("cannot flood; minimal interval allowed for user is %dms"), MINUSERINTERVAL);
 
 	if (interval >= INT_MAX/preload)
@@ -526,11 +1418,16 @@ void setup(socket_st *sock)
 	if (options & F_SO_DONTROUTE)
 		setsockopt(sock->fd, SOL_SOCKET, SO_DONTROUTE, (char *)&hold, sizeof(hold));
 
-#ifdef SO_TIMESTAMP
-	if (!(options&F_LATENCY)) {
+	if (tstamping) {
+		if (options&F_LATENCY)
+			error(2, 0, _("-k and -U are mutually exclusive"));
+		tstamp_setup(sock);
+	}
+#ifdef SO_TIMESTAMPNS
+	else if (!(options&F_LATENCY)) {
 		int on = 1;
-		if (setsockopt(sock->fd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on)))
-			error(0, 0, _("Warning: no SO_TIMESTAMP support, falling back to SIOCGSTAMP"));
+		if (setsockopt(sock->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)))
+			error(0, 0, _("Warning: no SO_TIMESTAMPNS support, falling back to SIOCGSTAMPNS"));
 	}
 #endif
 #ifdef SO_MARK
@@ -564,13 +1461,6 @@ void setup(socket_st *sock)
 	}
 	setsockopt(sock->fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&tv, sizeof(tv));
 
-	/* Set RCVTIMEO to "interval". Note, it is just an optimization
-	 * allowing to avoid redundant poll(). */
-	tv.tv_sec = SCHINT(interval)/1000;
-	tv.tv_usec = 1000*(SCHINT(interval)%1000);
-	if (setsockopt(sock->fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv)))
-		options |= F_FLOOD_POLL;
-
 	if (!(options & F_PINGFILLED)) {
 		int i;
 		unsigned char *p = outpack+8;
@@ -623,113 +1513,584 @@ int contains_pattern_in_payload(uint8_t *ptr)
 	uint8_t *cp, *dp;
  
 	/* check the data */
-	cp = ((u_char*)ptr) + sizeof(struct timeval);
-	dp = &outpack[8 + sizeof(struct timeval)];
-	for (i = sizeof(struct timeval); i < datalen; ++i, ++cp, ++dp) {
+	cp = ((u_char*)ptr) + sizeof(struct timespec);
+	dp = &outpack[8 + sizeof(struct timespec)];
+	for (i = sizeof(struct timespec); i < datalen; ++i, ++cp, ++dp) {
 		if (*cp != *dp)
 			return 0;
 	}
 	return 1;
 }
 
-void main_loop(ping_func_set_st *fset, socket_st *sock, uint8_t *packet, int packlen)
-{
+/*
+ * Receive ring. With recvmmsg() one system call drains up to rx_batch
+ * queued replies, each into its own packet buffer and control buffer, so
+ * that every reply keeps its own timestamp. Without it the ring has a
+ * single slot and is filled by plain recvmsg().
+ */
+#define RX_BATCH	64
+#define RX_CMSGLEN	512
+
+struct rx_slot {
 	char addrbuf[128];
-	char ans_data[4096];
+	char ans_data[RX_CMSGLEN];
 	struct iovec iov;
-	struct msghdr msg;
-	struct cmsghdr *c;
-	int cc;
-	int next;
-	int polling;
-	int recv_error;
-
-	iov.iov_base = (char *)packet;
+};
 
-	for (;;) {
-		/* Check exit conditions. */
-		if (exiting)
-			break;
-		if (npackets && nreceived + nerrors >= npackets)
-			break;
-		if (deadline && nerrors)
-			break;
-		/* Check for and do special actions. */
-		if (status_snapshot)
-			status();
+#ifdef HAVE_RECVMMSG
+static struct mmsghdr *rx_msgs;
+#else
+static struct msghdr rx_msg;
+static int rx_msg_len;
+#endif
+static struct rx_slot *rx_slots;
+static int rx_batch;
 
-		/* Send probes scheduled to this time. */
-		do {
-			next = pinger(fset, sock);
-			next = schedule_exit(next);
-		} while (next <= 0);
+static void rx_init(uint8_t *packet, int packlen)
+{
+	int i;
 
-		/* "next" is time to send next probe, if positive.
-		 * If next<=0 send now or as soon as possible. */
-
-		/* Technical part. Looks wicked. Could be dropped,
-		 * if everyone used the newest kernel. :-)
-		 * Its purpose is:
-		 * 1. Provide intervals less than resolution of scheduler.
-		 *    Solution: spinning.
-		 * 2. Avoid use of poll(), when recvmsg() can provide
-		 *    timed waiting (SO_RCVTIMEO). */
-		polling = 0;
-		recv_error = 0;
-		if ((options & (F_ADAPTIVE|F_FLOOD_POLL)) || next<SCHINT(interval)) {
-			int recv_expected = in_flight();
-
-			/* If we are here, recvmsg() is unable to wait for
-			 * required timeout. */
-			if (1000 % HZ == 0 ? next <= 1000 / HZ : (next < INT_MAX / HZ && next * HZ <= 1000)) {
-				/* Very short timeout... So, if we wait for
-				 * something, we sleep for MININTERVAL.
-				 * Otherwise, spin! */
-				if (recv_expected) {
-					next = MININTERVAL;
-				} else {
-					next = 0;
-					/* When spinning, no reasons to poll.
-					 * Use nonblocking recvmsg() instead. */
-					polling = MSG_DONTWAIT;
-					/* But yield yet. */
-					sched_yield();
-				}
-			}
+	rx_batch = 1;
+#ifdef HAVE_RECVMMSG
+	/* Batching pays only when replies can queue up: preload, or
+	 * several targets answering to the same round. */
+	rx_batch = preload * (ntargets ? ntargets : 1);
+	if (rx_batch > RX_BATCH)
+		rx_batch = RX_BATCH;
+	rx_msgs = calloc(rx_batch, sizeof(*rx_msgs));
+	if (!rx_msgs)
+		error(2, errno, _("memory allocation failed"));
+#endif
+	rx_slots = calloc(rx_batch, sizeof(*rx_slots));
+	if (!rx_slots)
+		error(2, errno, _("memory allocation failed"));
+
+	rx_slots[0].iov.iov_base = packet;
+	for (i = 1; i < rx_batch; i++) {
+		rx_slots[i].iov.iov_base = malloc(packlen);
+		if (!rx_slots[i].iov.iov_base)
+			error(2, errno, _("memory allocation failed"));
+	}
+	for (i = 0; i < rx_batch; i++)
+		rx_slots[i].iov.iov_len = packlen;
+}
 
-			if (!polling &&
-			    ((options & (F_ADAPTIVE|F_FLOOD_POLL)) || interval)) {
-				struct pollfd pset;
-				pset.fd = sock->fd;
-				pset.events = POLLIN;
-				pset.revents = 0;
-				if (poll(&pset, 1, next) < 1 ||
-				    !(pset.revents&(POLLIN|POLLERR)))
-					continue;
-				polling = MSG_DONTWAIT;
-				recv_error = pset.revents&POLLERR;
-			}
-		}
+static struct msghdr *rx_hdr(int i)
+{
+#ifdef HAVE_RECVMMSG
+	return &rx_msgs[i].msg_hdr;
+#else
+	(void)i;
+	return &rx_msg;
+#endif
+}
+
+/* Receive one or more replies into the ring, return their count. The
+ * first one may wait (unless flags say otherwise), the rest are only
+ * what is already queued. */
+static int rx_receive(socket_st *sock, int flags)
+{
+	int i;
+
+	for (i = 0; i < rx_batch; i++) {
+		struct msghdr *msg = rx_hdr(i);
+
+		memset(msg, 0, sizeof(*msg));
+		msg->msg_name = rx_slots[i].addrbuf;
+		msg->msg_namelen = sizeof(rx_slots[i].addrbuf);
+		msg->msg_iov = &rx_slots[i].iov;
+		msg->msg_iovlen = 1;
+		msg->msg_control = rx_slots[i].ans_data;
+		msg->msg_controllen = sizeof(rx_slots[i].ans_data);
+	}
+
+#ifdef HAVE_RECVMMSG
+	if (rx_batch > 1) {
+		i = recvmmsg(sock->fd, rx_msgs, rx_batch, flags | MSG_WAITFORONE, NULL);
+		if (i >= 0 || errno != ENOSYS)
+			return i;
+		/* Kernel is older than its headers, go one by one. */
+		rx_batch = 1;
+	}
+	i = recvmsg(sock->fd, rx_hdr(0), flags);
+	if (i >= 0)
+		rx_msgs[0].msg_len = i;
+#else
+	i = recvmsg(sock->fd, rx_hdr(0), flags);
+	if (i >= 0)
+		rx_msg_len = i;
+#endif
+	return i < 0 ? i : 1;
+}
+
+static int rx_len(int i)
+{
+#ifdef HAVE_RECVMMSG
+	return rx_msgs[i].msg_len;
+#else
+	(void)i;
+	return rx_msg_len;
+#endif
+}
+
+/* Hand one received reply over to the protocol, return "not ours". */
+static int rx_parse(ping_func_set_st *fset, socket_st *sock, struct msghdr *msg, int cc, int last)
+{
+	struct timespec recv_ts;
+	int have_ts = 0;
+	struct cmsghdr *c;
+	long long t = INSTR_START();
+	int rc;
+
+	memset(&rx_hw, 0, sizeof(rx_hw));
+	for (c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET)
+			continue;
+#ifdef SO_TIMESTAMPNS
+		if (c->cmsg_type == SCM_TIMESTAMPNS &&
+		    c->cmsg_len >= CMSG_LEN(sizeof(recv_ts))) {
+			memcpy(&recv_ts, CMSG_DATA(c), sizeof(recv_ts));
+			have_ts = 1;
+		}
+#endif
+		if (c->cmsg_type == SCM_TIMESTAMPING &&
+		    c->cmsg_len >= CMSG_LEN(sizeof(struct scm_timestamping))) {
+			struct scm_timestamping tss;
+
+			memcpy(&tss, CMSG_DATA(c), sizeof(tss));
+			if (ts_isset(&tss.ts[0])) {
+				recv_ts = tss.ts[0];
+				have_ts = 1;
+			}
+			rx_hw = tss.ts[2];
+		}
+	}
+
+	if ((options&F_LATENCY) || !have_ts) {
+		/* SIOCGSTAMPNS only knows about the last packet received. */
+		if ((options&F_LATENCY) || !last ||
+		    ioctl(sock->fd, SIOCGSTAMPNS, &recv_ts))
+			clock_gettime(CLOCK_REALTIME, &recv_ts);
+	}
+
+	/* The TX stamp of this reply's probe may still be queued. */
+	if (tx_unstamped > 0) {
+		int saved_errno = errno;
+
+		while (fset->receive_error_msg(sock))
+			;
+		errno = saved_errno;
+	}
+
+	rc = fset->parse_reply(sock, msg, cc, msg->msg_name, &recv_ts);
+	INSTR_STOP(PARSE, t);
+	return rc;
+}
+
+#ifdef HAVE_IO_URING
+static void ur_buf_put(unsigned bid)
+{
+	struct io_uring_buf *b = &ur->br->bufs[ur->br_tail & (ur->nbufs - 1)];
+
+	b->addr = (unsigned long)(ur->bufs + bid * ur->bufsize);
+	b->len = ur->bufsize;
+	b->bid = bid;
+	__atomic_store_n(&ur->br->tail, ++ur->br_tail, __ATOMIC_RELEASE);
+}
+
+static void ur_arm_recv(socket_st *sock)
+{
+	struct io_uring_sqe *sqe = ur_sqe();
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = sock->fd;
+	sqe->addr = (unsigned long)&ur->rx_tmpl;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = UR_BGID;
+	sqe->user_data = UR_RECV;
+	ur->rx_armed = 1;
+}
+
+static void ur_arm_errq(socket_st *sock)
+{
+	struct io_uring_sqe *sqe = ur_sqe();
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = sock->fd;
+	sqe->len = IORING_POLL_ADD_MULTI;
+#if __BYTE_ORDER == __BIG_ENDIAN
+	sqe->poll32_events = POLLERR << 16;
+#else
+	sqe->poll32_events = POLLERR;
+#endif
+	sqe->user_data = UR_ERRQ;
+	ur->errq_armed = 1;
+}
+
+static void ur_close(void)
+{
+	if (ur->bufs)
+		munmap(ur->bufs, ur->nbufs * ur->bufsize);
+	if (ur->br)
+		munmap(ur->br, ur->nbufs * sizeof(struct io_uring_buf));
+	if (ur->sqes)
+		munmap(ur->sqes, ur->sq_entries * sizeof(struct io_uring_sqe));
+	if (ur->ring)
+		munmap(ur->ring, ur->ring_len);
+	close(ur->fd);
+	free(ur);
+	ur = NULL;
+}
+
+/* Set up the ring and arm the receive side, 0 on success. */
+static int ur_setup(socket_st *sock, int packlen)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	size_t len;
+	uint8_t *ring;
+	unsigned i;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+	p.cq_entries = UR_ENTRIES * 16;
+	fd = syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+	if (fd < 0)
+		return -1;
+	ur = calloc(1, sizeof(*ur));
+	if (!ur)
+		error(2, errno, _("memory allocation failed"));
+	ur->fd = fd;
+	ur->sq_entries = p.sq_entries;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG))
+		goto fail;
+
+	len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	if (len < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+		len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ur->fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED)
+		goto fail;
+	ur->ring = ring;
+	ur->ring_len = len;
+	ur->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED) {
+		ur->sqes = NULL;
+		goto fail;
+	}
+	ur->sq_head = (unsigned *)(ring + p.sq_off.head);
+	ur->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+	ur->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+	ur->sq_array = (unsigned *)(ring + p.sq_off.array);
+	ur->sq_local = *ur->sq_tail;
+	ur->cq_head = (unsigned *)(ring + p.cq_off.head);
+	ur->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+	ur->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+	/* A reply lands as io_uring_recvmsg_out, the name and the control
+	 * data, each in the room the template asks for, then the packet. */
+	ur->rx_tmpl.msg_namelen = sizeof(((struct rx_slot *)0)->addrbuf);
+	ur->rx_tmpl.msg_controllen = RX_CMSGLEN;
+	ur->bufsize = sizeof(struct io_uring_recvmsg_out) + ur->rx_tmpl.msg_namelen +
+		      ur->rx_tmpl.msg_controllen + packlen;
+	ur->bufsize = (ur->bufsize + 63) & ~(size_t)63;
+	for (ur->nbufs = 8; ur->nbufs < 1024 && 2 * ur->nbufs * ur->bufsize <= UR_BUFMEM; )
+		ur->nbufs *= 2;
+
+	ur->br = mmap(NULL, ur->nbufs * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ur->br == MAP_FAILED) {
+		ur->br = NULL;
+		goto fail;
+	}
+	ur->bufs = mmap(NULL, ur->nbufs * ur->bufsize, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ur->bufs == MAP_FAILED) {
+		ur->bufs = NULL;
+		goto fail;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)ur->br;
+	reg.ring_entries = ur->nbufs;
+	reg.bgid = UR_BGID;
+	if (syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail;
+	for (i = 0; i < ur->nbufs; i++)
+		ur_buf_put(i);
+
+	/* Kernels that know the buffer ring but not multishot recvmsg
+	 * turn it down at once. */
+	ur_arm_recv(sock);
+	ur_arm_errq(sock);
+	if (ur_enter(NULL) < 0)
+		goto fail;
+	for (i = *ur->cq_head; i != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE); i++) {
+		struct io_uring_cqe *cqe = &ur->cqes[i & *ur->cq_mask];
+
+		if (cqe->res == -EINVAL)
+			goto fail;
+	}
+
+	/* Each probe buffer carries its own copy of the payload pattern. */
+	for (i = 0; i < UR_TX; i++) {
+		ur->tx[i].buf = malloc(8 + datalen);
+		if (!ur->tx[i].buf)
+			error(2, errno, _("memory allocation failed"));
+		memcpy(ur->tx[i].buf, outpack, 8 + datalen);
+		ur->tx_free[ur->ntx_free++] = i;
+	}
+	return 0;
+
+fail:
+	ur_close();
+	return -1;
+}
+
+/* One completion of the multishot recvmsg, return "not ours". */
+static int ur_recv(ping_func_set_st *fset, socket_st *sock, struct io_uring_cqe *cqe)
+{
+	struct io_uring_recvmsg_out *out;
+	struct msghdr msg;
+	struct iovec iov;
+	unsigned bid;
+	uint8_t *buf;
+	int cc, rc;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		ur->rx_armed = 0;
+	if (cqe->res < 0) {
+		INSTR_ERRNO(-cqe->res);
+		/* Out of buffers: they are back once this batch is done.
+		 * Anything else is a pending socket error, with its story
+		 * in the error queue. */
+		if (cqe->res != -ENOBUFS)
+			while (fset->receive_error_msg(sock))
+				;
+		return 0;
+	}
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		return 0;
+
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	buf = ur->bufs + bid * ur->bufsize;
+	out = (struct io_uring_recvmsg_out *)buf;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = buf + sizeof(*out);
+	msg.msg_namelen = out->namelen < ur->rx_tmpl.msg_namelen ? out->namelen : ur->rx_tmpl.msg_namelen;
+	msg.msg_control = (uint8_t *)msg.msg_name + ur->rx_tmpl.msg_namelen;
+	msg.msg_controllen = out->controllen;
+	msg.msg_flags = out->flags;
+	iov.iov_base = (uint8_t *)msg.msg_control + ur->rx_tmpl.msg_controllen;
+	iov.iov_len = ur->bufsize - ((uint8_t *)iov.iov_base - buf);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	cc = out->payloadlen < iov.iov_len ? (int)out->payloadlen : (int)iov.iov_len;
+
+	rc = rx_parse(fset, sock, &msg, cc, 0);
+	ur_buf_put(bid);
+	return rc;
+}
+
+/* A probe has gone out, or not. */
+static void ur_sent(struct io_uring_cqe *cqe)
+{
+	int slot = cqe->user_data >> 8;
+
+	ur->tx_free[ur->ntx_free++] = slot;
+	if (cqe->res >= 0)
+		return;
+	INSTR_ERRNO(-cqe->res);
+	/* It is counted as sent already, like a hard local error. */
+	if (options & F_QUIET)
+		return;
+	if (options & F_JSON)
+		json_local_error(NULL, -cqe->res, 0);
+	else if (options & F_FLOOD)
+		write_stdout("E", 1);
+	else
+		error(0, -cqe->res, "sendmsg");
+}
+
+/* Handle all completions there are, return their count. */
+static int ur_reap(ping_func_set_st *fset, socket_st *sock)
+{
+	unsigned head = *ur->cq_head;
+	unsigned tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+	int not_ours = 0;
+	int n = 0;
+
+	for (; head != tail; head++, n++) {
+		struct io_uring_cqe *cqe = &ur->cqes[head & *ur->cq_mask];
+
+		switch (cqe->user_data & 0xff) {
+		case UR_RECV:
+			not_ours |= ur_recv(fset, sock, cqe);
+			break;
+		case UR_ERRQ:
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				ur->errq_armed = 0;
+			if (cqe->res > 0)
+				while (fset->receive_error_msg(sock))
+					;
+			break;
+		case UR_SEND:
+			ur_sent(cqe);
+			break;
+		}
+	}
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+	/* See? ... someone runs another ping on this host. */
+	if (not_ours && sock->socktype == SOCK_RAW)
+		fset->install_filter(sock);
+	return n;
+}
+
+/* main_loop() on the ring; returns only if there is no ring to be had. */
+static void uring_loop(ping_func_set_st *fset, socket_st *sock, int packlen)
+{
+	if (ur_setup(sock, packlen) < 0)
+		return;
+
+	for (;;) {
+		struct io_uring_getevents_arg arg;
+		struct __kernel_timespec ts;
+		long long next, t;
+		int n;
+
+		if (shard)
+			shard_publish();
+		if (exiting)
+			break;
+		if (npackets && nreceived + nerrors >= npackets * (ntargets ? ntargets : 1))
+			break;
+		if (deadline && nerrors)
+			break;
+		if (status_snapshot)
+			status();
+
+		do {
+			next = pinger(fset, sock);
+			next = schedule_exit(next);
+		} while (next <= 0);
+		json_flush();
+
+		if (!ur->rx_armed)
+			ur_arm_recv(sock);
+		if (!ur->errq_armed)
+			ur_arm_errq(sock);
+
+		/* Submit the probes, then wait for completions or "next". */
+		ts.tv_sec = next / 1000000000;
+		ts.tv_nsec = next % 1000000000;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (unsigned long)&ts;
+		t = INSTR_START();
+		n = ur_enter(&arg);
+		INSTR_STOP(POLL, t);
+		if (n < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+			error(2, errno, "io_uring_enter");
+		if (ur_reap(fset, sock) > 0)
+			INSTR_COUNT(WAKEUP);
+	}
+	finish();
+}
+#endif /* HAVE_IO_URING */
+
+void main_loop(ping_func_set_st *fset, socket_st *sock, uint8_t *packet, int packlen)
+{
+	long long next;
+	int polling;
+	int recv_error;
+	int tfd = -1;
+
+	if (nshards > 1)
+		shard_go();
+#ifdef HAVE_IO_URING
+	uring_loop(fset, sock, packlen);
+#endif
+	rx_init(packet, packlen);
+#ifdef HAVE_TIMERFD
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+#endif
+
+	for (;;) {
+		struct pollfd pset[2];
+		int timeout = -1;
+		long long t;
+		int n;
+
+		if (shard)
+			shard_publish();
+		/* Check exit conditions. */
+		if (exiting)
+			break;
+		if (npackets && nreceived + nerrors >= npackets * (ntargets ? ntargets : 1))
+			break;
+		if (deadline && nerrors)
+			break;
+		/* Check for and do special actions. */
+		if (status_snapshot)
+			status();
+
+		/* Send probes scheduled to this time. */
+		do {
+			next = pinger(fset, sock);
+			next = schedule_exit(next);
+		} while (next <= 0);
+		json_flush();
+
+		/* "next" is the time in ns until the next probe is due. Sleep
+		 * in poll() until then or until a reply comes. The timerfd
+		 * wakes us with the precision of the hrtimers, where poll()'s
+		 * own timeout is in whole ms; it is the fallback, rounded up. */
+		pset[0].fd = sock->fd;
+		pset[0].events = POLLIN;
+		pset[0].revents = 0;
+		pset[1].fd = tfd;
+		pset[1].events = POLLIN;
+		pset[1].revents = 0;
+#ifdef HAVE_TIMERFD
+		if (tfd >= 0) {
+			struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+			its.it_value.tv_sec = next / 1000000000;
+			its.it_value.tv_nsec = next % 1000000000;
+			if (timerfd_settime(tfd, 0, &its, NULL) < 0)
+				error(2, errno, "timerfd_settime");
+		} else
+#endif
+		if (next / NSEC_PER_MSEC < INT_MAX)
+			timeout = (next + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+		t = INSTR_START();
+		n = poll(pset, 2, timeout);
+		INSTR_STOP(POLL, t);
+		if (n > 0)
+			INSTR_COUNT(WAKEUP);
+		if (n < 1 || !(pset[0].revents&(POLLIN|POLLERR)))
+			continue;
+		polling = MSG_DONTWAIT;
+		recv_error = pset[0].revents&POLLERR;
 
 		for (;;) {
-			struct timeval *recv_timep = NULL;
-			struct timeval recv_time;
 			int not_ours = 0; /* Raw socket can receive messages
 					   * destined to other running pings. */
+			int i;
 
-			iov.iov_len = packlen;
-			memset(&msg, 0, sizeof(msg));
-			msg.msg_name = addrbuf;
-			msg.msg_namelen = sizeof(addrbuf);
-			msg.msg_iov = &iov;
-			msg.msg_iovlen = 1;
-			msg.msg_control = ans_data;
-			msg.msg_controllen = sizeof(ans_data);
-
-			cc = recvmsg(sock->fd, &msg, polling);
+			t = INSTR_START();
+			n = rx_receive(sock, polling);
+			INSTR_STOP(RECV, t);
 			polling = MSG_DONTWAIT;
+			if (n < 0)
+				INSTR_ERRNO(errno);
 
-			if (cc < 0) {
+			if (n < 0) {
 				/* If there was a POLLERR and there is no packet
 				 * on the socket, try to read the error queue.
 				 * Otherwise, give up.
@@ -739,6 +2100,9 @@ void main_loop(ping_func_set_st *fset, socket_st *sock, uint8_t *packet, int pac
 					break;
 				recv_error = 0;
 				if (!fset->receive_error_msg(sock)) {
+					/* Only TX stamps were queued. */
+					if (errno == EAGAIN)
+						break;
 					if (errno) {
 						error(0, errno, "recvmsg");
 						break;
@@ -746,26 +2110,8 @@ void main_loop(ping_func_set_st *fset, socket_st *sock, uint8_t *packet, int pac
 					not_ours = 1;
 				}
 			} else {
-
-#ifdef SO_TIMESTAMP
-				for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
-					if (c->cmsg_level != SOL_SOCKET ||
-					    c->cmsg_type != SO_TIMESTAMP)
-						continue;
-					if (c->cmsg_len < CMSG_LEN(sizeof(struct timeval)))
-						continue;
-					recv_timep = (struct timeval*)CMSG_DATA(c);
-				}
-#endif
-
-				if ((options&F_LATENCY) || recv_timep == NULL) {
-					if ((options&F_LATENCY) ||
-					    ioctl(sock->fd, SIOCGSTAMP, &recv_time))
-						gettimeofday(&recv_time, NULL);
-					recv_timep = &recv_time;
-				}
-
-				not_ours = fset->parse_reply(sock, &msg, cc, addrbuf, recv_timep);
+				for (i = 0; i < n; i++)
+					not_ours |= rx_parse(fset, sock, rx_hdr(i), rx_len(i), i == n - 1);
 			}
 
 			/* See? ... someone runs another ping on this host. */
@@ -785,67 +2131,536 @@ void main_loop(ping_func_set_st *fset, socket_st *sock, uint8_t *packet, int pac
 	finish();
 }
 
-int gather_statistics(uint8_t *icmph, int icmplen,
+/*
+ * RTT histogram, log-linear in the manner of HdrHistogram: values below
+ * HIST_SUB ns get a bucket each, every power of two above is split into
+ * HIST_HALF buckets, so a bucket is never wider than 1/64 of its values.
+ * Fixed size, O(1) to update from gather_statistics().
+ */
+#define HIST_BITS	7
+#define HIST_SUB	(1 << HIST_BITS)
+#define HIST_HALF	(HIST_SUB / 2)
+#define HIST_NBUCKETS	(HIST_SUB + (64 - HIST_BITS) * HIST_HALF)
+
+char *hist_path;		/* -H: where to export the histogram */
+static uint64_t rtt_hist_own[HIST_NBUCKETS];
+static uint64_t *rtt_hist = rtt_hist_own;	/* in shared memory with -P */
+static uint64_t rtt_hist_count;
+
+static const double hist_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char *hist_qnames[] = { "p50", "p90", "p99", "p99.9" };
+
+static inline int hist_index(uint64_t v)
+{
+	int shift;
+
+	if (v < HIST_SUB)
+		return v;
+	shift = 64 - __builtin_clzll(v) - HIST_BITS;
+	return HIST_SUB + (shift - 1) * HIST_HALF + (v >> shift) - HIST_HALF;
+}
+
+/* Lowest value of bucket "i", "*width" gets the number of values in it. */
+static uint64_t hist_low(int i, uint64_t *width)
+{
+	int shift;
+
+	if (i < HIST_SUB) {
+		*width = 1;
+		return i;
+	}
+	i -= HIST_SUB;
+	shift = i / HIST_HALF + 1;
+	*width = (uint64_t)1 << shift;
+	return (uint64_t)(i % HIST_HALF + HIST_HALF) << shift;
+}
+
+static inline void hist_add(long long ns)
+{
+	rtt_hist[hist_index(ns)]++;
+	rtt_hist_count++;
+}
+
+static long long hist_quantile(double q)
+{
+	uint64_t rank = ceil(q * rtt_hist_count);
+	uint64_t seen = 0;
+	int i;
+
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < HIST_NBUCKETS; i++) {
+		seen += rtt_hist[i];
+		if (seen >= rank) {
+			uint64_t width, v;
+
+			/* The middle of the bucket, but never outside what
+			 * was actually seen. */
+			v = hist_low(i, &width) + width / 2;
+			if ((long long)v < tmin)
+				return tmin;
+			if ((long long)v > tmax)
+				return tmax;
+			return v;
+		}
+	}
+	return tmax;
+}
+
+/* "p50/p90/p99/p99.9 = a/b/c/d ms" */
+static void hist_print(FILE *f)
+{
+	size_t i;
+
+	fprintf(f, "p50/p90/p99/p99.9 = ");
+	for (i = 0; i < ARRAY_SIZE(hist_quantiles); i++) {
+		long long v = hist_quantile(hist_quantiles[i]);
+
+		if (tstamping)
+			fprintf(f, "%s%lld.%06lld", i ? "/" : "", v/1000000, v%1000000);
+		else
+			fprintf(f, "%s%lld.%03lld", i ? "/" : "", v/1000000, v/1000%1000);
+	}
+	fprintf(f, " ms");
+}
+
+/*
+ * Write the histogram to the -H file: a few "key value" summary lines,
+ * then "bucket <lowest> <highest> <count>" for every bucket in use. All
+ * values are in nanoseconds. The file is rewritten on every call.
+ */
+static void hist_export(void)
+{
+	FILE *f;
+	size_t i;
+	int b;
+
+	if (!hist_path)
+		return;
+	f = fopen(hist_path, "w");
+	if (!f) {
+		error(0, errno, _("cannot write histogram to %s"), hist_path);
+		return;
+	}
+	fprintf(f, "# ping RTT histogram for %s, values in ns\n",
+		ntargets ? targets_path : hostname);
+	fprintf(f, "count %llu\n", (unsigned long long)rtt_hist_count);
+	if (rtt_hist_count) {
+		fprintf(f, "min %lld\n", tmin);
+		fprintf(f, "mean %.0f\n", tsum / rtt_hist_count);
+		fprintf(f, "max %lld\n", tmax);
+		for (i = 0; i < ARRAY_SIZE(hist_quantiles); i++)
+			fprintf(f, "%s %lld\n", hist_qnames[i],
+				hist_quantile(hist_quantiles[i]));
+	}
+	for (b = 0; b < HIST_NBUCKETS; b++) {
+		uint64_t low, width;
+
+		if (!rtt_hist[b])
+			continue;
+		low = hist_low(b, &width);
+		fprintf(f, "bucket %llu %llu %llu\n", (unsigned long long)low,
+			(unsigned long long)(low + width - 1),
+			(unsigned long long)rtt_hist[b]);
+	}
+	if (fclose(f))
+		error(0, errno, _("cannot write histogram to %s"), hist_path);
+}
+
+/*
+ * Shards (-P). Each one owns a slot in a shared mapping: its histogram
+ * lives there, and its counters are published to it from the main loop
+ * under a sequence count, so the parent merges them into its own at
+ * status() and finish() without stopping anyone.
+ */
+int nshards = 1;
+int shard;
+
+struct shard_stats {
+	long npackets, ntransmitted, nreceived, nrepeats, nchecksum, nerrors;
+	long long tmin, tmax;
+	double tsum, tsum2;
+	int rtt, pipesize;
+	long bursts, burst_max, reordered, reorder_max, late;
+	struct timeval cur_time;
+	uint64_t hist_count;
+};
+
+struct ping_shard {
+	pid_t pid;
+	unsigned seq;			/* odd while "st" is being written */
+	struct shard_stats st;
+	uint64_t hist[HIST_NBUCKETS];
+#ifdef ENABLE_INSTRUMENT
+	struct instr_event instr[INSTR_NEVENTS];
+#endif
+};
+
+static struct ping_shard *shards;
+static uint64_t shard_hist[HIST_NBUCKETS];
+static int shard_gate[2] = { -1, -1 };	/* children start when it closes */
+#ifdef ENABLE_INSTRUMENT
+static struct instr_event shard_instr[INSTR_NEVENTS];	/* ours, while merged */
+#endif
+
+static void shard_save(struct shard_stats *st)
+{
+	st->npackets = npackets;
+	st->ntransmitted = ntransmitted;
+	st->nreceived = nreceived;
+	st->nrepeats = nrepeats;
+	st->nchecksum = nchecksum;
+	st->nerrors = nerrors;
+	st->tmin = tmin;
+	st->tmax = tmax;
+	st->tsum = tsum;
+	st->tsum2 = tsum2;
+	st->rtt = rtt;
+	st->pipesize = pipesize;
+	st->bursts = rcvd_tbl.bursts;
+	st->burst_max = rcvd_tbl.burst_max;
+	st->reordered = rcvd_tbl.reordered;
+	st->reorder_max = rcvd_tbl.reorder_max;
+	st->late = rcvd_tbl.late;
+	st->cur_time = cur_time;
+	st->hist_count = rtt_hist_count;
+}
+
+static void shard_load(const struct shard_stats *st)
+{
+	npackets = st->npackets;
+	ntransmitted = st->ntransmitted;
+	nreceived = st->nreceived;
+	nrepeats = st->nrepeats;
+	nchecksum = st->nchecksum;
+	nerrors = st->nerrors;
+	tmin = st->tmin;
+	tmax = st->tmax;
+	tsum = st->tsum;
+	tsum2 = st->tsum2;
+	rtt = st->rtt;
+	pipesize = st->pipesize;
+	rcvd_tbl.bursts = st->bursts;
+	rcvd_tbl.burst_max = st->burst_max;
+	rcvd_tbl.reordered = st->reordered;
+	rcvd_tbl.reorder_max = st->reorder_max;
+	rcvd_tbl.late = st->late;
+	cur_time = st->cur_time;
+	rtt_hist_count = st->hist_count;
+}
+
+static void shard_add(struct shard_stats *tot, const struct shard_stats *st)
+{
+	/* The ewma of all is that of the shards, by their replies. */
+	if (tot->nreceived + st->nreceived)
+		tot->rtt = ((long long)tot->rtt * tot->nreceived + (long long)st->rtt * st->nreceived) /
+			   (tot->nreceived + st->nreceived);
+	tot->npackets += st->npackets;
+	tot->ntransmitted += st->ntransmitted;
+	tot->nreceived += st->nreceived;
+	tot->nrepeats += st->nrepeats;
+	tot->nchecksum += st->nchecksum;
+	tot->nerrors += st->nerrors;
+	if (st->tmin < tot->tmin)
+		tot->tmin = st->tmin;
+	if (st->tmax > tot->tmax)
+		tot->tmax = st->tmax;
+	tot->tsum += st->tsum;
+	tot->tsum2 += st->tsum2;
+	if (st->pipesize > tot->pipesize)
+		tot->pipesize = st->pipesize;
+	tot->bursts += st->bursts;
+	if (st->burst_max > tot->burst_max)
+		tot->burst_max = st->burst_max;
+	tot->reordered += st->reordered;
+	if (st->reorder_max > tot->reorder_max)
+		tot->reorder_max = st->reorder_max;
+	tot->late += st->late;
+	if (timercmp(&st->cur_time, &tot->cur_time, >))
+		tot->cur_time = st->cur_time;
+	tot->hist_count += st->hist_count;
+}
+
+void shard_publish(void)
+{
+	struct ping_shard *p = &shards[shard];
+
+	__atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	shard_save(&p->st);
+#ifdef ENABLE_INSTRUMENT
+	memcpy(p->instr, instr_tab, sizeof(p->instr));
+#endif
+	__atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* A consistent copy of shard i's counters, unless it died writing them. */
+static void shard_read(int i, struct shard_stats *st)
+{
+	struct ping_shard *p = &shards[i];
+	int tries;
+
+	for (tries = 0; tries < 1000; tries++) {
+		unsigned seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+
+		if (seq & 1)
+			continue;
+		memcpy(st, &p->st, sizeof(*st));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&p->seq, __ATOMIC_RELAXED) == seq)
+			return;
+	}
+	memcpy(st, &p->st, sizeof(*st));
+}
+
+/* Put the totals of all shards in the globals; "own" gets ours. */
+static void shard_merge(struct shard_stats *own)
+{
+	struct shard_stats tot, st;
+	int i, b;
+
+	shard_save(own);
+	tot = *own;
+	memcpy(shard_hist, shards[0].hist, sizeof(shard_hist));
+#ifdef ENABLE_INSTRUMENT
+	memcpy(shard_instr, instr_tab, sizeof(shard_instr));
+#endif
+	for (i = 1; i < nshards; i++) {
+		shard_read(i, &st);
+		shard_add(&tot, &st);
+		for (b = 0; b < HIST_NBUCKETS; b++)
+			shard_hist[b] += __atomic_load_n(&shards[i].hist[b], __ATOMIC_RELAXED);
+#ifdef ENABLE_INSTRUMENT
+		for (b = 0; b < INSTR_NEVENTS; b++) {
+			instr_tab[b].count += __atomic_load_n(&shards[i].instr[b].count, __ATOMIC_RELAXED);
+			instr_tab[b].ns += __atomic_load_n(&shards[i].instr[b].ns, __ATOMIC_RELAXED);
+		}
+#endif
+	}
+	shard_load(&tot);
+	rtt_hist = shard_hist;
+}
+
+static void shard_unmerge(const struct shard_stats *own)
+{
+	shard_load(own);
+	rtt_hist = shards[0].hist;
+#ifdef ENABLE_INSTRUMENT
+	memcpy(instr_tab, shard_instr, sizeof(shard_instr));
+#endif
+}
+
+/* This shard is done: the parent waits for all the others, a child
+ * leaves the figures to the parent and goes. */
+static void shard_finish(void)
+{
+	struct shard_stats own;
+	int i;
+
+	rcvd_flush(&rcvd_tbl);
+	if (shard) {
+		shard_publish();
+		exit(0);
+	}
+	/* Each shard stops on its own count or deadline, or on ^C passed on. */
+	for (i = 1; i < nshards; i++) {
+		if (interrupted)
+			kill(shards[i].pid, SIGINT);
+		while (waitpid(shards[i].pid, NULL, 0) < 0 && errno == EINTR)
+			;
+	}
+	shard_merge(&own);
+}
+
+/* Pin the calling shard to the i-th of the CPUs it may run on. */
+static void shard_pin(int i)
+{
+	cpu_set_t set;
+	int cpu, n;
+
+	if (sched_getaffinity(0, sizeof(set), &set) < 0 || !(n = CPU_COUNT(&set)))
+		return;
+	i %= n;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &set) || i--)
+			continue;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		sched_setaffinity(0, sizeof(set), &set);
+		return;
+	}
+}
+
+/*
+ * Fork the shards. socks4[i] and socks6[i] are the sockets of shard i;
+ * on return [0] holds those of the calling one and the rest are closed.
+ * The probes of -c are dealt out among the shards.
+ */
+void shard_start(socket_st *socks4, socket_st *socks6)
+{
+	int i, me = 0;
+
+	shards = mmap(NULL, nshards * sizeof(*shards), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shards == MAP_FAILED)
+		error(2, errno, "mmap");
+	if (pipe(shard_gate) < 0)
+		error(2, errno, "pipe");
+	fflush(stdout);
+	for (i = 1; i < nshards; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			error(2, errno, "fork");
+		if (pid == 0) {
+			me = i;
+			close(shard_gate[1]);
+			shard_gate[1] = -1;
+			break;
+		}
+		shards[i].pid = pid;
+	}
+
+	for (i = 0; i < nshards; i++) {
+		if (i == me)
+			continue;
+		if (socks4[i].fd != -1)
+			close(socks4[i].fd);
+		if (socks6[i].fd != -1)
+			close(socks6[i].fd);
+	}
+	socks4[0] = socks4[me];
+	socks6[0] = socks6[me];
+
+	shard = me;
+	rtt_hist = shards[me].hist;
+	if (npackets)
+		npackets = npackets / nshards + (me < npackets % nshards);
+	shard_pin(me);
+}
+
+/*
+ * The children hold off until the parent has printed the PING line
+ * and is about to start, which it tells them by closing the gate.
+ */
+void shard_go(void)
+{
+	char c;
+
+	if (shard_gate[1] != -1)
+		close(shard_gate[1]);
+	while (shard && read(shard_gate[0], &c, 1) < 0 && errno == EINTR)
+		;
+	close(shard_gate[0]);
+}
+
+int gather_statistics(struct ping_target *target, uint8_t *icmph, int icmplen,
 		      int cc, uint16_t seq, int hops,
-		      int csfailed, struct timeval *tv, char *from,
+		      int csfailed, struct timespec *ts, char *from,
 		      void (*pr_reply)(uint8_t *icmph, int cc))
 {
 	int dupflag = 0;
-	long triptime = 0;
+	int reply = RCVD_NEW;
+	long long triptime = 0;		/* ns */
+	int have_rtt = 0;
+	struct timespec rx = *ts;
 	uint8_t *ptr = icmph + icmplen;
+	long long t;
 
 	++nreceived;
+	if (target)
+		++target->nreceived;
 	if (!csfailed)
 		acknowledge(seq);
 
-	if (timing && cc >= (int) (8+sizeof(struct timeval))) {
-		struct timeval tmp_tv;
-		memcpy(&tmp_tv, ptr, sizeof(tmp_tv));
+	if (timing && cc >= (int) (8+sizeof(struct timespec))) {
+		struct timespec sent;
+		memcpy(&sent, ptr, sizeof(sent));
 
+		have_rtt = 1;
+		if (tstamping)
+			tstamp_rtt(target, seq, &sent, ts);
 restamp:
-		tvsub(tv, &tmp_tv);
-		triptime = tv->tv_sec * 1000000 + tv->tv_usec;
+		triptime = tsdiff(ts, &sent);
 		if (triptime < 0) {
-			error(0, 0, _("Warning: time of day goes back (%ldus), taking countermeasures"), triptime);
+			error(0, 0, _("Warning: time of day goes back (%ldus), taking countermeasures"), (long)(triptime / 1000));
 			triptime = 0;
 			if (!(options & F_LATENCY)) {
-				gettimeofday(tv, NULL);
+				clock_gettime(CLOCK_REALTIME, ts);
 				options |= F_LATENCY;
 				goto restamp;
 			}
 		}
 		if (!csfailed) {
+			hist_add(triptime);
 			tsum += triptime;
-			tsum2 += (long long)triptime * (long long)triptime;
+			tsum2 += (double)triptime * triptime;
 			if (triptime < tmin)
 				tmin = triptime;
 			if (triptime > tmax)
 				tmax = triptime;
+			/* The smoothed rtt stays in microseconds. */
 			if (!rtt)
-				rtt = triptime*8;
+				rtt = triptime/1000*8;
 			else
-				rtt += triptime-rtt/8;
+				rtt += triptime/1000-rtt/8;
 			if (options&F_ADAPTIVE)
 				update_interval();
+			if (target) {
+				target->tsum += triptime;
+				target->tsum2 += (double)triptime * triptime;
+				if (triptime < target->tmin)
+					target->tmin = triptime;
+				if (triptime > target->tmax)
+					target->tmax = triptime;
+			}
 		}
 	}
 
 	if (csfailed) {
 		++nchecksum;
 		--nreceived;
-	} else if (rcvd_test(seq)) {
+		if (target) {
+			++target->nchecksum;
+			--target->nreceived;
+		}
+	} else if ((reply = rcvd_reply(target ? &target->rcvd : &rcvd_tbl, seq)) == RCVD_DUP) {
 		++nrepeats;
 		--nreceived;
+		if (target) {
+			++target->nrepeats;
+			--target->nreceived;
+		}
 		dupflag = 1;
-	} else {
-		rcvd_set(seq);
-		dupflag = 0;
 	}
 	confirm = confirm_flag;
 
 	if (options & F_QUIET)
 		return 1;
 
+	t = INSTR_START();
+	if (options & F_JSON) {
+		json_begin("reply", &rx);
+		json_str("from", from);
+		json_int("seq", seq);
+		json_int("bytes", cc);
+		if (hops >= 0)
+			json_int("ttl", hops);
+		if (have_rtt)
+			json_int("rtt_ns", triptime);
+		if (dupflag)
+			json_bool("dup", 1);
+		if (reply == RCVD_LATE)
+			json_bool("late", 1);
+		if (csfailed)
+			json_bool("bad_checksum", 1);
+		if (cc < datalen+8)
+			json_bool("truncated", 1);
+		json_end();
+		INSTR_STOP(FORMAT, t);
+		return 1;
+	}
+
 	if (options & F_FLOOD) {
 		if (!csfailed)
 			write_stdout("\b \b", 3);
@@ -866,20 +2681,26 @@ restamp:
 
 		if (cc < datalen+8) {
 			printf(_(" (truncated)\n"));
+			INSTR_STOP(FORMAT, t);
 			return 1;
 		}
-		if (timing) {
-			if (triptime >= 100000)
-				printf(_(" time=%ld ms"), (triptime+500)/1000);
-			else if (triptime >= 10000)
-				printf(_(" time=%ld.%01ld ms"), (triptime+50)/1000,
-				       ((triptime+50)%1000)/100);
-			else if (triptime >= 1000)
-				printf(_(" time=%ld.%02ld ms"), (triptime+5)/1000,
-				       ((triptime+5)%1000)/10);
+		if (timing && tstamping) {
+			printf(_(" time=%lld.%06lld ms"), triptime/1000000,
+			       triptime%1000000);
+		} else if (timing) {
+			long us = triptime/1000;
+
+			if (us >= 100000)
+				printf(_(" time=%ld ms"), (us+500)/1000);
+			else if (us >= 10000)
+				printf(_(" time=%ld.%01ld ms"), (us+50)/1000,
+				       ((us+50)%1000)/100);
+			else if (us >= 1000)
+				printf(_(" time=%ld.%02ld ms"), (us+5)/1000,
+				       ((us+5)%1000)/10);
 			else
-				printf(_(" time=%ld.%03ld ms"), triptime/1000,
-				       triptime%1000);
+				printf(_(" time=%ld.%03ld ms"), us/1000,
+				       us%1000);
 		}
 		if (dupflag)
 			printf(_(" (DUP!)"));
@@ -887,15 +2708,15 @@ restamp:
 			printf(_(" (BAD CHECKSUM!)"));
 
 		/* check the data */
-		cp = ((unsigned char*)ptr) + sizeof(struct timeval);
-		dp = &outpack[8 + sizeof(struct timeval)];
-		for (i = sizeof(struct timeval); i < datalen; ++i, ++cp, ++dp) {
+		cp = ((unsigned char*)ptr) + sizeof(struct timespec);
+		dp = &outpack[8 + sizeof(struct timespec)];
+		for (i = sizeof(struct timespec); i < datalen; ++i, ++cp, ++dp) {
 			if (*cp != *dp) {
 				printf(_("\nwrong data byte #%d should be 0x%x but was 0x%x"),
 				       i, *dp, *cp);
-				cp = (unsigned char*)ptr + sizeof(struct timeval);
-				for (i = sizeof(struct timeval); i < datalen; ++i, ++cp) {
-					if ((i % 32) == sizeof(struct timeval))
+				cp = (unsigned char*)ptr + sizeof(struct timespec);
+				for (i = sizeof(struct timespec); i < datalen; ++i, ++cp) {
+					if ((i % 32) == sizeof(struct timespec))
 						printf("\n#%d\t", i);
 					printf("%x ", *cp);
 				}
@@ -903,10 +2724,11 @@ restamp:
 			}
 		}
 	}
+	INSTR_STOP(FORMAT, t);
 	return 0;
 }
 
-static long llsqrt(long long a)
+static long long llsqrt(long long a)
 {
 	long long prev = LLONG_MAX;
 	long long x = a;
@@ -918,7 +2740,192 @@ static long llsqrt(long long a)
 		}
 	}
 
-	return (long)x;
+	return x;
+}
+
+/* Reordering, late replies and loss bursts, summed over the targets of -G. */
+static void rcvd_totals(struct rcvd_table *sum)
+{
+	int i;
+
+	if (!ntargets) {
+		*sum = rcvd_tbl;
+		return;
+	}
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i < ntargets; i++) {
+		struct rcvd_table *r = &targets[i].rcvd;
+
+		sum->reordered += r->reordered;
+		sum->late += r->late;
+		sum->bursts += r->bursts;
+		if (r->reorder_max > sum->reorder_max)
+			sum->reorder_max = r->reorder_max;
+		if (r->burst_max > sum->burst_max)
+			sum->burst_max = r->burst_max;
+	}
+}
+
+static void json_rcvd(const struct rcvd_table *r)
+{
+	if (r->reordered) {
+		json_int("reordered", r->reordered);
+		json_int("reorder_max", r->reorder_max);
+	}
+	if (r->late)
+		json_int("late", r->late);
+	if (r->bursts) {
+		json_int("loss_bursts", r->bursts);
+		json_int("loss_burst_max", r->burst_max);
+	}
+}
+
+/*
+ * finish_targets --
+ *	Print one summary line per target of a multi-target run.
+ */
+static void finish_targets(void)
+{
+	int i;
+
+	for (i = 0; i < ntargets; i++) {
+		struct ping_target *t = &targets[i];
+
+		printf(_("%s: %ld/%ld received"), t->name, t->nreceived, ntransmitted);
+		if (t->nrepeats)
+			printf(_(", +%ld duplicates"), t->nrepeats);
+		if (t->nchecksum)
+			printf(_(", +%ld corrupted"), t->nchecksum);
+		if (t->nerrors)
+			printf(_(", +%ld errors"), t->nerrors);
+		if (ntransmitted)
+			printf(_(", %g%% packet loss"),
+			       (float) ((((long long)(ntransmitted - t->nreceived)) * 100.0) /
+				      ntransmitted));
+		if (t->rcvd.bursts)
+			printf(_(", %ld loss bursts (max %ld)"), t->rcvd.bursts, t->rcvd.burst_max);
+		if (t->rcvd.reordered)
+			printf(_(", %ld reordered"), t->rcvd.reordered);
+		if (t->rcvd.late)
+			printf(_(", %ld late"), t->rcvd.late);
+		if (t->nreceived && timing) {
+			long tmin_us = t->tmin / 1000;
+			long tavg = t->tsum / (t->nreceived + t->nrepeats) / 1000;
+			long tmax_us = t->tmax / 1000;
+
+			printf(_(", rtt min/avg/max = %ld.%03ld/%ld.%03ld/%ld.%03ld ms"),
+			       tmin_us/1000, tmin_us%1000,
+			       tavg/1000, tavg%1000,
+			       tmax_us/1000, tmax_us%1000);
+		}
+		putchar('\n');
+	}
+}
+
+/*
+ * Totals as a JSON record; "elapsed" in ms, negative to leave it out.
+ * With "per_target" a "target" record follows for each target of -G.
+ */
+static void json_summary(const char *type, long elapsed, int per_target)
+{
+	static const char *qkeys[] = {
+		"rtt_p50_ns", "rtt_p90_ns", "rtt_p99_ns", "rtt_p999_ns"
+	};
+	struct rcvd_table tot;
+	size_t i;
+
+	rcvd_totals(&tot);
+	json_begin(type, NULL);
+	json_str("host", ntargets ? targets_path : hostname);
+	json_int("transmitted", nprobes());
+	json_int("received", nreceived);
+	if (nrepeats)
+		json_int("duplicates", nrepeats);
+	if (nchecksum)
+		json_int("corrupted", nchecksum);
+	if (nerrors)
+		json_int("errors", nerrors);
+	if (elapsed >= 0)
+		json_int("time_ms", elapsed);
+	if (nreceived && timing) {
+		double avg = tsum / (nreceived + nrepeats);
+		double var = tsum2 / (nreceived + nrepeats) - avg * avg;
+
+		json_int("rtt_min_ns", tmin);
+		json_int("rtt_avg_ns", avg);
+		json_int("rtt_max_ns", tmax);
+		json_int("rtt_mdev_ns", var > 0 ? sqrt(var) : 0);
+		json_int("rtt_ewma_ns", rtt / 8 * 1000LL);
+		for (i = 0; i < ARRAY_SIZE(qkeys); i++)
+			json_int(qkeys[i], hist_quantile(hist_quantiles[i]));
+	}
+	json_rcvd(&tot);
+	if (pipesize > 1)
+		json_int("pipe", pipesize);
+	json_end();
+
+	for (i = 0; per_target && i < (size_t)ntargets; i++) {
+		struct ping_target *t = &targets[i];
+
+		json_begin("target", NULL);
+		json_str("host", t->name);
+		json_int("transmitted", ntransmitted);
+		json_int("received", t->nreceived);
+		if (t->nrepeats)
+			json_int("duplicates", t->nrepeats);
+		if (t->nchecksum)
+			json_int("corrupted", t->nchecksum);
+		if (t->nerrors)
+			json_int("errors", t->nerrors);
+		if (t->nreceived && timing) {
+			json_int("rtt_min_ns", t->tmin);
+			json_int("rtt_avg_ns", t->tsum / (t->nreceived + t->nrepeats));
+			json_int("rtt_max_ns", t->tmax);
+		}
+		json_rcvd(&t->rcvd);
+		json_end();
+	}
+}
+
+#ifdef ENABLE_INSTRUMENT
+/* Hot path counters as a line on "f", or with -j as an "instr" record. */
+static void instr_print(FILE *f)
+{
+	char line[512];
+	int i;
+
+	if (!(options & F_JSON)) {
+		instr_format(line, sizeof(line));
+		fprintf(f, "instr %s\n", line);
+		return;
+	}
+	json_begin("instr", NULL);
+	for (i = 0; i < INSTR_NEVENTS; i++) {
+		json_int(instr_name(i), instr_tab[i].count);
+		if (i < INSTR_WAKEUP) {
+			snprintf(line, sizeof(line), "%s_ns", instr_name(i));
+			json_int(line, instr_tab[i].ns);
+		}
+	}
+	json_end();
+}
+#else
+# define instr_print(f)	((void)0)
+#endif
+
+/* Exit status of a finished run. */
+static void finish_exit(void) __attribute__((noreturn));
+static void finish_exit(void)
+{
+	if (ntargets) {
+		int i;
+
+		for (i = 0; i < ntargets; i++)
+			if (!targets[i].nreceived)
+				exit(1);
+		exit(0);
+	}
+	exit(!nreceived || (deadline && nreceived < npackets));
 }
 
 /*
@@ -927,15 +2934,35 @@ static long llsqrt(long long a)
  */
 void finish(void)
 {
-	struct timeval tv = cur_time;
+	struct timeval tv;
+	struct rcvd_table tot;
 	char *comma = "";
+	int i;
 
+	if (nshards > 1)
+		shard_finish();
+	tv = cur_time;
 	tvsub(&tv, &start_time);
+	hist_export();
+	rcvd_flush(&rcvd_tbl);
+	for (i = 0; i < ntargets; i++)
+		rcvd_flush(&targets[i].rcvd);
+
+	if (options & F_JSON) {
+		json_summary("summary", 1000*tv.tv_sec+(tv.tv_usec+500)/1000, 1);
+		instr_print(stdout);
+		json_flush();
+		finish_exit();
+	}
 
 	putchar('\n');
 	fflush(stdout);
-	printf(_("--- %s ping statistics ---\n"), hostname);
-	printf(_("%ld packets transmitted, "), ntransmitted);
+	if (ntargets) {
+		printf(_("--- %s per-target statistics ---\n"), targets_path);
+		finish_targets();
+	}
+	printf(_("--- %s ping statistics ---\n"), ntargets ? targets_path : hostname);
+	printf(_("%ld packets transmitted, "), nprobes());
 	printf(_("%ld received"), nreceived);
 	if (nrepeats)
 		printf(_(", +%ld duplicates"), nrepeats);
@@ -948,65 +2975,117 @@ void finish(void)
 	setlocale(LC_ALL, "C");
 #endif
 		printf(_(", %g%% packet loss"),
-		       (float) ((((long long)(ntransmitted - nreceived)) * 100.0) /
-			      ntransmitted));
+		       (float) ((((long long)(nprobes() - nreceived)) * 100.0) /
+			      nprobes()));
 		printf(_(", time %ldms"), 1000*tv.tv_sec+(tv.tv_usec+500)/1000);
 	}
 	putchar('\n');
 
 	if (nreceived && timing) {
-		double tmdev;
+		long long tavg, tmdev;
 
 		tsum /= nreceived + nrepeats;
 		tsum2 /= nreceived + nrepeats;
+		tavg = tsum;
 		tmdev = llsqrt(tsum2 - tsum * tsum);
 
-		printf(_("rtt min/avg/max/mdev = %ld.%03ld/%lu.%03ld/%ld.%03ld/%ld.%03ld ms"),
-		       (long)tmin/1000, (long)tmin%1000,
-		       (unsigned long)(tsum/1000), (long)tsum%1000,
-		       (long)tmax/1000, (long)tmax%1000,
-		       (long)tmdev/1000, (long)tmdev%1000
-		       );
+		if (tstamping) {
+			printf(_("rtt min/avg/max/mdev = %lld.%06lld/%lld.%06lld/%lld.%06lld/%lld.%06lld ms"),
+			       tmin/1000000, tmin%1000000,
+			       tavg/1000000, tavg%1000000,
+			       tmax/1000000, tmax%1000000,
+			       tmdev/1000000, tmdev%1000000
+			       );
+		} else {
+			tavg /= 1000;
+			tmdev /= 1000;
+			printf(_("rtt min/avg/max/mdev = %ld.%03ld/%lu.%03ld/%ld.%03ld/%ld.%03ld ms"),
+			       (long)(tmin/1000000), (long)(tmin/1000%1000),
+			       (unsigned long)(tavg/1000), (long)(tavg%1000),
+			       (long)(tmax/1000000), (long)(tmax/1000%1000),
+			       (long)(tmdev/1000), (long)(tmdev%1000)
+			       );
+		}
 		comma = ", ";
 	}
 	if (pipesize > 1) {
 		printf(_("%spipe %d"), comma, pipesize);
 		comma = ", ";
 	}
-	if (nreceived && (!interval || (options&(F_FLOOD|F_ADAPTIVE))) && ntransmitted > 1) {
+	if (nreceived && (!interval_ns || (options&(F_FLOOD|F_ADAPTIVE))) && ntransmitted > 1) {
 		int ipg = (1000000*(long long)tv.tv_sec+tv.tv_usec)/(ntransmitted-1);
 		printf(_("%sipg/ewma %d.%03d/%d.%03d ms"),
 		       comma, ipg/1000, ipg%1000, rtt/8000, (rtt/8)%1000);
 	}
 	putchar('\n');
-	exit(!nreceived || (deadline && nreceived < npackets));
+	rcvd_totals(&tot);
+	if (tot.bursts || tot.reordered || tot.late) {
+		printf(_("%ld loss bursts (max %ld), %ld reordered (max depth %ld), %ld late\n"),
+		       tot.bursts, tot.burst_max, tot.reordered, tot.reorder_max, tot.late);
+	}
+	if (rtt_hist_count) {
+		printf("rtt ");
+		hist_print(stdout);
+		putchar('\n');
+	}
+	instr_print(stdout);
+	finish_exit();
 }
 
 
-void status(void)
+static void status_print(void)
 {
 	int loss = 0;
 	long tavg = 0;
 
-	status_snapshot = 0;
+	if (options & F_JSON) {
+		json_summary("status", -1, 0);
+		instr_print(stderr);
+		json_flush();
+		hist_export();
+		return;
+	}
 
 	if (ntransmitted)
-		loss = (((long long)(ntransmitted - nreceived)) * 100) / ntransmitted;
+		loss = (((long long)(nprobes() - nreceived)) * 100) / nprobes();
 
 	fprintf(stderr, "\r");
-	fprintf(stderr, _("%ld/%ld packets, %d%% loss"), nreceived, ntransmitted, loss);
+	fprintf(stderr, _("%ld/%ld packets, %d%% loss"), nreceived, nprobes(), loss);
 
 	if (nreceived && timing) {
-		tavg = tsum / (nreceived + nrepeats);
+		tavg = tsum / (nreceived + nrepeats) / 1000;
 
 		fprintf(stderr, _(", min/avg/ewma/max = %ld.%03ld/%lu.%03ld/%d.%03d/%ld.%03ld ms"),
-		       (long)tmin/1000, (long)tmin%1000,
+		       (long)(tmin/1000000), (long)(tmin/1000%1000),
 		       tavg/1000, tavg%1000,
 		       rtt/8000, (rtt/8)%1000,
-		       (long)tmax/1000, (long)tmax%1000
+		       (long)(tmax/1000000), (long)(tmax/1000%1000)
 		       );
+		if (rtt_hist_count) {
+			fprintf(stderr, ", ");
+			hist_print(stderr);
+		}
 	}
 	fprintf(stderr, "\n");
+	instr_print(stderr);
+	hist_export();
+}
+
+void status(void)
+{
+	struct shard_stats own;
+
+	status_snapshot = 0;
+	if (nshards == 1) {
+		status_print();
+		return;
+	}
+	/* The parent speaks for all shards. */
+	if (shard)
+		return;
+	shard_merge(&own);
+	status_print();
+	shard_unmerge(&own);
 }
 
 inline int is_ours(socket_st *sock, uint16_t id) {
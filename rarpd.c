@@ -16,6 +16,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -27,6 +28,8 @@
 #include <linux/if_arp.h>
 #include <linux/if_packet.h>
 #include <linux/filter.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 
@@ -43,9 +46,18 @@ int listen_arp;
 char *ifname;
 char *tftp_dir = "/etc/tftpboot";
 
+/* <netinet/ether.h> does not mix with the linux headers */
 extern int ether_ntohost(char *name, unsigned char *ea);
+extern int ether_line(const char *line, unsigned char *ea, char *hostname);
 void usage(void) __attribute__((noreturn));
 
+/*
+ * Interfaces and their IPv4 addresses, hashed by ifindex. They are
+ * dumped over rtnetlink by load_if() and then kept current from link
+ * and address notifications on nl_fd.
+ */
+#define IFL_HASH_SIZE	64
+
 struct iflink
 {
 	struct iflink	*next;
@@ -54,7 +66,10 @@ struct iflink
 	unsigned char	lladdr[16];
 	char		name[IFNAMSIZ];
 	struct ifaddr 	*ifa_list;
-} *ifl_list;
+} *ifl_hash[IFL_HASH_SIZE];
+
+int nl_fd = -1;
+int if_reload;		/* notifications were lost */
 
 struct ifaddr
 {
@@ -64,6 +79,17 @@ struct ifaddr
 	uint32_t		local;
 };
 
+/*
+ * /etc/ethers is read into rarp_db at start and on SIGHUP, hashed by
+ * (ifindex, hatype, lladdr); ifindex 0 matches any interface. Host
+ * names are resolved when loaded and the addresses kept with the entry.
+ * Addresses missing from the file are asked of ether_ntohost() once and
+ * the answer, found or not, is remembered until the next reload.
+ */
+#define RARP_HASH_SIZE	4096
+#define RARP_LEARN_MAX	4096
+#define ETHERS_FILE	"/etc/ethers"
+
 struct rarp_map
 {
 	struct rarp_map *next;
@@ -73,7 +99,12 @@ struct rarp_map
 	int		lladdr_len;
 	unsigned char	lladdr[16];
 	uint32_t		ipaddr;
-} *rarp_db;
+
+	char		*host;		/* NULL: known to be unknown */
+	uint32_t	**alist;	/* addresses of host, NULL if unresolved */
+} *rarp_db[RARP_HASH_SIZE];
+
+int rarp_learned;
 
 void usage(void)
 {
@@ -93,134 +124,441 @@ void usage(void)
 	exit(1);
 }
 
+static unsigned int rarp_hash(int ifindex, int hatype, int halen,
+			      const unsigned char *lladdr)
+{
+	unsigned int h = ifindex * 31 + hatype;
+	int i;
+
+	for (i = 0; i < halen; i++)
+		h = h * 33 + lladdr[i];
+	return (h ^ (h >> 12)) & (RARP_HASH_SIZE - 1);
+}
+
+static struct rarp_map *rarp_find(int ifindex, int hatype, int halen,
+				  const unsigned char *lladdr)
+{
+	struct rarp_map *r;
+
+	r = rarp_db[rarp_hash(ifindex, hatype, halen, lladdr)];
+	for (; r; r = r->next) {
+		if (r->ifindex == ifindex && r->arp_type == hatype &&
+		    r->lladdr_len == halen && memcmp(r->lladdr, lladdr, halen) == 0)
+			break;
+	}
+	return r;
+}
+
+static void rarp_free(struct rarp_map *r)
+{
+	free(r->host);
+	free(r->alist);
+	free(r);
+}
+
+/* Entry for an ethernet address on any interface, NULL if out of memory. */
+static struct rarp_map *rarp_add(const unsigned char *lladdr, const char *host)
+{
+	struct rarp_map *r;
+	unsigned int h;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return NULL;
+	r->arp_type = ARPHRD_ETHER;
+	r->lladdr_len = 6;
+	memcpy(r->lladdr, lladdr, 6);
+	if (host && (r->host = strdup(host)) == NULL) {
+		free(r);
+		return NULL;
+	}
+	h = rarp_hash(0, ARPHRD_ETHER, 6, lladdr);
+	r->next = rarp_db[h];
+	rarp_db[h] = r;
+	return r;
+}
+
+/* Resolve r->host into r->alist, unless done already. */
+static int rarp_resolve(struct rarp_map *r)
+{
+	struct hostent *hp = NULL;
+	struct in_addr in;
+	uint32_t *addrs;
+	int i, n;
+
+	if (r->alist)
+		return 0;
+	if (inet_aton(r->host, &in)) {
+		n = 1;
+	} else {
+		hp = gethostbyname(r->host);
+		if (hp == NULL)
+			return -1;
+		if (hp->h_addrtype != AF_INET) {
+			syslog(LOG_ERR, "no IP address for %s", r->host);
+			return -1;
+		}
+		for (n = 0; hp->h_addr_list[n]; n++)
+			;
+	}
+
+	r->alist = malloc((n + 1) * sizeof(*r->alist) + n * sizeof(**r->alist));
+	if (r->alist == NULL)
+		return -1;
+	addrs = (uint32_t *)(r->alist + n + 1);
+	for (i = 0; i < n; i++) {
+		if (hp == NULL)
+			addrs[i] = in.s_addr;
+		else
+			memcpy(&addrs[i], hp->h_addr_list[i], sizeof(addrs[i]));
+		r->alist[i] = &addrs[i];
+	}
+	r->alist[n] = NULL;
+	return 0;
+}
+
 void load_db(void)
 {
+	struct rarp_map *r;
+	unsigned char ea[6];
+	char line[1024], host[1024];
+	FILE *fp;
+	int i, n = 0, unresolved = 0;
+
+	for (i = 0; i < RARP_HASH_SIZE; i++) {
+		while ((r = rarp_db[i]) != NULL) {
+			rarp_db[i] = r->next;
+			rarp_free(r);
+		}
+	}
+	rarp_learned = 0;
+
+	fp = fopen(ETHERS_FILE, "r");
+	if (fp == NULL) {
+		if (verbose)
+			syslog(LOG_INFO, "%s: %s", ETHERS_FILE, strerror(errno));
+		return;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		if (ether_line(line, ea, host))
+			continue;
+		/* the first line for an address wins, as in ether_ntohost() */
+		if (rarp_find(0, ARPHRD_ETHER, 6, ea))
+			continue;
+		r = rarp_add(ea, host);
+		if (r == NULL) {
+			syslog(LOG_ERR, "load_db: %s", strerror(errno));
+			break;
+		}
+		n++;
+		if (rarp_resolve(r))
+			unresolved++;
+	}
+	fclose(fp);
+	if (verbose)
+		syslog(LOG_INFO, "%d entries in %s, %d not resolved yet",
+		       n, ETHERS_FILE, unresolved);
 }
 
-void load_if(void)
+static struct iflink *find_if(int ifindex)
 {
-	int fd;
-	struct ifreq *ifrp, *ifend;
 	struct iflink *ifl;
+
+	for (ifl = ifl_hash[ifindex & (IFL_HASH_SIZE - 1)]; ifl; ifl = ifl->next)
+		if (ifl->index == ifindex)
+			break;
+	return ifl;
+}
+
+static void free_ifaddrs(struct iflink *ifl)
+{
 	struct ifaddr *ifa;
-	struct ifconf ifc;
-	struct ifreq ibuf[256];
 
-	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-		syslog(LOG_ERR, "socket: %s", strerror(errno));
-		return;
+	while ((ifa = ifl->ifa_list) != NULL) {
+		ifl->ifa_list = ifa->next;
+		free(ifa);
 	}
+}
 
-	ifc.ifc_len = sizeof ibuf;
-	ifc.ifc_buf = (char *)ibuf;
-	if (ioctl(fd, SIOCGIFCONF, (char *)&ifc) < 0 ||
-	    ifc.ifc_len < (int)sizeof(struct ifreq)) {
-		syslog(LOG_ERR, "SIOCGIFCONF: %s", strerror(errno));
-		close(fd);
+static void del_if(int ifindex)
+{
+	struct iflink **iflp = &ifl_hash[ifindex & (IFL_HASH_SIZE - 1)];
+	struct iflink *ifl;
+
+	while ((ifl = *iflp) != NULL) {
+		if (ifl->index == ifindex) {
+			*iflp = ifl->next;
+			free_ifaddrs(ifl);
+			free(ifl);
+			return;
+		}
+		iflp = &ifl->next;
+	}
+}
+
+static struct iflink *add_if(int ifindex)
+{
+	struct iflink *ifl = find_if(ifindex);
+
+	if (ifl)
+		return ifl;
+	ifl = (struct iflink*)malloc(sizeof(*ifl));
+	if (ifl == NULL)
+		return NULL;
+	memset(ifl, 0, sizeof(*ifl));
+	ifl->index = ifindex;
+	ifl->next = ifl_hash[ifindex & (IFL_HASH_SIZE - 1)];
+	ifl_hash[ifindex & (IFL_HASH_SIZE - 1)] = ifl;
+	return ifl;
+}
+
+static void log_addr(struct iflink *ifl, struct ifaddr *ifa)
+{
+	int i;
+	uint32_t m = ~0U;
+
+	for (i=32; i>=0; i--) {
+		if (htonl(m) == ifa->mask)
+			break;
+		m <<= 1;
+	}
+	if (ifa->local == ifa->prefix) {
+		syslog(LOG_INFO, "  addr %s/%d on %s\n",
+		       inet_ntoa(*(struct in_addr*)&ifa->local), i, ifl->name);
+	} else {
+		char tmpa[64];
+		sprintf(tmpa, "%s", inet_ntoa(*(struct in_addr*)&ifa->local));
+		syslog(LOG_INFO, "  addr %s %s/%d on %s\n", tmpa,
+		       inet_ntoa(*(struct in_addr*)&ifa->prefix), i, ifl->name);
+	}
+}
+
+static void nl_link(struct nlmsghdr *n)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(n);
+	struct rtattr *rta;
+	struct iflink *ifl;
+	int len = NLMSG_PAYLOAD(n, sizeof(*ifi));
+	int created;
+
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+		return;
+	if (ifidx && ifi->ifi_index != ifidx)
+		return;
+	if (n->nlmsg_type == RTM_DELLINK) {
+		del_if(ifi->ifi_index);
 		return;
 	}
 
-	while ((ifl = ifl_list) != NULL) {
-		while ((ifa = ifl->ifa_list) != NULL) {
-			ifl->ifa_list = ifa->next;
-			free(ifa);
+	created = find_if(ifi->ifi_index) == NULL;
+	ifl = add_if(ifi->ifi_index);
+	if (ifl == NULL)
+		return;
+	ifl->hatype = ifi->ifi_type;
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		size_t alen = RTA_PAYLOAD(rta);
+
+		switch (rta->rta_type) {
+		case IFLA_ADDRESS:
+			if (alen > sizeof(ifl->lladdr))
+				alen = sizeof(ifl->lladdr);
+			memset(ifl->lladdr, 0, sizeof(ifl->lladdr));
+			memcpy(ifl->lladdr, RTA_DATA(rta), alen);
+			break;
+		case IFLA_IFNAME:
+			if (alen >= sizeof(ifl->name))
+				alen = sizeof(ifl->name) - 1;
+			memcpy(ifl->name, RTA_DATA(rta), alen);
+			ifl->name[alen] = 0;
+			break;
 		}
-		ifl_list = ifl->next;
-		free(ifl);
 	}
+	if (created && verbose)
+		syslog(LOG_INFO, "link %s", ifl->name);
+}
 
-	ifend = (struct ifreq *)((char *)ibuf + ifc.ifc_len);
-	for (ifrp = ibuf; ifrp < ifend; ifrp++) {
-		uint32_t addr;
-		uint32_t mask;
-		uint32_t prefix;
+static void nl_addr(struct nlmsghdr *n)
+{
+	struct ifaddrmsg *ifm = NLMSG_DATA(n);
+	struct rtattr *rta;
+	struct iflink *ifl;
+	struct ifaddr *ifa, **ifap;
+	int len = NLMSG_PAYLOAD(n, sizeof(*ifm));
+	uint32_t addr = 0, prefix = 0, mask;
 
-		if (ifrp->ifr_addr.sa_family != AF_INET)
-			continue;
-		addr = ((struct sockaddr_in*)&ifrp->ifr_addr)->sin_addr.s_addr;
-		if (addr == 0)
-			continue;
-		if (ioctl(fd, SIOCGIFINDEX, ifrp)) {
-			syslog(LOG_ERR, "ioctl(SIOCGIFNAME): %s", strerror(errno));
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifm)))
+		return;
+	if (ifm->ifa_family != AF_INET || ifm->ifa_prefixlen > 32)
+		return;
+	if (ifidx && (int)ifm->ifa_index != ifidx)
+		return;
+	for (rta = IFA_RTA(ifm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (RTA_PAYLOAD(rta) < 4)
 			continue;
+		if (rta->rta_type == IFA_LOCAL)
+			memcpy(&addr, RTA_DATA(rta), 4);
+		else if (rta->rta_type == IFA_ADDRESS)
+			memcpy(&prefix, RTA_DATA(rta), 4);
+	}
+	/* IFA_ADDRESS is the peer on point-to-point links */
+	if (addr == 0)
+		addr = prefix;
+	if (prefix == 0)
+		prefix = addr;
+	mask = ifm->ifa_prefixlen ? htonl(~0U << (32 - ifm->ifa_prefixlen)) : 0;
+	if (addr == 0 || mask == 0)
+		return;
+
+	ifl = n->nlmsg_type == RTM_NEWADDR ? add_if(ifm->ifa_index) : find_if(ifm->ifa_index);
+	if (ifl == NULL)
+		return;
+	for (ifap = &ifl->ifa_list; (ifa = *ifap) != NULL; ifap = &ifa->next) {
+		if (ifa->local == addr &&
+		    ifa->prefix == prefix &&
+		    ifa->mask == mask)
+			break;
+	}
+	if (n->nlmsg_type == RTM_DELADDR) {
+		if (ifa) {
+			*ifap = ifa->next;
+			free(ifa);
 		}
-		if (ifidx && ifrp->ifr_ifindex != ifidx)
-			continue;
-		for (ifl = ifl_list; ifl; ifl = ifl->next)
-			if (ifl->index == ifrp->ifr_ifindex)
-				break;
-		if (ifl == NULL) {
-			char *p;
-			int index = ifrp->ifr_ifindex;
+		return;
+	}
+	if (ifa)
+		return;
+	ifa = (struct ifaddr*)malloc(sizeof(*ifa));
+	if (ifa == NULL)
+		return;
+	memset(ifa, 0, sizeof(*ifa));
+	ifa->local = addr;
+	ifa->prefix = prefix;
+	ifa->mask = mask;
+	ifa->next = ifl->ifa_list;
+	ifl->ifa_list = ifa;
+	if (verbose)
+		log_addr(ifl, ifa);
+}
 
-			if (ioctl(fd, SIOCGIFHWADDR, ifrp)) {
-				syslog(LOG_ERR, "ioctl(SIOCGIFHWADDR): %s", strerror(errno));
-				continue;
-			}
+/* Apply one datagram of rtnetlink messages; 1 at the end of a dump. */
+static int nl_parse(char *buf, int len)
+{
+	struct nlmsghdr *n;
+
+	for (n = (struct nlmsghdr *)buf; NLMSG_OK(n, (unsigned int)len); n = NLMSG_NEXT(n, len)) {
+		switch (n->nlmsg_type) {
+		case NLMSG_DONE:
+			return 1;
+		case NLMSG_ERROR:
+			syslog(LOG_ERR, "rtnetlink dump failed");
+			return 1;
+		case RTM_NEWLINK:
+		case RTM_DELLINK:
+			nl_link(n);
+			break;
+		case RTM_NEWADDR:
+		case RTM_DELADDR:
+			nl_addr(n);
+			break;
+		}
+	}
+	return 0;
+}
+
+static void nl_dump(int fd, int type, int family)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct rtgenmsg g;
+	} req;
+	struct sockaddr_nl nladdr;
+	char buf[32768] __attribute__((aligned(NLMSG_ALIGNTO)));
+	int len;
 
-			ifl = (struct iflink*)malloc(sizeof(*ifl));
-			if (ifl == NULL)
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = type;
+	req.nlh.nlmsg_flags = NLM_F_ROOT | NLM_F_MATCH | NLM_F_REQUEST;
+	req.nlh.nlmsg_seq = type;
+	req.g.rtgen_family = family;
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	if (sendto(fd, &req, sizeof(req), 0, (struct sockaddr*)&nladdr, sizeof(nladdr)) < 0) {
+		syslog(LOG_ERR, "rtnetlink: %s", strerror(errno));
+		return;
+	}
+	for (;;) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR)
 				continue;
-			memset(ifl, 0, sizeof(*ifl));
-			ifl->next = ifl_list;
-			ifl_list = ifl;
-			ifl->index = index;
-			ifl->hatype = ifrp->ifr_hwaddr.sa_family;
-			memcpy(ifl->lladdr, ifrp->ifr_hwaddr.sa_data, 14);
-			strncpy(ifl->name, ifrp->ifr_name, IFNAMSIZ);
-			p = strchr(ifl->name, ':');
-			if (p)
-				*p = 0;
-			if (verbose)
-				syslog(LOG_INFO, "link %s", ifl->name);
-		}
-		if (ioctl(fd, SIOCGIFNETMASK, ifrp)) {
-			syslog(LOG_ERR, "ioctl(SIOCGIFMASK): %s", strerror(errno));
-			continue;
+			syslog(LOG_ERR, "rtnetlink: %s", strerror(errno));
+			return;
 		}
-		mask = ((struct sockaddr_in*)&ifrp->ifr_netmask)->sin_addr.s_addr;
-		if (ioctl(fd, SIOCGIFDSTADDR, ifrp)) {
-			syslog(LOG_ERR, "ioctl(SIOCGIFDSTADDR): %s", strerror(errno));
+		if (nl_parse(buf, len))
+			return;
+	}
+}
+
+/* Changes since the last call; a lost notification means a full reload. */
+void nl_serve(void)
+{
+	char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	int len;
+
+	for (;;) {
+		len = recv(nl_fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == ENOBUFS)
+				if_reload = 1;
+			else if (errno != EINTR && errno != EAGAIN)
+				syslog(LOG_ERR, "rtnetlink: %s", strerror(errno));
+			if (errno != EINTR)
+				return;
 			continue;
 		}
-		prefix = ((struct sockaddr_in*)&ifrp->ifr_dstaddr)->sin_addr.s_addr;
-		for (ifa = ifl->ifa_list; ifa; ifa = ifa->next) {
-			if (ifa->local == addr &&
-			    ifa->prefix == prefix &&
-			    ifa->mask == mask)
-				break;
-		}
-		if (ifa == NULL) {
-			if (mask == 0 || prefix == 0)
-				continue;
-			ifa = (struct ifaddr*)malloc(sizeof(*ifa));
-			memset(ifa, 0, sizeof(*ifa));
-			ifa->local = addr;
-			ifa->prefix = prefix;
-			ifa->mask = mask;
-			ifa->next = ifl->ifa_list;
-			ifl->ifa_list = ifa;
-
-			if (verbose) {
-				int i;
-				uint32_t m = ~0U;
-				for (i=32; i>=0; i--) {
-					if (htonl(m) == mask)
-						break;
-					m <<= 1;
-				}
-				if (addr == prefix) {
-					syslog(LOG_INFO, "  addr %s/%d on %s\n",
-					       inet_ntoa(*(struct in_addr*)&addr), i, ifl->name);
-				} else {
-					char tmpa[64];
-					sprintf(tmpa, "%s", inet_ntoa(*(struct in_addr*)&addr));
-					syslog(LOG_INFO, "  addr %s %s/%d on %s\n", tmpa,
-					       inet_ntoa(*(struct in_addr*)&prefix), i, ifl->name);
-				}
-			}
-		}
+		nl_parse(buf, len);
+	}
+}
+
+/* Subscribe to link and IPv4 address changes; done before any dump. */
+int nl_open(void)
+{
+	struct sockaddr_nl nladdr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return -1;
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	nladdr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+	if (bind(fd, (struct sockaddr*)&nladdr, sizeof(nladdr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void load_if(void)
+{
+	int fd;
+	int i;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0) {
+		syslog(LOG_ERR, "socket: %s", strerror(errno));
+		return;
+	}
+
+	for (i = 0; i < IFL_HASH_SIZE; i++) {
+		while (ifl_hash[i])
+			del_if(ifl_hash[i]->index);
 	}
+
+	nl_dump(fd, RTM_GETLINK, AF_UNSPEC);
+	nl_dump(fd, RTM_GETADDR, AF_INET);
+	close(fd);
 }
 
 void configure(void)
@@ -253,19 +591,11 @@ struct ifaddr *select_ipaddr(int ifindex, uint32_t *sel_addr, uint32_t **alist)
 {
 	struct iflink *ifl;
 	struct ifaddr *ifa;
-	int retry = 0;
 	int i;
 
-retry:
-	for (ifl=ifl_list; ifl; ifl=ifl->next)
-		if (ifl->index == ifindex)
-			break;
-	if (ifl == NULL && !retry) {
-		retry++;
-		load_if();
-		goto retry;
-	}
-	if (ifl == NULL)
+	/* The table follows the kernel; what is not in it does not exist. */
+	ifl = find_if(ifindex);
+	if (ifl == NULL || ifl->ifa_list == NULL)
 		return NULL;
 
 	for (i=0; alist[i]; i++) {
@@ -276,11 +606,6 @@ retry:
 				return ifa;
 			}
 		}
-		if (ifa == NULL && retry==0) {
-			retry++;
-			load_if();
-			goto retry;
-		}
 	}
 	if (i==1 && allow_offlink) {
 		*sel_addr = *(alist[0]);
@@ -290,53 +615,70 @@ retry:
 	return NULL;
 }
 
+/* Ask ether_ntohost() about an address not in the table, and remember. */
+static struct rarp_map *rarp_learn(unsigned char *lladdr)
+{
+	static struct rarp_map *scratch;
+	char ename[256];
+	int found;
+
+	found = ether_ntohost(ename, lladdr) == 0;
+	if (rarp_learned < RARP_LEARN_MAX) {
+		struct rarp_map *r = rarp_add(lladdr, found ? ename : NULL);
+
+		if (r) {
+			rarp_learned++;
+			return r;
+		}
+	}
+	/* the cache is full; answer without it */
+	if (scratch)
+		rarp_free(scratch);
+	scratch = NULL;
+	if (!found)
+		return NULL;
+	scratch = calloc(1, sizeof(*scratch));
+	if (scratch && (scratch->host = strdup(ename)) == NULL) {
+		free(scratch);
+		scratch = NULL;
+	}
+	return scratch;
+}
+
 struct rarp_map *rarp_lookup(int ifindex, int hatype,
 			     int halen, unsigned char *lladdr)
 {
 	struct rarp_map *r;
+	struct ifaddr *ifa;
+	static struct rarp_map emap = {
+		.arp_type = ARPHRD_ETHER,
+		.lladdr_len = 6
+	};
 
-	for (r=rarp_db; r; r=r->next) {
-		if (r->arp_type != hatype && r->arp_type != -1)
-			continue;
-		if (r->lladdr_len != halen)
-			continue;
-		if (r->ifindex != ifindex && r->ifindex != 0)
-			continue;
-		if (memcmp(r->lladdr, lladdr, halen) == 0)
-			break;
+	r = rarp_find(ifindex, hatype, halen, lladdr);
+	if (r == NULL)
+		r = rarp_find(0, hatype, halen, lladdr);
+	if (r == NULL && hatype == ARPHRD_ETHER && halen == 6)
+		r = rarp_learn(lladdr);
+	if (r == NULL || r->host == NULL) {
+		if (verbose)
+			syslog(LOG_INFO, "not found in /etc/ethers");
+		return NULL;
 	}
-
-	if (r == NULL) {
-		if (hatype == ARPHRD_ETHER && halen == 6) {
-			struct ifaddr *ifa;
-			struct hostent *hp;
-			char ename[256];
-			static struct rarp_map emap = {
-				.arp_type = ARPHRD_ETHER,
-				.lladdr_len = 6
-			};
-
-			if (ether_ntohost(ename, lladdr) != 0 ||
-			    (hp = gethostbyname(ename)) == NULL) {
-				if (verbose)
-					syslog(LOG_INFO, "not found in /etc/ethers");
-				return NULL;
-			}
-			if (hp->h_addrtype != AF_INET) {
-				syslog(LOG_ERR, "no IP address");
-				return NULL;
-			}
-			ifa = select_ipaddr(ifindex, &emap.ipaddr, (uint32_t **)hp->h_addr_list);
-			if (ifa) {
-				memcpy(emap.lladdr, lladdr, 6);
-				if (only_ethers || bootable(emap.ipaddr))
-					return &emap;
-				if (verbose)
-					syslog(LOG_INFO, "not bootable");
-			}
-		}
+	if (rarp_resolve(r)) {
+		if (verbose)
+			syslog(LOG_INFO, "cannot resolve %s", r->host);
+		return NULL;
 	}
-	return r;
+	ifa = select_ipaddr(ifindex, &emap.ipaddr, r->alist);
+	if (ifa) {
+		memcpy(emap.lladdr, lladdr, 6);
+		if (only_ethers || bootable(emap.ipaddr))
+			return &emap;
+		if (verbose)
+			syslog(LOG_INFO, "not bootable");
+	}
+	return NULL;
 }
 
 static int load_arp_bpflet(int fd)
@@ -359,9 +701,7 @@ int put_mylladdr(unsigned char **ptr_p, int ifindex, int alen)
 {
 	struct iflink *ifl;
 
-	for (ifl=ifl_list; ifl; ifl = ifl->next)
-		if (ifl->index == ifindex)
-			break;
+	ifl = find_if(ifindex);
 
 	if (ifl==NULL)
 		return -1;
@@ -377,9 +717,7 @@ int put_myipaddr(unsigned char **ptr_p, int ifindex, uint32_t hisipaddr)
 	struct iflink *ifl;
 	struct ifaddr *ifa;
 
-	for (ifl=ifl_list; ifl; ifl = ifl->next)
-		if (ifl->index == ifindex)
-			break;
+	ifl = find_if(ifindex);
 
 	if (ifl==NULL)
 		return -1;
@@ -395,6 +733,7 @@ int put_myipaddr(unsigned char **ptr_p, int ifindex, uint32_t hisipaddr)
 	return 0;
 }
 
+/* Fallback for neigh_flush() when rtnetlink cannot be had. */
 void arp_advise(int ifindex, unsigned char *lladdr, int lllen, uint32_t ipaddr)
 {
 	int fd;
@@ -402,9 +741,7 @@ void arp_advise(int ifindex, unsigned char *lladdr, int lllen, uint32_t ipaddr)
 	struct sockaddr_in *sin;
 	struct iflink *ifl;
 
-	for (ifl=ifl_list; ifl; ifl = ifl->next)
-		if (ifl->index == ifindex)
-			break;
+	ifl = find_if(ifindex);
 
 	if (ifl == NULL)
 		return;
@@ -424,54 +761,166 @@ void arp_advise(int ifindex, unsigned char *lladdr, int lllen, uint32_t ipaddr)
 	close(fd);
 }
 
-void serve_it(int fd)
+/*
+ * Requests are received and answered RARP_BATCH at a time. The ARP
+ * cache updates for one batch go to the kernel as a single datagram of
+ * RTM_NEWNEIGH messages; each one does what SIOCSARP with ATF_COM did,
+ * a stale entry replacing whatever was there.
+ */
+#define RARP_BATCH	32
+
+struct rarp_slot
 {
-	unsigned char buf[1024];
-	struct sockaddr_ll sll;
-	socklen_t sll_len = sizeof(sll);
-	struct arphdr *a = (struct arphdr*)buf;
-	struct rarp_map *rmap;
-	unsigned char *ptr;
-	ssize_t n;
+	struct sockaddr_ll	sll;
+	struct iovec		iov;
+	int			len;
+	unsigned char		buf[1024];
+} rarp_slots[RARP_BATCH];
 
-	n = recvfrom(fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*)&sll, &sll_len);
-	if (n<0) {
-		if (errno != EINTR && errno != EAGAIN)
-			syslog(LOG_ERR, "recvfrom: %s", strerror(errno));
-		return;
+struct neigh_req
+{
+	struct nlmsghdr		nlh;
+	struct ndmsg		ndm;
+	struct rtattr		dst_rta;
+	uint32_t		dst;
+	struct rtattr		ll_rta;
+	unsigned char		lladdr[16];
+} neigh_reqs[RARP_BATCH];
+
+int neigh_count;
+int neigh_fd = -2;	/* not opened yet */
+uint32_t neigh_seq;
+
+static void neigh_queue(int ifindex, unsigned char *lladdr, int lllen, uint32_t ipaddr)
+{
+	struct neigh_req *r;
+	int i;
+
+	/* a client repeating itself within one batch */
+	for (i = 0; i < neigh_count; i++) {
+		r = &neigh_reqs[i];
+		if (r->ndm.ndm_ifindex == ifindex && r->dst == ipaddr)
+			break;
 	}
+	if (i == neigh_count) {
+		if (neigh_count == RARP_BATCH)
+			return;
+		neigh_count++;
+	}
+	r = &neigh_reqs[i];
+	memset(r, 0, sizeof(*r));
+	r->nlh.nlmsg_len = offsetof(struct neigh_req, lladdr) + lllen;
+	r->nlh.nlmsg_type = RTM_NEWNEIGH;
+	r->nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_REPLACE;
+	r->ndm.ndm_family = AF_INET;
+	r->ndm.ndm_ifindex = ifindex;
+	r->ndm.ndm_state = NUD_STALE;
+	r->dst_rta.rta_len = RTA_LENGTH(4);
+	r->dst_rta.rta_type = NDA_DST;
+	r->dst = ipaddr;
+	r->ll_rta.rta_len = RTA_LENGTH(lllen);
+	r->ll_rta.rta_type = NDA_LLADDR;
+	memcpy(r->lladdr, lladdr, lllen);
+}
 
-	/* Do not accept packets for other hosts and our own ones */
-	if (sll.sll_pkttype != PACKET_BROADCAST &&
-	    sll.sll_pkttype != PACKET_MULTICAST &&
-	    sll.sll_pkttype != PACKET_HOST)
+static void neigh_flush(void)
+{
+	struct iovec iov[RARP_BATCH];
+	struct sockaddr_nl nladdr;
+	struct msghdr msg;
+	char buf[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr *n;
+	int i, len;
+
+	if (!neigh_count)
 		return;
+	if (neigh_fd == -2) {
+		neigh_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+		if (neigh_fd < 0)
+			syslog(LOG_ERR, "rtnetlink: %s; using SIOCSARP", strerror(errno));
+	}
+
+	for (i = 0; i < neigh_count; i++) {
+		struct neigh_req *r = &neigh_reqs[i];
 
-	if (ifidx && sll.sll_ifindex != ifidx)
+		r->nlh.nlmsg_seq = ++neigh_seq;
+		iov[i].iov_base = r;
+		iov[i].iov_len = NLMSG_ALIGN(r->nlh.nlmsg_len);
+	}
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &nladdr;
+	msg.msg_namelen = sizeof(nladdr);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = neigh_count;
+
+	if (neigh_fd < 0 || sendmsg(neigh_fd, &msg, 0) < 0) {
+		if (neigh_fd >= 0)
+			syslog(LOG_ERR, "rtnetlink: %s", strerror(errno));
+		for (i = 0; i < neigh_count; i++) {
+			struct neigh_req *r = &neigh_reqs[i];
+
+			arp_advise(r->ndm.ndm_ifindex, r->lladdr,
+				   RTA_PAYLOAD(&r->ll_rta), r->dst);
+		}
+		neigh_count = 0;
 		return;
+	}
+	neigh_count = 0;
+
+	/* Without NLM_F_ACK only failures are answered, right away. */
+	while ((len = recv(neigh_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		for (n = (struct nlmsghdr *)buf; NLMSG_OK(n, (unsigned int)len); n = NLMSG_NEXT(n, len)) {
+			struct nlmsgerr *err = NLMSG_DATA(n);
+
+			if (n->nlmsg_type == NLMSG_ERROR && err->error)
+				syslog(LOG_ERR, "RTM_NEWNEIGH: %s", strerror(-err->error));
+		}
+	}
+}
+
+/* Turn the request in "s" into its reply; 0 if there is none. */
+static int rarp_reply(struct rarp_slot *s)
+{
+	unsigned char *buf = s->buf;
+	struct sockaddr_ll *sll = &s->sll;
+	struct arphdr *a = (struct arphdr*)buf;
+	struct rarp_map *rmap;
+	unsigned char *ptr;
+	ssize_t n = s->len;
+
+	/* Do not accept packets for other hosts and our own ones */
+	if (sll->sll_pkttype != PACKET_BROADCAST &&
+	    sll->sll_pkttype != PACKET_MULTICAST &&
+	    sll->sll_pkttype != PACKET_HOST)
+		return 0;
+
+	if (ifidx && sll->sll_ifindex != ifidx)
+		return 0;
 
 	if ((size_t)n<sizeof(*a)) {
 		syslog(LOG_ERR, "truncated arp packet; len=%zu", n);
-		return;
+		return 0;
 	}
 
 	/* Accept only RARP requests */
 	if (a->ar_op != htons(ARPOP_RREQUEST))
-		return;
+		return 0;
 
 	if (verbose) {
 		int i;
 		char tmpbuf[16*3];
 		char *p = tmpbuf;
-		for (i=0; i<sll.sll_halen; i++) {
+		for (i=0; i<sll->sll_halen; i++) {
 			if (i) {
-				sprintf(p, ":%02x", sll.sll_addr[i]);
+				sprintf(p, ":%02x", sll->sll_addr[i]);
 				p++;
 			} else
-				sprintf(p, "%02x", sll.sll_addr[i]);
+				sprintf(p, "%02x", sll->sll_addr[i]);
 			p += 2;
 		}
-		syslog(LOG_INFO, "RARP request from %s on if%d", tmpbuf, sll.sll_ifindex);
+		syslog(LOG_INFO, "RARP request from %s on if%d", tmpbuf, sll->sll_ifindex);
 	}
 
 	/* Sanity checks */
@@ -479,16 +928,16 @@ void serve_it(int fd)
 	/* 1. IP only -> pln==4 */
 	if (a->ar_pln != 4) {
 		syslog(LOG_ERR, "interesting rarp_req plen=%d", a->ar_pln);
-		return;
+		return 0;
 	}
 	/* 2. ARP protocol must be IP */
 	if (a->ar_pro != htons(ETH_P_IP)) {
 		syslog(LOG_ERR, "rarp protocol is not IP %04x", ntohs(a->ar_pro));
-		return;
+		return 0;
 	}
 	/* 3. ARP types must match */
-	if (htons(sll.sll_hatype) != a->ar_hrd) {
-		switch (sll.sll_hatype) {
+	if (htons(sll->sll_hatype) != a->ar_hrd) {
+		switch (sll->sll_hatype) {
 		case ARPHRD_FDDI:
 			if (a->ar_hrd == htons(ARPHRD_ETHER) ||
 			    a->ar_hrd == htons(ARPHRD_IEEE802))
@@ -496,33 +945,33 @@ void serve_it(int fd)
 			/* fallthrough */
 		default:
 			syslog(LOG_ERR, "rarp htype mismatch");
-			return;
+			return 0;
 		}
 	}
 	/* 3. LL address lengths must be equal */
-	if (a->ar_hln != sll.sll_halen) {
+	if (a->ar_hln != sll->sll_halen) {
 		syslog(LOG_ERR, "rarp hlen mismatch");
-		return;
+		return 0;
 	}
 	/* 4. Check packet length */
 	if (sizeof(*a) + 2*4 + 2*a->ar_hln > (size_t) n) {
 		syslog(LOG_ERR, "truncated rarp request; len=%zu", n);
-		return;
+		return 0;
 	}
 	/* 5. Silly check: if this guy set different source
 	      addresses in MAC header and in ARP, he is insane
 	 */
-	if (memcmp(sll.sll_addr, a+1, sll.sll_halen)) {
+	if (memcmp(sll->sll_addr, a+1, sll->sll_halen)) {
 		syslog(LOG_ERR, "this guy set different his lladdrs in arp and header");
-		return;
+		return 0;
 	}
 	/* End of sanity checks */
 
 	/* Lookup requested target in our database */
-	rmap = rarp_lookup(sll.sll_ifindex, sll.sll_hatype,
-			   sll.sll_halen, (unsigned char*)(a+1) + sll.sll_halen + 4);
+	rmap = rarp_lookup(sll->sll_ifindex, sll->sll_hatype,
+			   sll->sll_halen, (unsigned char*)(a+1) + sll->sll_halen + 4);
 	if (rmap == NULL)
-		return;
+		return 0;
 
 	/* Prepare reply. It is almost ready, we only
 	   replace ARP packet type, put our lladdr and
@@ -531,10 +980,10 @@ void serve_it(int fd)
 	 */
 	a->ar_op = htons(ARPOP_RREPLY);
 	ptr = (unsigned char*)(a+1);
-	if (put_mylladdr(&ptr, sll.sll_ifindex, rmap->lladdr_len))
-		return;
-	if (put_myipaddr(&ptr, sll.sll_ifindex, rmap->ipaddr))
-		return;
+	if (put_mylladdr(&ptr, sll->sll_ifindex, rmap->lladdr_len))
+		return 0;
+	if (put_myipaddr(&ptr, sll->sll_ifindex, rmap->ipaddr))
+		return 0;
 	/* It is already filled */
 	ptr += rmap->lladdr_len;
 	memcpy(ptr, &rmap->ipaddr, 4);
@@ -543,14 +992,133 @@ void serve_it(int fd)
 	/* Update our ARP cache. Probably, this guy
 	   will not able to make ARP (if it is broken)
 	 */
-	arp_advise(sll.sll_ifindex, rmap->lladdr, rmap->lladdr_len, rmap->ipaddr);
+	neigh_queue(sll->sll_ifindex, rmap->lladdr, rmap->lladdr_len, rmap->ipaddr);
+
+	return ptr - buf;
+}
+
+/* Whatever is queued on fd, up to RARP_BATCH; the count or -1. */
+static int rarp_recv(int fd)
+{
+#ifdef HAVE_RECVMMSG
+	static int no_mmsg;
+	struct mmsghdr msgs[RARP_BATCH];
+#endif
+	struct msghdr msg;
+	int i, n;
+
+	for (i = 0; i < RARP_BATCH; i++) {
+		rarp_slots[i].iov.iov_base = rarp_slots[i].buf;
+		rarp_slots[i].iov.iov_len = sizeof(rarp_slots[i].buf);
+	}
+#ifdef HAVE_RECVMMSG
+	if (!no_mmsg) {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < RARP_BATCH; i++) {
+			msgs[i].msg_hdr.msg_name = &rarp_slots[i].sll;
+			msgs[i].msg_hdr.msg_namelen = sizeof(rarp_slots[i].sll);
+			msgs[i].msg_hdr.msg_iov = &rarp_slots[i].iov;
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		n = recvmmsg(fd, msgs, RARP_BATCH, MSG_DONTWAIT, NULL);
+		for (i = 0; i < n; i++)
+			rarp_slots[i].len = msgs[i].msg_len;
+		if (n >= 0 || errno != ENOSYS)
+			return n;
+		/* Kernel is older than its headers, go one by one. */
+		no_mmsg = 1;
+	}
+#endif
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &rarp_slots[0].sll;
+	msg.msg_namelen = sizeof(rarp_slots[0].sll);
+	msg.msg_iov = &rarp_slots[0].iov;
+	msg.msg_iovlen = 1;
+	n = recvmsg(fd, &msg, MSG_DONTWAIT);
+	if (n < 0)
+		return -1;
+	rarp_slots[0].len = n;
+	return 1;
+}
+
+/* The first "n" slots hold replies; sending is blocking, but with 5sec timeout. */
+static void rarp_send(int fd, int n)
+{
+#ifdef HAVE_SENDMMSG
+	static int no_mmsg;
+	struct mmsghdr msgs[RARP_BATCH];
+#endif
+	int i, cc;
 
-	/* Sendto is blocking, but with 5sec timeout */
 	alarm(5);
-	sendto(fd, buf, ptr - buf, 0, (struct sockaddr*)&sll, sizeof(sll));
+#ifdef HAVE_SENDMMSG
+	if (!no_mmsg) {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < n; i++) {
+			rarp_slots[i].iov.iov_len = rarp_slots[i].len;
+			msgs[i].msg_hdr.msg_name = &rarp_slots[i].sll;
+			msgs[i].msg_hdr.msg_namelen = sizeof(rarp_slots[i].sll);
+			msgs[i].msg_hdr.msg_iov = &rarp_slots[i].iov;
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		for (i = 0; i < n; i += cc) {
+			cc = sendmmsg(fd, msgs + i, n - i, 0);
+			if (cc < 0) {
+				if (errno == ENOSYS) {
+					no_mmsg = 1;
+					break;
+				}
+				if (errno == EINTR)
+					goto out;
+				/* the one at "i" failed, go on with the rest */
+				cc = 1;
+			}
+		}
+		if (!no_mmsg)
+			goto out;
+	}
+#endif
+	for (i = 0; i < n; i++) {
+		cc = sendto(fd, rarp_slots[i].buf, rarp_slots[i].len, 0,
+			    (struct sockaddr*)&rarp_slots[i].sll, sizeof(rarp_slots[i].sll));
+		if (cc < 0 && errno == EINTR)
+			break;
+	}
+#ifdef HAVE_SENDMMSG
+out:
+#endif
 	alarm(0);
 }
 
+void serve_it(int fd)
+{
+	int i, n, nreply = 0;
+
+	n = rarp_recv(fd);
+	if (n<0) {
+		if (errno != EINTR && errno != EAGAIN)
+			syslog(LOG_ERR, "recvmsg: %s", strerror(errno));
+		return;
+	}
+
+	/* Replies are packed to the front, over requests already done. */
+	for (i = 0; i < n; i++) {
+		int len = rarp_reply(&rarp_slots[i]);
+
+		if (len <= 0)
+			continue;
+		if (nreply != i) {
+			memcpy(rarp_slots[nreply].buf, rarp_slots[i].buf, len);
+			rarp_slots[nreply].sll = rarp_slots[i].sll;
+		}
+		rarp_slots[nreply++].len = len;
+	}
+
+	neigh_flush();
+	if (nreply)
+		rarp_send(fd, nreply);
+}
+
 void catch_signal(int sig, void (*handler)(int))
 {
 	struct sigaction sa;
@@ -571,8 +1139,8 @@ void sig_hup(int signo __attribute__((__unused__)))
 
 int main(int argc, char **argv)
 {
-	struct pollfd pset[2];
-	int psize;
+	struct pollfd pset[3];
+	int psize, nfds;
 	int opt;
 
 
@@ -705,6 +1273,16 @@ int main(int argc, char **argv)
 	catch_signal(SIGALRM, sig_alarm);
 	catch_signal(SIGHUP, sig_hup);
 
+	nl_fd = nl_open();
+	if (nl_fd < 0)
+		syslog(LOG_ERR, "rtnetlink: %s; interface changes need SIGHUP", strerror(errno));
+	nfds = psize;
+	if (nl_fd >= 0) {
+		pset[nfds].fd = nl_fd;
+		pset[nfds].events = POLLIN;
+		nfds++;
+	}
+
 	for (;;) {
 		int i;
 
@@ -712,6 +1290,10 @@ int main(int argc, char **argv)
 			configure();
 			do_reload = 0;
 		}
+		if (if_reload) {
+			load_if();
+			if_reload = 0;
+		}
 
 #define EVENTS (POLLIN|POLLPRI|POLLERR|POLLHUP)
 		pset[0].events = EVENTS;
@@ -719,7 +1301,10 @@ int main(int argc, char **argv)
 		pset[1].events = EVENTS;
 		pset[1].revents = 0;
 
-		i = poll(pset, psize, -1);
+		if (nl_fd >= 0)
+			pset[psize].revents = 0;
+
+		i = poll(pset, nfds, -1);
 		if (i <= 0) {
 			if (errno != EINTR && i<0) {
 				syslog(LOG_ERR, "poll returned some crap: %s\n", strerror(errno));
@@ -727,6 +1312,9 @@ int main(int argc, char **argv)
 			}
 			continue;
 		}
+		/* interfaces first, a request may be about to use them */
+		if (nl_fd >= 0 && pset[psize].revents)
+			nl_serve();
 		for (i=0; i<psize; i++) {
 			if (pset[i].revents&EVENTS)
 				serve_it(pset[i].fd);
@@ -45,6 +45,9 @@
 #include <sys/ioctl.h>
 #include <linux/if.h>
 #include <linux/route.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <poll.h>
 
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -63,6 +66,8 @@
 #include <string.h>
 #include <syslog.h>
 
+#include "iputils_cksum.h"
+
 struct interface
 {
 	struct in_addr 	address;	/* Used to identify the interface */
@@ -105,6 +110,8 @@ static int is_directly_connected(struct in_addr in);
 static void initlog(void);
 static void discard_table(void);
 static void init(void);
+static int nl_open(void);
+static int nl_changed(void);
 
 #define ICMP_ROUTER_ADVERTISEMENT	9
 #define ICMP_ROUTER_SOLICITATION	10
@@ -162,6 +169,7 @@ static int interfaces_size;			/* Number of elements in interfaces */
 int debugfile;
 
 int s;			/* Socket file descriptor */
+int nl_fd = -1;		/* rtnetlink link and address notifications */
 struct sockaddr_in whereto;/* Address to send to */
 
 /* Common variables */
@@ -198,7 +206,6 @@ static void graceful_finish(void);
 static void finish(void);
 static void timer(void);
 static void initifs(void);
-static unsigned short in_cksum(unsigned short *addr, int len);
 
 static int logging = 0;
 
@@ -275,7 +282,7 @@ void do_fork(void)
 		exit(0);
 
 	for (t = 0; t < open_max; t++)
-		if (t != s)
+		if (t != s && t != nl_fd)
 			close(t);
 
 	setsid();
@@ -304,6 +311,8 @@ int main(int argc, char **argv)
 	struct sockaddr_in *to = &whereto;
 	struct sockaddr_in joinaddr;
 	sigset_t sset, sset_empty;
+	struct pollfd pset[2];
+	int nfds = 1;
 #ifdef RDISC_SERVER
 	int val;
 
@@ -464,6 +473,11 @@ next:
 	sigaddset(&sset, SIGTERM);
 	sigaddset(&sset, SIGINT);
 
+	/* Subscribed before the first look at the interfaces, to miss nothing. */
+	nl_fd = nl_open();
+	if (nl_fd < 0)
+		logperror("rtnetlink");
+
 	init();
 	if (join(s, &joinaddr) < 0) {
 		logmsg(LOG_ERR, "Failed joining addresses\n");
@@ -472,16 +486,38 @@ next:
 
 	timer();	/* start things going */
 
+	pset[0].fd = s;
+	pset[0].events = POLLIN;
+	if (nl_fd >= 0) {
+		pset[1].fd = nl_fd;
+		pset[1].events = POLLIN;
+		nfds++;
+	}
+
 	for (;;) {
 		unsigned char	packet[MAXPACKET];
 		int len = sizeof (packet);
 		socklen_t fromlen = sizeof (from);
 		int cc;
 
-		cc=recvfrom(s, (char *)packet, len, 0,
+		if (poll(pset, nfds, -1) < 0) {
+			if (errno != EINTR)
+				logperror("poll");
+			continue;
+		}
+		if (nfds > 1 && pset[1].revents && nl_changed()) {
+			sigprocmask(SIG_SETMASK, &sset, NULL);
+			initifs();
+			join(s, &joinaddr);
+			sigprocmask(SIG_SETMASK, &sset_empty, NULL);
+		}
+		if (!pset[0].revents)
+			continue;
+
+		cc=recvfrom(s, (char *)packet, len, MSG_DONTWAIT,
 			    (struct sockaddr *)&from, &fromlen);
 		if (cc<0) {
-			if (errno == EINTR)
+			if (errno == EINTR || errno == EAGAIN)
 				continue;
 			logperror("recvfrom");
 			continue;
@@ -495,7 +531,7 @@ next:
 }
 
 #define TIMER_INTERVAL 	3
-#define GETIFCONF_TIMER	30
+#define GETIFCONF_TIMER	30	/* without rtnetlink */
 
 static int left_until_advertise;
 
@@ -513,7 +549,7 @@ void timer()
 	left_until_advertise -= TIMER_INTERVAL;
 	left_until_solicit -= TIMER_INTERVAL;
 
-	if (left_until_getifconf < 0) {
+	if (nl_fd < 0 && left_until_getifconf < 0) {
 		initifs();
 		left_until_getifconf = GETIFCONF_TIMER;
 	}
@@ -568,7 +604,7 @@ solicitor(struct sockaddr_in *sin)
 	packetlen = 8;
 
 	/* Compute ICMP checksum here */
-	icp->checksum = in_cksum( (unsigned short *)icp, packetlen );
+	icp->checksum = in_cksum( (unsigned short *)icp, packetlen, 0 );
 
 	if (isbroadcast(sin))
 		i = sendbcast(s, (char *)outpack, packetlen);
@@ -628,7 +664,7 @@ advertise(struct sockaddr_in *sin, int lft)
 		rap->icmp_num_addrs++;
 
 		/* Compute ICMP checksum here */
-		rap->icmp_cksum = in_cksum( (unsigned short *)rap, packetlen );
+		rap->icmp_cksum = in_cksum( (unsigned short *)rap, packetlen, 0 );
 
 		if (isbroadcast(sin))
 			cc = sendbcastif(s, (char *)outpack, packetlen,
@@ -761,7 +797,7 @@ pr_pack(char *buf, int cc, struct sockaddr_in *from)
 
 		/* TBD verify that the link is multicast or broadcast */
 		/* XXX Find out the link it came in over? */
-		if (in_cksum((unsigned short *)ALLIGN(buf+hlen), cc)) {
+		if (in_cksum((unsigned short *)ALLIGN(buf+hlen), cc, 0)) {
 			if (verbose)
 				logmsg(LOG_INFO, "ICMP %s from %s: Bad checksum\n",
 					 pr_type((int)rap->icmp_type),
@@ -850,7 +886,7 @@ pr_pack(char *buf, int cc, struct sockaddr_in *from)
 		/* TBD verify that the link is multicast or broadcast */
 		/* XXX Find out the link it came in over? */
 
-		if (in_cksum((unsigned short *)ALLIGN(buf+hlen), cc)) {
+		if (in_cksum((unsigned short *)ALLIGN(buf+hlen), cc, 0)) {
 			if (verbose)
 				logmsg(LOG_INFO, "ICMP %s from %s: Bad checksum\n",
 					      pr_type((int)icp->type),
@@ -917,51 +953,6 @@ pr_pack(char *buf, int cc, struct sockaddr_in *from)
 }
 
 
-/*
- *			I N _ C K S U M
- *
- * Checksum routine for Internet Protocol family headers (C Version)
- *
- */
-#if BYTE_ORDER == LITTLE_ENDIAN
-# define ODDBYTE(v)	(v)
-#elif BYTE_ORDER == BIG_ENDIAN
-# define ODDBYTE(v)	((unsigned short)(v) << 8)
-#else
-# define ODDBYTE(v)	htons((unsigned short)(v) << 8)
-#endif
-
-unsigned short in_cksum(unsigned short *addr, int len)
-{
-	int nleft = len;
-	unsigned short *w = addr;
-	unsigned short answer;
-	int sum = 0;
-
-	/*
-	 *  Our algorithm is simple, using a 32 bit accumulator (sum),
-	 *  we add sequential 16 bit words to it, and at the end, fold
-	 *  back all the carry bits from the top 16 bits into the lower
-	 *  16 bits.
-	 */
-	while( nleft > 1 )  {
-		sum += *w++;
-		nleft -= 2;
-	}
-
-	/* mop up an odd byte, if necessary */
-	if( nleft == 1 )
-		sum += ODDBYTE(*(unsigned char *)w);	/* le16toh() may be unavailable on old systems */
-
-	/*
-	 * add back carry outs from top 16 bits to low 16 bits
-	 */
-	sum = (sum >> 16) + (sum & 0xffff);	/* add hi 16 to low 16 */
-	sum += (sum >> 16);			/* add carry */
-	answer = ~sum;				/* truncate to 16 bits */
-	return (answer);
-}
-
 /*
  *			F I N I S H
  *
@@ -1101,13 +1092,61 @@ void
 init()
 {
 	initifs();
-#ifdef RDISC_SERVER
-	{
-		int i;
-		for (i = 0; i < interfaces_size; i++)
-			interfaces[i].preference = preference;
+}
+
+int
+nl_open(void)
+{
+	struct sockaddr_nl nladdr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return (-1);
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	nladdr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+	if (bind(fd, (struct sockaddr *)&nladdr, sizeof(nladdr)) < 0) {
+		(void) close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+/*
+ * Read all pending notifications; 1 if the interfaces have to be looked
+ * at again. A burst of them, or lost ones, costs a single initifs().
+ */
+int
+nl_changed(void)
+{
+	char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr *h;
+	int len, changed = 0;
+
+	for (;;) {
+		len = recv(nl_fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS)
+				changed = 1;
+			else if (errno != EAGAIN)
+				logperror("rtnetlink");
+			return (changed);
+		}
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, (unsigned)len);
+		     h = NLMSG_NEXT(h, len)) {
+			switch (h->nlmsg_type) {
+			case RTM_NEWLINK:
+			case RTM_DELLINK:
+			case RTM_NEWADDR:
+			case RTM_DELADDR:
+				changed = 1;
+				break;
+			}
+		}
 	}
-#endif
 }
 
 void
@@ -1179,6 +1218,9 @@ initifs()
 		if ((ifreq.ifr_flags & (IFF_MULTICAST|IFF_BROADCAST|IFF_POINTOPOINT)) == 0)
 			continue;
 		strncpy(interfaces[i].name, ifr->ifr_name, IFNAMSIZ-1);
+#ifdef RDISC_SERVER
+		interfaces[i].preference = preference;
+#endif
 
 		sin = (struct sockaddr_in *)ALLIGN(&ifr->ifr_addr);
 		interfaces[i].localaddr = sin->sin_addr;
@@ -1251,8 +1293,9 @@ join(int sock, struct sockaddr_in *sin)
 		mreq.imr_ifindex = interfaces[i].ifindex;
 		mreq.imr_address.s_addr = 0;
 
+		/* Joined already if initifs() was run again. */
 		if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
-			       (char *)&mreq, sizeof(mreq)) < 0) {
+			       (char *)&mreq, sizeof(mreq)) < 0 && errno != EADDRINUSE) {
 			logperror("setsockopt (IP_ADD_MEMBERSHIP)");
 			return (-1);
 		}
@@ -1299,98 +1342,231 @@ is_directly_connected(struct in_addr in)
 
 /*
  * TABLES
+ *
+ * Routers are hashed by address, kept in a heap ordered by preference so
+ * the best one is at the root, and hung on a timer wheel of one second
+ * slots by the time their lifetime runs out. Those with a route in the
+ * kernel are also on the kernel_routes list. When the set of best routers
+ * changes, routes to the new ones are added before the old ones go, so
+ * the kernel is not left without a default route in between.
  */
+#define TABLE_HASH_BITS	8
+#define TABLE_HASH_SIZE	(1 << TABLE_HASH_BITS)
+#define WHEEL_SIZE	256	/* seconds */
+
+struct table;
+
+struct tlink {
+	struct table	*next;
+	struct table	**pprev;
+};
+
+#define TLINK_ADD(head, tp, f) do {				\
+	(tp)->f.next = *(head);					\
+	if (*(head))						\
+		(*(head))->f.pprev = &(tp)->f.next;		\
+	*(head) = (tp);						\
+	(tp)->f.pprev = (head);					\
+} while (0)
+
+#define TLINK_DEL(tp, f) do {					\
+	*(tp)->f.pprev = (tp)->f.next;				\
+	if ((tp)->f.next)					\
+		(tp)->f.next->f.pprev = (tp)->f.pprev;		\
+} while (0)
+
 struct table {
 	struct in_addr	router;
 	int		preference;
-	int		remaining_time;
+	unsigned long	expire;		/* table_clock it times out at */
 	int		in_kernel;
-	struct table	*next;
+	int		hpos;		/* index in heap[] */
+	struct tlink	hash;
+	struct tlink	wheel;
+	struct tlink	kernel;
 };
 
-struct table *table;
+static struct table *table_hash[TABLE_HASH_SIZE];
+static struct table *wheel[WHEEL_SIZE];
+static struct table *kernel_routes;
+static struct table **heap;
+static int heap_len;
+static int heap_size;
+static unsigned long table_clock;	/* seconds aged so far */
+
+static struct table **hash_head(struct in_addr addr)
+{
+	return &table_hash[(addr.s_addr * 2654435761u) >> (32 - TABLE_HASH_BITS)];
+}
 
-struct table *
+static struct table *
 find_router(struct in_addr addr)
 {
 	struct table *tp;
 
-	tp = table;
-	while (tp) {
+	for (tp = *hash_head(addr); tp; tp = tp->hash.next)
 		if (tp->router.s_addr == addr.s_addr)
 			return (tp);
-		tp = tp->next;
-	}
 	return (NULL);
 }
 
-int max_preference(void)
+static int max_preference(void)
 {
-	struct table *tp;
-	int max = (int)INELIGIBLE_PREF;
+	return heap_len ? heap[0]->preference : (int)INELIGIBLE_PREF;
+}
+
+static void heap_set(int i, struct table *tp)
+{
+	heap[i] = tp;
+	tp->hpos = i;
+}
 
-	tp = table;
-	while (tp) {
-		if (tp->preference > max)
-			max = tp->preference;
-		tp = tp->next;
+/* Move tp to its place after its preference changed. */
+static void heap_fix(struct table *tp)
+{
+	int i = tp->hpos;
+
+	while (i > 0 && heap[(i - 1) / 2]->preference < tp->preference) {
+		heap_set(i, heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	for (;;) {
+		int c = 2 * i + 1;
+
+		if (c >= heap_len)
+			break;
+		if (c + 1 < heap_len && heap[c + 1]->preference > heap[c]->preference)
+			c++;
+		if (heap[c]->preference <= tp->preference)
+			break;
+		heap_set(i, heap[c]);
+		i = c;
 	}
-	return (max);
+	heap_set(i, tp);
 }
 
+static int heap_insert(struct table *tp)
+{
+	if (heap_len == heap_size) {
+		int size = heap_size ? heap_size * 2 : 16;
+		struct table **h = realloc(heap, size * sizeof(*h));
+
+		if (h == NULL)
+			return (-1);
+		heap = h;
+		heap_size = size;
+	}
+	heap_set(heap_len++, tp);
+	heap_fix(tp);
+	return (0);
+}
+
+static void heap_remove(struct table *tp)
+{
+	struct table *last = heap[--heap_len];
+
+	if (last == tp)
+		return;
+	heap_set(tp->hpos, last);
+	heap_fix(last);
+}
+
+/* Time tp out "ttl" seconds from now, at the next tick at the earliest. */
+static void wheel_set(struct table *tp, int ttl)
+{
+	if (tp->wheel.pprev)
+		TLINK_DEL(tp, wheel);
+	tp->expire = table_clock + (ttl > 0 ? ttl : 1);
+	TLINK_ADD(&wheel[tp->expire % WHEEL_SIZE], tp, wheel);
+}
+
+static void route_add(struct table *tp)
+{
+	add_route(tp->router);
+	tp->in_kernel++;
+	TLINK_ADD(&kernel_routes, tp, kernel);
+}
+
+static void route_del(struct table *tp)
+{
+	del_route(tp->router);
+	tp->in_kernel = 0;
+	TLINK_DEL(tp, kernel);
+}
+
+/* Add routes to those at heap[i] and below that have preference "max". */
+static void promote(int i, int max)
+{
+	if (i >= heap_len || heap[i]->preference != max)
+		return;
+	if (!heap[i]->in_kernel)
+		route_add(heap[i]);
+	promote(2 * i + 1, max);
+	promote(2 * i + 2, max);
+}
+
+/* With best_preference, make the kernel routes those to the best routers. */
+static void sync_best(void)
+{
+	int max = max_preference();
+	struct table *tp, *next;
+
+	if (max != (int) INELIGIBLE_PREF)
+		promote(0, max);
+	for (tp = kernel_routes; tp; tp = next) {
+		next = tp->kernel.next;
+		if (tp->preference != max || max == (int) INELIGIBLE_PREF)
+			route_del(tp);
+	}
+}
 
-/* Note: this might leave the kernel with no default route for a short time. */
 void
 age_table(int time)
 {
-	struct table **tpp, *tp;
-	int recalculate_max = 0;
-	int max = max_preference();
+	struct table *expired = NULL, *tp, *next;
+	int old_max = max_preference();
+	int n;
 
-	tpp = &table;
-	while (*tpp != NULL) {
-		tp = *tpp;
-		tp->remaining_time -= time;
-		if (tp->remaining_time <= 0) {
-			*tpp = tp->next;
-			if (tp->in_kernel)
-				del_route(tp->router);
-			if (best_preference &&
-			    tp->preference == max)
-				recalculate_max++;
-			free((char *)tp);
-		} else {
-			tpp = &tp->next;
+	for (n = 0; n < time; n++) {
+		table_clock++;
+		if (n >= WHEEL_SIZE)
+			continue;
+		for (tp = wheel[table_clock % WHEEL_SIZE]; tp; tp = next) {
+			next = tp->wheel.next;
+			if (tp->expire > table_clock)
+				continue;
+			TLINK_DEL(tp, wheel);
+			TLINK_DEL(tp, hash);
+			heap_remove(tp);
+			tp->hash.next = expired;
+			expired = tp;
 		}
 	}
-	if (recalculate_max) {
-		int max_pref = max_preference();
-
-		if (max_pref != (int) INELIGIBLE_PREF) {
-			tp = table;
-			while (tp) {
-				if (tp->preference == max_pref && !tp->in_kernel) {
-					add_route(tp->router);
-					tp->in_kernel++;
-				}
-				tp = tp->next;
-			}
-		}
+	if (expired == NULL)
+		return;
+	if (best_preference && max_preference() != old_max)
+		sync_best();
+	for (tp = expired; tp; tp = next) {
+		next = tp->hash.next;
+		if (tp->in_kernel)
+			route_del(tp);
+		free((char *)tp);
 	}
 }
 
 void discard_table(void)
 {
-	struct table **tpp, *tp;
+	int i;
 
-	tpp = &table;
-	while (*tpp != NULL) {
-		tp = *tpp;
-		*tpp = tp->next;
-		if (tp->in_kernel)
-			del_route(tp->router);
-		free((char *)tp);
+	for (i = 0; i < heap_len; i++) {
+		if (heap[i]->in_kernel)
+			del_route(heap[i]->router);
+		free((char *)heap[i]);
 	}
+	heap_len = 0;
+	kernel_routes = NULL;
+	memset(table_hash, 0, sizeof(table_hash));
+	memset(wheel, 0, sizeof(wheel));
 }
 
 
@@ -1399,8 +1575,7 @@ record_router(struct in_addr router, int pref, int ttl)
 {
 	struct table *tp;
 	int old_max = max_preference();
-	int changed_up = 0;	/* max preference could have increased */
-	int changed_down = 0;	/* max preference could have decreased */
+	int eligible;
 
 	if (ttl < 4)
 		pref = INELIGIBLE_PREF;
@@ -1412,65 +1587,38 @@ record_router(struct in_addr router, int pref, int ttl)
 			 pref);
 	tp = find_router(router);
 	if (tp) {
-		if (tp->preference > pref &&
-		    tp->preference == old_max)
-			changed_down++;
-		else if (pref > tp->preference)
-			changed_up++;
-		tp->preference = pref;
-		tp->remaining_time = ttl;
+		if (tp->preference != pref) {
+			tp->preference = pref;
+			heap_fix(tp);
+		}
 	} else {
-		if (pref > old_max)
-			changed_up++;
-		tp = (struct table *)ALLIGN(malloc(sizeof(struct table)));
+		tp = (struct table *)ALLIGN(calloc(1, sizeof(struct table)));
 		if (tp == NULL) {
 			logmsg(LOG_ERR, "Out of memory\n");
 			return;
 		}
 		tp->router = router;
 		tp->preference = pref;
-		tp->remaining_time = ttl;
-		tp->in_kernel = 0;
-		tp->next = table;
-		table = tp;
-	}
-	if (!tp->in_kernel &&
-	    (!best_preference || tp->preference == max_preference()) &&
-	    tp->preference != (int) INELIGIBLE_PREF) {
-		add_route(tp->router);
-		tp->in_kernel++;
-	}
-	if (tp->preference == (int) INELIGIBLE_PREF && tp->in_kernel) {
-		del_route(tp->router);
-		tp->in_kernel = 0;
-	}
-	if (best_preference && changed_down) {
-		/* Check if we should add routes */
-		int new_max = max_preference();
-		if (new_max != (int) INELIGIBLE_PREF) {
-			tp = table;
-			while (tp) {
-				if (tp->preference == new_max &&
-				    !tp->in_kernel) {
-					add_route(tp->router);
-					tp->in_kernel++;
-				}
-				tp = tp->next;
-			}
+		if (heap_insert(tp) < 0) {
+			logmsg(LOG_ERR, "Out of memory\n");
+			free(tp);
+			return;
 		}
+		TLINK_ADD(hash_head(router), tp, hash);
 	}
-	if (best_preference && (changed_up || changed_down)) {
-		/* Check if we should remove routes already in the kernel */
-		int new_max = max_preference();
-		tp = table;
-		while (tp) {
-			if (tp->preference < new_max && tp->in_kernel) {
-				del_route(tp->router);
-				tp->in_kernel = 0;
-			}
-			tp = tp->next;
-		}
+	wheel_set(tp, ttl);
+
+	if (best_preference && max_preference() != old_max) {
+		sync_best();
+		return;
 	}
+	/* The best routers are the same, only tp may have to change. */
+	eligible = tp->preference != (int) INELIGIBLE_PREF &&
+		(!best_preference || tp->preference == max_preference());
+	if (eligible && !tp->in_kernel)
+		route_add(tp);
+	else if (!eligible && tp->in_kernel)
+		route_del(tp);
 }
 
 void
@@ -31,10 +31,40 @@
 
 #include <arpa/tftp.h>
 
+/* Option negotiation, RFC 2347 */
+#ifndef OACK
+#define	OACK	06
+#endif
+#ifndef EOPTNEG
+#define	EOPTNEG	8
+#endif
+
+#define	MINSEGSIZE	8		/* blksize, RFC 2348 */
+#define	MAXSEGSIZE	65464
+#define	MAXPKTSIZE	(MAXSEGSIZE+4)
+
+extern int segsize;
+
+#define	WBUFSIZE	(128*1024)	/* uploads go to disk in writes this large */
+
+/* file i/o state of one transfer: netascii conversion, write buffer */
+struct tftp_conv {
+	int newline;            /* read: in middle of newline expansion */
+	int prevchar;           /* previous char (cr check) */
+	char *wbuf;             /* write: WBUFSIZE, allocated on first use */
+	int wlen;               /* write: bytes in wbuf */
+};
+
 extern int readit(FILE * file, struct tftphdr **dpp, int convert);
 extern void read_ahead(FILE *file, int convert);
+extern int read_block(FILE *file, char *data, int len, int convert, struct tftp_conv *cv);
 extern int writeit(FILE *file, struct tftphdr **dpp, int ct, int convert);
 extern int write_behind(FILE *file, int convert);
+extern int write_block(FILE *file, char *buf, int count, int convert, struct tftp_conv *cv);
+extern int write_close(FILE *file, struct tftp_conv *cv);
+extern char *map_file(FILE *file, off_t *sizep);
+extern int send_data(int fd, const void *to, socklen_t tolen, int flags,
+		     unsigned long block, const char *data, int len);
 extern int synchnet(int f);
 extern struct tftphdr *w_init(void);
 extern struct tftphdr *r_init(void);
@@ -35,6 +35,7 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <signal.h>
 #include <fcntl.h>
@@ -51,17 +52,25 @@
 #include <string.h>
 #include <stdlib.h>
 #include <grp.h>
+#include <poll.h>
+#include <time.h>
 
 #include "tftp.h"
+#include "iputils_instr.h"
 
 #define	TIMEOUT		5
+#define	MAXWINDOW	64		/* windowsize, RFC 7440 */
 
 int	peer;
 int	rexmtval = TIMEOUT;
 int	maxtimeout = 5*TIMEOUT;
 char	buf[PKTSIZE];
 char	ackbuf[PKTSIZE];
-union {
+char	oackbuf[PKTSIZE];
+int	oacklen;			/* 0: no options, plain RFC 1350 */
+int	windowsize = 1;
+off_t	tsize = -1;
+union sockunion {
 	struct	sockaddr     sa;
 	struct	sockaddr_in  sin;
 	struct	sockaddr_in6 sin6;
@@ -71,12 +80,38 @@ socklen_t	fromlen;
 #define MAXARG	1
 char	*dirs[MAXARG+1];
 
+INSTR_DEFINE;
+#ifdef ENABLE_INSTRUMENT
+static volatile sig_atomic_t got_sigquit;
+
+/* Log the hot path counters when a transfer exits, or on SIGQUIT with -l. */
+static void instr_log(void)
+{
+	char line[512];
+
+	instr_format(line, sizeof(line));
+	syslog(LOG_INFO, "instr %s\n", line);
+}
+
+static void instr_sigquit(int signo __attribute__((__unused__)))
+{
+	got_sigquit = 1;
+}
+#endif
+
 void tftp(struct tftphdr *tp, int size) __attribute__((noreturn));
+void options(char *cp, char *end, int opcode, int convert);
 void nak(int error);
+int errpkt(char *pkt, int error);
 int validate_access(char *filename, int mode);
+int tftpd_listen(const char *port);
+void serve(int fd) __attribute__((noreturn));
 
 struct formats;
 
+int parse_request(struct tftphdr *tp, int size, char **filenamep,
+		  struct formats **pfp, char **optp);
+
 void sendfile(struct formats *pf);
 void recvfile(struct formats *pf);
 
@@ -86,14 +121,33 @@ int main(int ac, char **av)
 	struct tftphdr *tp;
 	int n = 0;
 	int on = 1;
+	int ch, standalone = 0;
+	char *port = "tftp";
+	int fd = -1;
 
-	if (ac == 2 && !strcmp(av[1], "-V")) {
-		printf(IPUTILS_VERSION("tftpd"));
-		return 0;
+	while ((ch = getopt(ac, av, "lp:V")) != EOF) {
+		switch (ch) {
+		case 'l':
+			standalone = 1;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'V':
+			printf(IPUTILS_VERSION("tftpd"));
+			return 0;
+		default:
+			fprintf(stderr, "Usage: tftpd [-l [-p port]] directory\n");
+			exit(1);
+		}
 	}
 
 	openlog("tftpd", LOG_PID, LOG_DAEMON);
 
+	/* before giving up root, the port may need it */
+	if (standalone)
+		fd = tftpd_listen(port);
+
 	/* Sanity. If parent forgot to setuid() on us. */
 	if (geteuid() == 0) {
 		/* Drop all supplementary groups. No error checking is needed */
@@ -104,10 +158,13 @@ int main(int ac, char **av)
 		}
 	}
 
-	ac--; av++;
+	ac -= optind; av += optind;
 	while (ac-- > 0 && n < MAXARG)
 		dirs[n++] = *av++;
 
+	if (standalone)
+		serve(fd);
+
 	if (ioctl(0, FIONBIO, &on) < 0) {
 		syslog(LOG_ERR, "ioctl(FIONBIO): %s\n", strerror(errno));
 		exit(1);
@@ -171,6 +228,9 @@ int main(int ac, char **av)
 			exit(0);
 		}
 	}
+#ifdef ENABLE_INSTRUMENT
+	atexit(instr_log);
+#endif
 	alarm(0);
 	close(0);
 	close(1);
@@ -203,26 +263,26 @@ struct formats {
 };
 
 /*
- * Handle initial connection protocol.
+ * Split a request into file name and mode. Returns a TFTP error code,
+ * or 0 with *optp at the options which may follow the mode.
  */
-void tftp(struct tftphdr *tp, int size)
+int parse_request(struct tftphdr *tp, int size, char **filenamep,
+		  struct formats **pfp, char **optp)
 {
-	char *cp;
-	int first = 1, ecode;
+	char *cp, *end = (char *)tp + size;
+	int first = 1;
 	struct formats *pf;
-	char *filename, *mode = NULL;
+	char *mode = NULL;
 
-	filename = cp = tp->th_stuff;
+	*filenamep = cp = tp->th_stuff;
 again:
-	while (cp < buf + size) {
+	while (cp < end) {
 		if (*cp == '\0')
 			break;
 		cp++;
 	}
-	if (*cp != '\0') {
-		nak(EBADOP);
-		exit(1);
-	}
+	if (cp >= end)
+		return EBADOP;
 	if (first) {
 		mode = ++cp;
 		first = 0;
@@ -234,8 +294,26 @@ again:
 	for (pf = formats; pf->f_mode; pf++)
 		if (strcmp(pf->f_mode, mode) == 0)
 			break;
-	if (pf->f_mode == 0) {
-		nak(EBADOP);
+	if (pf->f_mode == 0)
+		return EBADOP;
+	*pfp = pf;
+	*optp = cp + 1;
+	return 0;
+}
+
+/*
+ * Handle initial connection protocol.
+ */
+void tftp(struct tftphdr *tp, int size)
+{
+	char *opts;
+	int ecode;
+	struct formats *pf;
+	char *filename;
+
+	ecode = parse_request(tp, size, &filename, &pf, &opts);
+	if (ecode) {
+		nak(ecode);
 		exit(1);
 	}
 	ecode = (*pf->f_validate)(filename, tp->th_opcode);
@@ -243,6 +321,7 @@ again:
 		nak(ecode);
 		exit(1);
 	}
+	options(opts, (char *)tp + size, tp->th_opcode, pf->f_convert);
 	if (tp->th_opcode == WRQ)
 		(*pf->f_recv)(pf);
 	else
@@ -250,6 +329,84 @@ again:
 	exit(0);
 }
 
+/* Append "name" = "value" to the OACK. */
+static void oack_add(const char *name, long long value)
+{
+	int n;
+
+	n = snprintf(oackbuf + oacklen, sizeof(oackbuf) - oacklen,
+		     "%s%c%lld", name, '\0', value);
+	if (n < 0 || n + 1 > (int)sizeof(oackbuf) - oacklen)
+		return;
+	oacklen += n + 1;
+}
+
+/*
+ * Options after the mode (RFC 2347): blksize (RFC 2348), timeout and
+ * tsize (RFC 2349), windowsize (RFC 7440). Unknown or bad ones are
+ * ignored, values too large are lowered. The accepted ones go into
+ * oackbuf; windowsize only for reads, where we are the sender.
+ */
+void options(char *cp, char *end, int opcode, int convert)
+{
+	struct tftphdr *op = (struct tftphdr *)oackbuf;
+	char *name, *value, *ep;
+	long long v;
+
+	op->th_opcode = htons((unsigned short)OACK);
+	oacklen = (char *)&op->th_stuff - oackbuf;
+
+	while (cp < end) {
+		name = cp;
+		while (cp < end && *cp)
+			cp++;
+		if (++cp >= end)
+			break;
+		value = cp;
+		while (cp < end && *cp)
+			cp++;
+		if (cp++ >= end)
+			break;
+
+		errno = 0;
+		v = strtoll(value, &ep, 10);
+		if (errno || ep == value || *ep || v < 0)
+			continue;
+
+		if (strcasecmp(name, "blksize") == 0) {
+			if (v < MINSEGSIZE)
+				continue;
+			if (v > MAXSEGSIZE)
+				v = MAXSEGSIZE;
+			segsize = v;
+			oack_add("blksize", v);
+		} else if (strcasecmp(name, "windowsize") == 0) {
+			if (opcode != RRQ || v < 1)
+				continue;
+			if (v > MAXWINDOW)
+				v = MAXWINDOW;
+			windowsize = v;
+			oack_add("windowsize", v);
+		} else if (strcasecmp(name, "timeout") == 0) {
+			if (v < 1 || v > 255)
+				continue;
+			rexmtval = v;
+			maxtimeout = 5*rexmtval;
+			oack_add("timeout", v);
+		} else if (strcasecmp(name, "tsize") == 0) {
+			/* the size of a netascii file is not known ahead */
+			if (opcode == RRQ) {
+				if (convert || tsize < 0)
+					continue;
+				v = tsize;
+			}
+			oack_add("tsize", v);
+		}
+	}
+	if (oacklen == (char *)&op->th_stuff - oackbuf)
+		oacklen = 0;
+}
+
 
 FILE *file;
 
@@ -293,6 +450,8 @@ int validate_access(char *filename, int mode)
 		return (errno == ENOENT ? ENOTFOUND : EACCESS);
 	}
 	if (mode == RRQ) {
+		if (S_ISREG(stbuf.st_mode))
+			tsize = stbuf.st_size;
 		if ((stbuf.st_mode&(S_IREAD >> 6)) == 0) {
 			syslog(LOG_ERR, "not readable %s", filename);
 			return (EACCESS);
@@ -329,67 +488,155 @@ void timer(int signo __attribute__((__unused__)))
 }
 
 /*
- * Send the requested file.
+ * Send the OACK of a read request and wait for its ACK of block 0.
+ */
+int oack_sync(void)
+{
+	struct tftphdr *ap = (struct tftphdr *)ackbuf;
+	int n;
+
+	timeout = 0;
+	(void) setjmp(timeoutbuf);
+	if (send(peer, oackbuf, oacklen, 0) != oacklen) {
+		syslog(LOG_ERR, "tftpd: write: %s\n", strerror(errno));
+		return -1;
+	}
+	for ( ; ; ) {
+		alarm(rexmtval);
+		n = recv(peer, ackbuf, sizeof (ackbuf), 0);
+		alarm(0);
+		if (n < 0) {
+			syslog(LOG_ERR, "tftpd: read: %s\n", strerror(errno));
+			return -1;
+		}
+		if (n < 4)
+			continue;
+		if (ntohs(ap->th_opcode) == ERROR)
+			return -1;
+		if (ntohs(ap->th_opcode) == ACK && ap->th_block == 0)
+			return 0;
+	}
+}
+
+/*
+ * Send the requested file, up to windowsize blocks before an ACK
+ * (RFC 7440; 1 is plain lock-step). Blocks stay in a ring until they
+ * are acknowledged. The client ACKs the end of a window or the last
+ * block it got in order; either way sending goes on after the block
+ * acknowledged, and a timeout resends the window from its start.
+ * An octet file that can be mapped needs no ring, its blocks are sent
+ * straight from the mapping.
  */
 void sendfile(struct formats *pf)
 {
 	struct tftphdr *dp;
 	struct tftphdr *ap;    /* ack packet */
-	volatile int block = 1;
+	int slotsize = (segsize + 4 + 3) & ~3;
+	static int sizes[MAXWINDOW];
+	struct tftp_conv cv = { 0, -1, NULL, 0 };
+	char *ring, *map;
+	off_t mapsize, off;
+	/* block numbers, not wrapped at 65536 */
+	volatile unsigned long base = 1, next = 1, top = 0, last = 0;
+	unsigned short acked;
+	long long t;
 	int size, n;
 
 	confirmed = 0;
 	signal(SIGALRM, timer);
-	dp = r_init();
 	ap = (struct tftphdr *)ackbuf;
-	do {
-		size = readit(file, &dp, pf->f_convert);
+	map = pf->f_convert ? NULL : map_file(file, &mapsize);
+	ring = map ? NULL : malloc((size_t)windowsize * slotsize);
+	if (map == NULL && ring == NULL) {
+		nak(ENOSPACE);
+		goto abort;
+	}
+	if (oacklen && oack_sync() < 0)
+		goto abort;
+
+	timeout = 0;
+	if (setjmp(timeoutbuf))
+		next = base;
+	for ( ; ; ) {
+		for ( ; next < base + windowsize && (!last || next <= last); next++) {
+			if (map) {
+				off = (off_t)(next - 1) * segsize;
+				size = mapsize - off < segsize ? mapsize - off : segsize;
+				if (size < segsize)
+					last = next;
+				t = INSTR_START();
+				n = send_data(peer, NULL, 0, confirmed, next, map + off, size);
+				INSTR_STOP(SEND, t);
+				goto sent;
+			}
+			dp = (struct tftphdr *)(ring + (next % windowsize) * slotsize);
+			if (next > top) {
+				t = INSTR_START();
+				size = read_block(file, dp->th_data, segsize, pf->f_convert, &cv);
+				INSTR_STOP(FILE, t);
+				if (size < 0) {
+					nak(errno + 100);
+					goto abort;
+				}
+				dp->th_opcode = htons((unsigned short)DATA);
+				dp->th_block = htons((unsigned short)next);
+				sizes[next % windowsize] = size;
+				if (size < segsize)
+					last = next;
+				top = next;
+			}
+			size = sizes[next % windowsize];
+			t = INSTR_START();
+			n = send(peer, dp, size + 4, confirmed);
+			INSTR_STOP(SEND, t);
+sent:
+			if (n != size + 4) {
+				INSTR_ERRNO(errno);
+				syslog(LOG_ERR, "tftpd: write: %s\n", strerror(errno));
+				goto abort;
+			}
+			confirmed = 0;
+		}
+		alarm(rexmtval);        /* read the ack */
+		t = INSTR_START();
+		size = recv(peer, ackbuf, sizeof (ackbuf), 0);
+		INSTR_STOP(RECV, t);
+		alarm(0);
 		if (size < 0) {
-			nak(errno + 100);
+			syslog(LOG_ERR, "tftpd: read: %s\n", strerror(errno));
 			goto abort;
 		}
-		dp->th_opcode = htons((unsigned short)DATA);
-		dp->th_block = htons((unsigned short)block);
-		timeout = 0;
-		(void) setjmp(timeoutbuf);
+		if (size < 4)
+			continue;
+		ap->th_opcode = ntohs((unsigned short)ap->th_opcode);
+		ap->th_block = ntohs((unsigned short)ap->th_block);
 
-send_data:
-		if (send(peer, dp, size + 4, confirmed) != size + 4) {
-			syslog(LOG_ERR, "tftpd: write: %s\n", strerror(errno));
+		if (ap->th_opcode == ERROR)
 			goto abort;
-		}
-		confirmed = 0;
-		read_ahead(file, pf->f_convert);
-		for ( ; ; ) {
-			alarm(rexmtval);        /* read the ack */
-			n = recv(peer, ackbuf, sizeof (ackbuf), 0);
-			alarm(0);
-			if (n < 0) {
-				syslog(LOG_ERR, "tftpd: read: %s\n", strerror(errno));
-				goto abort;
-			}
-			ap->th_opcode = ntohs((unsigned short)ap->th_opcode);
-			ap->th_block = ntohs((unsigned short)ap->th_block);
-
-			if (ap->th_opcode == ERROR)
-				goto abort;
-
-			if (ap->th_opcode == ACK) {
-				if (ap->th_block == block) {
-					confirmed = MSG_CONFIRM;
-					break;
-				}
-				/* Re-synchronize with the other side */
-				synchnet(peer);
-				if (ap->th_block == (block -1)) {
-					goto send_data;
-				}
-			}
+		if (ap->th_opcode != ACK)
+			continue;
 
+		/* how far past base - 1 it goes */
+		acked = ap->th_block - (unsigned short)(base - 1);
+		if (acked > next - base)
+			continue;
+		if (acked == 0) {
+			/* Re-synchronize with the other side */
+			synchnet(peer);
+			next = base;
+			continue;
 		}
-		block++;
-	} while (size == SEGSIZE);
+		base += acked;
+		timeout = 0;
+		confirmed = MSG_CONFIRM;
+		if (last && base > last)
+			break;
+		next = base;
+	}
 abort:
+	if (map)
+		munmap(map, mapsize);
+	free(ring);
 	(void) fclose(file);
 }
 
@@ -407,6 +654,7 @@ void recvfile(struct formats *pf)
 	struct tftphdr *dp;
 	struct tftphdr *ap;    /* ack buffer */
 	volatile int block = 0, n, size;
+	long long t;
 
 	confirmed = 0;
 	signal(SIGALRM, timer);
@@ -419,15 +667,31 @@ void recvfile(struct formats *pf)
 		block++;
 		(void) setjmp(timeoutbuf);
 send_ack:
-		if (send(peer, ackbuf, 4, confirmed) != 4) {
-			syslog(LOG_ERR, "tftpd: write: %s\n", strerror(errno));
-			goto abort;
+		/* with options the OACK stands for ACK 0 */
+		if (block == 1 && oacklen) {
+			if (send(peer, oackbuf, oacklen, confirmed) != oacklen) {
+				syslog(LOG_ERR, "tftpd: write: %s\n", strerror(errno));
+				goto abort;
+			}
+		} else {
+			t = INSTR_START();
+			n = send(peer, ackbuf, 4, confirmed);
+			INSTR_STOP(SEND, t);
+			if (n != 4) {
+				INSTR_ERRNO(errno);
+				syslog(LOG_ERR, "tftpd: write: %s\n", strerror(errno));
+				goto abort;
+			}
 		}
 		confirmed = 0;
+		t = INSTR_START();
 		write_behind(file, pf->f_convert);
+		INSTR_STOP(FILE, t);
 		for ( ; ; ) {
 			alarm(rexmtval);
-			n = recv(peer, dp, PKTSIZE, 0);
+			t = INSTR_START();
+			n = recv(peer, dp, MAXPKTSIZE, 0);
+			INSTR_STOP(RECV, t);
 			alarm(0);
 			if (n < 0) {            /* really? */
 				syslog(LOG_ERR, "tftpd: read: %s\n", strerror(errno));
@@ -449,15 +713,20 @@ send_ack:
 			}
 		}
 		/*  size = write(file, dp->th_data, n - 4); */
+		t = INSTR_START();
 		size = writeit(file, &dp, n - 4, pf->f_convert);
+		INSTR_STOP(FILE, t);
 		if (size != (n-4)) {                    /* ahem */
 			if (size < 0) nak(errno + 100);
 			else nak(ENOSPACE);
 			goto abort;
 		}
-	} while (size == SEGSIZE);
+	} while (size == segsize);
 	write_behind(file, pf->f_convert);
-	(void) fclose(file);            /* close data file */
+	if (write_close(file, NULL) < 0) {     /* close data file */
+		nak(errno + 100);
+		goto abort;
+	}
 
 	ap->th_opcode = htons((unsigned short)ACK);    /* send the "final" ack */
 	ap->th_block = htons((unsigned short)(block));
@@ -498,12 +767,22 @@ struct errmsg {
  * offset by 100.
  */
 void nak(int error)
+{
+	int length;
+
+	length = errpkt(buf, error);
+	if (send(peer, buf, length, 0) != length)
+		syslog(LOG_ERR, "nak: %s\n", strerror(errno));
+}
+
+/* Build the error packet for nak() in pkt, return its length. */
+int errpkt(char *pkt, int error)
 {
 	struct tftphdr *tp;
 	int length;
 	struct errmsg *pe;
 
-	tp = (struct tftphdr *)buf;
+	tp = (struct tftphdr *)pkt;
 	tp->th_opcode = htons((unsigned short)ERROR);
 	tp->th_code = htons((unsigned short)error);
 	for (pe = errmsgs; pe->e_code >= 0; pe++)
@@ -517,6 +796,572 @@ void nak(int error)
 	length = strlen(pe->e_msg);
 	tp->th_msg[length] = '\0';
 	length += 5;
-	if (send(peer, buf, length, 0) != length)
+	return length;
+}
+
+/*
+ * Standalone server (-l). A single socket on the tftp port carries all
+ * the transfers, told apart by the client address; each is a struct
+ * xfer hashed on it. serve() drives them from the packets that come in
+ * and from a scan for timeouts every XFER_TICK ms; a window that finds
+ * the socket buffer full is picked up again once it drains. Requests go through
+ * validate_access() and options() as from inetd, and what these leave
+ * in the globals is taken over by the new transfer.
+ */
+#define	XFER_HASH	256
+#define	XFER_MAX	1024
+#define	XFER_TICK	250		/* ms */
+
+enum {
+	XF_OACK,			/* read, OACK sent */
+	XF_SEND,			/* read, sending data */
+	XF_RECV,			/* write, receiving data */
+	XF_DALLY,			/* write done, final ACK may be lost */
+};
+
+struct xfer {
+	struct xfer	*hnext;
+	struct xfer	*lnext, *lprev;	/* all transfers, for the scan */
+	union sockunion	peer;
+	socklen_t	peerlen;
+	FILE		*file;
+	int		convert;
+	int		state;
+	int		segsize;
+	int		windowsize;
+	int		rexmtval;
+	int		timeout;	/* seconds waited in vain so far */
+	int		blocked;	/* window stopped on a full socket buffer */
+	long long	deadline;	/* ms, CLOCK_MONOTONIC */
+	/* block numbers, not wrapped at 65536; base is the last one received on writes */
+	unsigned long	base, next, top, last;
+	struct tftp_conv conv;
+	char		*ring;		/* windowsize blocks, or */
+	char		*map;		/* the whole octet file */
+	off_t		mapsize;
+	int		sizes[MAXWINDOW];
+	char		*oack;
+	int		oacklen;
+};
+
+struct xfer *xfer_hash[XFER_HASH];
+struct xfer *xfers;
+int nxfers;
+int nblocked;
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static unsigned int xfer_hashfn(union sockunion *su, socklen_t len)
+{
+	unsigned char *p = (unsigned char *)su;
+	unsigned int h = 0;
+
+	while (len--)
+		h = h * 31 + *p++;
+	return h % XFER_HASH;
+}
+
+static struct xfer *xfer_find(union sockunion *su, socklen_t len)
+{
+	struct xfer *x;
+
+	for (x = xfer_hash[xfer_hashfn(su, len)]; x; x = x->hnext)
+		if (x->peerlen == len && memcmp(&x->peer, su, len) == 0)
+			return x;
+	return NULL;
+}
+
+static void xfer_free(struct xfer *x)
+{
+	struct xfer **xp;
+
+	for (xp = &xfer_hash[xfer_hashfn(&x->peer, x->peerlen)]; *xp != x; xp = &(*xp)->hnext)
+		;
+	*xp = x->hnext;
+	if (x->lnext)
+		x->lnext->lprev = x->lprev;
+	if (x->lprev)
+		x->lprev->lnext = x->lnext;
+	else
+		xfers = x->lnext;
+	nxfers--;
+	if (x->blocked)
+		nblocked--;
+
+	if (x->file)
+		fclose(x->file);
+	if (x->map)
+		munmap(x->map, x->mapsize);
+	free(x->conv.wbuf);
+	free(x->ring);
+	free(x->oack);
+	free(x);
+}
+
+/*
+ * n of len bytes went out to x, the retransmission timer restarts.
+ * -1 if the socket buffer was full, then nothing changes.
+ */
+static int xfer_sent(struct xfer *x, int n, int len)
+{
+	if (n != len) {
+		INSTR_ERRNO(errno);
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+			return -1;
+		syslog(LOG_ERR, "tftpd: write: %s\n", strerror(errno));
+	}
+	x->deadline = now_ms() + x->rexmtval * 1000LL;
+	return 0;
+}
+
+/* An ACK or OACK; one the socket had no room for counts as lost. */
+static void xfer_send(int fd, struct xfer *x, void *pkt, int len)
+{
+	long long t = INSTR_START();
+	int n;
+
+	n = sendto(fd, pkt, len, 0, &x->peer.sa, x->peerlen);
+	INSTR_STOP(SEND, t);
+	if (xfer_sent(x, n, len) < 0)
+		x->deadline = now_ms() + x->rexmtval * 1000LL;
+}
+
+static void xfer_nak(int fd, union sockunion *to, socklen_t tolen, int error)
+{
+	char pkt[PKTSIZE];
+	int len;
+
+	len = errpkt(pkt, error);
+	if (sendto(fd, pkt, len, 0, &to->sa, tolen) != len)
 		syslog(LOG_ERR, "nak: %s\n", strerror(errno));
 }
+
+/* ACK of the last block received, or the OACK standing for ACK 0 */
+static void xfer_ack(int fd, struct xfer *x)
+{
+	struct tftphdr ack;
+
+	if (x->base == 0 && x->oacklen) {
+		xfer_send(fd, x, x->oack, x->oacklen);
+		return;
+	}
+	ack.th_opcode = htons((unsigned short)ACK);
+	ack.th_block = htons((unsigned short)x->base);
+	xfer_send(fd, x, &ack, 4);
+}
+
+/*
+ * Send the window from x->next on, as sendfile() does; 0 or an error.
+ * On a full socket buffer the window stops at the block that did not
+ * go out, and x is marked blocked for serve() to resume.
+ */
+static int xfer_window(int fd, struct xfer *x)
+{
+	int slotsize = (x->segsize + 4 + 3) & ~3;
+	struct tftphdr *dp;
+	long long t;
+	off_t off;
+	int size, n;
+
+	if (x->blocked) {
+		x->blocked = 0;
+		nblocked--;
+	}
+	for ( ; x->next < x->base + x->windowsize && (!x->last || x->next <= x->last); x->next++) {
+		if (x->map) {
+			off = (off_t)(x->next - 1) * x->segsize;
+			size = x->mapsize - off < x->segsize ? x->mapsize - off : x->segsize;
+			if (size < x->segsize)
+				x->last = x->next;
+			t = INSTR_START();
+			n = send_data(fd, &x->peer.sa, x->peerlen, 0, x->next, x->map + off, size);
+			INSTR_STOP(SEND, t);
+			if (xfer_sent(x, n, size + 4) < 0)
+				break;
+			continue;
+		}
+		dp = (struct tftphdr *)(x->ring + (x->next % x->windowsize) * slotsize);
+		if (x->next > x->top) {
+			t = INSTR_START();
+			size = read_block(x->file, dp->th_data, x->segsize, x->convert, &x->conv);
+			INSTR_STOP(FILE, t);
+			if (size < 0)
+				return errno + 100;
+			dp->th_opcode = htons((unsigned short)DATA);
+			dp->th_block = htons((unsigned short)x->next);
+			x->sizes[x->next % x->windowsize] = size;
+			if (size < x->segsize)
+				x->last = x->next;
+			x->top = x->next;
+		}
+		size = x->sizes[x->next % x->windowsize] + 4;
+		t = INSTR_START();
+		n = sendto(fd, dp, size, 0, &x->peer.sa, x->peerlen);
+		INSTR_STOP(SEND, t);
+		if (xfer_sent(x, n, size) < 0)
+			break;
+	}
+	if (x->next < x->base + x->windowsize && (!x->last || x->next <= x->last)) {
+		x->blocked = 1;
+		nblocked++;
+	}
+	return 0;
+}
+
+/* The socket has room again: carry on with the windows it stopped. */
+static void xfer_resume(int fd)
+{
+	struct xfer *x, *next;
+	int ecode;
+
+	for (x = xfers; x && nblocked; x = next) {
+		next = x->lnext;
+		if (!x->blocked)
+			continue;
+		ecode = xfer_window(fd, x);
+		if (ecode) {
+			xfer_nak(fd, &x->peer, x->peerlen, ecode);
+			xfer_free(x);
+		}
+	}
+}
+
+static void xfer_start(int fd, struct tftphdr *tp, int size, union sockunion *su, socklen_t len)
+{
+	struct formats *pf;
+	char *filename, *opts;
+	struct xfer *x;
+	int opcode = ntohs(tp->th_opcode);
+	int ecode;
+	unsigned int h;
+
+	if (nxfers >= XFER_MAX) {
+		xfer_nak(fd, su, len, EUNDEF);
+		return;
+	}
+	ecode = parse_request(tp, size, &filename, &pf, &opts);
+	if (ecode) {
+		xfer_nak(fd, su, len, ecode);
+		return;
+	}
+	/* the defaults, as options() expects them */
+	segsize = SEGSIZE;
+	windowsize = 1;
+	rexmtval = TIMEOUT;
+	maxtimeout = 5*TIMEOUT;
+	tsize = -1;
+	file = NULL;
+	ecode = (*pf->f_validate)(filename, opcode);
+	if (ecode) {
+		xfer_nak(fd, su, len, ecode);
+		return;
+	}
+	options(opts, (char *)tp + size, opcode, pf->f_convert);
+
+	x = calloc(1, sizeof(*x));
+	if (x && oacklen)
+		x->oack = malloc(oacklen);
+	if (x && opcode == RRQ && !pf->f_convert)
+		x->map = map_file(file, &x->mapsize);
+	if (x && opcode == RRQ && !x->map)
+		x->ring = malloc((size_t)windowsize * ((segsize + 4 + 3) & ~3));
+	if (!x || (oacklen && !x->oack) || (opcode == RRQ && !x->map && !x->ring)) {
+		if (x) {
+			if (x->map)
+				munmap(x->map, x->mapsize);
+			free(x->oack);
+			free(x);
+		}
+		fclose(file);
+		xfer_nak(fd, su, len, ENOSPACE);
+		return;
+	}
+	memcpy(&x->peer, su, len);
+	x->peerlen = len;
+	x->file = file;
+	file = NULL;
+	x->convert = pf->f_convert;
+	x->segsize = segsize;
+	x->windowsize = windowsize;
+	x->rexmtval = rexmtval;
+	x->conv.prevchar = -1;
+	if (oacklen)
+		memcpy(x->oack, oackbuf, oacklen);
+	x->oacklen = oacklen;
+
+	h = xfer_hashfn(su, len);
+	x->hnext = xfer_hash[h];
+	xfer_hash[h] = x;
+	x->lnext = xfers;
+	if (xfers)
+		xfers->lprev = x;
+	xfers = x;
+	nxfers++;
+
+	if (opcode == WRQ) {
+		x->state = XF_RECV;
+		xfer_ack(fd, x);
+		return;
+	}
+	x->base = x->next = 1;
+	if (x->oacklen) {
+		x->state = XF_OACK;
+		xfer_send(fd, x, x->oack, x->oacklen);
+		return;
+	}
+	x->state = XF_SEND;
+	ecode = xfer_window(fd, x);
+	if (ecode) {
+		xfer_nak(fd, su, len, ecode);
+		xfer_free(x);
+	}
+}
+
+/* A packet for a transfer under way. */
+static void xfer_input(int fd, struct xfer *x, struct tftphdr *tp, int size)
+{
+	unsigned short block, acked;
+	int opcode, ecode = 0, n;
+	long long t;
+
+	if (size < 4)
+		return;
+	opcode = ntohs(tp->th_opcode);
+	block = ntohs(tp->th_block);
+	if (opcode == ERROR) {
+		xfer_free(x);
+		return;
+	}
+
+	switch (x->state) {
+	case XF_OACK:
+		if (opcode != ACK || block != 0)
+			return;
+		x->state = XF_SEND;
+		x->timeout = 0;
+		ecode = xfer_window(fd, x);
+		break;
+	case XF_SEND:
+		if (opcode != ACK)
+			return;
+		acked = block - (unsigned short)(x->base - 1);
+		if (acked > x->next - x->base)
+			return;
+		/* a duplicate ACK in lock-step is left to the timeout (RFC 1123) */
+		if (acked == 0 && x->windowsize == 1)
+			return;
+		x->base += acked;
+		if (acked)
+			x->timeout = 0;
+		if (x->last && x->base > x->last) {
+			xfer_free(x);
+			return;
+		}
+		x->next = x->base;
+		ecode = xfer_window(fd, x);
+		break;
+	case XF_RECV:
+		if (opcode != DATA)
+			return;
+		if (block == (unsigned short)x->base) {
+			xfer_ack(fd, x);	/* our ACK was lost */
+			return;
+		}
+		if (block != (unsigned short)(x->base + 1))
+			return;
+		size -= 4;
+		if (size > x->segsize)
+			return;
+		errno = 0;
+		t = INSTR_START();
+		n = write_block(x->file, tp->th_data, size, x->convert, &x->conv);
+		INSTR_STOP(FILE, t);
+		if (n != size) {
+			ecode = errno ? errno + 100 : ENOSPACE;
+			break;
+		}
+		x->base++;
+		x->timeout = 0;
+		if (size < x->segsize) {
+			n = write_close(x->file, &x->conv);
+			x->file = NULL;
+			if (n < 0) {
+				ecode = errno + 100;
+				break;
+			}
+			x->state = XF_DALLY;
+		}
+		xfer_ack(fd, x);
+		break;
+	case XF_DALLY:
+		if (opcode == DATA && block == (unsigned short)x->base)
+			xfer_ack(fd, x);
+		break;
+	}
+	if (ecode) {
+		xfer_nak(fd, &x->peer, x->peerlen, ecode);
+		xfer_free(x);
+	}
+}
+
+/* Retransmit for the transfers whose time is up, drop the dead ones. */
+static void xfer_timeouts(int fd, long long now)
+{
+	struct xfer *x, *next;
+	int ecode;
+
+	for (x = xfers; x; x = next) {
+		next = x->lnext;
+		if (now < x->deadline)
+			continue;
+		x->timeout += x->rexmtval;
+		if (x->state == XF_DALLY || x->timeout >= 5*x->rexmtval) {
+			xfer_free(x);
+			continue;
+		}
+		switch (x->state) {
+		case XF_OACK:
+			xfer_send(fd, x, x->oack, x->oacklen);
+			break;
+		case XF_SEND:
+			x->next = x->base;
+			ecode = xfer_window(fd, x);
+			if (ecode) {
+				xfer_nak(fd, &x->peer, x->peerlen, ecode);
+				xfer_free(x);
+			}
+			break;
+		case XF_RECV:
+			xfer_ack(fd, x);
+			break;
+		}
+	}
+}
+
+int tftpd_listen(const char *port)
+{
+	struct sockaddr_in6 sin6;
+	struct sockaddr_in sin;
+	struct servent *sp;
+	int fd, on = 1, off = 0;
+	int rcvbuf = 1 << 20, sndbuf = 1 << 20;
+	unsigned short pnum;
+
+	if ((sp = getservbyname(port, "udp")) != NULL)
+		pnum = sp->s_port;
+	else if (atoi(port) > 0 && atoi(port) < 65536)
+		pnum = htons(atoi(port));
+	else {
+		syslog(LOG_ERR, "bad port %s\n", port);
+		exit(1);
+	}
+
+	/* IPv6 with v4-mapped addresses, or else IPv4 only */
+	memset(&sin6, 0, sizeof(sin6));
+	sin6.sin6_family = AF_INET6;
+	sin6.sin6_port = pnum;
+	fd = socket(AF_INET6, SOCK_DGRAM, 0);
+	if (fd >= 0 && (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0 ||
+			bind(fd, (struct sockaddr *)&sin6, sizeof(sin6)) < 0)) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0) {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = pnum;
+		fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (fd < 0) {
+			syslog(LOG_ERR, "socket: %s\n", strerror(errno));
+			exit(1);
+		}
+		if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+			syslog(LOG_ERR, "bind: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	if (ioctl(fd, FIONBIO, &on) < 0) {
+		syslog(LOG_ERR, "ioctl(FIONBIO): %s\n", strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+void serve(int fd)
+{
+	static char pkt[MAXPKTSIZE];
+	struct tftphdr *tp = (struct tftphdr *)pkt;
+	struct pollfd pfd;
+	long long now, scan = 0;
+	union sockunion su;
+	socklen_t len;
+	struct xfer *x;
+	long long t;
+	int i, n, opcode;
+
+#ifdef ENABLE_INSTRUMENT
+	signal(SIGQUIT, instr_sigquit);
+#endif
+	pfd.fd = fd;
+	for (;;) {
+#ifdef ENABLE_INSTRUMENT
+		if (got_sigquit) {
+			got_sigquit = 0;
+			instr_log();
+		}
+#endif
+		pfd.events = nblocked ? POLLIN | POLLOUT : POLLIN;
+		t = INSTR_START();
+		n = poll(&pfd, 1, xfers ? XFER_TICK : -1);
+		INSTR_STOP(POLL, t);
+		if (n < 0 && errno != EINTR) {
+			syslog(LOG_ERR, "poll: %s\n", strerror(errno));
+			exit(1);
+		}
+		if (n > 0)
+			INSTR_COUNT(WAKEUP);
+		if (n > 0 && (pfd.revents & POLLOUT))
+			xfer_resume(fd);
+		/* a bounded batch, so that timeouts are not starved */
+		for (i = 0; i < 64; i++) {
+			len = sizeof(su);
+			t = INSTR_START();
+			n = recvfrom(fd, pkt, sizeof(pkt), 0, &su.sa, &len);
+			INSTR_STOP(RECV, t);
+			if (n < 0) {
+				INSTR_ERRNO(errno);
+				if (errno != EAGAIN && errno != EINTR)
+					syslog(LOG_ERR, "recvfrom: %s\n", strerror(errno));
+				break;
+			}
+			if (n < 4)
+				continue;
+			opcode = ntohs(tp->th_opcode);
+			x = xfer_find(&su, len);
+			if (opcode == RRQ || opcode == WRQ) {
+				/* a repeated request is answered by its transfer */
+				if (x && x->state != XF_DALLY)
+					continue;
+				if (x)
+					xfer_free(x);
+				xfer_start(fd, tp, n, &su, len);
+			} else if (x)
+				xfer_input(fd, x, tp, n);
+			else if (opcode != ERROR)
+				xfer_nak(fd, &su, len, EBADID);
+		}
+		now = now_ms();
+		if (now >= scan) {
+			xfer_timeouts(fd, now);
+			scan = now + XFER_TICK;
+		}
+	}
+}
@@ -30,38 +30,46 @@
    server.  Written originally with multiple buffers in mind, but current
    implementation has two buffer logic wired in.
 
-   Todo:  add some sort of final error check so when the write-buffer
-   is finally flushed, the caller can detect if the disk filled up
-   (or had an i/o error) and return a nak to the other side.
-
 			Jim Guyton 10/85
+
+   Below the buffers, octet files are read by mapping them and sending
+   blocks straight out of the mapping, and uploads are gathered into
+   WBUFSIZE writes; write_close() tells whether the last of them made
+   it to the disk.
  */
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 
 #include "tftp.h"
 
 struct bf {
 	int counter;            /* size of data in buffer, or flag */
-	char buf[PKTSIZE];      /* room for data packet */
+	char buf[MAXPKTSIZE];   /* room for data packet */
 } bfs[2];
 
 				/* Values for bf.counter  */
 #define BF_ALLOC -3             /* alloc'd but not yet filled */
 #define BF_FREE  -2             /* free */
-/* [-1 .. SEGSIZE] = size of data in the data buffer */
+/* [-1 .. segsize] = size of data in the data buffer */
 
 static int nextone;     /* index of next buffer to use */
 static int current;     /* index of buffer in use */
 
-			/* control flags for crlf conversions */
-int newline = 0;        /* fillbuf: in middle of newline expansion */
-int prevchar = -1;      /* putbuf: previous char (cr check) */
+static struct tftp_conv conv = { 0, -1, NULL, 0 };   /* for the buffers above */
+
+int segsize = SEGSIZE;  /* data bytes per block, blksize option */
 
 struct tftphdr *rw_init(int);
 
@@ -72,8 +80,9 @@ struct tftphdr *r_init() { return rw_init(1); }         /* read-ahead */
 /* x is zero for write-behind, one for read-head */
 struct tftphdr *rw_init(int x)
 {
-	newline = 0;            /* init crlf flag */
-	prevchar = -1;
+	conv.newline = 0;       /* init crlf flag */
+	conv.prevchar = -1;
+	conv.wlen = 0;
 	bfs[0].counter =  BF_ALLOC;     /* pass out the first buffer */
 	current = 0;
 	bfs[1].counter = BF_FREE;
@@ -108,9 +117,6 @@ int readit(FILE * file, struct tftphdr **dpp, int convert)
  */
 void read_ahead(FILE *file, int convert)
 {
-	int i;
-	char *p;
-	int c;
 	struct bf *b;
 	struct tftphdr *dp;
 
@@ -120,32 +126,75 @@ void read_ahead(FILE *file, int convert)
 	nextone = !nextone;             /* "incr" next buffer ptr */
 
 	dp = (struct tftphdr *)b->buf;
+	b->counter = read_block(file, dp->th_data, segsize, convert, &conv);
+}
+
+/* What follows the cr that a char becomes in netascii, plus one; 0: as is */
+static const unsigned char netascii_cr[256] = {
+	['\n'] = 1 + '\n',     /* lf to cr,lf */
+	['\r'] = 1 + '\0',     /* cr to cr,nul */
+};
+
+/*
+ * Read the next block of up to len bytes into data, converted as above
+ * with the state in cv. Returns its size, short at the end of the file,
+ * or -1.
+ */
+int read_block(FILE *file, char *data, int len, int convert, struct tftp_conv *cv)
+{
+	char *p, *in, *end;
+	int i, n, c;
 
 	if (convert == 0) {
-		b->counter = read(fileno(file), dp->th_data, SEGSIZE);
-		return;
-	}
+		int n, size = 0;
 
-	p = dp->th_data;
-	for (i = 0 ; i < SEGSIZE; i++) {
-		if (newline) {
-			if (prevchar == '\n')
-				c = '\n';       /* lf to cr,lf */
-			else    c = '\0';       /* cr to cr,nul */
-			newline = 0;
+		/* a large block may come in pieces */
+		while (size < len) {
+			n = read(fileno(file), data + size, len - size);
+			if (n < 0)
+				return -1;
+			if (n == 0)
+				break;
+			size += n;
 		}
-		else {
-			c = getc(file);
-			if (c == EOF) break;
-			if (c == '\n' || c == '\r') {
-				prevchar = c;
-				c = '\r';
-				newline = 1;
+		return size;
+	}
+
+	p = data;
+	end = data + len;
+	if (cv->newline && p < end) {
+		*p++ = netascii_cr[cv->prevchar] - 1;
+		cv->newline = 0;
+	}
+	while (p < end) {
+		/*
+		 * A char read takes at most two in the block, so read half
+		 * the room left into its back half and expand it forward:
+		 * the output never catches up with the input.
+		 */
+		n = end - p > 1 ? (end - p) / 2 : 1;
+		in = end - n;
+		n = fread(in, 1, n, file);
+		if (n == 0)
+			break;
+		for (i = 0; i < n; i++) {
+			c = (unsigned char)in[i];
+			if (!netascii_cr[c]) {
+				*p++ = c;
+				continue;
+			}
+			*p++ = '\r';
+			if (p == end) {         /* the rest goes in the next block */
+				cv->prevchar = c;
+				cv->newline = 1;
+				break;
 			}
+			*p++ = netascii_cr[c] - 1;
 		}
-	       *p++ = c;
 	}
-	b->counter = (int)(p - dp->th_data);
+	if (ferror(file))
+		return -1;
+	return (int)(p - data);
 }
 
 /* Update count associated with the buffer, get new buffer
@@ -173,9 +222,6 @@ int write_behind(FILE *file, int convert)
 {
 	char *buf;
 	int count;
-	int ct;
-	char *p;
-	int c;                 /* current character */
 	struct bf *b;
 	struct tftphdr *dp;
 
@@ -191,28 +237,161 @@ int write_behind(FILE *file, int convert)
 
 	if (count <= 0) return -1;      /* nak logic? */
 
+	return write_block(file, buf, count, convert, &conv);
+}
+
+/* Write out what is in the write buffer of cv, -1 on error. */
+static int wbuf_flush(FILE *file, struct tftp_conv *cv)
+{
+	int n, done = 0;
+
+	while (done < cv->wlen) {
+		n = write(fileno(file), cv->wbuf + done, cv->wlen - done);
+		if (n <= 0) {
+			if (n == 0)
+				errno = ENOSPC;
+			else if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += n;
+	}
+	cv->wlen = 0;
+	return 0;
+}
+
+/* Append n bytes to the write buffer, written out each time it fills. */
+static int wbuf_put(FILE *file, struct tftp_conv *cv, const char *p, int n)
+{
+	int k;
+
+	while (n > 0) {
+		k = WBUFSIZE - cv->wlen;
+		if (k > n)
+			k = n;
+		memcpy(cv->wbuf + cv->wlen, p, k);
+		cv->wlen += k;
+		p += k;
+		n -= k;
+		if (cv->wlen == WBUFSIZE && wbuf_flush(file, cv) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Write count bytes of buf as above, with the state in cv. They are
+ * buffered, a failure may only show in a later call or write_close().
+ * A cr is held back until the char after it tells what it stands for.
+ */
+int write_block(FILE *file, char *buf, int count, int convert, struct tftp_conv *cv)
+{
+	char *cr;
+	int n;
+
+	if (!cv->wbuf && !(cv->wbuf = malloc(WBUFSIZE)))
+		return -1;
 	if (convert == 0)
-		return write(fileno(file), buf, count);
-
-	p = buf;
-	ct = count;
-	while (ct--) {                  /* loop over the buffer */
-	    c = *p++;                   /* pick up a character */
-	    if (prevchar == '\r') {     /* if prev char was cr */
-		if (c == '\n')          /* if have cr,lf then just */
-		   fseek(file, -1, 1);  /* smash lf on top of the cr */
-		else
-		   if (c == '\0')       /* if have cr,nul then */
-			goto skipit;    /* just skip over the putc */
-		/* else just fall through and allow it */
-	    }
-	    putc(c, file);
-skipit:
-	    prevchar = c;
+		return wbuf_put(file, cv, buf, count) < 0 ? -1 : count;
+
+	for (n = count; n > 0; ) {
+		if (cv->prevchar == '\r') {
+			cv->prevchar = -1;
+			if (*buf == '\n' || *buf == '\0') {
+				/* cr,lf to lf and cr,nul to cr */
+				if (wbuf_put(file, cv, *buf == '\n' ? "\n" : "\r", 1) < 0)
+					return -1;
+				buf++;
+				n--;
+				continue;
+			}
+			if (wbuf_put(file, cv, "\r", 1) < 0)
+				return -1;
+		}
+		cr = memchr(buf, '\r', n);
+		if (wbuf_put(file, cv, buf, cr ? cr - buf : n) < 0)
+			return -1;
+		if (!cr)
+			break;
+		cv->prevchar = '\r';
+		n -= cr + 1 - buf;
+		buf = cr + 1;
 	}
 	return count;
 }
 
+/*
+ * Write out what write_block() holds for cv, or with cv NULL for the
+ * write-behind buffers, and close the file. -1 if any of it failed.
+ */
+int write_close(FILE *file, struct tftp_conv *cv)
+{
+	int ret = 0;
+
+	if (cv == NULL)
+		cv = &conv;
+	if (cv->prevchar == '\r') {    /* a cr last in the file stays */
+		cv->prevchar = -1;
+		ret = wbuf_put(file, cv, "\r", 1);
+	}
+	if (ret == 0)
+		ret = wbuf_flush(file, cv);
+	free(cv->wbuf);
+	cv->wbuf = NULL;
+	cv->wlen = 0;
+	if (fclose(file) && ret == 0)
+		ret = -1;
+	return ret;
+}
+
+/*
+ * Map all of a regular file for reading, *sizep gets its size. NULL if
+ * it cannot be, and the caller reads the file instead. Only the kernel
+ * touches the mapping, in send_data(): should the file be cut short
+ * under us, the send fails with EFAULT rather than raising SIGBUS.
+ */
+char *map_file(FILE *file, off_t *sizep)
+{
+	struct stat st;
+	void *p;
+
+	if (fstat(fileno(file), &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size <= 0 || (uintmax_t)st.st_size > SIZE_MAX)
+		return NULL;
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+	*sizep = st.st_size;
+	return p;
+}
+
+/*
+ * Send DATA block len bytes at data long, to "to" unless the socket is
+ * connected. The header and the data go out as two iovecs, so the data
+ * is not copied into a packet first. Returns what sendmsg() does.
+ */
+int send_data(int fd, const void *to, socklen_t tolen, int flags,
+	      unsigned long block, const char *data, int len)
+{
+	unsigned short hdr[2];
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	hdr[0] = htons((unsigned short)DATA);
+	hdr[1] = htons((unsigned short)block);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = (void *)to;
+	msg.msg_namelen = tolen;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	return sendmsg(fd, &msg, flags);
+}
+
 
 /* When an error has occurred, it is possible that the two sides
  * are out of synch.  Ie: that what I think is the other side's
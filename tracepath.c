@@ -11,6 +11,7 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <linux/errqueue.h>
 #include <linux/icmp.h>
@@ -22,12 +23,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "iputils_common.h"
+#include "iputils_rdns.h"
 
 #ifdef USE_IDN
 # ifndef AI_IDN
@@ -54,6 +60,7 @@
 
 enum {
 	MAX_PROBES = 10,
+	MAX_TRIES = 3,
 
 	MAX_HOPS_DEFAULT = 30,
 	MAX_HOPS_LIMIT = 255,
@@ -61,6 +68,7 @@ enum {
 	HOST_COLUMN_SIZE = 52,
 
 	HIS_ARRAY_SIZE = 64,
+	HIS_ARRAY_PARALLEL = 1024,
 
 	DEFAULT_OVERHEAD_IPV4 = 28,
 	DEFAULT_OVERHEAD_IPV6 = 48,
@@ -71,6 +79,10 @@ enum {
 	DEFAULT_BASEPORT = 44444,
 
 	ANCILLARY_DATA_LEN = 512,
+
+	PATH_ENTRIES = 1024,
+	PATH_HOPS = 64,
+	PATH_WAYS = 8,
 };
 
 struct hhistory {
@@ -83,9 +95,64 @@ struct probehdr {
 	struct timeval tv;
 };
 
+struct probe_reply {
+	struct sock_extended_err ee;
+	struct sockaddr_storage offender;
+	socklen_t offenderlen;
+	struct timeval rtt;
+	int sndhops;
+	int rethops;
+	unsigned int
+		have_rtt:1,
+		broken_router:1;
+};
+
+struct hop {
+	struct probe_reply reply;
+	struct probe_reply pmtu;
+	int size;
+	int tries;
+	unsigned int
+		answered:1,
+		has_pmtu:1,
+		pending:1;
+};
+
+/*
+ * The path cache (-C) is a file of PATH_ENTRIES fixed size entries,
+ * mapped shared and locked with flock(), in host byte order. An entry
+ * is found among PATH_WAYS slots from the hash of its destination.
+ */
+struct path_hop {
+	uint32_t rtt;			/* us */
+	uint8_t family;			/* 0: no reply */
+	uint8_t addr[16];
+};
+
+struct path_entry {
+	uint32_t stamp;			/* time() of the trace */
+	uint32_t pmtu;
+	uint16_t port;
+	uint8_t family;
+	uint8_t hops;			/* to the destination, 0: slot free */
+	uint8_t back;
+	uint8_t addr[16];
+	struct path_hop hop[PATH_HOPS];	/* by TTL - 1 */
+};
+
+struct path_cache {
+	char magic[8];
+	uint32_t entries;
+	uint32_t hops;
+	struct path_entry ent[PATH_ENTRIES];
+};
+
+static const char path_magic[8] = "tpcache1";
+
 struct run_state {
-	struct hhistory his[HIS_ARRAY_SIZE];
+	struct hhistory his[HIS_ARRAY_PARALLEL];
 	int hisptr;
+	int his_mask;
 	struct sockaddr_storage target;
 	struct addrinfo *ai;
 	int socket_fd;
@@ -98,10 +165,14 @@ struct run_state {
 	void *pktbuf;
 	int hops_to;
 	int hops_from;
+	struct path_cache *cache;
+	int cache_fd;
+	struct path_entry path;		/* what this trace found, for the cache */
 	unsigned int
 		no_resolve:1,
 		show_both:1,
-		mapped:1;
+		mapped:1,
+		parallel:1;
 };
 
 /*
@@ -135,7 +206,11 @@ static void print_host(struct run_state const *const ctl, char const *const a,
 	printf("%*s", HOST_COLUMN_SIZE - plen, "");
 }
 
-static int recverr(struct run_state *const ctl)
+/*
+ * Take one message off the error queue into "r". Returns -1 once the
+ * queue is empty and 0 for a message without extended error info.
+ */
+static int read_reply(struct run_state *const ctl, struct probe_reply *const r)
 {
 	ssize_t recv_size;
 	struct probehdr rcvbuf;
@@ -146,11 +221,6 @@ static int recverr(struct run_state *const ctl)
 	struct timeval tv;
 	struct timeval *rettv;
 	int slot = 0;
-	int rethops;
-	int sndhops;
-	int progress = -1;
-	int broken_router;
-	char hnamebuf[NI_MAXHOST] = "";
 	struct iovec iov = {
 		.iov_base = &rcvbuf,
 		.iov_len = sizeof(rcvbuf)
@@ -174,17 +244,15 @@ static int recverr(struct run_state *const ctl)
 	recv_size = recvmsg(ctl->socket_fd, &msg, MSG_ERRQUEUE);
 	if (recv_size < 0) {
 		if (errno == EAGAIN)
-			return progress;
+			return -1;
 		goto restart;
 	}
 
-	progress = ctl->mtu;
-
-	rethops = -1;
-	sndhops = -1;
+	memset(r, 0, sizeof(*r));
+	r->rethops = -1;
+	r->sndhops = -1;
 	e = NULL;
 	rettv = NULL;
-	broken_router = 0;
 
 	slot = -ctl->base_port;
 	switch (ctl->ai->ai_family) {
@@ -196,16 +264,16 @@ static int recverr(struct run_state *const ctl)
 		break;
 	}
 
-	if (slot >= 0 && slot < (HIS_ARRAY_SIZE - 1) && ctl->his[slot].hops) {
-		sndhops = ctl->his[slot].hops;
+	if (slot >= 0 && slot <= ctl->his_mask && ctl->his[slot].hops) {
+		r->sndhops = ctl->his[slot].hops;
 		rettv = &ctl->his[slot].sendtime;
 		ctl->his[slot].hops = 0;
 	}
 	if (recv_size == sizeof(rcvbuf)) {
 		if (rcvbuf.ttl == 0 || rcvbuf.tv.tv_sec == 0)
-			broken_router = 1;
+			r->broken_router = 1;
 		else {
-			sndhops = rcvbuf.ttl;
+			r->sndhops = rcvbuf.ttl;
 			rettv = &rcvbuf.tv;
 		}
 	}
@@ -221,7 +289,7 @@ static int recverr(struct run_state *const ctl)
 #ifdef IPV6_2292HOPLIMIT
 			case IPV6_2292HOPLIMIT:
 #endif
-				memcpy(&rethops, CMSG_DATA(cmsg), sizeof(rethops));
+				memcpy(&r->rethops, CMSG_DATA(cmsg), sizeof(r->rethops));
 				break;
 			default:
 				printf(_("cmsg6:%d\n "), cmsg->cmsg_type);
@@ -233,43 +301,76 @@ static int recverr(struct run_state *const ctl)
 				e = (struct sock_extended_err *)CMSG_DATA(cmsg);
 				break;
 			case IP_TTL:
-				rethops = *(uint8_t *)CMSG_DATA(cmsg);
+				r->rethops = *(uint8_t *)CMSG_DATA(cmsg);
 				break;
 			default:
 				printf(_("cmsg4:%d\n "), cmsg->cmsg_type);
 			}
 		}
 	}
-	if (e == NULL) {
-		printf(_("no info\n"));
+	if (e == NULL)
 		return 0;
-	}
-	if (e->ee_origin == SO_EE_ORIGIN_LOCAL)
-		printf("%2d?: %-32s ", ctl->ttl, _("[LOCALHOST]"));
-	else if (e->ee_origin == SO_EE_ORIGIN_ICMP6 ||
-		 e->ee_origin == SO_EE_ORIGIN_ICMP) {
-		char abuf[NI_MAXHOST];
-		struct sockaddr *sa = (struct sockaddr *)(e + 1);
-		socklen_t salen;
 
-		if (sndhops > 0)
-			printf("%2d:  ", sndhops);
-		else
-			printf("%2d?: ", ctl->ttl);
+	r->ee = *e;
+	if (e->ee_origin == SO_EE_ORIGIN_ICMP6 || e->ee_origin == SO_EE_ORIGIN_ICMP) {
+		struct sockaddr *sa = (struct sockaddr *)(e + 1);
 
 		switch (sa->sa_family) {
 		case AF_INET6:
-			salen = sizeof(struct sockaddr_in6);
+			r->offenderlen = sizeof(struct sockaddr_in6);
 			break;
 		case AF_INET:
-			salen = sizeof(struct sockaddr_in);
+			r->offenderlen = sizeof(struct sockaddr_in);
 			break;
-		default:
-			salen = 0;
 		}
+		memcpy(&r->offender, sa, r->offenderlen);
+	}
+
+	if (rettv) {
+		timersub(&tv, rettv, &r->rtt);
+		r->have_rtt = 1;
+	}
+
+	if (r->rethops <= 64)
+		r->rethops = 65 - r->rethops;
+	else if (r->rethops <= 128)
+		r->rethops = 129 - r->rethops;
+	else
+		r->rethops = 256 - r->rethops;
+	return 1;
+}
+
+/* Did the probe expire on the way, i.e. is there more path behind? */
+static int time_exceeded(struct sock_extended_err const *const e)
+{
+	return (e->ee_origin == SO_EE_ORIGIN_ICMP &&
+		e->ee_type == ICMP_TIME_EXCEEDED &&
+		e->ee_code == ICMP_EXC_TTL) ||
+	       (e->ee_origin == SO_EE_ORIGIN_ICMP6 &&
+		e->ee_type == ICMPV6_TIME_EXCEED &&
+		e->ee_code == ICMPV6_EXC_HOPLIMIT);
+}
+
+/* Print the line of hop "ttl" for reply "r". */
+static void print_reply(struct run_state const *const ctl,
+			struct probe_reply const *const r, int ttl)
+{
+	char hnamebuf[NI_MAXHOST] = "";
+
+	if (r->ee.ee_origin == SO_EE_ORIGIN_LOCAL)
+		printf("%2d?: %-32s ", ttl, _("[LOCALHOST]"));
+	else if (r->ee.ee_origin == SO_EE_ORIGIN_ICMP6 ||
+		 r->ee.ee_origin == SO_EE_ORIGIN_ICMP) {
+		char abuf[NI_MAXHOST];
+		struct sockaddr const *sa = (struct sockaddr const *)&r->offender;
+
+		if (r->sndhops > 0)
+			printf("%2d:  ", r->sndhops);
+		else
+			printf("%2d?: ", ttl);
 
 		if (ctl->no_resolve || ctl->show_both) {
-			if (getnameinfo(sa, salen, abuf, sizeof(abuf), NULL, 0,
+			if (getnameinfo(sa, r->offenderlen, abuf, sizeof(abuf), NULL, 0,
 					NI_NUMERICHOST))
 				strcpy(abuf, "???");
 		} else
@@ -277,8 +378,14 @@ static int recverr(struct run_state *const ctl)
 
 		if (!ctl->no_resolve || ctl->show_both) {
 			fflush(stdout);
-			if (getnameinfo(sa, salen, hnamebuf, sizeof hnamebuf, NULL, 0,
-					getnameinfo_flags))
+			/*
+			 * No name within RDNS_WAIT, the address stands in; with
+			 * other hops in flight nothing is worth waiting for.
+			 */
+			if (!rdns_lookup(sa, r->offenderlen, getnameinfo_flags, hnamebuf,
+					 sizeof hnamebuf, ctl->parallel ? 0 : RDNS_WAIT) &&
+			    getnameinfo(sa, r->offenderlen, hnamebuf, sizeof hnamebuf, NULL, 0,
+					NI_NUMERICHOST))
 				strcpy(hnamebuf, "???");
 		} else
 			hnamebuf[0] = 0;
@@ -289,98 +396,176 @@ static int recverr(struct run_state *const ctl)
 			print_host(ctl, hnamebuf, abuf);
 	}
 
-	if (rettv) {
-		struct timeval res;
-
-		timersub(&tv, rettv, &res);
-		printf(_("%3ld.%03ldms "), res.tv_sec * 1000 + res.tv_usec / 1000, res.tv_usec % 1000);
-		if (broken_router)
+	if (r->have_rtt) {
+		printf(_("%3ld.%03ldms "), r->rtt.tv_sec * 1000 + r->rtt.tv_usec / 1000,
+		       r->rtt.tv_usec % 1000);
+		if (r->broken_router)
 			printf(_("(This broken router returned corrupted payload) "));
 	}
 
-	if (rethops <= 64)
-		rethops = 65 - rethops;
-	else if (rethops <= 128)
-		rethops = 129 - rethops;
-	else
-		rethops = 256 - rethops;
-
-	switch (e->ee_errno) {
+	switch (r->ee.ee_errno) {
 	case ETIMEDOUT:
 		printf("\n");
 		break;
 	case EMSGSIZE:
-		printf(_("pmtu %d\n"), e->ee_info);
-		ctl->mtu = e->ee_info;
-		progress = ctl->mtu;
+		printf(_("pmtu %d\n"), r->ee.ee_info);
 		break;
 	case ECONNREFUSED:
 		printf(_("reached\n"));
-		ctl->hops_to = sndhops < 0 ? ctl->ttl : sndhops;
-		ctl->hops_from = rethops;
-		return 0;
+		break;
 	case EPROTO:
 		printf("!P\n");
-		return 0;
+		break;
 	case EHOSTUNREACH:
-		if ((e->ee_origin == SO_EE_ORIGIN_ICMP &&
-		     e->ee_type == ICMP_TIME_EXCEEDED &&
-		     e->ee_code == ICMP_EXC_TTL) ||
-		    (e->ee_origin == SO_EE_ORIGIN_ICMP6 &&
-		     e->ee_type == ICMPV6_TIME_EXCEED &&
-		     e->ee_code == ICMPV6_EXC_HOPLIMIT)) {
-			if (rethops >= 0) {
-				if (sndhops >= 0 && rethops != sndhops)
-					printf(_("asymm %2d "), rethops);
-				else if (sndhops < 0 && rethops != ctl->ttl)
-					printf(_("asymm %2d "), rethops);
+		if (time_exceeded(&r->ee)) {
+			if (r->rethops >= 0) {
+				if (r->sndhops >= 0 && r->rethops != r->sndhops)
+					printf(_("asymm %2d "), r->rethops);
+				else if (r->sndhops < 0 && r->rethops != ttl)
+					printf(_("asymm %2d "), r->rethops);
 			}
 			printf("\n");
 			break;
 		}
 		printf("!H\n");
-		return 0;
+		break;
 	case ENETUNREACH:
 		printf("!N\n");
-		return 0;
+		break;
 	case EACCES:
 		printf("!A\n");
-		return 0;
+		break;
 	default:
 		printf("\n");
-		errno = e->ee_errno;
+		errno = r->ee.ee_errno;
 		perror(_("NET ERROR"));
-		return 0;
 	}
-	goto restart;
+}
+
+/* The family and address of "ss" as the path cache keeps them. */
+static void path_addr(struct sockaddr_storage const *const ss, uint8_t *const family,
+		      uint8_t *const addr)
+{
+	memset(addr, 0, 16);
+	*family = 0;
+	switch (ss->ss_family) {
+	case AF_INET6:
+		memcpy(addr, &((struct sockaddr_in6 const *)ss)->sin6_addr, 16);
+		*family = AF_INET6;
+		break;
+	case AF_INET:
+		memcpy(addr, &((struct sockaddr_in const *)ss)->sin_addr, 4);
+		*family = AF_INET;
+		break;
+	}
+}
+
+/* Note reply "r" for hop "ttl" in the path to be cached. */
+static void path_note(struct run_state *const ctl, struct probe_reply const *const r,
+		      int ttl)
+{
+	struct path_hop *h;
+
+	if (r->sndhops > 0)
+		ttl = r->sndhops;
+	if (ttl < 1 || ttl > PATH_HOPS || r->ee.ee_errno == EMSGSIZE ||
+	    (r->ee.ee_origin != SO_EE_ORIGIN_ICMP && r->ee.ee_origin != SO_EE_ORIGIN_ICMP6))
+		return;
+	h = &ctl->path.hop[ttl - 1];
+	path_addr(&r->offender, &h->family, h->addr);
+	h->rtt = r->have_rtt ? r->rtt.tv_sec * 1000000 + r->rtt.tv_usec : 0;
+}
+
+static int recverr(struct run_state *const ctl)
+{
+	struct probe_reply r;
+	int progress = -1;
+
+	for (;;) {
+		switch (read_reply(ctl, &r)) {
+		case -1:
+			return progress;
+		case 0:
+			printf(_("no info\n"));
+			return 0;
+		}
+		progress = ctl->mtu;
+		print_reply(ctl, &r, ctl->ttl);
+		path_note(ctl, &r, ctl->ttl);
+
+		switch (r.ee.ee_errno) {
+		case ETIMEDOUT:
+			break;
+		case EMSGSIZE:
+			ctl->mtu = r.ee.ee_info;
+			progress = ctl->mtu;
+			break;
+		case ECONNREFUSED:
+			ctl->hops_to = r.sndhops < 0 ? ctl->ttl : r.sndhops;
+			ctl->hops_from = r.rethops;
+			return 0;
+		case EHOSTUNREACH:
+			if (time_exceeded(&r.ee))
+				break;
+			return 0;
+		default:
+			return 0;
+		}
+	}
+}
+
+static void set_ttl(struct run_state const *const ctl, int ttl)
+{
+	switch (ctl->ai->ai_family) {
+	case AF_INET6:
+		if (setsockopt(ctl->socket_fd, SOL_IPV6, IPV6_UNICAST_HOPS, &ttl, sizeof(ttl))) {
+			perror("IPV6_UNICAST_HOPS");
+			exit(1);
+		}
+		if (!ctl->mapped)
+			break;
+		/*FALLTHROUGH*/
+	case AF_INET:
+		if (setsockopt(ctl->socket_fd, SOL_IP, IP_TTL, &ttl, sizeof(ttl))) {
+			perror("IP_TTL");
+			exit(1);
+		}
+	}
+}
+
+/* Send a probe for "hops" hops from history slot ctl->hisptr. */
+static ssize_t send_probe(struct run_state *const ctl, int hops)
+{
+	struct probehdr *hdr = ctl->pktbuf;
+
+	hdr->ttl = hops;
+	switch (ctl->ai->ai_family) {
+	case AF_INET6:
+		((struct sockaddr_in6 *)&ctl->target)->sin6_port =
+		    htons(ctl->base_port + ctl->hisptr);
+		break;
+	case AF_INET:
+		((struct sockaddr_in *)&ctl->target)->sin_port =
+		    htons(ctl->base_port + ctl->hisptr);
+		break;
+	}
+	gettimeofday(&hdr->tv, NULL);
+	ctl->his[ctl->hisptr].hops = hops;
+	ctl->his[ctl->hisptr].sendtime = hdr->tv;
+	return sendto(ctl->socket_fd, ctl->pktbuf, ctl->mtu - ctl->overhead, 0,
+		      (struct sockaddr *)&ctl->target, ctl->targetlen);
 }
 
 static int probe_ttl(struct run_state *const ctl)
 {
 	int i;
-	struct probehdr *hdr = ctl->pktbuf;
 
 	memset(ctl->pktbuf, 0, ctl->mtu);
  restart:
 	for (i = 0; i < MAX_PROBES; i++) {
 		int res;
 
-		hdr->ttl = ctl->ttl;
-		switch (ctl->ai->ai_family) {
-		case AF_INET6:
-			((struct sockaddr_in6 *)&ctl->target)->sin6_port =
-			    htons(ctl->base_port + ctl->hisptr);
-			break;
-		case AF_INET:
-			((struct sockaddr_in *)&ctl->target)->sin_port =
-			    htons(ctl->base_port + ctl->hisptr);
-			break;
-		}
-		gettimeofday(&hdr->tv, NULL);
-		ctl->his[ctl->hisptr].hops = ctl->ttl;
-		ctl->his[ctl->hisptr].sendtime = hdr->tv;
-		if (sendto(ctl->socket_fd, ctl->pktbuf, ctl->mtu - ctl->overhead, 0,
-			   (struct sockaddr *)&ctl->target, ctl->targetlen) > 0)
+		if (send_probe(ctl, ctl->ttl) > 0)
 			break;
 		res = recverr(ctl);
 		ctl->his[ctl->hisptr].hops = 0;
@@ -389,7 +574,7 @@ static int probe_ttl(struct run_state *const ctl)
 		if (res > 0)
 			goto restart;
 	}
-	ctl->hisptr = (ctl->hisptr + 1) & (HIS_ARRAY_SIZE - 1);
+	ctl->hisptr = (ctl->hisptr + 1) & ctl->his_mask;
 
 	if (i < MAX_PROBES) {
 		data_wait(ctl);
@@ -404,6 +589,418 @@ static int probe_ttl(struct run_state *const ctl)
 	return 0;
 }
 
+/*
+ * Parallel mode (-P): queued errors are sorted into hop[] by the TTL of
+ * the probe they answer. "cur" is the TTL of the probe just sent, for
+ * errors that cannot be matched otherwise. A "pmtu" report is kept on
+ * the side and makes the hop be probed again at the new size; anything
+ * else is the answer for the hop, and unless it expired in transit the
+ * path ends there, so "*last" shrinks to it.
+ */
+static void collect_replies(struct run_state *const ctl, struct hop *const hop,
+			    int cur, int *const last)
+{
+	struct probe_reply r;
+	struct hop *h;
+	int n;
+
+	while ((n = read_reply(ctl, &r)) >= 0) {
+		if (n == 0)
+			continue;
+		n = r.sndhops > 0 ? r.sndhops : cur;
+		if (n <= 0 || n > ctl->max_hops)
+			continue;
+		h = &hop[n];
+		h->pending = 0;
+
+		if (r.ee.ee_errno == EMSGSIZE) {
+			if (!h->has_pmtu || r.ee.ee_info < h->pmtu.ee.ee_info) {
+				h->pmtu = r;
+				h->has_pmtu = 1;
+			}
+			if ((int)r.ee.ee_info > ctl->overhead &&
+			    (int)r.ee.ee_info < ctl->mtu)
+				ctl->mtu = r.ee.ee_info;
+			/* Too big is no answer, it does not use up a try. */
+			if ((int)r.ee.ee_info < h->size && !h->answered && h->tries)
+				h->tries--;
+			continue;
+		}
+		if (h->answered)
+			continue;
+		h->reply = r;
+		h->answered = 1;
+		/* Look the name up while the hops before are still out. */
+		if ((!ctl->no_resolve || ctl->show_both) &&
+		    (r.ee.ee_origin == SO_EE_ORIGIN_ICMP || r.ee.ee_origin == SO_EE_ORIGIN_ICMP6))
+			rdns_lookup(&r.offender, r.offenderlen, getnameinfo_flags, NULL, 0, 0);
+		if (r.ee.ee_errno != ETIMEDOUT &&
+		    !(r.ee.ee_errno == EHOSTUNREACH && time_exceeded(&r.ee)) &&
+		    n < *last)
+			*last = n;
+	}
+}
+
+static int hop_final(struct hop const *const h)
+{
+	return h->answered || (h->tries >= MAX_TRIES && !h->pending);
+}
+
+/*
+ * Trace with probes for all TTLs in flight at once. Each round sends one
+ * probe to every hop still without an answer and collects replies until
+ * all are in or a second has passed, so a path costs about one round
+ * trip per try instead of one per hop. After a PMTU drop the next round
+ * resends everything behind it at the new size straight away. Hops are
+ * printed in order as soon as the ones before them are settled. Hops
+ * before "first" are known already and left alone.
+ */
+static int probe_parallel(struct run_state *const ctl, int first)
+{
+	struct hop *hop;
+	int last = ctl->max_hops;
+	int printed = first - 1;
+	int reported_mtu = ctl->mtu;
+	int data_reply = 0;
+	int ttl;
+
+	hop = calloc(ctl->max_hops + 1, sizeof(*hop));
+	if (!hop) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(ctl->pktbuf, 0, ctl->mtu);
+	/* so that late replies from before do not count */
+	for (ttl = 1; ttl < first; ttl++)
+		hop[ttl].answered = 1;
+
+	while (printed < last && !data_reply) {
+		struct timeval deadline, now;
+
+		for (ttl = first; ttl <= last; ttl++) {
+			struct hop *const h = &hop[ttl];
+
+			if (h->answered || h->tries >= MAX_TRIES)
+				continue;
+			set_ttl(ctl, ttl);
+			h->size = ctl->mtu;
+			h->tries++;
+			if (send_probe(ctl, ttl) > 0) {
+				ctl->hisptr = (ctl->hisptr + 1) & ctl->his_mask;
+				h->pending = 1;
+				continue;
+			}
+			collect_replies(ctl, hop, ttl, &last);
+			ctl->his[ctl->hisptr].hops = 0;
+			if (!h->answered && ctl->mtu < h->size)
+				ttl--;
+		}
+
+		gettimeofday(&deadline, NULL);
+		deadline.tv_sec++;
+		for (;;) {
+			struct timeval tv;
+			fd_set fds;
+			int outstanding = 0;
+
+			for (ttl = first; ttl <= last; ttl++)
+				outstanding |= hop[ttl].pending;
+			gettimeofday(&now, NULL);
+			if (!outstanding || !timercmp(&now, &deadline, <))
+				break;
+			timersub(&deadline, &now, &tv);
+			FD_ZERO(&fds);
+			FD_SET(ctl->socket_fd, &fds);
+			select(ctl->socket_fd + 1, &fds, NULL, NULL, &tv);
+			if (recv(ctl->socket_fd, ctl->pktbuf, ctl->mtu, MSG_DONTWAIT) > 0) {
+				data_reply = 1;
+				break;
+			}
+			collect_replies(ctl, hop, 0, &last);
+		}
+		for (ttl = first; ttl <= last; ttl++)
+			hop[ttl].pending = 0;
+
+		for (; printed < last && hop_final(&hop[printed + 1]); printed++) {
+			struct hop *const h = &hop[printed + 1];
+
+			if (h->has_pmtu && (int)h->pmtu.ee.ee_info < reported_mtu) {
+				print_reply(ctl, &h->pmtu, printed + 1);
+				reported_mtu = h->pmtu.ee.ee_info;
+			}
+			if (h->answered) {
+				print_reply(ctl, &h->reply, printed + 1);
+				path_note(ctl, &h->reply, printed + 1);
+			} else
+				printf(_("%2d:  no reply\n"), printed + 1);
+		}
+	}
+
+	if (data_reply) {
+		printf(_("%2d?: reply received 8)\n"), printed + 1);
+		free(hop);
+		return 0;
+	}
+	if (!hop[last].answered || hop[last].reply.ee.ee_errno == ETIMEDOUT ||
+	    time_exceeded(&hop[last].reply.ee)) {
+		free(hop);
+		return -1;
+	}
+	if (hop[last].reply.ee.ee_errno == ECONNREFUSED) {
+		ctl->hops_to = last;
+		ctl->hops_from = hop[last].reply.rethops;
+	}
+	free(hop);
+	return 0;
+}
+
+/*
+ * Map the path cache in "name", made afresh if it is new or empty. If
+ * it cannot be had, tracepath goes on without it; a file that is not a
+ * path cache is left alone and the run refused.
+ */
+static void cache_open(struct run_state *const ctl, char const *const name)
+{
+	struct path_cache *c;
+	struct stat st;
+	int fd;
+
+	fd = open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || flock(fd, LOCK_EX) || fstat(fd, &st))
+		goto fail;
+	if (st.st_size != 0 && st.st_size != sizeof(*c)) {
+		fprintf(stderr, "tracepath: %s: not a path cache\n", name);
+		exit(1);
+	}
+	if (st.st_size == 0 && ftruncate(fd, sizeof(*c)))
+		goto fail;
+	c = mmap(NULL, sizeof(*c), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (c == MAP_FAILED)
+		goto fail;
+	if (st.st_size == 0) {
+		memcpy(c->magic, path_magic, sizeof(c->magic));
+		c->entries = PATH_ENTRIES;
+		c->hops = PATH_HOPS;
+	} else if (memcmp(c->magic, path_magic, sizeof(c->magic)) ||
+		   c->entries != PATH_ENTRIES || c->hops != PATH_HOPS) {
+		fprintf(stderr, "tracepath: %s: not a path cache\n", name);
+		exit(1);
+	}
+	flock(fd, LOCK_UN);
+	ctl->cache = c;
+	ctl->cache_fd = fd;
+	return;
+ fail:
+	fprintf(stderr, "tracepath: %s: %s\n", name, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ * The cache entry of the destination, or with "create" a slot for it:
+ * a free one, else the one traced longest ago. Called with the lock.
+ */
+static struct path_entry *cache_slot(struct run_state *const ctl, int create)
+{
+	struct path_entry *e, *victim = NULL;
+	uint8_t family, addr[16];
+	uint32_t h = 2166136261u;
+	int i;
+
+	path_addr(&ctl->target, &family, addr);
+	for (i = 0; i < 16; i++)
+		h = (h ^ addr[i]) * 16777619u;
+	h = (h ^ family ^ ctl->base_port) * 16777619u;
+	for (i = 0; i < PATH_WAYS; i++) {
+		e = &ctl->cache->ent[(h + i) % PATH_ENTRIES];
+		if (!e->hops) {
+			if (!victim || victim->hops)
+				victim = e;
+			continue;
+		}
+		if (e->family == family && e->port == ctl->base_port &&
+		    !memcmp(e->addr, addr, sizeof(addr)))
+			return e;
+		if (!victim || (victim->hops && e->stamp < victim->stamp))
+			victim = e;
+	}
+	return create ? victim : NULL;
+}
+
+/*
+ * Copy the cached path of the destination to "old", 0 if there is none
+ * or it does not hold up: the file is shared, so nothing in it is taken
+ * on trust.
+ */
+static int cache_load(struct run_state *const ctl, struct path_entry *const old)
+{
+	struct path_entry *e;
+
+	flock(ctl->cache_fd, LOCK_SH);
+	e = cache_slot(ctl, 0);
+	if (e)
+		*old = *e;
+	flock(ctl->cache_fd, LOCK_UN);
+	if (!e || old->hops > PATH_HOPS ||
+	    (old->family != AF_INET && old->family != AF_INET6) ||
+	    old->pmtu < 68 || old->pmtu > 65535)
+		return 0;
+	return 1;
+}
+
+/*
+ * Keep the path just traced, if it reached the destination; a path
+ * that did not is forgotten, so that the next run traces it in full.
+ */
+static void cache_store(struct run_state *const ctl)
+{
+	struct path_entry *e;
+
+	flock(ctl->cache_fd, LOCK_EX);
+	if (ctl->hops_to < 1 || ctl->hops_to > PATH_HOPS) {
+		e = cache_slot(ctl, 0);
+		if (e)
+			e->hops = 0;
+	} else {
+		e = cache_slot(ctl, 1);
+		path_addr(&ctl->target, &ctl->path.family, ctl->path.addr);
+		ctl->path.port = ctl->base_port;
+		ctl->path.hops = ctl->hops_to;
+		ctl->path.back = ctl->hops_from < 0 ? 0 : ctl->hops_from;
+		ctl->path.pmtu = ctl->mtu;
+		ctl->path.stamp = time(NULL);
+		*e = ctl->path;
+	}
+	flock(ctl->cache_fd, LOCK_UN);
+}
+
+/*
+ * Probe hop "ttl" until it answers, up to MAX_TRIES times a second
+ * apart; a PMTU drop is printed and the probe goes again at the new
+ * size. 1 with the answer in "r", 0 if none came or the data got one.
+ */
+static int probe_once(struct run_state *const ctl, int ttl, struct probe_reply *const r)
+{
+	struct timeval deadline, now, tv;
+	int tries = 0, probes = 0;
+	fd_set fds;
+	int sent, n;
+
+	set_ttl(ctl, ttl);
+	while (tries < MAX_TRIES && probes++ < MAX_PROBES) {
+		sent = send_probe(ctl, ttl) > 0;
+		if (sent)
+			ctl->hisptr = (ctl->hisptr + 1) & ctl->his_mask;
+		tries++;
+		gettimeofday(&deadline, NULL);
+		deadline.tv_sec++;
+		for (;;) {
+			if (recv(ctl->socket_fd, ctl->pktbuf, ctl->mtu, MSG_DONTWAIT) > 0)
+				return 0;
+			while ((n = read_reply(ctl, r)) >= 0) {
+				/* late answers to earlier probes */
+				if (n == 0 || (r->sndhops > 0 && r->sndhops != ttl))
+					continue;
+				if (r->ee.ee_errno != EMSGSIZE)
+					return 1;
+				print_reply(ctl, r, ttl);
+				if ((int)r->ee.ee_info > ctl->overhead &&
+				    (int)r->ee.ee_info < ctl->mtu) {
+					ctl->mtu = r->ee.ee_info;
+					tries--;
+				}
+				goto again;
+			}
+			/* a send that failed with nothing queued */
+			if (!sent)
+				return 0;
+			gettimeofday(&now, NULL);
+			if (!timercmp(&now, &deadline, <))
+				break;
+			timersub(&deadline, &now, &tv);
+			FD_ZERO(&fds);
+			FD_SET(ctl->socket_fd, &fds);
+			select(ctl->socket_fd + 1, &fds, NULL, NULL, &tv);
+		}
+ again:
+		;
+	}
+	return 0;
+}
+
+/*
+ * Whether hop "ttl" answers as it did in the cached path "old": from
+ * the same address, and at the end of the path as the destination.
+ */
+static int hop_same(struct run_state *const ctl, struct path_entry const *const old,
+		    int ttl)
+{
+	struct probe_reply r;
+	uint8_t family, addr[16];
+
+	if (!probe_once(ctl, ttl, &r))
+		return 0;
+	if (ttl == old->hops ? r.ee.ee_errno != ECONNREFUSED : !time_exceeded(&r.ee))
+		return 0;
+	path_addr(&r.offender, &family, addr);
+	if (!family || family != old->hop[ttl - 1].family ||
+	    memcmp(addr, old->hop[ttl - 1].addr, sizeof(addr)))
+		return 0;
+	path_note(ctl, &r, ttl);
+	if (ttl == old->hops)
+		ctl->hops_from = r.rethops;
+	return 1;
+}
+
+/*
+ * Re-trace (-C) a path that is in the cache. The destination should be
+ * as many hops away behind the same last router, at the cached PMTU;
+ * then that is all. Otherwise a bisection over the hops that answered
+ * before finds the last one that still does, taking the path to be the
+ * same up to there. Returns the TTL to trace on from, 0 if the path is
+ * unchanged.
+ */
+static int retrace(struct run_state *const ctl, struct path_entry const *const old)
+{
+	int lo = 0, hi = old->hops;
+	int mid, t, d;
+
+	if ((int)old->pmtu > ctl->overhead && (int)old->pmtu < ctl->mtu)
+		ctl->mtu = old->pmtu;
+	memset(ctl->pktbuf, 0, ctl->mtu);
+	memcpy(ctl->path.hop, old->hop, sizeof(ctl->path.hop));
+
+	if (hop_same(ctl, old, hi)) {
+		hi--;
+		if (!hi || !old->hop[hi - 1].family || hop_same(ctl, old, hi)) {
+			ctl->hops_to = old->hops;
+			printf(_("     Same path: %d hops\n"), old->hops);
+			return 0;
+		}
+	}
+	while (hi - lo > 1) {
+		/* the answering hop nearest the middle of (lo, hi) */
+		mid = (lo + hi) / 2;
+		for (t = 0, d = 0; !t && (mid - d > lo || mid + d < hi); d++) {
+			if (mid - d > lo && old->hop[mid - d - 1].family)
+				t = mid - d;
+			else if (mid + d < hi && old->hop[mid + d - 1].family)
+				t = mid + d;
+		}
+		if (!t)
+			break;
+		if (hop_same(ctl, old, t))
+			lo = t;
+		else
+			hi = t;
+	}
+	memset(&ctl->path.hop[lo], 0, sizeof(ctl->path.hop) - lo * sizeof(ctl->path.hop[0]));
+	ctl->hops_from = -1;
+	if (lo)
+		printf(_("     Same path to hop %d\n"), lo);
+	return lo + 1;
+}
+
 static void usage(void)
 {
 	fprintf(stderr, _(
@@ -413,10 +1010,12 @@ static void usage(void)
 		"  -4             use IPv4\n"
 		"  -6             use IPv6\n"
 		"  -b             print both name and ip\n"
+		"  -C <file>      cache paths in <file>, re-trace them later\n"
 		"  -l <length>    use packet <length>\n"
 		"  -m <hops>      use maximum <hops>\n"
 		"  -n             no dns name resolution\n"
 		"  -p <port>      use destination <port>\n"
+		"  -P             probe all hops in parallel\n"
 		"  -V             print version and exit\n"
 		"  <destination>  dns name or ip address\n"
 		"\nFor more details see tracepath(8).\n"));
@@ -440,6 +1039,9 @@ int main(int argc, char **argv)
 #endif
 	};
 	struct addrinfo *result;
+	struct path_entry old;
+	char *cache_name = NULL;
+	int first = 1;
 	int ch;
 	int status;
 	int on;
@@ -460,7 +1062,7 @@ int main(int argc, char **argv)
 	else if (argv[0][strlen(argv[0]) - 1] == '6')
 		hints.ai_family = AF_INET6;
 
-	while ((ch = getopt(argc, argv, "46nbh?l:m:p:V")) != EOF) {
+	while ((ch = getopt(argc, argv, "46nbC:h?l:m:p:PV")) != EOF) {
 		switch (ch) {
 		case '4':
 			if (hints.ai_family == AF_INET6) {
@@ -484,6 +1086,9 @@ int main(int argc, char **argv)
 		case 'b':
 			ctl.show_both = 1;
 			break;
+		case 'C':
+			cache_name = optarg;
+			break;
 		case 'l':
 			if ((ctl.mtu = atoi(optarg)) <= ctl.overhead) {
 				fprintf(stderr,
@@ -504,6 +1109,9 @@ int main(int argc, char **argv)
 		case 'p':
 			ctl.base_port = atoi(optarg);
 			break;
+		case 'P':
+			ctl.parallel = 1;
+			break;
 		case 'V':
 			printf(IPUTILS_VERSION("tracepath"));
 			return 0;
@@ -612,29 +1220,25 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	for (ctl.ttl = 1; ctl.ttl <= ctl.max_hops; ctl.ttl++) {
+	ctl.his_mask = (ctl.parallel ? HIS_ARRAY_PARALLEL : HIS_ARRAY_SIZE) - 1;
+	if (cache_name)
+		cache_open(&ctl, cache_name);
+	if (ctl.cache && cache_load(&ctl, &old) && old.hops <= ctl.max_hops) {
+		first = retrace(&ctl, &old);
+		if (!first)
+			goto done;
+	}
+	if (ctl.parallel && probe_parallel(&ctl, first) == 0)
+		goto done;
+
+	for (ctl.ttl = first; !ctl.parallel && ctl.ttl <= ctl.max_hops; ctl.ttl++) {
 		int res;
 		int i;
 
-		on = ctl.ttl;
-		switch (ctl.ai->ai_family) {
-		case AF_INET6:
-			if (setsockopt(ctl.socket_fd, SOL_IPV6, IPV6_UNICAST_HOPS, &on, sizeof(on))) {
-				perror("IPV6_UNICAST_HOPS");
-				exit(1);
-			}
-			if (!ctl.mapped)
-				break;
-			/*FALLTHROUGH*/
-		case AF_INET:
-			if (setsockopt(ctl.socket_fd, SOL_IP, IP_TTL, &on, sizeof(on))) {
-				perror("IP_TTL");
-				exit(1);
-			}
-		}
+		set_ttl(&ctl, ctl.ttl);
 
  restart:
-		for (i = 0; i < 3; i++) {
+		for (i = 0; i < MAX_TRIES; i++) {
 			int old_mtu;
 
 			old_mtu = ctl.mtu;
@@ -654,6 +1258,8 @@ int main(int argc, char **argv)
 
  done:
 	freeaddrinfo(result);
+	if (ctl.cache)
+		cache_store(&ctl);
 
 	printf(_("     Resume: pmtu %d "), ctl.mtu);
 	if (ctl.hops_to >= 0)
@@ -252,6 +252,7 @@
 #endif
 
 #include "iputils_common.h"
+#include "iputils_rdns.h"
 
 #ifdef USE_IDN
 # ifndef NI_IDN
@@ -332,6 +333,7 @@ struct run_state {
 	char *device;
 	char *hostname;
 	int nprobes;
+	int squeries;			/* probes in flight at once (-N) */
 	int max_ttl;
 	pid_t ident;
 	unsigned short port;		/* start udp dest port # for probe packets */
@@ -348,18 +350,71 @@ struct pkt_format {
 	struct timespec ts;
 };
 
+/* Probe "seq" of the windowed engine is probe[seq - 1]. */
+struct probe {
+	struct timespec sent;
+	struct sockaddr_in6 from;
+	double rtt;
+	int result;			/* what packet_ok() returned */
+	enum {
+		PROBE_UNSENT,
+		PROBE_SENT,
+		PROBE_DONE
+	} state;
+};
+
 /*
  * All includes, definitions, struct declarations, and global variables are
  * above.  After this comment all you can find is functions.
  */
 
+static ssize_t recv_reply(struct run_state *ctl, struct sockaddr_in6 *from,
+			  struct in6_addr *to)
+{
+	ssize_t cc;
+	char cbuf[PACKET_SIZE];
+	struct iovec iov = {
+		.iov_base = ctl->packet,
+		.iov_len = sizeof(ctl->packet)
+	};
+	struct msghdr msg = {
+		.msg_name = (void *)from,
+		.msg_namelen = sizeof(*from),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+		0
+	};
+
+	cc = recvmsg(ctl->icmp_sock, &msg, 0);
+	if (cc >= 0) {
+		struct cmsghdr *cmsg;
+		struct in6_pktinfo *ipi;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_IPV6)
+				continue;
+			switch (cmsg->cmsg_type) {
+			case IPV6_PKTINFO:
+#ifdef IPV6_2292PKTINFO
+			case IPV6_2292PKTINFO:
+#endif
+				ipi = (struct in6_pktinfo *)
+				    CMSG_DATA(cmsg);
+				memcpy(to, ipi, sizeof(*to));
+			}
+		}
+	}
+	return cc;
+}
+
 static int wait_for_reply(struct run_state *ctl, struct sockaddr_in6 *from,
 			  struct in6_addr *to, const uint8_t reset_timer)
 {
 	fd_set fds;
 	static struct timeval wait;
 	ssize_t cc = 0;
-	char cbuf[PACKET_SIZE];
 
 	FD_ZERO(&fds);
 	FD_SET(ctl->icmp_sock, &fds);
@@ -380,41 +435,8 @@ static int wait_for_reply(struct run_state *ctl, struct sockaddr_in6 *from,
 		wait.tv_usec = 0;
 	}
 
-	if (select(ctl->icmp_sock + 1, &fds, NULL, NULL, &wait) > 0) {
-		struct iovec iov = {
-			.iov_base = ctl->packet,
-			.iov_len = sizeof(ctl->packet)
-		};
-		struct msghdr msg = {
-			.msg_name = (void *)from,
-			.msg_namelen = sizeof(*from),
-			.msg_iov = &iov,
-			.msg_iovlen = 1,
-			.msg_control = cbuf,
-			.msg_controllen = sizeof(cbuf),
-			0
-		};
-
-		cc = recvmsg(ctl->icmp_sock, &msg, 0);
-		if (cc >= 0) {
-			struct cmsghdr *cmsg;
-			struct in6_pktinfo *ipi;
-
-			for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-				if (cmsg->cmsg_level != SOL_IPV6)
-					continue;
-				switch (cmsg->cmsg_type) {
-				case IPV6_PKTINFO:
-#ifdef IPV6_2292PKTINFO
-				case IPV6_2292PKTINFO:
-#endif
-					ipi = (struct in6_pktinfo *)
-					    CMSG_DATA(cmsg);
-					memcpy(to, ipi, sizeof(*to));
-				}
-			}
-		}
-	}
+	if (select(ctl->icmp_sock + 1, &fds, NULL, NULL, &wait) > 0)
+		cc = recv_reply(ctl, from, to);
 
 	return (cc);
 }
@@ -520,8 +542,12 @@ static char const *pr_type(const uint8_t t)
 	abort();
 }
 
+/*
+ * Is the packet a reply to our probe "*seq"? With "*seq" 0 any of our
+ * probes will do and "*seq" gets the one it answers.
+ */
 static int packet_ok(struct run_state *ctl, int cc, struct sockaddr_in6 *from,
-		     struct in6_addr *to, uint32_t seq, struct timespec *ts)
+		     struct in6_addr *to, uint32_t *seq, struct timespec *ts)
 {
 	struct icmp6_hdr *icp = (struct icmp6_hdr *)ctl->packet;
 	uint8_t type, code;
@@ -548,7 +574,9 @@ static int packet_ok(struct run_state *ctl, int cc, struct sockaddr_in6 *from,
 
 			pkt = (struct pkt_format *)(up + 1);
 
-			if (ntohl(pkt->ident) == (uint32_t) ctl->ident && ntohl(pkt->seq) == seq) {
+			if (ntohl(pkt->ident) == (uint32_t) ctl->ident &&
+			    (ntohl(pkt->seq) == *seq || (!*seq && pkt->seq))) {
+				*seq = ntohl(pkt->seq);
 				*ts = pkt->ts;
 				return (type == ICMP6_TIME_EXCEEDED ? -1 : code + 1);
 			}
@@ -595,13 +623,173 @@ static void print(struct run_state *ctl, struct sockaddr_in6 *from)
 		printf(" %s", inet_ntop(AF_INET6, &from->sin6_addr, pa, sizeof(pa)));
 	else {
 		inet_ntop(AF_INET6, &from->sin6_addr, pa, sizeof(pa));
-		getnameinfo((struct sockaddr *)from, sizeof *from, hnamebuf,
-			    sizeof hnamebuf, NULL, 0, getnameinfo_flags);
+		/* Without a name by then the address stands in; -N has
+		 * replies to take in meanwhile and does not wait at all. */
+		rdns_lookup(from, sizeof *from, getnameinfo_flags, hnamebuf,
+			    sizeof hnamebuf, ctl->squeries > 1 ? 0 : RDNS_WAIT);
 
 		printf(" %s (%s)", hnamebuf[0] ? hnamebuf : pa, pa);
 	}
 }
 
+/* One answered probe of a hop line, "result" as from packet_ok(). */
+static void print_probe(struct run_state *ctl, struct sockaddr_in6 *from,
+			double rtt, int result, struct in6_addr *lastaddr,
+			int *unreachable, uint8_t *got_there)
+{
+	if (memcmp(&from->sin6_addr, lastaddr, sizeof(from->sin6_addr))) {
+		print(ctl, from);
+		memcpy(lastaddr, &from->sin6_addr, sizeof(*lastaddr));
+	}
+	printf(_("  %.4f ms"), rtt);
+	switch (result - 1) {
+	case ICMP6_DST_UNREACH_NOPORT:
+		*got_there = 1;
+		break;
+
+	case ICMP6_DST_UNREACH_NOROUTE:
+		++*unreachable;
+		printf(" !N");
+		break;
+	case ICMP6_DST_UNREACH_ADDR:
+		++*unreachable;
+		printf(" !H");
+		break;
+
+	case ICMP6_DST_UNREACH_ADMIN:
+		++*unreachable;
+		printf(" !X");
+		break;
+	}
+}
+
+/*
+ * Print the hop whose probes start at probes[first]. Returns 1 if the
+ * trace ends with it.
+ */
+static int print_hop(struct run_state *ctl, struct probe *probes, int first)
+{
+	struct in6_addr lastaddr = { {{0,}} };
+	uint8_t got_there = 0;
+	int unreachable = 0;
+	int probe;
+
+	printf("%2d ", first / ctl->nprobes + 1);
+	for (probe = first; probe < first + ctl->nprobes; probe++) {
+		if (probes[probe].result)
+			print_probe(ctl, &probes[probe].from, probes[probe].rtt,
+				    probes[probe].result, &lastaddr,
+				    &unreachable, &got_there);
+		else
+			printf(" *");
+	}
+	putchar('\n');
+	return got_there || (unreachable > 0 && unreachable >= ctl->nprobes - 1);
+}
+
+/*
+ * Windowed engine (-N): keep up to ctl->squeries probes outstanding,
+ * across queries and hops, instead of waiting for each in turn. Probe
+ * "seq" is query (seq - 1) % nprobes of hop (seq - 1) / nprobes + 1,
+ * so the seq echoed back in the payload says what a reply answers. A
+ * hop is printed once all of its probes are answered or have timed
+ * out, and only after the hops before it.
+ */
+static void trace_window(struct run_state *ctl)
+{
+	struct probe *probes;
+	int limit = ctl->max_ttl * ctl->nprobes;	/* probes up to the last hop */
+	int next = 0;		/* next probe to send */
+	int first = 0;		/* first probe of the next hop to print */
+	int inflight = 0;
+
+	probes = calloc(limit, sizeof(*probes));
+	if (probes == NULL) {
+		fprintf(stderr, _("malloc failed\n"));
+		exit(1);
+	}
+
+	while (first < limit) {
+		struct sockaddr_in6 from;
+		struct in6_addr to_addr;
+		struct timespec now, ts;
+		struct timeval tv;
+		struct probe *pr;
+		fd_set fds;
+		uint32_t seq;
+		double left;
+		ssize_t cc;
+		int i;
+
+		for (; inflight < ctl->squeries && next < limit; next++, inflight++) {
+			clock_gettime(CLOCK_MONOTONIC_RAW, &probes[next].sent);
+			send_probe(ctl, next + 1, next / ctl->nprobes + 1);
+			probes[next].state = PROBE_SENT;
+		}
+
+		/* Probes go out in order, so the oldest one in flight is
+		 * the next to time out. */
+		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+		left = 0;
+		for (i = first; i < next; i++) {
+			if (probes[i].state != PROBE_SENT)
+				continue;
+			left = ctl->waittime * 1000.0 - deltaT(&probes[i].sent, &now);
+			if (left > 0)
+				break;
+			probes[i].state = PROBE_DONE;
+			inflight--;
+		}
+
+		while (first < limit) {
+			for (i = first; i < first + ctl->nprobes; i++)
+				if (probes[i].state != PROBE_DONE)
+					break;
+			if (i < first + ctl->nprobes)
+				break;
+			if (print_hop(ctl, probes, first))
+				limit = first + ctl->nprobes;
+			first += ctl->nprobes;
+		}
+		fflush(stdout);
+		if (first >= limit || !inflight)
+			continue;
+
+		tv.tv_sec = left / 1000;
+		tv.tv_usec = (left - tv.tv_sec * 1000.0) * 1000 + 1;
+		FD_ZERO(&fds);
+		FD_SET(ctl->icmp_sock, &fds);
+		if (select(ctl->icmp_sock + 1, &fds, NULL, NULL, &tv) <= 0)
+			continue;
+		cc = recv_reply(ctl, &from, &to_addr);
+		if (cc <= 0)
+			continue;
+		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+		seq = 0;
+		i = packet_ok(ctl, cc, &from, &to_addr, &seq, &ts);
+		if (!i || seq > (uint32_t)next || probes[seq - 1].state != PROBE_SENT)
+			continue;
+
+		pr = &probes[seq - 1];
+		pr->state = PROBE_DONE;
+		pr->from = from;
+		pr->rtt = deltaT(&ts, &now);
+		pr->result = i;
+		inflight--;
+		/* Look the name up while the hops before are still out. */
+		if (!ctl->nflag)
+			rdns_lookup(&from, sizeof from, getnameinfo_flags, NULL, 0, 0);
+		/* Nothing behind the destination needs probing. */
+		if (i - 1 == ICMP6_DST_UNREACH_NOPORT) {
+			int end = (seq - 1) / ctl->nprobes * ctl->nprobes + ctl->nprobes;
+
+			if (end < limit)
+				limit = end;
+		}
+	}
+	free(probes);
+}
+
 static __attribute__((noreturn)) void usage(void)
 {
 	fprintf(stderr, _(
@@ -612,6 +800,7 @@ static __attribute__((noreturn)) void usage(void)
 		"  -i <device>   bind to <device>\n"
 		"  -m <hops>     use maximum <hops>\n"
 		"  -n            no dns name resolution\n"
+		"  -N <squeries> number of probes in flight at once\n"
 		"  -p <port>     use destination <port>\n"
 		"  -q <nprobes>  number of probes\n"
 		"  -r            use SO_DONTROUTE socket option\n"
@@ -640,6 +829,7 @@ int main(int argc, char **argv)
 {
 	struct run_state ctl = {
 		.nprobes = DEFAULT_PROBES,
+		.squeries = 1,
 		.max_ttl = DEFAULT_HOPS,
 		.port = DEFAULT_PORT,
 		.waittime = DEFAULT_WAIT,
@@ -689,7 +879,7 @@ int main(int argc, char **argv)
 	textdomain (PACKAGE_NAME);
 #endif
 #endif
-	while ((ch = getopt(argc, argv, "dm:np:q:rs:w:vi:V")) != EOF) {
+	while ((ch = getopt(argc, argv, "dm:nN:p:q:rs:w:vi:V")) != EOF) {
 		switch (ch) {
 		case 'd':
 			ctl.options |= SO_DEBUG;
@@ -704,6 +894,13 @@ int main(int argc, char **argv)
 		case 'n':
 			ctl.nflag = 1;
 			break;
+		case 'N':
+			ctl.squeries = atoi(optarg);
+			if (ctl.squeries < 1) {
+				fprintf(stderr, _("traceroute: squeries must be >0.\n"));
+				exit(1);
+			}
+			break;
 		case 'p':
 			ctl.port = atoi(optarg);
 			if (ctl.port < 1) {
@@ -904,6 +1101,12 @@ int main(int argc, char **argv)
 	fprintf(stderr, _(", %d hops max, %d byte packets\n"), ctl.max_ttl, ctl.datalen);
 	fflush(stderr);
 
+	if (ctl.squeries > 1) {
+		trace_window(&ctl);
+		free(resolved_hostname);
+		return 0;
+	}
+
 	for (ttl = 1; ttl <= ctl.max_ttl; ++ttl) {
 		struct in6_addr lastaddr = { {{0,}} };
 		uint8_t got_there = 0;
@@ -920,33 +1123,9 @@ int main(int argc, char **argv)
 			send_probe(&ctl, ++seq, ttl);
 			while ((cc = wait_for_reply(&ctl, &from, &to_addr, reset_timer)) != 0) {
 				clock_gettime(CLOCK_MONOTONIC_RAW, &t2);
-				if ((i = packet_ok(&ctl, cc, &from, &to_addr, seq, &t1))) {
-					if (memcmp(&from.sin6_addr, &lastaddr,
-						   sizeof(from.sin6_addr))) {
-						print(&ctl, &from);
-						memcpy(&lastaddr,
-						       &from.sin6_addr, sizeof(lastaddr));
-					}
-					printf(_("  %.4f ms"), deltaT(&t1, &t2));
-					switch (i - 1) {
-					case ICMP6_DST_UNREACH_NOPORT:
-						got_there = 1;
-						break;
-
-					case ICMP6_DST_UNREACH_NOROUTE:
-						++unreachable;
-						printf(" !N");
-						break;
-					case ICMP6_DST_UNREACH_ADDR:
-						++unreachable;
-						printf(" !H");
-						break;
-
-					case ICMP6_DST_UNREACH_ADMIN:
-						++unreachable;
-						printf(" !X");
-						break;
-					}
+				if ((i = packet_ok(&ctl, cc, &from, &to_addr, &seq, &t1))) {
+					print_probe(&ctl, &from, deltaT(&t1, &t2), i,
+						    &lastaddr, &unreachable, &got_there);
 					break;
 				} else
 					reset_timer = 0;